@@ -0,0 +1,147 @@
+#!/usr/bin/env bash
+#
+# Data path benchmarks: for every block size and fio job file (bench/*.fio),
+# formats a fresh image, mounts it on a loop device and runs fio in an empty
+# directory of it. The bandwidth, IOPS and completion latency percentiles of
+# each job and direction go to a JSON report, one object per line, along with
+# the raw fio output; a summary table is printed at the end. Jobs that fail,
+# e.g. those of a mode the filesystem does not support, are reported with
+# their error instead. The label defaults to the current commit, to compare
+# runs before and after a change.
+#
+# Files are as large as the block size allows (up to 64 MiB, see
+# SIMPLEFS_MAX_FILESIZE), so that larger blocks also mean larger extents.
+#
+# Usage: bench/run.sh [-b "block-sizes ..."] [-j "job-files ..."]
+#                     [-s image-MiB] [-t runtime] [-n writers] [-l label]
+#                     [-o output-dir]
+
+SIMPLEFS_MOD=simplefs.ko
+MKFS=${MKFS:-mkfs.simplefs}
+FIO=${FIO:-fio}
+IMAGE=${IMAGE:-fio_bench.img}
+MNT=fio_bench_mnt
+
+BENCH_DIR=$(dirname "$0")
+BLOCK_SIZES=4096
+JOBS=$(ls "$BENCH_DIR"/*.fio)
+IMAGESIZE=512
+RUNTIME=10
+NUMJOBS=8
+LABEL=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+OUT=bench_results
+
+while getopts "b:j:s:t:n:l:o:" opt; do
+    case $opt in
+    b) BLOCK_SIZES=$OPTARG ;;
+    j) JOBS=$OPTARG ;;
+    s) IMAGESIZE=$OPTARG ;;
+    t) RUNTIME=$OPTARG ;;
+    n) NUMJOBS=$OPTARG ;;
+    l) LABEL=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) sed -n '15,17p' "$0"; exit 1 ;;
+    esac
+done
+
+if [ "$EUID" -eq 0 ]
+  then echo "Don't run this script as root"
+  exit
+fi
+
+for tool in $FIO jq; do
+    command -v $tool >/dev/null || { echo "$tool is required"; exit 1; }
+done
+
+cleanup() {
+    sudo umount $MNT 2>/dev/null
+}
+
+# Largest file size within SIMPLEFS_MAX_FILESIZE, capped at 64 MiB, in KiB
+file_size() {
+    local bs=$1 max
+
+    max=$((8 * bs * ((bs - 4) / 16) / 1024))
+    [ $max -gt 65536 ] && max=65536
+    echo ${max}k
+}
+
+# One fio job and direction per line, or the job and its error
+REPORT_JQ='
+.jobs[] as $j
+| if $j.error != 0 then
+    {job: $j.jobname, error: $j.error}
+  else
+    ("read", "write") as $d
+    | $j[$d] | select(.io_bytes > 0)
+    | {job: $j.jobname, error: 0, dir: $d,
+       bw_mib_s: (.bw_bytes / 1048576), iops: .iops,
+       clat_p50_us: ((.clat_ns.percentile["50.000000"] // 0) / 1000),
+       clat_p99_us: ((.clat_ns.percentile["99.000000"] // 0) / 1000),
+       clat_p999_us: ((.clat_ns.percentile["99.900000"] // 0) / 1000)}
+    + if ($j.sync.lat_ns.N // 0) > 0 then
+        {fsync_p99_us:
+           (($j.sync.lat_ns.percentile["99.000000"] // 0) / 1000)}
+      else {} end
+  end
+| {label: $tag, block_size: $bs, jobfile: $file} + .'
+
+# One job file: fresh image, mount, fio, unmount
+run_once() {
+    local bs=$1 jobfile=$2 name raw status
+
+    name=$(basename "$jobfile" .fio)
+    raw=$OUT/$LABEL-$bs-$name.json
+    dd if=/dev/zero of=$IMAGE bs=1M count=$IMAGESIZE status=none &&
+        ./$MKFS -b $bs $IMAGE >/dev/null || return 1
+    sudo mount -t simplefs -o loop $IMAGE $MNT || return 1
+    sudo mkdir $MNT/bench || return 1
+
+    sudo FILESIZE=$(file_size $bs) RUNTIME=$RUNTIME LOOPS=4 NUMJOBS=$NUMJOBS \
+        NRFILES=32 $FIO --output-format=json --output="$raw" \
+        --directory=$MNT/bench "$jobfile"
+    status=$?
+    cleanup
+    sudo chown "$USER" "$raw" 2>/dev/null
+
+    if ! jq -c --arg tag "$LABEL" --argjson bs $bs --arg file "$name" \
+        "$REPORT_JQ" "$raw" >>$OUT/report.jsonl 2>/dev/null; then
+        echo "{\"label\": \"$LABEL\", \"block_size\": $bs," \
+            "\"jobfile\": \"$name\", \"error\": \"fio exited $status\"}" \
+            >>$OUT/report.jsonl
+        return 1
+    fi
+    return $status
+}
+
+trap cleanup EXIT
+mkdir -p $MNT $OUT
+cleanup
+sudo rmmod simplefs 2>/dev/null
+(modinfo $SIMPLEFS_MOD >/dev/null || exit 1) &&
+    sudo insmod $SIMPLEFS_MOD || exit 1
+
+failures=0
+for bs in $BLOCK_SIZES; do
+    for jobfile in $JOBS; do
+        echo "block size $bs: $jobfile"
+        run_once $bs $jobfile || failures=$((failures + 1))
+    done
+done
+
+rm -f $IMAGE
+rmdir $MNT
+
+# Summary of this label
+jq -r --arg tag "$LABEL" 'select(.label == $tag)
+    | [.block_size, .jobfile, .job // "-", .dir // "-",
+       if .error != 0 then "error \(.error)" else
+         (.bw_mib_s * 10 | round / 10), (.iops | round),
+         (.clat_p50_us | round), (.clat_p99_us | round),
+         (.clat_p999_us | round)
+       end] | @tsv' $OUT/report.jsonl |
+    (printf 'bs\tfile\tjob\tdir\tMiB/s\tIOPS\tp50us\tp99us\tp99.9us\n'; cat) |
+    tee $OUT/$LABEL-report.tsv
+
+echo "Report appended to $OUT/report.jsonl, $failures failed job file(s)"
+[ $failures -eq 0 ]
@@ -2,21 +2,24 @@
 #define SIMPLEFS_BITMAP_H
 
 #include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
 
 #include "simplefs.h"
 
 /* Returns the first bit found and clears the following 'len' consecutive
  * free bits (sets them to 1) in a given in-memory bitmap spanning multiple
- * blocks. Returns 0 if an adequate number of free bits were not found.
- * Assumes the first bit is never free (reserved for the superblock and the
- * root inode), allowing the use of 0 as an error value.
+ * blocks, searching from bit 'first'. Returns 0 if an adequate number of free
+ * bits were not found. Assumes the first bit is never free (reserved for the
+ * superblock and the root inode), allowing the use of 0 as an error value.
  */
-static inline uint32_t get_first_free_bits(unsigned long *freemap,
-                                           unsigned long size,
-                                           uint32_t len)
+static inline uint32_t get_first_free_bits_from(unsigned long *freemap,
+                                                unsigned long first,
+                                                unsigned long size,
+                                                uint32_t len)
 {
-    uint32_t bit, prev = 0, count = 0;
-    for_each_set_bit (bit, freemap, size) {
+    uint32_t bit = first, prev = 0, count = 0;
+    for_each_set_bit_from (bit, freemap, size) {
         if (prev != bit - 1)
             count = 0;
         prev = bit;
@@ -28,81 +31,243 @@ static inline uint32_t get_first_free_bits(unsigned long *freemap,
     return 0;
 }
 
+static inline uint32_t get_first_free_bits(unsigned long *freemap,
+                                           unsigned long size,
+                                           uint32_t len)
+{
+    return get_first_free_bits_from(freemap, 0, size, len);
+}
+
+/* First on-disk block of the inode and block free bitmaps */
+static inline uint32_t simplefs_ifree_start(struct simplefs_sb_info *sbi)
+{
+    return 1 + sbi->nr_istore_blocks;
+}
+
+static inline uint32_t simplefs_bfree_start(struct simplefs_sb_info *sbi)
+{
+    return 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks;
+}
+
+/* First bit of [bit, bit + len) set in @busy, or bit + len if none. The
+ * bits were just taken from a free bitmap: the barrier pairs with the ones of
+ * simplefs_hold_bit() and simplefs_journal_free(), which mark a bit busy
+ * before they look at, or set, its free bit.
+ */
+static inline uint32_t simplefs_busy_bit(unsigned long *busy,
+                                         uint32_t bit,
+                                         uint32_t len)
+{
+    if (!busy)
+        return bit + len;
+    smp_mb();
+    return find_next_bit(busy, bit + len, bit);
+}
+
 /* Return an unused inode number and mark it used.
  * Return 0 if no free inode was found.
  */
-static inline uint32_t get_free_inode(struct simplefs_sb_info *sbi)
+static inline uint32_t get_free_inode(struct super_block *sb)
 {
-    uint32_t ret = get_first_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, 1);
-    if (ret)
-        sbi->nr_free_inodes--;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t ret, first = 0;
+
+    for (;;) {
+        ret = get_first_free_bits_from(sbi->ifree_bitmap, first,
+                                       sbi->nr_inodes, 1);
+        if (!ret)
+            return 0;
+        /* Inodes freed by a running transaction are skipped */
+        if (simplefs_busy_bit(sbi->ifree_pending, ret, 1) == ret + 1)
+            break;
+        bitmap_set(sbi->ifree_bitmap, ret, 1);
+        first = ret + 1;
+    }
+
+    if (simplefs_init_itable_block(sb, ret) ||
+        simplefs_journal_bitmap(sb, sbi->ifree_bitmap,
+                                simplefs_ifree_start(sbi), ret, 1)) {
+        bitmap_set(sbi->ifree_bitmap, ret, 1);
+        return 0;
+    }
+    sbi->nr_free_inodes--;
     return ret;
 }
 
-/* Return 'len' unused block(s) number and mark it used.
+/* Blocks [*first, *end) of device @dev of a striped partition. Partitions
+ * on a single device are mounted as one device of sbi->nr_blocks blocks.
+ */
+static inline void simplefs_dev_range(struct simplefs_sb_info *sbi,
+                                      uint32_t dev,
+                                      uint32_t *first,
+                                      uint32_t *end)
+{
+    uint32_t i;
+
+    *first = 0;
+    for (i = 0; i < dev; i++)
+        *first += sbi->dev_blocks[i];
+    *end = *first + sbi->dev_blocks[dev];
+}
+
+/* Return 'len' unused block(s) number within [first, end) and mark it used.
  * Clean the block content.
  * Return 0 if no enough free block(s) were found.
  */
-static inline uint32_t get_free_blocks(struct super_block *sb, uint32_t len)
+static inline uint32_t get_free_blocks_in(struct super_block *sb,
+                                          uint32_t len,
+                                          uint32_t first,
+                                          uint32_t end)
 {
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
-    uint32_t ret = get_first_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, len);
-    uint32_t i;
-    if (!ret) /* No enough free blocks */
-        return 0;
-
-    sbi->nr_free_blocks -= len;
     struct buffer_head *bh;
+    uint32_t ret, i;
+
+    for (;;) {
+        ret = get_first_free_bits_from(sbi->bfree_bitmap, first, end, len);
+        if (!ret) /* No enough free blocks */
+            return 0;
+        /* Runs being discarded, or freed by a running transaction, are
+         * skipped
+         */
+        i = min(simplefs_busy_bit(sbi->discard_bitmap, ret, len),
+                simplefs_busy_bit(sbi->bfree_pending, ret, len));
+        if (i == ret + len)
+            break;
+        bitmap_set(sbi->bfree_bitmap, ret, len);
+        first = i + 1;
+    }
+
+    /* Zero the whole run with a single request instead of writing and waiting
+     * on every block, then bring the cached copies in line with the disk.
+     */
+    if (simplefs_issue_zeroout(sb, ret, len)) {
+        pr_err("get_free_blocks: zeroing blocks %u-%u failed\n", ret,
+               ret + len - 1);
+        goto restore;
+    }
     for (i = 0; i < len; i++) {
-        bh = sb_bread(sb, ret + i);
-        if (!bh) {
-            pr_err("get_free_blocks: sb_bread failed for block %d\n", ret + i);
-            /* Restore all len blocks - bitmap was cleared atomically */
-            bitmap_set(sbi->bfree_bitmap, ret, len);
-            sbi->nr_free_blocks += len;
-            return 0; /* Return 0 to indicate failure (0 is reserved) */
-        }
-        memset(bh->b_data, 0, SIMPLEFS_BLOCK_SIZE);
-        mark_buffer_dirty(bh);
-        sync_dirty_buffer(bh); /* write the buffer to disk */
+        bh = sb_find_get_block(sb, ret + i);
+        if (!bh)
+            continue;
+        lock_buffer(bh);
+        memset(bh->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        clear_buffer_dirty(bh);
+        clear_buffer_verified(bh);
+        unlock_buffer(bh);
         brelse(bh);
     }
+
+    if (simplefs_journal_bitmap(sb, sbi->bfree_bitmap,
+                                simplefs_bfree_start(sbi), ret, len))
+        goto restore;
+
+    sbi->nr_free_blocks -= len;
     return ret;
+
+restore:
+    /* Restore all len blocks - bitmap was cleared atomically */
+    bitmap_set(sbi->bfree_bitmap, ret, len);
+    return 0; /* Return 0 to indicate failure (0 is reserved) */
 }
 
-/* Mark the 'len' bit(s) from i-th bit in freemap as free (i.e. 1) */
-static inline int put_free_bits(unsigned long *freemap,
-                                unsigned long size,
-                                uint32_t i,
-                                uint32_t len)
+/* Blocks of metadata, directories and everything else but file data: on the
+ * first device, out of the log with the log mount option.
+ */
+static inline uint32_t get_free_blocks(struct super_block *sb, uint32_t len)
 {
-    /* i is greater than freemap size */
-    if (i + len - 1 > size)
-        return -1;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t bno;
+
+    if (sbi->log) {
+        bno = simplefs_log_alloc_meta(sb, len);
+        if (bno)
+            return bno;
+    }
+    return get_free_blocks_in(sb, len, 0, sbi->dev_blocks[0]);
+}
 
-    bitmap_set(freemap, i, len);
+/* Blocks of extent @ei of a regular file: at the head of the log with the
+ * log mount option, else on the device of the extent, or on any device once
+ * that one is full. The first device is left out when it only holds
+ * metadata.
+ */
+static inline uint32_t get_free_data_blocks(struct super_block *sb,
+                                            uint32_t len,
+                                            uint32_t ei)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t skip = simplefs_has_metadata_dev(sb) ? 1 : 0;
+    uint32_t first, end, bno;
 
-    return 0;
+    if (sbi->log) {
+        bno = simplefs_log_alloc(sb, len);
+        if (bno)
+            return bno;
+    }
+    simplefs_dev_range(sbi, skip + ei % (sbi->nr_devices - skip), &first,
+                       &end);
+    bno = get_free_blocks_in(sb, len, first, end);
+    if (!bno && sbi->nr_devices > 1)
+        bno = get_free_blocks_in(sb, len, skip ? sbi->dev_blocks[0] : 0,
+                                 sbi->nr_blocks);
+    return bno;
 }
 
-/* Mark an inode as unused */
-static inline void put_inode(struct simplefs_sb_info *sbi, uint32_t ino)
+/* Mark an inode as unused. On a journaled partition, it is only reused once
+ * the transaction freeing it commits.
+ */
+static inline int put_inode(struct super_block *sb, uint32_t ino)
 {
-    if (put_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, ino, 1))
-        return;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    int err;
+
+    if (ino >= sbi->nr_inodes)
+        return -EINVAL;
 
+    simplefs_journal_free(sb, sbi->ifree_pending, ino, 1);
+    bitmap_set(sbi->ifree_bitmap, ino, 1);
     sbi->nr_free_inodes++;
+    err = simplefs_journal_bitmap(sb, sbi->ifree_bitmap,
+                                  simplefs_ifree_start(sbi), ino, 1);
+    if (err) {
+        bitmap_clear(sbi->ifree_bitmap, ino, 1);
+        sbi->nr_free_inodes--;
+    }
+    return err;
 }
 
-/* Mark len block(s) as unused */
-static inline void put_blocks(struct simplefs_sb_info *sbi,
-                              uint32_t bno,
-                              uint32_t len)
+/* Mark len block(s) as unused, unless other files share them. On a
+ * journaled partition, they are only reused once the transaction freeing
+ * them commits.
+ */
+static inline int put_blocks(struct super_block *sb,
+                             uint32_t bno,
+                             uint32_t len)
 {
-    if (put_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, bno, len))
-        return;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    int err;
 
+    /* Shared extents are only freed by the last file holding them */
+    if (simplefs_refcount_put(sb, bno))
+        return 0;
+    if (bno + len > sbi->nr_blocks)
+        return -EINVAL;
+
+    simplefs_journal_free(sb, sbi->bfree_pending, bno, len);
+    bitmap_set(sbi->bfree_bitmap, bno, len);
     sbi->nr_free_blocks += len;
+    err = simplefs_journal_bitmap(sb, sbi->bfree_bitmap,
+                                  simplefs_bfree_start(sbi), bno, len);
+    if (err) {
+        bitmap_clear(sbi->bfree_bitmap, bno, len);
+        sbi->nr_free_blocks -= len;
+        return err;
+    }
+    if (sbi->s_mount_opt & SIMPLEFS_MOUNT_DISCARD)
+        simplefs_discard_queue(sb, bno, len);
+    return 0;
 }
 
 #endif /* SIMPLEFS_BITMAP_H */
@@ -0,0 +1,416 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/jbd2.h>
+#include <linux/kernel.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/writeback.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+#if SIMPLEFS_HAS_COMPRESSION
+
+/* Transparent compression of regular files, with the compress mount option.
+ *
+ * The unit is a full extent, SIMPLEFS_MAX_BLOCKS_PER_EXTENT blocks of data
+ * within i_size. At writeback, every such extent with dirty pages is
+ * compressed with LZ4 into a new run of ee_clen blocks, written before the
+ * transaction that switches the extent to it and frees the raw run. Extents
+ * that do not compress by at least a block, partial extents at the end of
+ * files, and extents whose pages are not all in the page cache are written
+ * raw by mpage as usual.
+ *
+ * Reads decompress the whole extent once per readahead batch and fill the
+ * folios from it; the blocks read are the compressed ones only. A write to
+ * a compressed extent first moves it back to a raw run, with its pages dirty,
+ * see simplefs_unshare_range(), so that get_block() never maps blocks of a
+ * compressed extent; writeback may compress it again.
+ *
+ * Writeback only compresses when it can take the inode lock, which writes
+ * and truncates hold, and never from the jbd2 commit thread, which cannot
+ * start handles: data=ordered writes raw. Writes are not ordered before the
+ * commit on a compress mount, so that writeback gets to compress them; the
+ * blocks are zeroed when allocated, so a crash loses recent data but never
+ * exposes stale blocks.
+ */
+
+/* Buffers of simplefs_compress_writepages() */
+struct simplefs_compress_ctx {
+    char *raw;    /* the extent, uncompressed */
+    char *cbuf;   /* struct simplefs_cluster, padded to a block */
+    void *wrkmem; /* LZ4 state */
+};
+
+static size_t simplefs_ext_bytes(struct super_block *sb)
+{
+    return SIMPLEFS_MAX_BLOCKS_PER_EXTENT * sb->s_blocksize;
+}
+
+/* Copy between the folios of an extent and a linear buffer */
+static void simplefs_copy_folio(struct folio *folio, char *buf, bool to_folio)
+{
+    size_t off;
+
+    for (off = 0; off < folio_size(folio); off += PAGE_SIZE) {
+        char *addr = kmap_local_folio(folio, off);
+
+        if (to_folio)
+            memcpy(addr, buf + off, PAGE_SIZE);
+        else
+            memcpy(buf + off, addr, PAGE_SIZE);
+        kunmap_local(addr);
+    }
+}
+
+/* Read the compressed blocks of @ext and decompress them to @out */
+static int simplefs_cluster_read(struct super_block *sb,
+                                 struct simplefs_extent *ext,
+                                 char *out)
+{
+    struct buffer_head *bhs[SIMPLEFS_MAX_BLOCKS_PER_EXTENT] = {NULL};
+    struct simplefs_cluster *c;
+    uint32_t i, nr = ext->ee_clen;
+    char *cbuf;
+    int ret = 0, size;
+
+    if (!nr || nr >= ext->ee_len ||
+        ext->ee_len != SIMPLEFS_MAX_BLOCKS_PER_EXTENT) {
+        pr_err("corrupted compressed extent at block %u\n", ext->ee_start);
+        return -EIO;
+    }
+    cbuf = kvmalloc(nr * sb->s_blocksize, GFP_NOFS);
+    if (!cbuf)
+        return -ENOMEM;
+
+    for (i = 0; i < nr; i++) {
+        bhs[i] = sb_getblk(sb, ext->ee_start + i);
+        if (!bhs[i]) {
+            ret = -ENOMEM;
+            goto release;
+        }
+    }
+    bh_read_batch(nr, bhs);
+    for (i = 0; i < nr; i++) {
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i])) {
+            ret = -EIO;
+            goto release;
+        }
+        memcpy(cbuf + i * sb->s_blocksize, bhs[i]->b_data, sb->s_blocksize);
+    }
+
+    c = (struct simplefs_cluster *) cbuf;
+    size = -1;
+    if (c->c_size <= nr * sb->s_blocksize - sizeof(*c))
+        size = LZ4_decompress_safe(c->c_data, out, c->c_size,
+                                   simplefs_ext_bytes(sb));
+    if (size != simplefs_ext_bytes(sb)) {
+        pr_err("corrupted compressed extent at block %u\n", ext->ee_start);
+        ret = -EIO;
+    }
+
+release:
+    for (i = 0; i < nr; i++)
+        brelse(bhs[i]);
+    kvfree(cbuf);
+    return ret;
+}
+
+/* Fill @folio, locked, if it belongs to a compressed extent: then it is
+ * unlocked, uptodate unless an error is returned, and 1 is returned. The
+ * extent last decompressed is kept in @cb for the next folios of a
+ * readahead batch. Returns 0 for folios of raw extents, left locked.
+ */
+int simplefs_compress_read_folio(struct folio *folio,
+                                 struct simplefs_cluster_buf *cb)
+{
+    struct inode *inode = folio->mapping->host;
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent ext;
+    struct buffer_head *bh_index;
+    loff_t pos = folio_pos(folio), isize;
+    uint32_t ei;
+    int ret;
+
+    bh_index = simplefs_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
+    if (!bh_index) {
+        ret = -EIO;
+        goto unlock;
+    }
+    index = (struct simplefs_file_ei_block *) bh_index->b_data;
+    ei = simplefs_ext_search(index, simplefs_max_extents(sb),
+                             pos >> sb->s_blocksize_bits);
+    if (ei >= simplefs_max_extents(sb) || !index->extents[ei].ee_start ||
+        !(index->extents[ei].ee_flags & SIMPLEFS_EXT_LZ4)) {
+        brelse(bh_index);
+        return 0;
+    }
+    ext = index->extents[ei];
+    brelse(bh_index);
+
+    if (!cb->data || cb->ee_start != ext.ee_start) {
+        if (!cb->data)
+            cb->data = kvmalloc(simplefs_ext_bytes(sb), GFP_NOFS);
+        if (!cb->data) {
+            ret = -ENOMEM;
+            goto unlock;
+        }
+        cb->ee_start = 0;
+        ret = simplefs_cluster_read(sb, &ext, cb->data);
+        if (ret)
+            goto unlock;
+        cb->ee_start = ext.ee_start;
+    }
+
+    pos -= (loff_t) ext.ee_block << sb->s_blocksize_bits;
+    simplefs_copy_folio(folio, cb->data + pos, true);
+    pos = folio_pos(folio);
+    /* The extent may have been truncated since it was compressed */
+    isize = i_size_read(inode);
+    if (pos + folio_size(folio) > isize)
+        folio_zero_segment(folio, max_t(loff_t, isize - pos, 0),
+                           folio_size(folio));
+    folio_mark_uptodate(folio);
+    folio_unlock(folio);
+    return 1;
+
+unlock:
+    folio_unlock(folio);
+    return ret;
+}
+
+void simplefs_cluster_buf_release(struct simplefs_cluster_buf *cb)
+{
+    kvfree(cb->data);
+    cb->data = NULL;
+}
+
+/* Lock the folios of [start, end), all cached and uptodate. Returns their
+ * number, or 0 if one is missing. Blocks are at most a page, so an extent
+ * has at most SIMPLEFS_MAX_BLOCKS_PER_EXTENT folios.
+ */
+static int simplefs_lock_extent(struct address_space *mapping,
+                                loff_t start,
+                                loff_t end,
+                                struct folio **folios)
+{
+    struct folio *folio;
+    int n = 0;
+
+    while (start < end) {
+        folio = filemap_lock_folio(mapping, start >> PAGE_SHIFT);
+        if (IS_ERR(folio))
+            goto unlock;
+        if (!folio_test_uptodate(folio)) {
+            folio_unlock(folio);
+            folio_put(folio);
+            goto unlock;
+        }
+        folio_wait_writeback(folio);
+        folios[n++] = folio;
+        start = folio_pos(folio) + folio_size(folio);
+    }
+    return n;
+
+unlock:
+    while (n--) {
+        folio_unlock(folios[n]);
+        folio_put(folios[n]);
+    }
+    return 0;
+}
+
+/* Write @nr blocks of @buf from @bno and wait for them */
+static int simplefs_cluster_write(struct super_block *sb,
+                                  uint32_t bno,
+                                  uint32_t nr,
+                                  char *buf)
+{
+    struct buffer_head *bhs[SIMPLEFS_MAX_BLOCKS_PER_EXTENT];
+    uint32_t i, n;
+    int ret = 0;
+
+    for (n = 0; n < nr; n++) {
+        bhs[n] = sb_getblk(sb, bno + n);
+        if (!bhs[n]) {
+            ret = -ENOMEM;
+            break;
+        }
+        lock_buffer(bhs[n]);
+        memcpy(bhs[n]->b_data, buf + n * sb->s_blocksize, sb->s_blocksize);
+        set_buffer_uptodate(bhs[n]);
+        unlock_buffer(bhs[n]);
+        mark_buffer_dirty(bhs[n]);
+        write_dirty_buffer(bhs[n], 0);
+    }
+    for (i = 0; i < n; i++) {
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i]))
+            ret = -EIO;
+        brelse(bhs[i]);
+    }
+    return ret;
+}
+
+/* Compress extent @ei of the index in @bh_index, if it is worth it */
+static int simplefs_compress_extent(struct inode *inode,
+                                    struct buffer_head *bh_index,
+                                    uint32_t ei,
+                                    struct simplefs_compress_ctx *ctx)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_file_ei_block *index =
+        (struct simplefs_file_ei_block *) bh_index->b_data;
+    struct simplefs_extent *ext = &index->extents[ei];
+    struct simplefs_cluster *c = (struct simplefs_cluster *) ctx->cbuf;
+    struct folio *folios[SIMPLEFS_MAX_BLOCKS_PER_EXTENT];
+    size_t bytes = simplefs_ext_bytes(sb), off = 0;
+    loff_t start = (loff_t) ext->ee_block << sb->s_blocksize_bits;
+    uint32_t old_start, clen, bno;
+    handle_t *handle;
+    int i, n, size, ret = 0;
+
+    /* Handles are started before locking pages, as jbd2 commits lock them */
+    handle = simplefs_journal_start(sb, SIMPLEFS_COMPRESS_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    n = simplefs_lock_extent(inode->i_mapping, start, start + bytes, folios);
+    if (!n)
+        goto stop;
+
+    for (i = 0; i < n; i++) {
+        simplefs_copy_folio(folios[i], ctx->raw + off, false);
+        off += folio_size(folios[i]);
+    }
+    size = LZ4_compress_default(ctx->raw, c->c_data, bytes,
+                                LZ4_compressBound(bytes), ctx->wrkmem);
+    clen = DIV_ROUND_UP(sizeof(*c) + size, sb->s_blocksize);
+    if (size <= 0 || clen >= ext->ee_len)
+        goto unlock;
+    c->c_size = size;
+    memset(c->c_data + size, 0, clen * sb->s_blocksize - sizeof(*c) - size);
+
+    bno = get_free_blocks(sb, clen);
+    if (!bno)
+        goto unlock;
+    ret = simplefs_cluster_write(sb, bno, clen, ctx->cbuf);
+    if (!ret)
+        ret = simplefs_journal_get_write_access(handle, bh_index);
+    if (ret) {
+        put_blocks(sb, bno, clen);
+        goto unlock;
+    }
+    simplefs_fc_mark_ineligible(sb, handle);
+    old_start = ext->ee_start;
+    ext->ee_start = bno;
+    ext->ee_clen = clen;
+    ext->ee_flags |= SIMPLEFS_EXT_LZ4;
+    ret = simplefs_journal_dirty_metadata(handle, sb, bh_index);
+    if (!ret)
+        ret = put_blocks(sb, old_start, ext->ee_len);
+
+    /* The data is on disk: the pages are clean, and their buffers, mapped to
+     * the raw run, go.
+     */
+    for (i = 0; i < n; i++) {
+        struct buffer_head *head = folio_buffers(folios[i]), *bh = head;
+
+        folio_clear_dirty_for_io(folios[i]);
+        if (head) {
+            do {
+                clear_buffer_dirty(bh);
+                bh = bh->b_this_page;
+            } while (bh != head);
+            try_to_free_buffers(folios[i]);
+        }
+    }
+
+unlock:
+    for (i = 0; i < n; i++) {
+        folio_unlock(folios[i]);
+        folio_put(folios[i]);
+    }
+stop:
+    simplefs_journal_stop(handle);
+    return ret;
+}
+
+/* Called by simplefs_writepages() before mpage writes what is left */
+int simplefs_compress_writepages(struct address_space *mapping,
+                                 struct writeback_control *wbc)
+{
+    struct inode *inode = mapping->host;
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_compress_ctx ctx = {NULL};
+    struct simplefs_file_ei_block *index;
+    struct buffer_head *bh_index;
+    loff_t start = 0, end = LLONG_MAX, isize;
+    uint32_t ei;
+    int ret = 0;
+
+    if (!(sbi->s_mount_opt & SIMPLEFS_MOUNT_COMPRESS))
+        return 0;
+    if (sbi->journal && current == sbi->journal->j_task)
+        return 0;
+    if (!inode_trylock(inode))
+        return 0;
+    if (!wbc->range_cyclic) {
+        start = wbc->range_start;
+        end = wbc->range_end;
+    }
+
+    bh_index = simplefs_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
+    if (!bh_index) {
+        ret = -EIO;
+        goto unlock;
+    }
+    index = (struct simplefs_file_ei_block *) bh_index->b_data;
+    isize = i_size_read(inode);
+
+    for (ei = 0; ei < simplefs_max_extents(sb) && index->extents[ei].ee_start;
+         ei++) {
+        struct simplefs_extent *ext = &index->extents[ei];
+        loff_t ext_start = (loff_t) ext->ee_block << sb->s_blocksize_bits;
+        loff_t ext_end = ext_start + simplefs_ext_bytes(sb);
+
+        if (ext->ee_flags & SIMPLEFS_EXT_LZ4 ||
+            ext->ee_len != SIMPLEFS_MAX_BLOCKS_PER_EXTENT || ext_end > isize ||
+            ext_end <= start || ext_start > end ||
+            !filemap_range_needs_writeback(mapping, ext_start, ext_end - 1))
+            continue;
+
+        if (!ctx.raw) {
+            ctx.raw = kvmalloc(simplefs_ext_bytes(sb), GFP_NOFS);
+            ctx.cbuf = kvmalloc(LZ4_compressBound(simplefs_ext_bytes(sb)) +
+                                    sizeof(struct simplefs_cluster) +
+                                    sb->s_blocksize,
+                                GFP_NOFS);
+            ctx.wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_NOFS);
+            if (!ctx.raw || !ctx.cbuf || !ctx.wrkmem) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+        ret = simplefs_compress_extent(inode, bh_index, ei, &ctx);
+        if (ret)
+            break;
+    }
+
+    kvfree(ctx.raw);
+    kvfree(ctx.cbuf);
+    kvfree(ctx.wrkmem);
+    brelse(bh_index);
+unlock:
+    inode_unlock(inode);
+    return ret;
+}
+
+#endif /* SIMPLEFS_HAS_COMPRESSION */
@@ -0,0 +1,178 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+
+#include "simplefs.h"
+
+#if SIMPLEFS_AT_LEAST(6, 14, 0)
+#include <linux/crc32.h>
+#else
+#include <linux/crc32c.h>
+#endif
+
+/* Metadata checksums (SIMPLEFS_FEATURE_METADATA_CSUM).
+ *
+ * Checksums are updated whenever a metadata block is logged or dirtied, in
+ * simplefs_journal_dirty_metadata(), and verified the first time a block is
+ * read from disk: simplefs_bread() then flags the buffer as verified, so that
+ * blocks served from the cache cost nothing. crc32c() uses the CPU crc32
+ * instructions where available.
+ */
+
+static u32 simplefs_csum(sector_t block, const void *data, size_t len)
+{
+    __le32 nr = cpu_to_le32(block);
+
+    return crc32c(crc32c(~0, &nr, sizeof(nr)), data, len);
+}
+
+/* Checksum of the superblock, skipping its checksum field */
+static u32 simplefs_csum_sb(struct buffer_head *bh)
+{
+    size_t off = offsetof(struct simplefs_sb_info, checksum);
+    u32 crc = simplefs_csum(bh->b_blocknr, bh->b_data, off);
+
+    off += sizeof(uint32_t);
+    return crc32c(crc, bh->b_data + off, bh->b_size - off);
+}
+
+static bool simplefs_is_bitmap(struct super_block *sb, sector_t block)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+
+    return block > sbi->nr_istore_blocks &&
+           block <= sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+                        sbi->nr_bfree_blocks;
+}
+
+/* sb_bread() for metadata blocks other than the superblock and bitmaps:
+ * returns NULL if the checksum does not match.
+ */
+struct buffer_head *simplefs_bread(struct super_block *sb, sector_t block)
+{
+    struct buffer_head *bh = sb_bread(sb, block);
+    __le32 *csum;
+
+    if (!bh || !simplefs_has_metadata_csum(sb) || buffer_verified(bh))
+        return bh;
+
+    csum = (__le32 *) (bh->b_data + simplefs_csum_offset(sb));
+    if (le32_to_cpu(*csum) !=
+        simplefs_csum(block, bh->b_data, simplefs_csum_offset(sb))) {
+        pr_err("checksum mismatch in metadata block %llu\n",
+               (unsigned long long) block);
+        brelse(bh);
+        return NULL;
+    }
+    set_buffer_verified(bh);
+    return bh;
+}
+
+/* Update the checksum of a metadata block about to be written. Bitmap
+ * checksums are updated by simplefs_csum_bitmap() instead.
+ */
+void simplefs_csum_set(struct super_block *sb, struct buffer_head *bh)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_sb_info *disk_sb;
+    __le32 *csum;
+
+    if (!simplefs_has_metadata_csum(sb) ||
+        simplefs_is_bitmap(sb, bh->b_blocknr))
+        return;
+
+    /* Index, directory, inode store and checksum table blocks are sized to
+     * leave room for the checksum, see SIMPLEFS_MAX_EXTENTS() and others.
+     */
+    /* Blocks shared by several inodes may be updated concurrently: the last
+     * update must see the last change.
+     */
+    spin_lock(&sbi->csum_lock);
+    if (bh->b_blocknr == SIMPLEFS_SB_BLOCK_NR) {
+        disk_sb = (struct simplefs_sb_info *) bh->b_data;
+        disk_sb->checksum = cpu_to_le32(simplefs_csum_sb(bh));
+    } else {
+        csum = (__le32 *) (bh->b_data + simplefs_csum_offset(sb));
+        *csum = cpu_to_le32(simplefs_csum(bh->b_blocknr, bh->b_data,
+                                          simplefs_csum_offset(sb)));
+    }
+    spin_unlock(&sbi->csum_lock);
+    set_buffer_verified(bh);
+}
+
+/* Index of the checksum of bitmap block @block in the checksum table */
+static uint32_t simplefs_csum_index(struct super_block *sb, sector_t block)
+{
+    return block - SIMPLEFS_SB(sb)->nr_istore_blocks - 1;
+}
+
+/* Checksum table block holding the checksum of bitmap block @block */
+sector_t simplefs_csum_table(struct super_block *sb, sector_t block)
+{
+    return SIMPLEFS_SB(sb)->csum_start +
+           simplefs_csum_index(sb, block) /
+               SIMPLEFS_CSUMS_PER_BLOCK(sb->s_blocksize);
+}
+
+/* Record the checksum of bitmap block @bh in @table_bh, its checksum table
+ * block, see simplefs_csum_table(). The caller dirties @table_bh, which
+ * updates its own checksum.
+ */
+void simplefs_csum_bitmap(struct super_block *sb,
+                          struct buffer_head *table_bh,
+                          struct buffer_head *bh)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    __le32 *table = (__le32 *) table_bh->b_data;
+    uint32_t idx = simplefs_csum_index(sb, bh->b_blocknr) %
+                   SIMPLEFS_CSUMS_PER_BLOCK(sb->s_blocksize);
+    u32 crc;
+
+    if (!simplefs_has_metadata_csum(sb))
+        return;
+    crc = simplefs_csum(bh->b_blocknr, bh->b_data, sb->s_blocksize);
+    spin_lock(&sbi->csum_lock);
+    table[idx] = cpu_to_le32(crc);
+    spin_unlock(&sbi->csum_lock);
+}
+
+int simplefs_csum_verify_sb(struct super_block *sb, struct buffer_head *bh)
+{
+    struct simplefs_sb_info *disk_sb = (struct simplefs_sb_info *) bh->b_data;
+
+    if (!(disk_sb->features & SIMPLEFS_FEATURE_METADATA_CSUM))
+        return 0;
+    if (le32_to_cpu(disk_sb->checksum) != simplefs_csum_sb(bh)) {
+        pr_err("superblock checksum mismatch\n");
+        return -EBADMSG;
+    }
+    return 0;
+}
+
+/* Check bitmap block @bh against the checksum kept in the checksum table */
+int simplefs_csum_verify_bitmap(struct super_block *sb, struct buffer_head *bh)
+{
+    uint32_t idx = simplefs_csum_index(sb, bh->b_blocknr) %
+                   SIMPLEFS_CSUMS_PER_BLOCK(sb->s_blocksize);
+    struct buffer_head *table_bh;
+    __le32 *table;
+    int ret = 0;
+
+    if (!simplefs_has_metadata_csum(sb))
+        return 0;
+
+    table_bh = simplefs_bread(sb, simplefs_csum_table(sb, bh->b_blocknr));
+    if (!table_bh)
+        return -EIO;
+    table = (__le32 *) table_bh->b_data;
+    if (le32_to_cpu(table[idx]) !=
+        simplefs_csum(bh->b_blocknr, bh->b_data, sb->s_blocksize)) {
+        pr_err("checksum mismatch in bitmap block %llu\n",
+               (unsigned long long) bh->b_blocknr);
+        ret = -EBADMSG;
+    }
+    brelse(table_bh);
+    return ret;
+}
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "simplefs.h"
+
+/* Deduplication of a mounted simplefs: every extent of the regular files
+ * under the paths given is hashed, by several threads, and extents with the
+ * same hash are deduplicated against the first one found with
+ * FIDEDUPERANGE. The kernel compares the data itself, so hash collisions
+ * only cost a request. Extents are SIMPLEFS_MAX_BLOCKS_PER_EXTENT blocks,
+ * the last one of a file may be shorter.
+ */
+
+#define DEDUP_MAX_DESTS 64 /* destinations per FIDEDUPERANGE */
+
+struct file {
+    char *path;
+    off_t size;
+};
+
+struct extent {
+    uint32_t file;
+    uint32_t len;
+    off_t offset;
+    uint64_t hash;
+};
+
+static struct file *files;
+static uint32_t nr_files, files_alloc;
+static struct extent *extents;
+static size_t nr_extents, next_extent;
+static uint32_t ext_bytes;
+
+static int dry_run;
+static int verbose;
+
+static unsigned long nr_failed;
+static unsigned long long nr_dups, bytes_deduped, bytes_dup;
+
+static int add_file(const char *path,
+                    const struct stat *st,
+                    int type,
+                    struct FTW *ftw)
+{
+    if (type != FTW_F || !S_ISREG(st->st_mode) || !st->st_size)
+        return 0;
+    if (nr_files == files_alloc) {
+        struct file *f;
+
+        files_alloc = files_alloc ? 2 * files_alloc : 1024;
+        f = realloc(files, files_alloc * sizeof(*files));
+        if (!f)
+            return -1;
+        files = f;
+    }
+    files[nr_files].path = strdup(path);
+    if (!files[nr_files].path)
+        return -1;
+    files[nr_files++].size = st->st_size;
+    return 0;
+}
+
+/* FNV-1a, 64 bits */
+static uint64_t hash(const unsigned char *data, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        h ^= *data++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Worker: hashes extents until there are none left. Files are opened once
+ * per run of extents of the same file.
+ */
+static void *hash_extents(void *arg)
+{
+    unsigned char *buf = malloc(ext_bytes);
+    uint32_t cur = UINT32_MAX;
+    int fd = -1;
+    size_t i;
+
+    if (!buf)
+        return NULL;
+    while ((i = __atomic_fetch_add(&next_extent, 1, __ATOMIC_RELAXED)) <
+           nr_extents) {
+        struct extent *e = &extents[i];
+
+        if (e->file != cur) {
+            if (fd >= 0)
+                close(fd);
+            cur = e->file;
+            fd = open(files[cur].path, O_RDONLY | O_NOFOLLOW);
+        }
+        if (fd < 0 || pread(fd, buf, e->len, e->offset) != e->len) {
+            /* Never deduplicated: no other extent has this length */
+            e->len = 0;
+            continue;
+        }
+        e->hash = hash(buf, e->len);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_extents(const void *a, const void *b)
+{
+    const struct extent *x = a, *y = b;
+
+    if (x->len != y->len)
+        return x->len < y->len ? -1 : 1;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    if (x->file != y->file)
+        return x->file < y->file ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Deduplicate extents [first + 1, first + n) against extent first */
+static void dedup_group(struct extent *first, size_t n)
+{
+    struct extent *dests[DEDUP_MAX_DESTS];
+    struct file_dedupe_range *req;
+    int src, fds[DEDUP_MAX_DESTS];
+    size_t done = 1;
+
+    nr_dups += n - 1;
+    bytes_dup += (unsigned long long) (n - 1) * first->len;
+    if (dry_run)
+        return;
+
+    src = open(files[first->file].path, O_RDONLY | O_NOFOLLOW);
+    req = calloc(1, sizeof(*req) + DEDUP_MAX_DESTS * sizeof(req->info[0]));
+    if (src < 0 || !req) {
+        fprintf(stderr, "%s: %s\n", files[first->file].path, strerror(errno));
+        nr_failed += n - 1;
+        goto out;
+    }
+
+    while (done < n) {
+        uint16_t k, count = 0;
+
+        req->src_offset = first->offset;
+        req->src_length = first->len;
+        while (done < n && count < DEDUP_MAX_DESTS) {
+            struct extent *e = &first[done++];
+
+            fds[count] = open(files[e->file].path, O_RDONLY | O_NOFOLLOW);
+            if (fds[count] < 0) {
+                fprintf(stderr, "%s: %s\n", files[e->file].path,
+                        strerror(errno));
+                nr_failed++;
+                continue;
+            }
+            dests[count] = e;
+            memset(&req->info[count], 0, sizeof(req->info[count]));
+            req->info[count].dest_fd = fds[count];
+            req->info[count].dest_offset = e->offset;
+            count++;
+        }
+        if (!count)
+            break;
+        req->dest_count = count;
+
+        if (ioctl(src, FIDEDUPERANGE, req) < 0) {
+            fprintf(stderr, "%s: FIDEDUPERANGE: %s\n",
+                    files[first->file].path, strerror(errno));
+            nr_failed += count;
+        } else {
+            for (k = 0; k < count; k++) {
+                if (req->info[k].status == FILE_DEDUPE_RANGE_SAME)
+                    bytes_deduped += req->info[k].bytes_deduped;
+                else if (verbose)
+                    printf("extent at %llu of %s: %s\n",
+                           (unsigned long long) dests[k]->offset,
+                           files[dests[k]->file].path,
+                           req->info[k].status == FILE_DEDUPE_RANGE_DIFFERS
+                               ? "data differs"
+                               : strerror(-req->info[k].status));
+            }
+        }
+        for (k = 0; k < count; k++)
+            close(fds[k]);
+    }
+
+out:
+    if (src >= 0)
+        close(src);
+    free(req);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n] [-j threads] [-v] path...\n"
+            "  -n  only report the duplicate extents\n"
+            "  -j  number of threads hashing extents (default: one per CPU)\n"
+            "  -v  print every group of duplicate extents\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *threads;
+    struct statfs sfs;
+    size_t i, j;
+    long t, nr_started = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "nj:v")) != -1) {
+        switch (opt) {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 'j':
+            nr_threads = strtol(optarg, NULL, 10);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind == argc || nr_threads < 1 || nr_threads > 1024) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int a = optind; a < argc; a++) {
+        if (statfs(argv[a], &sfs)) {
+            perror(argv[a]);
+            return EXIT_FAILURE;
+        }
+        if (sfs.f_type != SIMPLEFS_MAGIC) {
+            fprintf(stderr, "%s: not on a simplefs partition\n", argv[a]);
+            return EXIT_FAILURE;
+        }
+        ext_bytes = SIMPLEFS_MAX_BLOCKS_PER_EXTENT * sfs.f_bsize;
+        /* Files on other partitions mounted below are left alone */
+        if (nftw(argv[a], add_file, 64, FTW_PHYS | FTW_MOUNT)) {
+            perror(argv[a]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* One extent per SIMPLEFS_MAX_BLOCKS_PER_EXTENT blocks of every file */
+    for (i = 0; i < nr_files; i++)
+        nr_extents += (files[i].size + ext_bytes - 1) / ext_bytes;
+    extents = calloc(nr_extents ? nr_extents : 1, sizeof(*extents));
+    threads = calloc(nr_threads, sizeof(*threads));
+    if (!extents || !threads) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (i = 0, j = 0; i < nr_files; i++) {
+        for (off_t off = 0; off < files[i].size; off += ext_bytes, j++) {
+            extents[j].file = i;
+            extents[j].offset = off;
+            extents[j].len = files[i].size - off < ext_bytes
+                                 ? files[i].size - off
+                                 : ext_bytes;
+        }
+    }
+
+    for (t = 0; t < nr_threads; t++) {
+        if (pthread_create(&threads[t], NULL, hash_extents, NULL))
+            break;
+        nr_started++;
+    }
+    if (!nr_started) {
+        fprintf(stderr, "Cannot start the scan\n");
+        return EXIT_FAILURE;
+    }
+    for (t = 0; t < nr_started; t++)
+        pthread_join(threads[t], NULL);
+
+    /* Groups of extents of the same length and hash */
+    qsort(extents, nr_extents, sizeof(*extents), cmp_extents);
+    for (i = 0; i < nr_extents; i = j) {
+        for (j = i + 1; j < nr_extents && extents[j].len == extents[i].len &&
+                        extents[j].hash == extents[i].hash;
+             j++)
+            ;
+        if (j - i < 2 || !extents[i].len)
+            continue;
+        if (verbose)
+            printf("%zu extents of %u bytes like the one at %llu of %s\n",
+                   j - i, extents[i].len,
+                   (unsigned long long) extents[i].offset,
+                   files[extents[i].file].path);
+        dedup_group(&extents[i], j - i);
+    }
+
+    printf("%u files, %zu extents scanned by %ld threads, %llu duplicate(s) "
+           "of %llu bytes",
+           nr_files, nr_extents, nr_started, nr_dups, bytes_dup);
+    if (!dry_run)
+        printf(", %llu bytes deduplicated", bytes_deduped);
+    printf("\n");
+    if (nr_failed)
+        fprintf(stderr, "%lu extent(s) failed\n", nr_failed);
+    return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "simplefs.h"
+
+/* Online defragmentation of a mounted simplefs: every regular file under the
+ * paths given with more fragments (runs of blocks contiguous on disk) than
+ * the threshold is moved to one contiguous run with SIMPLEFS_IOC_DEFRAG.
+ * Extents are at most SIMPLEFS_MAX_BLOCKS_PER_EXTENT blocks, so their count
+ * only follows the file size; fragments are what a sequential read seeks
+ * between.
+ */
+
+static int dry_run;
+static int verbose;
+static uint32_t threshold = 1;
+
+static unsigned long nr_scanned, nr_fragmented, nr_defragged, nr_failed;
+static unsigned long long frags_before, frags_after, blocks_moved;
+
+static int defrag_file(const char *path,
+                       const struct stat *st,
+                       int type,
+                       struct FTW *ftw)
+{
+    struct simplefs_defrag d = {.flags = SIMPLEFS_DEFRAG_DRY_RUN};
+    int fd;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+
+    fd = open(path, (dry_run ? O_RDONLY : O_RDWR) | O_NOFOLLOW);
+    if (fd < 0)
+        goto fail;
+    if (ioctl(fd, SIMPLEFS_IOC_DEFRAG, &d) < 0)
+        goto fail_close;
+    nr_scanned++;
+    if (d.frags_before <= threshold) {
+        close(fd);
+        return 0;
+    }
+    nr_fragmented++;
+    frags_before += d.frags_before;
+
+    if (!dry_run) {
+        d.flags = 0;
+        if (ioctl(fd, SIMPLEFS_IOC_DEFRAG, &d) < 0)
+            goto fail_close;
+        nr_defragged++;
+        blocks_moved += d.nr_blocks;
+    }
+    frags_after += d.frags_after;
+    if (verbose)
+        printf("%s: %u -> %u fragments, %u blocks moved\n", path,
+               d.frags_before, d.frags_after, d.nr_blocks);
+    close(fd);
+    return 0;
+
+fail_close:
+    close(fd);
+fail:
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    nr_failed++;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n] [-t fragments] [-v] path...\n"
+            "  -n  only report the fragmented files\n"
+            "  -t  defragment files of more fragments (default: 1)\n"
+            "  -v  print every fragmented file\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    struct statfs sfs;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "nt:v")) != -1) {
+        switch (opt) {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 't':
+            threshold = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (statfs(argv[i], &sfs)) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        if (sfs.f_type != SIMPLEFS_MAGIC) {
+            fprintf(stderr, "%s: not on a simplefs partition\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        /* Files on other partitions mounted below are left alone */
+        if (nftw(argv[i], defrag_file, 64, FTW_PHYS | FTW_MOUNT)) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%lu files scanned, %lu with more than %u fragment(s)", nr_scanned,
+           nr_fragmented, threshold);
+    if (dry_run)
+        printf(": %llu fragments\n", frags_before);
+    else
+        printf(", %lu defragmented: %llu -> %llu fragments, %llu blocks "
+               "moved\n",
+               nr_defragged, frags_before, frags_after, blocks_moved);
+    if (nr_failed)
+        fprintf(stderr, "%lu file(s) failed\n", nr_failed);
+    return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
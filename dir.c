@@ -29,7 +29,7 @@ static int simplefs_iterate(struct file *dir, struct dir_context *ctx)
     /* Check that ctx->pos is not bigger than what we can handle (including
      * . and ..)
      */
-    if (ctx->pos > SIMPLEFS_MAX_SUBFILES + 2)
+    if (ctx->pos > simplefs_max_subfiles(sb) + 2)
         return 0;
 
     /* Commit . and .. to ctx */
@@ -37,7 +37,7 @@ static int simplefs_iterate(struct file *dir, struct dir_context *ctx)
         return 0;
 
     /* Read the directory index block on disk */
-    bh = sb_bread(sb, ci->ei_block);
+    bh = simplefs_bread(sb, ci->ei_block);
     if (!bh)
         return -EIO;
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
@@ -48,7 +48,7 @@ static int simplefs_iterate(struct file *dir, struct dir_context *ctx)
     int remained_nr_files = eblock->nr_files - (ctx->pos - 2);
 
     int offset = ctx->pos - 2;
-    for (ei = 0; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
+    for (ei = 0; ei < simplefs_max_extents(sb); ei++) {
         if (eblock->extents[ei].ee_start == 0)
             continue;
         if (offset > eblock->extents[ei].nr_files) {
@@ -59,14 +59,14 @@ static int simplefs_iterate(struct file *dir, struct dir_context *ctx)
     }
 
     /* Iterate over the index block and commit subfiles */
-    for (; remained_nr_files && ei < SIMPLEFS_MAX_EXTENTS; ei++) {
+    for (; remained_nr_files && ei < simplefs_max_extents(sb); ei++) {
         if (eblock->extents[ei].ee_start == 0)
             continue;
 
         /* Iterate over blocks in one extent */
         for (bi = 0; bi < eblock->extents[ei].ee_len && remained_nr_files;
              bi++) {
-            bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+            bh2 = simplefs_bread(sb, eblock->extents[ei].ee_start + bi);
             if (!bh2) {
                 ret = -EIO;
                 goto release_bh;
@@ -80,7 +80,7 @@ static int simplefs_iterate(struct file *dir, struct dir_context *ctx)
                 continue;
             }
 
-            for (fi = 0; fi < SIMPLEFS_FILES_PER_BLOCK;) {
+            for (fi = 0; fi < simplefs_files_per_block(sb);) {
                 if (dblock->files[fi].inode != 0) {
                     if (offset) {
                         offset--;
@@ -113,4 +113,8 @@ release_bh:
 const struct file_operations simplefs_dir_ops = {
     .owner = THIS_MODULE,
     .iterate_shared = simplefs_iterate,
+    .unlocked_ioctl = simplefs_ioctl,
+#if SIMPLEFS_AT_LEAST(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
 };
@@ -0,0 +1,341 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include <linux/kernel.h>
+#include <linux/list_sort.h>
+#include <linux/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* Discard of free blocks, so that thin-provisioned volumes and SSDs learn
+ * about them.
+ *
+ * FITRIM walks the bfree bitmap for free runs. With the discard mount option,
+ * put_blocks() also queues every freed extent here; a worker discards them in
+ * batches, sorted and merged, a commit interval later. Either way:
+ *
+ * - A free is only final once the transaction that made it commits: before
+ *   that, a crash brings the blocks back to their file. Runs are discarded
+ *   once that transaction has committed, and blocks still marked in
+ *   sbi->bfree_pending are left out.
+ * - The runs being discarded are marked in sbi->discard_bitmap, a bit at a
+ *   time as allocations may race, and get_free_blocks_in() skips them, so
+ *   that a block allocated meanwhile is not discarded after it is written.
+ *   The bfree bitmap is left alone: its blocks are logged whole, and a run
+ *   taken out of it would be committed as in use.
+ */
+
+struct simplefs_discard {
+    struct super_block *sb;
+    spinlock_t lock;
+    struct list_head extents; /* freed, to be discarded */
+    tid_t tid;                /* transaction that freed the last of them */
+    struct delayed_work work;
+};
+
+struct simplefs_discard_extent {
+    struct list_head list;
+    uint32_t bno;
+    uint32_t len;
+};
+
+static bool simplefs_can_discard(struct super_block *sb)
+{
+#if SIMPLEFS_AT_LEAST(5, 19, 0)
+    return bdev_max_discard_sectors(sb->s_bdev);
+#else
+    return blk_queue_discard(bdev_get_queue(sb->s_bdev));
+#endif
+}
+
+/* Mark free block @bno as being discarded. Returns false if it is in use,
+ * freed by a transaction that has not committed yet, or already being
+ * discarded.
+ */
+static bool simplefs_hold_bit(struct simplefs_sb_info *sbi, uint32_t bno)
+{
+    if (test_and_set_bit(bno, sbi->discard_bitmap))
+        return false;
+    /* Pairs with the barrier of simplefs_busy_bit(): either the allocator
+     * sees the mark, or the block is seen in use here.
+     */
+    smp_mb__after_atomic();
+    if (test_bit(bno, sbi->bfree_bitmap)) {
+        /* simplefs_journal_free() marks it pending before it is freed */
+        smp_rmb();
+        if (!sbi->bfree_pending || !test_bit(bno, sbi->bfree_pending))
+            return true;
+    }
+    clear_bit(bno, sbi->discard_bitmap);
+    return false;
+}
+
+static void simplefs_release_bits(unsigned long *map,
+                                  uint32_t bit,
+                                  uint32_t len)
+{
+    while (len--)
+        clear_bit(bit++, map);
+}
+
+/* Mark the free runs of at least @minlen blocks in [start, end) as being
+ * discarded and add them to @runs.
+ */
+static int simplefs_reserve_free(struct super_block *sb,
+                                 uint32_t start,
+                                 uint32_t end,
+                                 uint32_t minlen,
+                                 struct list_head *runs)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_discard_extent *run;
+    uint32_t bit = start, len;
+
+    while ((bit = find_next_bit(sbi->bfree_bitmap, end, bit)) < end) {
+        for (len = 0; bit + len < end && simplefs_hold_bit(sbi, bit + len);
+             len++)
+            ;
+        if (len && len >= minlen) {
+            run = kmalloc(sizeof(*run), GFP_NOFS);
+            if (!run) {
+                simplefs_release_bits(sbi->discard_bitmap, bit, len);
+                return -ENOMEM;
+            }
+            run->bno = bit;
+            run->len = len;
+            list_add_tail(&run->list, runs);
+        } else {
+            simplefs_release_bits(sbi->discard_bitmap, bit, len);
+        }
+        /* bit + len is in use, being discarded, or the end */
+        bit += len + 1;
+    }
+    return 0;
+}
+
+/* Discard the runs of @runs if @issue, and let them be allocated again.
+ * Returns the number of blocks discarded.
+ */
+static uint64_t simplefs_discard_runs(struct super_block *sb,
+                                      struct list_head *runs,
+                                      bool issue)
+{
+    struct simplefs_discard_extent *run, *tmp;
+    uint64_t discarded = 0;
+    int err;
+
+    list_for_each_entry_safe (run, tmp, runs, list) {
+        if (issue) {
+            err = simplefs_issue_discard(sb, run->bno, run->len);
+            if (!err)
+                discarded += run->len;
+            else if (err != -EOPNOTSUPP)
+                pr_warn_ratelimited("discard of blocks %u-%u failed: %d\n",
+                                    run->bno, run->bno + run->len - 1, err);
+        }
+        simplefs_release_bits(SIMPLEFS_SB(sb)->discard_bitmap, run->bno,
+                              run->len);
+        list_del(&run->list);
+        kfree(run);
+    }
+    return discarded;
+}
+
+/* FITRIM: discard the free runs of at least range->minlen bytes within
+ * [range->start, range->start + range->len), one bitmap block worth of
+ * blocks at a time. range->len is set to the number of bytes discarded.
+ */
+int simplefs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t bits_per_block = sb->s_blocksize * 8;
+    uint32_t start, end, next, minlen;
+    uint64_t trimmed = 0;
+    LIST_HEAD(runs);
+    int ret = 0;
+
+    if (!sbi->discard_bitmap)
+        return -EOPNOTSUPP;
+    minlen = max_t(uint64_t, 1,
+                   DIV_ROUND_UP_ULL(range->minlen, sb->s_blocksize));
+    if (minlen > sbi->nr_blocks || range->len < sb->s_blocksize)
+        return -EINVAL;
+
+    start = max_t(uint64_t, range->start >> sb->s_blocksize_bits,
+                  simplefs_bfree_start(sbi) + sbi->nr_bfree_blocks);
+    end = min_t(uint64_t, sbi->nr_blocks,
+                (range->start >> sb->s_blocksize_bits) +
+                    (range->len >> sb->s_blocksize_bits));
+
+    for (; start < end; start = next) {
+        next = min(end, round_down(start, bits_per_block) + bits_per_block);
+        ret = simplefs_reserve_free(sb, start, next, minlen, &runs);
+        if (!ret && sbi->journal && !list_empty(&runs))
+            ret = jbd2_journal_force_commit(sbi->journal);
+        trimmed += simplefs_discard_runs(sb, &runs, !ret);
+        if (ret)
+            break;
+        if (fatal_signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        cond_resched();
+    }
+
+    range->len = trimmed << sb->s_blocksize_bits;
+    return ret;
+}
+
+#if SIMPLEFS_AT_LEAST(5, 13, 0)
+static int simplefs_discard_cmp(void *priv,
+                                const struct list_head *a,
+                                const struct list_head *b)
+#else
+static int simplefs_discard_cmp(void *priv,
+                                struct list_head *a,
+                                struct list_head *b)
+#endif
+{
+    uint32_t bno_a = list_entry(a, struct simplefs_discard_extent, list)->bno;
+    uint32_t bno_b = list_entry(b, struct simplefs_discard_extent, list)->bno;
+
+    return bno_a < bno_b ? -1 : bno_a > bno_b;
+}
+
+static void simplefs_discard_work(struct work_struct *work)
+{
+    struct simplefs_discard *dc =
+        container_of(to_delayed_work(work), struct simplefs_discard, work);
+    struct super_block *sb = dc->sb;
+    journal_t *journal = SIMPLEFS_SB(sb)->journal;
+    struct simplefs_discard_extent *ext, *next;
+    LIST_HEAD(freed);
+    LIST_HEAD(runs);
+    bool ok = true;
+    tid_t tid;
+
+    spin_lock(&dc->lock);
+    list_splice_init(&dc->extents, &freed);
+    tid = dc->tid;
+    spin_unlock(&dc->lock);
+    if (list_empty(&freed))
+        return;
+
+    /* Usually committed already: the work runs a commit interval later */
+    if (journal && jbd2_complete_transaction(journal, tid))
+        ok = false;
+
+    /* One discard per run of adjacent extents */
+    list_sort(NULL, &freed, simplefs_discard_cmp);
+    ext = list_first_entry(&freed, struct simplefs_discard_extent, list);
+    while (!list_is_last(&ext->list, &freed)) {
+        next = list_next_entry(ext, list);
+        if (next->bno <= ext->bno + ext->len) {
+            ext->len = max(ext->len, next->bno + next->len - ext->bno);
+            list_del(&next->list);
+            kfree(next);
+        } else {
+            ext = next;
+        }
+    }
+
+    list_for_each_entry_safe (ext, next, &freed, list) {
+        if (ok && simplefs_reserve_free(sb, ext->bno, ext->bno + ext->len, 1,
+                                        &runs))
+            ok = false;
+        simplefs_discard_runs(sb, &runs, ok);
+        list_del(&ext->list);
+        kfree(ext);
+    }
+}
+
+/* put_blocks() with the discard mount option. Extents that cannot be queued
+ * are left to FITRIM.
+ */
+void simplefs_discard_queue(struct super_block *sb, uint32_t bno, uint32_t len)
+{
+    struct simplefs_discard *dc = SIMPLEFS_SB(sb)->discard;
+    struct simplefs_discard_extent *ext, *last;
+    handle_t *handle = journal_current_handle();
+
+    if (!dc)
+        return;
+    ext = kmalloc(sizeof(*ext), GFP_NOFS);
+    if (!ext)
+        return;
+    ext->bno = bno;
+    ext->len = len;
+
+    spin_lock(&dc->lock);
+    if (handle)
+        dc->tid = handle->h_transaction->t_tid;
+    /* Files are mostly freed extent after extent */
+    last = list_empty(&dc->extents)
+               ? NULL
+               : list_last_entry(&dc->extents, struct simplefs_discard_extent,
+                                 list);
+    if (last && last->bno + last->len == bno) {
+        last->len += len;
+        kfree(ext);
+    } else {
+        list_add_tail(&ext->list, &dc->extents);
+    }
+    spin_unlock(&dc->lock);
+
+    schedule_delayed_work(&dc->work, SIMPLEFS_SB(sb)->s_commit_interval);
+}
+
+/* Set up the map of runs being discarded if the device supports discard,
+ * and the discard queue if mounted with the discard option.
+ */
+int simplefs_discard_init(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_discard *dc;
+
+    if (!simplefs_can_discard(sb)) {
+        if (sbi->s_mount_opt & SIMPLEFS_MOUNT_DISCARD)
+            pr_warn("discard not supported by the device, disabled\n");
+        sbi->s_mount_opt &= ~SIMPLEFS_MOUNT_DISCARD;
+        return 0;
+    }
+    sbi->discard_bitmap =
+        kvzalloc(sbi->nr_bfree_blocks * sb->s_blocksize, GFP_KERNEL);
+    if (!sbi->discard_bitmap)
+        return -ENOMEM;
+    if (!(sbi->s_mount_opt & SIMPLEFS_MOUNT_DISCARD))
+        return 0;
+
+    dc = kzalloc(sizeof(*dc), GFP_KERNEL);
+    if (!dc)
+        return -ENOMEM;
+    dc->sb = sb;
+    spin_lock_init(&dc->lock);
+    INIT_LIST_HEAD(&dc->extents);
+    INIT_DELAYED_WORK(&dc->work, simplefs_discard_work);
+    sbi->discard = dc;
+    return 0;
+}
+
+/* Discard what is queued, then free the queue. The journal must still be
+ * loaded.
+ */
+void simplefs_discard_release(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_discard *dc = sbi->discard;
+
+    if (dc) {
+        flush_delayed_work(&dc->work);
+        sbi->discard = NULL;
+        kfree(dc);
+    }
+    kvfree(sbi->discard_bitmap);
+    sbi->discard_bitmap = NULL;
+}
@@ -1,15 +1,20 @@
+#ifdef __KERNEL__
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#else
+#include <stdint.h> /* also built into libsimplefs */
+#endif
 
 #include "simplefs.h"
 
-/* Search for the extent containing the target block. Binary search is used
- * for efficiency.
+/* Search for the extent containing the target block in an index block of
+ * @nr_extents extents. Binary search is used for efficiency.
  *
- * Returns the first unused file index if not found.
- * Returns -1 if the target block is out of range.
+ * Returns the first unused file index if not found, @nr_extents if they are
+ * all in use.
  */
 uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
+                             uint32_t nr_extents,
                              uint32_t iblock)
 {
     /* First, find the first unused file index with binary search.
@@ -17,7 +22,7 @@ uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
      * value when the file index is not found.
      */
     uint32_t start = 0;
-    uint32_t end = SIMPLEFS_MAX_EXTENTS - 1;
+    uint32_t end = nr_extents - 1;
     uint32_t boundary;
     uint32_t end_block;
     uint32_t end_len;
@@ -64,9 +69,7 @@ uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
      */
     end_block = index->extents[end].ee_block;
     end_len = index->extents[end].ee_len;
-    if (iblock >= end_block && iblock < end_len)
+    if (iblock >= end_block && iblock < end_block + end_len)
         return end;
-    if (boundary < SIMPLEFS_MAX_EXTENTS)
-        return boundary;
     return boundary;
 }
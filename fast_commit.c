@@ -0,0 +1,852 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include <linux/kernel.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+
+#include "simplefs.h"
+
+#if SIMPLEFS_AT_LEAST(6, 14, 0)
+#include <linux/crc32.h>
+#else
+#include <linux/crc32c.h>
+#endif
+
+/* Fast commits, on top of jbd2.
+ *
+ * A full commit logs whole 4 KiB images of every metadata block a transaction
+ * touched. Small operations also describe themselves in a compact logical log
+ * (inode images, extents added to a file, entries added to a directory), kept
+ * in memory for the running transaction. fsync() writes the records that are
+ * not on disk yet to the fast commit area of the journal, usually in a single
+ * block, instead of committing the whole transaction. At mount, jbd2 replays
+ * the last full commit, then hands us the fast commit blocks that follow it.
+ *
+ * Every operation running in a handle must either log itself here or call
+ * simplefs_fc_mark_ineligible(): fsync then falls back to a full commit for
+ * the rest of the transaction. Creating regular files and allocating their
+ * blocks, adding and removing directory entries without allocating directory
+ * blocks, and freeing regular files and symbolic links are logged.
+ *
+ * A full commit writes the data of the files it exposes first, through jbd2
+ * inodes; a fast commit only has the list of inodes kept along with the log,
+ * whose data is written out before the records.
+ */
+
+#define SIMPLEFS_FC_LOG_SIZE (64 * 1024)
+#define SIMPLEFS_FC_MAX_INODES 16
+
+struct simplefs_fc {
+    spinlock_t lock;
+    bool enabled;           /* fast_commit mount option, accepted by jbd2 */
+    tid_t tid;              /* transaction the log belongs to */
+    bool ineligible;        /* tid made a change the log cannot describe */
+    unsigned int nr_inodes; /* inodes of tid whose data the log exposes */
+    uint32_t inodes[SIMPLEFS_FC_MAX_INODES];
+    unsigned int data_seq;  /* bumped by each record exposing data */
+    size_t len;             /* bytes of records in log */
+    size_t flushed;         /* bytes of records already fast committed */
+    char *log;              /* records of tid */
+    int replay_blocks;      /* fast commit blocks ending with a valid tail */
+    u32 replay_crc;         /* crc of the commit being scanned */
+};
+
+#if SIMPLEFS_AT_LEAST(5, 11, 0)
+
+/* Overwrite the unflushed image of the inode of @rec, if any */
+static bool simplefs_fc_find_inode(struct simplefs_fc *fc,
+                                   const struct simplefs_fc_inode *rec,
+                                   uint16_t len)
+{
+    struct simplefs_fc_tl *tl;
+    struct simplefs_fc_inode *cur;
+    size_t pos = fc->flushed;
+
+    while (pos < fc->len) {
+        tl = (struct simplefs_fc_tl *) (fc->log + pos);
+        cur = (struct simplefs_fc_inode *) (tl + 1);
+        if (le16_to_cpu(tl->fc_tag) == SIMPLEFS_FC_TAG_INODE &&
+            cur->ino == rec->ino) {
+            memcpy(cur, rec, len);
+            return true;
+        }
+        pos += sizeof(*tl) + le16_to_cpu(tl->fc_len);
+    }
+    return false;
+}
+
+/* Add @ino to the inodes whose data the log exposes */
+static void simplefs_fc_add_inode(struct simplefs_fc *fc, uint32_t ino)
+{
+    unsigned int i;
+
+    fc->data_seq++;
+    for (i = 0; i < fc->nr_inodes; i++) {
+        if (fc->inodes[i] == ino)
+            return;
+    }
+    if (fc->nr_inodes == SIMPLEFS_FC_MAX_INODES)
+        fc->ineligible = true;
+    else
+        fc->inodes[fc->nr_inodes++] = ino;
+}
+
+/* Append a record for the transaction of @handle, starting a new log when the
+ * transaction changed. A non-zero @data_ino tells that the record exposes file
+ * data of that inode, which a fast commit must write first.
+ */
+static void simplefs_fc_log(handle_t *handle,
+                            struct super_block *sb,
+                            uint16_t tag,
+                            const void *value,
+                            uint16_t len,
+                            const char *name,
+                            uint32_t data_ino)
+{
+    struct simplefs_fc *fc = SIMPLEFS_SB(sb)->fc;
+    tid_t tid;
+    uint16_t name_len = name ? strlen(name) + 1 : 0;
+    uint16_t size = round_up(len + name_len, 4);
+    struct simplefs_fc_tl tl = {.fc_tag = cpu_to_le16(tag),
+                                .fc_len = cpu_to_le16(size)};
+
+    if (!handle || !fc || !fc->enabled)
+        return;
+    tid = handle->h_transaction->t_tid;
+
+    spin_lock(&fc->lock);
+    if (fc->tid != tid) {
+        fc->tid = tid;
+        fc->ineligible = false;
+        fc->nr_inodes = 0;
+        fc->len = fc->flushed = 0;
+    }
+    if (data_ino)
+        simplefs_fc_add_inode(fc, data_ino);
+    if (!fc->ineligible) {
+        /* Inodes are logged on every change: overwrite the image not
+         * committed yet rather than piling up records.
+         */
+        if (tag == SIMPLEFS_FC_TAG_INODE &&
+            simplefs_fc_find_inode(fc, value, len))
+            goto unlock;
+        if (fc->len + sizeof(tl) + size > SIMPLEFS_FC_LOG_SIZE) {
+            fc->ineligible = true;
+        } else {
+            memcpy(fc->log + fc->len, &tl, sizeof(tl));
+            memcpy(fc->log + fc->len + sizeof(tl), value, len);
+            memset(fc->log + fc->len + sizeof(tl) + len, 0, size - len);
+            if (name)
+                memcpy(fc->log + fc->len + sizeof(tl) + len, name, name_len);
+            fc->len += sizeof(tl) + size;
+        }
+    }
+unlock:
+    spin_unlock(&fc->lock);
+}
+
+void simplefs_fc_mark_ineligible(struct super_block *sb, handle_t *handle)
+{
+    struct simplefs_fc *fc = SIMPLEFS_SB(sb)->fc;
+
+    if (!handle || !fc || !fc->enabled)
+        return;
+
+    spin_lock(&fc->lock);
+    fc->tid = handle->h_transaction->t_tid;
+    fc->ineligible = true;
+    spin_unlock(&fc->lock);
+}
+
+void simplefs_fc_log_inode(handle_t *handle,
+                           struct inode *inode,
+                           struct simplefs_inode *raw)
+{
+    struct simplefs_fc_inode rec = {.ino = cpu_to_le32(inode->i_ino)};
+
+    /* Freed inodes are described by simplefs_fc_log_free(). Their image must
+     * not replace one logged before the entry of the inode was added.
+     */
+    if (!raw->i_nlink)
+        return;
+    rec.raw = *raw;
+    simplefs_fc_log(handle, inode->i_sb, SIMPLEFS_FC_TAG_INODE, &rec,
+                    sizeof(rec), NULL,
+                    S_ISREG(inode->i_mode) && raw->i_size ? inode->i_ino : 0);
+}
+
+void simplefs_fc_log_extent(handle_t *handle,
+                            struct inode *inode,
+                            uint32_t index,
+                            struct simplefs_extent *extent)
+{
+    struct simplefs_fc_extent rec = {
+        .ino = cpu_to_le32(inode->i_ino),
+        .ei_block = cpu_to_le32(SIMPLEFS_INODE(inode)->ei_block),
+        .index = cpu_to_le32(index),
+    };
+
+    rec.extent = *extent;
+    simplefs_fc_log(handle, inode->i_sb, SIMPLEFS_FC_TAG_EXTENT, &rec,
+                    sizeof(rec), NULL, inode->i_ino);
+}
+
+static void simplefs_fc_log_name(handle_t *handle,
+                                 struct inode *dir,
+                                 uint16_t tag,
+                                 uint32_t ino,
+                                 const char *name)
+{
+    struct simplefs_fc_dirent rec = {
+        .dir = cpu_to_le32(dir->i_ino),
+        .ino = cpu_to_le32(ino),
+    };
+
+    simplefs_fc_log(handle, dir->i_sb, tag, &rec, sizeof(rec), name, 0);
+}
+
+void simplefs_fc_log_dirent(handle_t *handle,
+                            struct inode *dir,
+                            uint32_t ino,
+                            const char *name)
+{
+    simplefs_fc_log_name(handle, dir, SIMPLEFS_FC_TAG_DIRENT, ino, name);
+}
+
+void simplefs_fc_log_link(handle_t *handle,
+                          struct inode *dir,
+                          uint32_t ino,
+                          const char *name)
+{
+    simplefs_fc_log_name(handle, dir, SIMPLEFS_FC_TAG_LINK, ino, name);
+}
+
+void simplefs_fc_log_unlink(handle_t *handle,
+                            struct inode *dir,
+                            uint32_t ino,
+                            const char *name)
+{
+    simplefs_fc_log_name(handle, dir, SIMPLEFS_FC_TAG_UNLINK, ino, name);
+}
+
+void simplefs_fc_log_free(handle_t *handle, struct inode *inode)
+{
+    struct simplefs_fc_free rec = {.ino = cpu_to_le32(inode->i_ino)};
+
+    simplefs_fc_log(handle, inode->i_sb, SIMPLEFS_FC_TAG_FREE, &rec,
+                    sizeof(rec), NULL, 0);
+}
+
+/* Fast commit blocks being filled by simplefs_fc_write() */
+struct simplefs_fc_writer {
+    journal_t *journal;
+    struct buffer_head *bh;
+    unsigned int off;
+    int nr_blocks;
+    u32 crc;
+};
+
+/* Write out the current block, synchronously */
+static int simplefs_fc_submit(struct simplefs_fc_writer *w, bool tail)
+{
+    int flags = REQ_SYNC;
+    int ret;
+
+    /* The tail must not reach the disk before the rest of the commit, nor
+     * before the file data written by fsync, unless mounted with nobarrier.
+     */
+    if (tail && (w->journal->j_flags & JBD2_BARRIER))
+        flags |= REQ_PREFLUSH | REQ_FUA;
+
+    set_buffer_uptodate(w->bh);
+    set_buffer_dirty(w->bh);
+    ret = __sync_dirty_buffer(w->bh, flags);
+    w->bh = NULL;
+    return ret;
+}
+
+/* Make room for @size bytes, padding and submitting the current block and
+ * moving to the next one if needed.
+ */
+static int simplefs_fc_reserve(struct simplefs_fc_writer *w, unsigned int size)
+{
+    unsigned int bsize = w->journal->j_blocksize;
+    struct simplefs_fc_tl *tl;
+    int ret;
+
+    if (w->bh && w->off + size <= bsize)
+        return 0;
+
+    if (w->bh) {
+        tl = (struct simplefs_fc_tl *) (w->bh->b_data + w->off);
+        tl->fc_tag = cpu_to_le16(SIMPLEFS_FC_TAG_PAD);
+        tl->fc_len = cpu_to_le16(bsize - w->off - sizeof(*tl));
+        w->crc = crc32c(w->crc, tl, bsize - w->off);
+        ret = simplefs_fc_submit(w, false);
+        if (ret)
+            return ret;
+    }
+
+    ret = jbd2_fc_get_buf(w->journal, &w->bh);
+    if (ret)
+        return ret;
+    w->nr_blocks++;
+    w->off = 0;
+    lock_buffer(w->bh);
+    memset(w->bh->b_data, 0, bsize);
+    unlock_buffer(w->bh);
+    return 0;
+}
+
+/* Write @len bytes of records followed by a tail for @tid */
+static int simplefs_fc_write(journal_t *journal,
+                             const char *log,
+                             size_t len,
+                             tid_t tid,
+                             int *nr_blocks)
+{
+    struct simplefs_fc_writer w = {.journal = journal, .crc = ~0};
+    struct simplefs_fc_tl tl = {
+        .fc_tag = cpu_to_le16(SIMPLEFS_FC_TAG_TAIL),
+        .fc_len = cpu_to_le16(sizeof(struct simplefs_fc_tail)),
+    };
+    struct simplefs_fc_tail tail = {.tid = cpu_to_le32(tid)};
+    size_t pos = 0, size;
+    int ret = 0;
+
+    while (pos < len) {
+        size = sizeof(tl) +
+               le16_to_cpu(((struct simplefs_fc_tl *) (log + pos))->fc_len);
+        ret = simplefs_fc_reserve(&w, size);
+        if (ret)
+            goto out;
+        memcpy(w.bh->b_data + w.off, log + pos, size);
+        w.crc = crc32c(w.crc, log + pos, size);
+        w.off += size;
+        pos += size;
+    }
+
+    ret = simplefs_fc_reserve(&w, sizeof(tl) + sizeof(tail));
+    if (ret)
+        goto out;
+    w.crc = crc32c(w.crc, &tl, sizeof(tl));
+    w.crc = crc32c(w.crc, &tail.tid, sizeof(tail.tid));
+    tail.crc = cpu_to_le32(w.crc);
+    memcpy(w.bh->b_data + w.off, &tl, sizeof(tl));
+    memcpy(w.bh->b_data + w.off + sizeof(tl), &tail, sizeof(tail));
+    ret = simplefs_fc_submit(&w, true);
+
+out:
+    *nr_blocks = w.nr_blocks;
+    return ret;
+}
+
+/* Write out the data of the inodes of the log and wait for it. fsync() already
+ * wrote the data of @inode, which is only written again if dirtied since.
+ */
+static int simplefs_fc_write_data(struct inode *inode,
+                                  const uint32_t *inodes,
+                                  unsigned int nr_inodes)
+{
+    struct super_block *sb = inode->i_sb;
+    struct inode *other;
+    bool flush = false;
+    unsigned int i;
+    int ret = 0, err;
+
+    for (i = 0; i < nr_inodes; i++) {
+        other = ilookup(sb, inodes[i]);
+        if (!other)
+            continue;
+        err = filemap_write_and_wait(other->i_mapping);
+        if (err && !ret)
+            ret = err;
+        flush |= other != inode;
+        iput(other);
+    }
+
+    /* jbd2 only flushes the first device of a striped partition */
+    if (flush && !ret)
+        ret = simplefs_stripe_flush(sb);
+    return ret;
+}
+
+/* Make the changes of transaction @tid durable for fsync() of @inode, whose
+ * data is already written: with a fast commit when every change so far can be
+ * described by the log, or a full commit otherwise.
+ */
+int simplefs_fc_commit(struct inode *inode, tid_t tid)
+{
+    struct super_block *sb = inode->i_sb;
+    journal_t *journal = SIMPLEFS_SB(sb)->journal;
+    struct simplefs_fc *fc = SIMPLEFS_SB(sb)->fc;
+    uint32_t inodes[SIMPLEFS_FC_MAX_INODES];
+    unsigned int nr_inodes, data_seq;
+    size_t start, end;
+    int nr_blocks = 0;
+    bool eligible;
+    int ret;
+
+    if (!fc || !fc->enabled)
+        return jbd2_complete_transaction(journal, tid);
+
+    spin_lock(&fc->lock);
+    eligible = fc->tid == tid && !fc->ineligible;
+    nr_inodes = fc->nr_inodes;
+    memcpy(inodes, fc->inodes, nr_inodes * sizeof(*inodes));
+    data_seq = fc->data_seq;
+    spin_unlock(&fc->lock);
+    if (!eligible)
+        return jbd2_complete_transaction(journal, tid);
+
+    /* Handles may still run: data they expose from now on is caught below */
+    ret = simplefs_fc_write_data(inode, inodes, nr_inodes);
+    if (ret)
+        return ret;
+
+    /* Fails if tid is already committing, or if no full commit happened yet
+     * since mount. On success, no handle runs until the end of the commit.
+     */
+    ret = jbd2_fc_begin_commit(journal, tid);
+    if (ret)
+        return jbd2_complete_transaction(journal, tid);
+
+    spin_lock(&fc->lock);
+    eligible = fc->tid == tid && !fc->ineligible && fc->data_seq == data_seq;
+    start = fc->flushed;
+    end = fc->len;
+    spin_unlock(&fc->lock);
+    if (!eligible)
+        return jbd2_fc_end_commit_fallback(journal);
+
+    if (start != end) {
+        ret = simplefs_fc_write(journal, fc->log + start, end - start, tid,
+                                &nr_blocks);
+        if (nr_blocks && jbd2_fc_wait_bufs(journal, nr_blocks) && !ret)
+            ret = -EIO;
+        if (ret) {
+            pr_err("fast commit failed: %d, falling back\n", ret);
+            return jbd2_fc_end_commit_fallback(journal);
+        }
+        spin_lock(&fc->lock);
+        fc->flushed = end;
+        spin_unlock(&fc->lock);
+    }
+
+    return jbd2_fc_end_commit(journal);
+}
+
+/* Mark bit @bit of the on-disk bitmap starting at block @first as in use, or
+ * as free if @used is false.
+ */
+static void simplefs_fc_mark(struct super_block *sb,
+                             uint32_t first,
+                             uint32_t bit,
+                             bool used)
+{
+    uint32_t bits_per_block = sb->s_blocksize * 8;
+    struct buffer_head *bh, *table_bh;
+
+    bh = sb_bread(sb, first + bit / bits_per_block);
+    if (!bh)
+        return;
+    if (used)
+        __clear_bit_le(bit % bits_per_block, bh->b_data);
+    else
+        __set_bit_le(bit % bits_per_block, bh->b_data);
+    mark_buffer_dirty(bh);
+
+    if (simplefs_has_metadata_csum(sb)) {
+        table_bh = sb_bread(sb, simplefs_csum_table(sb, bh->b_blocknr));
+        if (table_bh) {
+            simplefs_csum_bitmap(sb, table_bh, bh);
+            simplefs_journal_dirty_metadata(NULL, sb, table_bh);
+            brelse(table_bh);
+        }
+    }
+    brelse(bh);
+}
+
+/* Lazy itable: whether no inode of inode store block @block is in use, i.e.
+ * the block may never have been zeroed, if the transaction that did it was
+ * lost along with the full commit.
+ */
+static bool simplefs_fc_itable_unused(struct super_block *sb, uint32_t block)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t bits_per_block = sb->s_blocksize * 8;
+    uint32_t ino = (block - 1) * simplefs_inodes_per_block(sb);
+    uint32_t i;
+    struct buffer_head *bh;
+    bool used;
+
+    for (i = 0; i < simplefs_inodes_per_block(sb); i++, ino++) {
+        bh = sb_bread(sb, 1 + sbi->nr_istore_blocks + ino / bits_per_block);
+        if (!bh)
+            return false;
+        used = !test_bit_le(ino % bits_per_block, bh->b_data);
+        brelse(bh);
+        if (used)
+            return false;
+    }
+    return true;
+}
+
+static int simplefs_fc_replay_inode(struct super_block *sb,
+                                    struct simplefs_fc_inode *rec)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t ino = le32_to_cpu(rec->ino);
+    struct simplefs_inode *disk_inode;
+    struct buffer_head *bh;
+
+    if (ino >= sbi->nr_inodes || rec->raw.ei_block >= sbi->nr_blocks)
+        return -EUCLEAN;
+
+    bh = sb_bread(sb, ino / simplefs_inodes_per_block(sb) + 1);
+    if (!bh)
+        return -EIO;
+    if (simplefs_has_lazy_itable(sb) &&
+        simplefs_fc_itable_unused(sb, bh->b_blocknr))
+        memset(bh->b_data, 0, sb->s_blocksize);
+    disk_inode = (struct simplefs_inode *) bh->b_data;
+    disk_inode[ino % simplefs_inodes_per_block(sb)] = rec->raw;
+    simplefs_journal_dirty_metadata(NULL, sb, bh);
+    brelse(bh);
+
+    simplefs_fc_mark(sb, 1 + sbi->nr_istore_blocks, ino, true);
+    if (rec->raw.ei_block)
+        simplefs_fc_mark(
+            sb, 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks,
+            rec->raw.ei_block, true);
+    return 0;
+}
+
+static int simplefs_fc_replay_extent(struct super_block *sb,
+                                     struct simplefs_fc_extent *rec)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t ei_block = le32_to_cpu(rec->ei_block);
+    uint32_t index = le32_to_cpu(rec->index);
+    struct simplefs_file_ei_block *eblock;
+    struct buffer_head *bh;
+    uint32_t i;
+
+    if (!ei_block || ei_block >= sbi->nr_blocks ||
+        index >= simplefs_max_extents(sb) ||
+        rec->extent.ee_start + rec->extent.ee_len > sbi->nr_blocks)
+        return -EUCLEAN;
+
+    bh = sb_bread(sb, ei_block);
+    if (!bh)
+        return -EIO;
+    eblock = (struct simplefs_file_ei_block *) bh->b_data;
+    eblock->extents[index] = rec->extent;
+    simplefs_journal_dirty_metadata(NULL, sb, bh);
+    brelse(bh);
+
+    for (i = 0; i < rec->extent.ee_len; i++)
+        simplefs_fc_mark(
+            sb, 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks,
+            rec->extent.ee_start + i, true);
+    return 0;
+}
+
+/* Free the inode of @rec, and the index block and extents of a regular file */
+static int simplefs_fc_replay_free(struct super_block *sb,
+                                   struct simplefs_fc_free *rec)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t bfree = 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks;
+    uint32_t ino = le32_to_cpu(rec->ino);
+    struct simplefs_inode *disk_inode;
+    struct simplefs_file_ei_block *eblock;
+    struct simplefs_extent *extent;
+    struct buffer_head *bh, *bh2;
+    uint32_t ei, i;
+
+    if (ino >= sbi->nr_inodes)
+        return -EUCLEAN;
+
+    bh = sb_bread(sb, ino / simplefs_inodes_per_block(sb) + 1);
+    if (!bh)
+        return -EIO;
+    disk_inode = (struct simplefs_inode *) bh->b_data;
+    disk_inode += ino % simplefs_inodes_per_block(sb);
+
+    if (S_ISREG(disk_inode->i_mode) && disk_inode->ei_block) {
+        if (disk_inode->ei_block >= sbi->nr_blocks) {
+            brelse(bh);
+            return -EUCLEAN;
+        }
+        bh2 = sb_bread(sb, disk_inode->ei_block);
+        if (!bh2) {
+            brelse(bh);
+            return -EIO;
+        }
+        eblock = (struct simplefs_file_ei_block *) bh2->b_data;
+        for (ei = 0; ei < simplefs_max_extents(sb); ei++) {
+            extent = &eblock->extents[ei];
+            if (!extent->ee_start)
+                break;
+            if (extent->ee_start + simplefs_ext_blocks(extent) >
+                sbi->nr_blocks)
+                continue;
+            for (i = 0; i < simplefs_ext_blocks(extent); i++)
+                simplefs_fc_mark(sb, bfree, extent->ee_start + i, false);
+        }
+        brelse(bh2);
+        simplefs_fc_mark(sb, bfree, disk_inode->ei_block, false);
+    }
+
+    memset(disk_inode, 0, sizeof(*disk_inode));
+    simplefs_journal_dirty_metadata(NULL, sb, bh);
+    brelse(bh);
+
+    simplefs_fc_mark(sb, 1 + sbi->nr_istore_blocks, ino, false);
+    return 0;
+}
+
+/* Walk the records of a fast commit block. When @apply is false, only check
+ * them: returns 1 if the block ends a valid commit, 0 if the commit goes on in
+ * the next block, or -EUCLEAN if the block is not part of a valid commit.
+ */
+static int simplefs_fc_walk(struct super_block *sb,
+                            struct buffer_head *bh,
+                            bool apply,
+                            tid_t expected_tid)
+{
+    struct simplefs_fc *fc = SIMPLEFS_SB(sb)->fc;
+    unsigned int bsize = bh->b_size;
+    unsigned int off = 0, len;
+    struct simplefs_fc_tl *tl;
+    struct simplefs_fc_tail *tail;
+    void *value;
+    int ret = 0;
+
+    while (off + sizeof(*tl) <= bsize) {
+        tl = (struct simplefs_fc_tl *) (bh->b_data + off);
+        value = tl + 1;
+        len = le16_to_cpu(tl->fc_len);
+        if (off + sizeof(*tl) + len > bsize)
+            return -EUCLEAN;
+
+        switch (le16_to_cpu(tl->fc_tag)) {
+        case SIMPLEFS_FC_TAG_INODE:
+            if (len < sizeof(struct simplefs_fc_inode))
+                return -EUCLEAN;
+            if (apply)
+                ret = simplefs_fc_replay_inode(sb, value);
+            break;
+        case SIMPLEFS_FC_TAG_EXTENT:
+            if (len < sizeof(struct simplefs_fc_extent))
+                return -EUCLEAN;
+            if (apply)
+                ret = simplefs_fc_replay_extent(sb, value);
+            break;
+        case SIMPLEFS_FC_TAG_DIRENT:
+        case SIMPLEFS_FC_TAG_LINK:
+        case SIMPLEFS_FC_TAG_UNLINK: {
+            struct simplefs_fc_dirent *rec = value;
+            char *name = (char *) (rec + 1);
+            uint16_t tag = le16_to_cpu(tl->fc_tag);
+
+            if (len <= sizeof(*rec) ||
+                strnlen(name, len - sizeof(*rec)) == len - sizeof(*rec))
+                return -EUCLEAN;
+            if (!apply)
+                break;
+            if (tag == SIMPLEFS_FC_TAG_UNLINK)
+                ret = simplefs_replay_unlink(sb, le32_to_cpu(rec->dir),
+                                             le32_to_cpu(rec->ino), name);
+            else
+                ret = simplefs_replay_dirent(sb, le32_to_cpu(rec->dir),
+                                             le32_to_cpu(rec->ino), name,
+                                             tag == SIMPLEFS_FC_TAG_DIRENT);
+            break;
+        }
+        case SIMPLEFS_FC_TAG_FREE:
+            if (len < sizeof(struct simplefs_fc_free))
+                return -EUCLEAN;
+            if (apply)
+                ret = simplefs_fc_replay_free(sb, value);
+            break;
+        case SIMPLEFS_FC_TAG_PAD:
+            if (!apply)
+                fc->replay_crc =
+                    crc32c(fc->replay_crc, tl, sizeof(*tl) + len);
+            return 0;
+        case SIMPLEFS_FC_TAG_TAIL:
+            if (apply)
+                return 1;
+            tail = value;
+            if (len < sizeof(*tail) ||
+                le32_to_cpu(tail->tid) != expected_tid)
+                return -EUCLEAN;
+            fc->replay_crc = crc32c(fc->replay_crc, tl, sizeof(*tl));
+            fc->replay_crc =
+                crc32c(fc->replay_crc, &tail->tid, sizeof(tail->tid));
+            if (le32_to_cpu(tail->crc) != fc->replay_crc)
+                return -EUCLEAN;
+            fc->replay_crc = ~0;
+            return 1;
+        default:
+            return -EUCLEAN;
+        }
+        if (ret)
+            return ret;
+        if (!apply)
+            fc->replay_crc = crc32c(fc->replay_crc, tl, sizeof(*tl) + len);
+        off += sizeof(*tl) + len;
+    }
+    return 0;
+}
+
+/* Called by jbd2 for each fast commit block following the last full commit:
+ * first to scan them, then to replay the ones belonging to complete fast
+ * commits.
+ */
+static int simplefs_fc_replay(journal_t *journal,
+                              struct buffer_head *bh,
+                              enum passtype pass,
+                              int off,
+                              tid_t expected_tid)
+{
+    struct super_block *sb = journal->j_private;
+    struct simplefs_fc *fc = SIMPLEFS_SB(sb)->fc;
+    int ret;
+
+    if (pass == PASS_SCAN) {
+        if (!off) {
+            fc->replay_blocks = 0;
+            fc->replay_crc = ~0;
+        }
+        ret = simplefs_fc_walk(sb, bh, false, expected_tid);
+        if (ret < 0)
+            return JBD2_FC_REPLAY_STOP;
+        if (ret > 0)
+            fc->replay_blocks = off + 1;
+        return JBD2_FC_REPLAY_CONTINUE;
+    }
+
+    if (pass != PASS_REPLAY || off >= fc->replay_blocks)
+        return JBD2_FC_REPLAY_STOP;
+
+    if (!off)
+        pr_info("replaying %d fast commit blocks\n", fc->replay_blocks);
+    ret = simplefs_fc_walk(sb, bh, true, expected_tid);
+    if (ret < 0) {
+        pr_err("fast commit replay failed: %d\n", ret);
+        return ret;
+    }
+    return JBD2_FC_REPLAY_CONTINUE;
+}
+
+/* Called before loading the journal, so that fast commits can be replayed */
+int simplefs_fc_init(struct super_block *sb, journal_t *journal)
+{
+    struct simplefs_fc *fc;
+
+    fc = kzalloc(sizeof(*fc), GFP_KERNEL);
+    if (!fc)
+        return -ENOMEM;
+    fc->log = kvmalloc(SIMPLEFS_FC_LOG_SIZE, GFP_KERNEL);
+    if (!fc->log) {
+        kfree(fc);
+        return -ENOMEM;
+    }
+    spin_lock_init(&fc->lock);
+    SIMPLEFS_SB(sb)->fc = fc;
+    journal->j_fc_replay_callback = simplefs_fc_replay;
+    return 0;
+}
+
+/* Called once the journal is loaded. jbd2 takes the fast commit area from the
+ * end of the journal, which must keep at least JBD2_MIN_JOURNAL_BLOCKS.
+ */
+void simplefs_fc_enable(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+
+    if (!sbi->fc || !(sbi->s_mount_opt & SIMPLEFS_MOUNT_FAST_COMMIT))
+        return;
+
+    if (!jbd2_journal_set_features(sbi->journal, 0, 0,
+                                   JBD2_FEATURE_INCOMPAT_FAST_COMMIT)) {
+        pr_warn("journal too small for fast commits, disabled\n");
+        return;
+    }
+    sbi->fc->enabled = true;
+}
+
+#else /* !SIMPLEFS_AT_LEAST(5, 11, 0) */
+
+void simplefs_fc_mark_ineligible(struct super_block *sb, handle_t *handle) {}
+
+void simplefs_fc_log_inode(handle_t *handle,
+                           struct inode *inode,
+                           struct simplefs_inode *raw)
+{
+}
+
+void simplefs_fc_log_extent(handle_t *handle,
+                            struct inode *inode,
+                            uint32_t index,
+                            struct simplefs_extent *extent)
+{
+}
+
+void simplefs_fc_log_dirent(handle_t *handle,
+                            struct inode *dir,
+                            uint32_t ino,
+                            const char *name)
+{
+}
+
+void simplefs_fc_log_link(handle_t *handle,
+                          struct inode *dir,
+                          uint32_t ino,
+                          const char *name)
+{
+}
+
+void simplefs_fc_log_unlink(handle_t *handle,
+                            struct inode *dir,
+                            uint32_t ino,
+                            const char *name)
+{
+}
+
+void simplefs_fc_log_free(handle_t *handle, struct inode *inode) {}
+
+int simplefs_fc_commit(struct inode *inode, tid_t tid)
+{
+    return jbd2_complete_transaction(SIMPLEFS_SB(inode->i_sb)->journal, tid);
+}
+
+int simplefs_fc_init(struct super_block *sb, journal_t *journal)
+{
+    return 0;
+}
+
+void simplefs_fc_enable(struct super_block *sb)
+{
+    if (SIMPLEFS_SB(sb)->s_mount_opt & SIMPLEFS_MOUNT_FAST_COMMIT)
+        pr_warn("fast commits need Linux 5.11 or later, disabled\n");
+}
+
+#endif /* SIMPLEFS_AT_LEAST(5, 11, 0) */
+
+void simplefs_fc_release(struct super_block *sb)
+{
+    struct simplefs_fc *fc = SIMPLEFS_SB(sb)->fc;
+
+    if (!fc)
+        return;
+    kvfree(fc->log);
+    kfree(fc);
+    SIMPLEFS_SB(sb)->fc = NULL;
+}
@@ -5,6 +5,8 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/mpage.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
 
 #include "bitmap.h"
 #include "simplefs.h"
@@ -23,21 +25,25 @@ static int simplefs_file_get_block(struct inode *inode,
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
     struct simplefs_file_ei_block *index;
     struct buffer_head *bh_index;
+    handle_t *handle = NULL;
     int ret = 0, bno;
     uint32_t extent;
 
-    /* If block number exceeds filesize, fail */
-    if (iblock >= SIMPLEFS_MAX_BLOCKS_PER_EXTENT * SIMPLEFS_MAX_EXTENTS)
+    /* If block number exceeds filesize, fail. Only allocations are bounded:
+     * mkfs may build longer extents, e.g. for the internal journal.
+     */
+    if (create &&
+        iblock >= SIMPLEFS_MAX_BLOCKS_PER_EXTENT * simplefs_max_extents(sb))
         return -EFBIG;
 
     /* Read directory block from disk */
-    bh_index = sb_bread(sb, ci->ei_block);
+    bh_index = simplefs_bread(sb, ci->ei_block);
     if (!bh_index)
         return -EIO;
     index = (struct simplefs_file_ei_block *) bh_index->b_data;
 
-    extent = simplefs_ext_search(index, iblock);
-    if (extent == -1) {
+    extent = simplefs_ext_search(index, simplefs_max_extents(sb), iblock);
+    if (extent >= simplefs_max_extents(sb)) {
         ret = -EFBIG;
         goto brelse_index;
     }
@@ -51,10 +57,24 @@ static int simplefs_file_get_block(struct inode *inode,
             ret = 0;
             goto brelse_index;
         }
-        bno = get_free_blocks(sb, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+
+        /* Allocations join the handle of simplefs_write_begin(), or get their
+         * own when called from writeback. Mapping allocated blocks never
+         * starts a handle, as jbd2 itself maps them when it writes ordered
+         * data at commit time.
+         */
+        handle = simplefs_journal_start(sb, SIMPLEFS_ALLOC_CREDITS);
+        if (IS_ERR(handle)) {
+            ret = PTR_ERR(handle);
+            goto brelse_index;
+        }
+        ret = simplefs_journal_get_write_access(handle, bh_index);
+        if (ret)
+            goto stop;
+        bno = get_free_data_blocks(sb, SIMPLEFS_MAX_BLOCKS_PER_EXTENT, extent);
         if (!bno) {
             ret = -ENOSPC;
-            goto brelse_index;
+            goto stop;
         }
 
         index->extents[extent].ee_start = bno;
@@ -63,14 +83,43 @@ static int simplefs_file_get_block(struct inode *inode,
             extent ? index->extents[extent - 1].ee_block +
                          index->extents[extent - 1].ee_len
                    : 0;
+        ret = simplefs_journal_dirty_metadata(handle, sb, bh_index);
+        if (ret)
+            goto stop;
+        simplefs_fc_log_extent(handle, inode, extent, &index->extents[extent]);
+
+        /* data=ordered: the commit holding the new blocks first writes their
+         * data. Overwrites of blocks already allocated are not ordered. Not
+         * with compress, so that writeback compresses it instead.
+         */
+        if (!(SIMPLEFS_SB(sb)->s_mount_opt & SIMPLEFS_MOUNT_COMPRESS)) {
+            ret = simplefs_journal_inode_ranges(
+                handle, inode,
+                (loff_t) index->extents[extent].ee_block
+                    << sb->s_blocksize_bits,
+                SIMPLEFS_MAX_BLOCKS_PER_EXTENT << sb->s_blocksize_bits,
+                bno);
+            if (ret)
+                goto stop;
+        }
+        bno += iblock - index->extents[extent].ee_block;
+        set_buffer_new(bh_result);
+    } else if (index->extents[extent].ee_flags & SIMPLEFS_EXT_LZ4) {
+        /* Compressed extents are read by simplefs_compress_read_folio(), and
+         * moved back to raw blocks before they are written to.
+         */
+        ret = create ? -EIO : 0;
+        goto brelse_index;
     } else {
         bno = index->extents[extent].ee_start + iblock -
               index->extents[extent].ee_block;
     }
 
-    /* Map the physical block to the given 'buffer_head'. */
-    map_bh(bh_result, sb, bno);
+    /* Map the physical block to the given 'buffer_head', on its device. */
+    simplefs_map_bh(bh_result, sb, bno);
 
+stop:
+    simplefs_journal_stop(handle);
 brelse_index:
     brelse(bh_index);
 
@@ -81,8 +130,37 @@ brelse_index:
  * into memory.
  */
 #if SIMPLEFS_AT_LEAST(5, 19, 0)
+static int simplefs_read_folio(struct file *file, struct folio *folio)
+{
+#if SIMPLEFS_HAS_COMPRESSION
+    struct simplefs_cluster_buf cb = {NULL};
+    int ret = simplefs_compress_read_folio(folio, &cb);
+
+    simplefs_cluster_buf_release(&cb);
+    if (ret)
+        return ret < 0 ? ret : 0;
+#endif
+    return mpage_read_folio(folio, simplefs_file_get_block);
+}
+
 static void simplefs_readahead(struct readahead_control *rac)
 {
+#if SIMPLEFS_HAS_COMPRESSION
+    struct simplefs_cluster_buf cb = {NULL};
+    struct folio *folio;
+
+    if (simplefs_has_compression(rac->mapping->host->i_sb)) {
+        /* A folio at a time, so that each compressed extent is read and
+         * decompressed once
+         */
+        while ((folio = readahead_folio(rac))) {
+            if (!simplefs_compress_read_folio(folio, &cb))
+                mpage_read_folio(folio, simplefs_file_get_block);
+        }
+        simplefs_cluster_buf_release(&cb);
+        return;
+    }
+#endif
     mpage_readahead(rac, simplefs_file_get_block);
 }
 #else
@@ -109,6 +187,64 @@ static int simplefs_writepage(struct page *page, struct writeback_control *wbc)
 }
 #endif
 
+/* Called by writeback, and by jbd2 at commit time to write the data ordered
+ * before the transaction.
+ */
+static int simplefs_writepages(struct address_space *mapping,
+                               struct writeback_control *wbc)
+{
+#if SIMPLEFS_HAS_COMPRESSION
+    int ret = simplefs_compress_writepages(mapping, wbc);
+
+    if (ret)
+        return ret;
+#endif
+    return mpage_writepages(mapping, wbc, simplefs_file_get_block);
+}
+
+/* Map a logical block to its physical block. jbd2 relies on it to locate the
+ * blocks of the internal journal.
+ */
+static sector_t simplefs_bmap(struct address_space *mapping, sector_t block)
+{
+    return generic_block_bmap(mapping, block, simplefs_file_get_block);
+}
+
+/* Direct I/O only maps blocks: allocations and i_blocks are left to
+ * simplefs_write_begin()/simplefs_write_end(). A direct write that reaches an
+ * unallocated block stops there and the rest goes through the page cache.
+ */
+static int simplefs_dio_get_block(struct inode *inode,
+                                  sector_t iblock,
+                                  struct buffer_head *bh_result,
+                                  int create)
+{
+    return simplefs_file_get_block(inode, iblock, bh_result, 0);
+}
+
+static ssize_t simplefs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    /* Compressed extents have no blocks to map, and shared ones are not
+     * written in place: buffered I/O it is
+     */
+    if (simplefs_has_compression(inode->i_sb) ||
+        (iov_iter_rw(iter) == WRITE && simplefs_has_reflink(inode->i_sb)))
+        return 0;
+
+    /* Writers hold the inode lock already; readers take it shared so that
+     * simplefs_ioctl_defrag() does not free blocks under them.
+     */
+    if (iov_iter_rw(iter) == WRITE)
+        return blockdev_direct_IO(iocb, inode, iter, simplefs_dio_get_block);
+    inode_lock_shared(inode);
+    ret = blockdev_direct_IO(iocb, inode, iter, simplefs_dio_get_block);
+    inode_unlock_shared(inode);
+    return ret;
+}
+
 /* Called by the VFS when a write() syscall is made on a file, before writing
  * the data into the page cache. This function checks if the write operation
  * can complete and allocates the necessary blocks through block_write_begin().
@@ -122,14 +258,16 @@ static int simplefs_write_begin(const struct kiocb *iocb,
                                 void **fsdata)
 {
     struct file *file = iocb->ki_filp;
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
+    struct super_block *sb = file->f_inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    handle_t *handle;
     int err;
     uint32_t nr_allocs = 0;
 
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
+    if (pos + len > sb->s_maxbytes)
         return -ENOSPC;
 
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
+    nr_allocs = max(pos + len, file->f_inode->i_size) / sb->s_blocksize;
     if (nr_allocs > file->f_inode->i_blocks - 1)
         nr_allocs -= file->f_inode->i_blocks - 1;
     else
@@ -137,9 +275,21 @@ static int simplefs_write_begin(const struct kiocb *iocb,
     if (nr_allocs > sbi->nr_free_blocks)
         return -ENOSPC;
 
+    err = simplefs_unshare_range(mapping->host, pos, len);
+    if (err)
+        return err;
+
+    /* The handle stays open until simplefs_write_end() */
+    handle = simplefs_journal_start(
+        sb, SIMPLEFS_ALLOC_CREDITS + SIMPLEFS_TRUNCATE_CREDITS(sb));
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
     err = block_write_begin(mapping, pos, len, foliop, simplefs_file_get_block);
-    if (err < 0)
+    if (err < 0) {
         pr_err("newly allocated blocks reclaim not implemented yet\n");
+        simplefs_journal_stop(handle);
+    }
     return err;
 }
 #elif SIMPLEFS_AT_LEAST(6, 12, 0)
@@ -150,14 +300,16 @@ static int simplefs_write_begin(struct file *file,
                                 struct folio **foliop,
                                 void **fsdata)
 {
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
+    struct super_block *sb = file->f_inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    handle_t *handle;
     int err;
     uint32_t nr_allocs = 0;
 
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
+    if (pos + len > sb->s_maxbytes)
         return -ENOSPC;
 
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
+    nr_allocs = max(pos + len, file->f_inode->i_size) / sb->s_blocksize;
     if (nr_allocs > file->f_inode->i_blocks - 1)
         nr_allocs -= file->f_inode->i_blocks - 1;
     else
@@ -165,9 +317,21 @@ static int simplefs_write_begin(struct file *file,
     if (nr_allocs > sbi->nr_free_blocks)
         return -ENOSPC;
 
+    err = simplefs_unshare_range(mapping->host, pos, len);
+    if (err)
+        return err;
+
+    /* The handle stays open until simplefs_write_end() */
+    handle = simplefs_journal_start(
+        sb, SIMPLEFS_ALLOC_CREDITS + SIMPLEFS_TRUNCATE_CREDITS(sb));
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
     err = block_write_begin(mapping, pos, len, foliop, simplefs_file_get_block);
-    if (err < 0)
+    if (err < 0) {
         pr_err("newly allocated blocks reclaim not implemented yet\n");
+        simplefs_journal_stop(handle);
+    }
     return err;
 }
 #elif SIMPLEFS_AT_LEAST(5, 19, 0)
@@ -178,14 +342,16 @@ static int simplefs_write_begin(struct file *file,
                                 struct page **pagep,
                                 void **fsdata)
 {
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
+    struct super_block *sb = file->f_inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    handle_t *handle;
     int err;
     uint32_t nr_allocs = 0;
 
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
+    if (pos + len > sb->s_maxbytes)
         return -ENOSPC;
 
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
+    nr_allocs = max(pos + len, file->f_inode->i_size) / sb->s_blocksize;
     if (nr_allocs > file->f_inode->i_blocks - 1)
         nr_allocs -= file->f_inode->i_blocks - 1;
     else
@@ -193,9 +359,21 @@ static int simplefs_write_begin(struct file *file,
     if (nr_allocs > sbi->nr_free_blocks)
         return -ENOSPC;
 
+    err = simplefs_unshare_range(mapping->host, pos, len);
+    if (err)
+        return err;
+
+    /* The handle stays open until simplefs_write_end() */
+    handle = simplefs_journal_start(
+        sb, SIMPLEFS_ALLOC_CREDITS + SIMPLEFS_TRUNCATE_CREDITS(sb));
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
     err = block_write_begin(mapping, pos, len, pagep, simplefs_file_get_block);
-    if (err < 0)
+    if (err < 0) {
         pr_err("newly allocated blocks reclaim not implemented yet\n");
+        simplefs_journal_stop(handle);
+    }
     return err;
 }
 #else
@@ -207,14 +385,16 @@ static int simplefs_write_begin(struct file *file,
                                 struct page **pagep,
                                 void **fsdata)
 {
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(file->f_inode->i_sb);
+    struct super_block *sb = file->f_inode->i_sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    handle_t *handle;
     int err;
     uint32_t nr_allocs = 0;
 
-    if (pos + len > SIMPLEFS_MAX_FILESIZE)
+    if (pos + len > sb->s_maxbytes)
         return -ENOSPC;
 
-    nr_allocs = max(pos + len, file->f_inode->i_size) / SIMPLEFS_BLOCK_SIZE;
+    nr_allocs = max(pos + len, file->f_inode->i_size) / sb->s_blocksize;
     if (nr_allocs > file->f_inode->i_blocks - 1)
         nr_allocs -= file->f_inode->i_blocks - 1;
     else
@@ -222,10 +402,22 @@ static int simplefs_write_begin(struct file *file,
     if (nr_allocs > sbi->nr_free_blocks)
         return -ENOSPC;
 
+    err = simplefs_unshare_range(mapping->host, pos, len);
+    if (err)
+        return err;
+
+    /* The handle stays open until simplefs_write_end() */
+    handle = simplefs_journal_start(
+        sb, SIMPLEFS_ALLOC_CREDITS + SIMPLEFS_TRUNCATE_CREDITS(sb));
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
     err = block_write_begin(mapping, pos, len, flags, pagep,
                             simplefs_file_get_block);
-    if (err < 0)
+    if (err < 0) {
         pr_err("newly allocated blocks reclaim not implemented yet\n");
+        simplefs_journal_stop(handle);
+    }
     return err;
 }
 #endif
@@ -267,6 +459,7 @@ static int simplefs_write_end(struct file *file,
 #endif
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
     struct super_block *sb = inode->i_sb;
+    handle_t *handle = journal_current_handle();
 #if SIMPLEFS_AT_LEAST(6, 6, 0)
     struct timespec64 cur_time;
 #endif
@@ -284,13 +477,15 @@ static int simplefs_write_end(struct file *file,
 #endif
     if (ret < len) {
         pr_err("wrote less than requested.");
-        return ret;
+        goto end;
     }
 
+    simplefs_log_written(sb, copied);
+
     nr_blocks_old = inode->i_blocks;
 
     /* Update inode metadata */
-    inode->i_blocks = DIV_ROUND_UP(inode->i_size, SIMPLEFS_BLOCK_SIZE) + 1;
+    inode->i_blocks = DIV_ROUND_UP(inode->i_size, sb->s_blocksize) + 1;
 
 #if SIMPLEFS_AT_LEAST(6, 7, 0)
     cur_time = current_time(inode);
@@ -308,7 +503,7 @@ static int simplefs_write_end(struct file *file,
 
     /* If file is smaller than before, free unused blocks */
     if (nr_blocks_old > inode->i_blocks) {
-        int i;
+        int i, err;
         struct buffer_head *bh_index;
         struct simplefs_file_ei_block *index;
         uint32_t first_ext;
@@ -317,7 +512,7 @@ static int simplefs_write_end(struct file *file,
         truncate_pagecache(inode, inode->i_size);
 
         /* Read ei_block to remove unused blocks */
-        bh_index = sb_bread(sb, ci->ei_block);
+        bh_index = simplefs_bread(sb, ci->ei_block);
         if (!bh_index) {
 #if SIMPLEFS_AT_LEAST(6, 15, 0)
             pr_err("Failed to truncate '%s'. Lost %llu blocks\n",
@@ -330,25 +525,37 @@ static int simplefs_write_end(struct file *file,
 #endif
             goto end;
         }
+        if (simplefs_journal_get_write_access(handle, bh_index)) {
+            brelse(bh_index);
+            goto end;
+        }
+        simplefs_fc_mark_ineligible(sb, handle);
         index = (struct simplefs_file_ei_block *) bh_index->b_data;
 
-        first_ext = simplefs_ext_search(index, inode->i_blocks - 1);
+        first_ext = simplefs_ext_search(
+            index, simplefs_max_extents(sb), inode->i_blocks - 1);
 
         /* Reserve unused block in last extent */
         if (inode->i_blocks - 1 != index->extents[first_ext].ee_block)
             first_ext++;
 
-        for (i = first_ext; i < SIMPLEFS_MAX_EXTENTS; i++) {
+        for (i = first_ext; i < simplefs_max_extents(sb); i++) {
             if (!index->extents[i].ee_start)
                 break;
-            put_blocks(SIMPLEFS_SB(sb), index->extents[i].ee_start,
-                       index->extents[i].ee_len);
+            err = put_blocks(sb, index->extents[i].ee_start,
+                             simplefs_ext_blocks(&index->extents[i]));
+            if (err) {
+                ret = err;
+                break;
+            }
             memset(&index->extents[i], 0, sizeof(struct simplefs_extent));
         }
-        mark_buffer_dirty(bh_index);
+        simplefs_journal_dirty_metadata(handle, sb, bh_index);
         brelse(bh_index);
     }
 end:
+    /* Close the handle opened by simplefs_write_begin() */
+    simplefs_journal_stop(handle);
     return ret;
 }
 
@@ -360,227 +567,443 @@ end:
  *
  * Truncation is achieved by reading the file's index block from disk, iterating
  * over the data block pointers, releasing the associated data blocks, and
- * updating the inode metadata (size and block count).
+ * updating the inode metadata (size and block count). Writers are locked out
+ * and the page cache is dropped first, so that no page is written back to the
+ * blocks once they are freed.
  */
 static int simplefs_open(struct inode *inode, struct file *filp)
 {
     bool wronly = (filp->f_flags & O_WRONLY);
     bool rdwr = (filp->f_flags & O_RDWR);
     bool trunc = (filp->f_flags & O_TRUNC);
+    struct buffer_head *bh_index;
+    struct simplefs_file_ei_block *ei_block;
+    sector_t iblock;
+    handle_t *handle;
+    int ret;
 
-    if ((wronly || rdwr) && trunc && inode->i_size) {
-        struct buffer_head *bh_index;
-        struct simplefs_file_ei_block *ei_block;
-        sector_t iblock;
-
-        /* Fetch the file's extent block from disk */
-        bh_index = sb_bread(inode->i_sb, SIMPLEFS_INODE(inode)->ei_block);
-        if (!bh_index)
-            return -EIO;
-
-        ei_block = (struct simplefs_file_ei_block *) bh_index->b_data;
-
-        for (iblock = 0; iblock <= SIMPLEFS_MAX_EXTENTS &&
-                         ei_block->extents[iblock].ee_start;
-             iblock++) {
-            put_blocks(SIMPLEFS_SB(inode->i_sb),
-                       ei_block->extents[iblock].ee_start,
-                       ei_block->extents[iblock].ee_len);
-            memset(&ei_block->extents[iblock], 0,
-                   sizeof(struct simplefs_extent));
-        }
-        /* Update inode metadata */
-        inode->i_size = 0;
-        inode->i_blocks = 1;
+    if (!(wronly || rdwr) || !trunc || !inode->i_size)
+        return 0;
 
-        mark_buffer_dirty(bh_index);
-        brelse(bh_index);
-        mark_inode_dirty(inode);
+    inode_lock(inode);
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_lock(inode->i_mapping);
+#endif
+    inode_dio_wait(inode);
+    ret = 0;
+    if (!inode->i_size)
+        goto unlock;
+
+    ret = simplefs_journal_begin_truncate(inode, 0);
+    if (ret)
+        goto unlock;
+    i_size_write(inode, 0);
+    truncate_pagecache(inode, 0);
+
+    handle = simplefs_journal_start(
+        inode->i_sb, SIMPLEFS_TRUNCATE_CREDITS(inode->i_sb));
+    if (IS_ERR(handle)) {
+        ret = PTR_ERR(handle);
+        goto unlock;
     }
-    return 0;
+
+    /* Fetch the file's extent block from disk */
+    bh_index = simplefs_bread(inode->i_sb, SIMPLEFS_INODE(inode)->ei_block);
+    if (!bh_index) {
+        ret = -EIO;
+        goto stop;
+    }
+
+    ret = simplefs_journal_get_write_access(handle, bh_index);
+    if (ret)
+        goto release;
+    simplefs_fc_mark_ineligible(inode->i_sb, handle);
+
+    ei_block = (struct simplefs_file_ei_block *) bh_index->b_data;
+
+    for (iblock = 0; iblock < simplefs_max_extents(inode->i_sb) &&
+                     ei_block->extents[iblock].ee_start;
+         iblock++) {
+        ret = put_blocks(inode->i_sb, ei_block->extents[iblock].ee_start,
+                         simplefs_ext_blocks(&ei_block->extents[iblock]));
+        if (ret)
+            goto release;
+        memset(&ei_block->extents[iblock], 0, sizeof(struct simplefs_extent));
+    }
+    /* Update inode metadata */
+    inode->i_blocks = 1;
+
+    ret = simplefs_journal_dirty_metadata(handle, inode->i_sb, bh_index);
+    mark_inode_dirty(inode);
+release:
+    brelse(bh_index);
+stop:
+    simplefs_journal_stop(handle);
+unlock:
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_unlock(inode->i_mapping);
+#endif
+    inode_unlock(inode);
+    return ret;
 }
 
-static ssize_t simplefs_read(struct file *file,
-                             char __user *buf,
-                             size_t len,
-                             loff_t *ppos)
+/* Data goes through the page cache and the address space operations above.
+ * Holes are not supported, so like before, nothing is written past the end of
+ * the file.
+ */
+static ssize_t simplefs_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct inode *inode = file_inode(file);
-    struct super_block *sb = inode->i_sb;
-    ssize_t bytes_read = 0;
-    loff_t pos = *ppos;
+    struct inode *inode = file_inode(iocb->ki_filp);
 
-    if (pos > inode->i_size)
+    if (!(iocb->ki_flags & IOCB_APPEND) && iocb->ki_pos > i_size_read(inode))
         return 0;
 
-    /* find extent block */
-    struct buffer_head *bh = sb_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
-    struct simplefs_file_ei_block *ei_block =
-        (struct simplefs_file_ei_block *) bh->b_data;
-
-    if (pos + len > inode->i_size)
-        len = inode->i_size - pos;
-
-    /* count block position */
-    sector_t block_index = pos / SIMPLEFS_BLOCK_SIZE;
-    sector_t ei_index = block_index / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-    sector_t block_offset = ei_block->extents[ei_index].ee_start +
-                            block_index % SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-
-    while (len > 0) {
-        struct buffer_head *bh_data = sb_bread(sb, block_offset);
-        if (!bh_data) {
-            pr_err("Failed to read data block %llu\n", block_offset);
-            bytes_read = -EIO;
-            break;
-        }
+    return generic_file_write_iter(iocb, from);
+}
 
-        size_t offset = pos % SIMPLEFS_BLOCK_SIZE;
-        size_t bytes_to_read =
-            min_t(size_t, len, SIMPLEFS_BLOCK_SIZE - pos % SIMPLEFS_BLOCK_SIZE);
-        if (copy_to_user(buf + bytes_read, bh_data->b_data + offset,
-                         bytes_to_read)) {
-            brelse(bh_data);
-            bytes_read = -EFAULT;
-            break;
-        }
-        brelse(bh_data);
-
-        /* successfully read data */
-        bytes_read += bytes_to_read;
-        len -= bytes_to_read;
-        pos += bytes_to_read;
-
-        /* count extent block */
-        block_index++;
-        ei_index = block_index / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-        block_offset = ei_block->extents[ei_index].ee_start +
-                       block_index % SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+/* On a journaled partition, metadata is durable once the last transaction that
+ * logged the inode has committed; data=ordered writes the data before it. With
+ * fast commits, only the changes not committed yet are logged.
+ */
+static int simplefs_fsync(struct file *file,
+                          loff_t start,
+                          loff_t end,
+                          int datasync)
+{
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    journal_t *journal = SIMPLEFS_SB(sb)->journal;
+    int ret;
+
+    if (!journal) {
+        /* Index and directory blocks live in the block device cache */
+        ret = sync_blockdev(sb->s_bdev);
+        if (ret)
+            return ret;
+        ret = generic_file_fsync(file, start, end, datasync);
+        return ret ? ret : simplefs_stripe_flush(sb);
     }
 
-    brelse(bh);
-    *ppos = pos;
+    /* jbd2 only flushes the first device of a striped partition */
+    ret = file_write_and_wait_range(file, start, end);
+    if (!ret)
+        ret = simplefs_stripe_flush(sb);
+    if (ret)
+        return ret;
 
-    return bytes_read;
+    return simplefs_fc_commit(inode,
+                              READ_ONCE(SIMPLEFS_INODE(inode)->i_sync_tid));
 }
 
-static ssize_t simplefs_write(struct file *file,
-                              const char __user *buf,
-                              size_t len,
-                              loff_t *ppos)
+/* Copy @n buffers to disk and release them */
+static int simplefs_write_buffers(struct buffer_head **bhs, int n)
 {
-    struct inode *inode = file_inode(file);
-    struct super_block *sb = inode->i_sb;
-    ssize_t bytes_write = 0;
-    loff_t pos = *ppos;
-
-    if (pos > inode->i_size)
-        return 0;
-    len = min_t(size_t, len, SIMPLEFS_MAX_FILESIZE - pos);
+    int i, ret = 0;
+
+    for (i = 0; i < n; i++)
+        write_dirty_buffer(bhs[i], 0);
+    for (i = 0; i < n; i++) {
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i]))
+            ret = -EIO;
+        brelse(bhs[i]);
+    }
+    return ret;
+}
 
-    /* find extent block */
-    struct buffer_head *bh = sb_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
-    if (!bh)
-        return -EIO;
-    struct simplefs_file_ei_block *ei_block =
-        (struct simplefs_file_ei_block *) bh->b_data;
-
-    /* count block position */
-    sector_t block_index = pos / SIMPLEFS_BLOCK_SIZE;
-    sector_t ei_index = block_index / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-
-    /* write data */
-    while (len > 0) {
-        /* check if block is allocated */
-        if (ei_block->extents[ei_index].ee_start == 0) {
-            int bno = get_free_blocks(sb, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-            if (!bno) {
-                bytes_write = -ENOSPC;
-                break;
+/* Copy the blocks of the first @nr_extents extents of @index, back to back,
+ * to the blocks from @run, and wait for them to be on disk
+ */
+static int simplefs_defrag_copy(struct super_block *sb,
+                                struct simplefs_file_ei_block *index,
+                                uint32_t nr_extents,
+                                uint32_t run)
+{
+    struct buffer_head *bhs[SIMPLEFS_MAX_BLOCKS_PER_EXTENT * 4];
+    struct buffer_head *src, *dst;
+    uint32_t ei, bi;
+    int n = 0, ret = 0, err;
+
+    for (ei = 0; ei < nr_extents; ei++) {
+        for (bi = 0; bi < simplefs_ext_blocks(&index->extents[ei]); bi++) {
+            uint32_t bno = index->extents[ei].ee_start + bi;
+
+            /* File data goes through the page cache of the file: a copy in
+             * the block device cache may be stale, e.g. the zeroes left by
+             * get_free_blocks().
+             */
+            src = sb_find_get_block(sb, bno);
+            if (src) {
+                lock_buffer(src);
+                clear_buffer_uptodate(src);
+                unlock_buffer(src);
+                brelse(src);
+            }
+            src = sb_bread(sb, bno);
+            if (!src) {
+                ret = -EIO;
+                goto flush;
+            }
+            dst = sb_getblk(sb, run++);
+            if (!dst) {
+                brelse(src);
+                ret = -ENOMEM;
+                goto flush;
+            }
+            lock_buffer(dst);
+            memcpy(dst->b_data, src->b_data, sb->s_blocksize);
+            set_buffer_uptodate(dst);
+            unlock_buffer(dst);
+            mark_buffer_dirty(dst);
+            brelse(src);
+
+            bhs[n++] = dst;
+            if (n == ARRAY_SIZE(bhs)) {
+                ret = simplefs_write_buffers(bhs, n);
+                n = 0;
+                if (ret)
+                    return ret;
             }
-            ei_block->extents[ei_index].ee_start = bno;
-            ei_block->extents[ei_index].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
-            ei_block->extents[ei_index].ee_block =
-                ei_index ? ei_block->extents[ei_index - 1].ee_block +
-                               ei_block->extents[ei_index - 1].ee_len
-                         : 0;
-        }
-
-        struct buffer_head *bh_data =
-            sb_bread(sb, ei_block->extents[ei_index].ee_start +
-                             block_index % SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-        if (!bh_data) {
-            pr_err("Failed to read data block %llu\n",
-                   ei_block->extents[ei_index].ee_start +
-                       block_index % SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
-            bytes_write = -EIO;
-            break;
-        }
-        /* copy data from buffer */
-        size_t bytes_to_write =
-            min_t(size_t, len, SIMPLEFS_BLOCK_SIZE - pos % SIMPLEFS_BLOCK_SIZE);
-
-        if (copy_from_user(bh_data->b_data + pos % SIMPLEFS_BLOCK_SIZE,
-                           buf + bytes_write, bytes_to_write)) {
-            brelse(bh_data);
-            bytes_write = -EFAULT;
-            break;
         }
+    }
+flush:
+    err = simplefs_write_buffers(bhs, n);
+    return ret ? ret : err;
+}
 
-        mark_buffer_dirty(bh_data);
-        sync_dirty_buffer(bh_data);
-        brelse(bh_data);
+/* SIMPLEFS_IOC_DEFRAG: move the data of a file to one run of contiguous
+ * blocks, with the same extents, then switch the inode to a new index block
+ * pointing there. Writers and direct reads are held off by the inode lock,
+ * page faults and readahead by the invalidate lock; the cached pages are
+ * written back first and dropped after, as their buffers map the old blocks.
+ * The new blocks are on disk before the transaction that switches ei_block
+ * commits, so a crash leaves one layout or the other.
+ */
+static long simplefs_ioctl_defrag(struct file *file,
+                                  struct simplefs_defrag __user *arg)
+{
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct simplefs_file_ei_block *index, *new_index;
+    struct buffer_head *bh_index, *bh_new;
+    struct simplefs_defrag info;
+    uint32_t nr_extents, next = 0, run, new_bno, old_bno, i;
+    handle_t *handle;
+    int ret, err;
+
+    if (!S_ISREG(inode->i_mode))
+        return -EINVAL;
+    if (copy_from_user(&info, arg, sizeof(info)))
+        return -EFAULT;
+    if (info.flags & ~SIMPLEFS_DEFRAG_DRY_RUN)
+        return -EINVAL;
+    if (!(info.flags & SIMPLEFS_DEFRAG_DRY_RUN)) {
+        /* One run of blocks would undo the striping, or the log order */
+        if (simplefs_has_stripe(sb) || SIMPLEFS_SB(sb)->log)
+            return -EOPNOTSUPP;
+        if (!(file->f_mode & FMODE_WRITE))
+            return -EBADF;
+        ret = mnt_want_write_file(file);
+        if (ret)
+            return ret;
+    }
+    info.frags_before = info.frags_after = info.nr_blocks = 0;
 
-        /* successfully write data */
-        len = len - bytes_to_write;
-        bytes_write += bytes_to_write;
-        pos += bytes_to_write;
+    inode_lock(inode);
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_lock(inode->i_mapping);
+#endif
+    inode_dio_wait(inode);
 
-        /* count extent block */
-        block_index = pos / SIMPLEFS_BLOCK_SIZE;
-        ei_index = block_index / SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    bh_index = simplefs_bread(sb, ci->ei_block);
+    if (!bh_index) {
+        ret = -EIO;
+        goto unlock;
+    }
+    index = (struct simplefs_file_ei_block *) bh_index->b_data;
+    for (nr_extents = 0; nr_extents < simplefs_max_extents(sb) &&
+                         index->extents[nr_extents].ee_start;
+         nr_extents++) {
+        struct simplefs_extent *ext = &index->extents[nr_extents];
+
+        if (ext->ee_start != next)
+            info.frags_before++;
+        next = ext->ee_start + simplefs_ext_blocks(ext);
+        info.nr_blocks += simplefs_ext_blocks(ext);
+    }
+    info.frags_after = info.frags_before;
+    ret = 0;
+    if (info.frags_before <= 1 || info.flags & SIMPLEFS_DEFRAG_DRY_RUN) {
+        info.nr_blocks = 0;
+        goto release;
     }
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
 
-    inode->i_size = max(pos, inode->i_size);
-    inode->i_blocks = DIV_ROUND_UP(inode->i_size, SIMPLEFS_BLOCK_SIZE) + 1;
-#if SIMPLEFS_AT_LEAST(6, 7, 0)
-    struct timespec64 cur_time = current_time(inode);
-    inode_set_mtime_to_ts(inode, cur_time);
-    inode_set_ctime_to_ts(inode, cur_time);
-#elif SIMPLEFS_AT_LEAST(6, 6, 0)
-    struct timespec64 cur_time = current_time(inode);
-    inode->i_mtime = cur_time;
-    inode_set_ctime_to_ts(inode, cur_time);
-#else
-    inode->i_mtime = inode->i_ctime = current_time(inode);
-#endif
+    ret = filemap_write_and_wait(inode->i_mapping);
+    if (ret)
+        goto release;
+
+    handle = simplefs_journal_start_revoke(sb, SIMPLEFS_DEFRAG_CREDITS(sb), 1);
+    if (IS_ERR(handle)) {
+        ret = PTR_ERR(handle);
+        goto release;
+    }
+    simplefs_fc_mark_ineligible(sb, handle);
+
+    ret = -ENOSPC;
+    run = get_free_blocks(sb, info.nr_blocks);
+    if (!run)
+        goto stop;
+    new_bno = get_free_blocks(sb, 1);
+    if (!new_bno)
+        goto put_run;
+
+    ret = simplefs_defrag_copy(sb, index, nr_extents, run);
+    if (ret)
+        goto put_index;
+
+    /* The new index block: the same extents, in the new run */
+    bh_new = sb_getblk(sb, new_bno);
+    if (!bh_new) {
+        ret = -ENOMEM;
+        goto put_index;
+    }
+    ret = simplefs_journal_get_create_access(handle, bh_new);
+    if (ret) {
+        brelse(bh_new);
+        goto put_index;
+    }
+    lock_buffer(bh_new);
+    memcpy(bh_new->b_data, bh_index->b_data, sb->s_blocksize);
+    new_index = (struct simplefs_file_ei_block *) bh_new->b_data;
+    for (i = 0; i < nr_extents; i++) {
+        new_index->extents[i].ee_start = run;
+        run += simplefs_ext_blocks(&new_index->extents[i]);
+    }
+    set_buffer_uptodate(bh_new);
+    unlock_buffer(bh_new);
+    ret = simplefs_journal_dirty_metadata(handle, sb, bh_new);
+    brelse(bh_new);
+    if (ret)
+        goto put_index;
+
+    old_bno = ci->ei_block;
+    ci->ei_block = new_bno;
     mark_inode_dirty(inode);
-    *ppos = pos;
+    truncate_pagecache(inode, 0);
+
+    /* Past this point the old blocks are unused whatever happens */
+    for (i = 0; i < nr_extents; i++) {
+        err = put_blocks(sb, index->extents[i].ee_start,
+                         simplefs_ext_blocks(&index->extents[i]));
+        if (err)
+            ret = err;
+    }
+    if (handle) {
+        brelse(bh_index);
+        bh_index = NULL;
+        simplefs_journal_revoke(handle, sb, old_bno, 1);
+    } else {
+        memset(bh_index->b_data, 0, sb->s_blocksize);
+        mark_buffer_dirty(bh_index);
+    }
+    err = put_blocks(sb, old_bno, 1);
+    if (err)
+        ret = err;
+    info.frags_after = 1;
+    goto stop;
+
+put_index:
+    put_blocks(sb, new_bno, 1);
+put_run:
+    put_blocks(sb, run, info.nr_blocks);
+stop:
+    simplefs_journal_stop(handle);
+release:
+    brelse(bh_index);
+unlock:
+#if SIMPLEFS_AT_LEAST(5, 15, 0)
+    filemap_invalidate_unlock(inode->i_mapping);
+#endif
+    inode_unlock(inode);
+    if (!(info.flags & SIMPLEFS_DEFRAG_DRY_RUN))
+        mnt_drop_write_file(file);
+    if (!ret && copy_to_user(arg, &info, sizeof(info)))
+        ret = -EFAULT;
+    return ret;
+}
+
+/* FITRIM, on any file or directory of the partition */
+static long simplefs_ioctl_trim(struct file *file,
+                               struct fstrim_range __user *arg)
+{
+    struct fstrim_range range;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (copy_from_user(&range, arg, sizeof(range)))
+        return -EFAULT;
+    ret = simplefs_trim_fs(file_inode(file)->i_sb, &range);
+    if (ret)
+        return ret;
+    if (copy_to_user(arg, &range, sizeof(range)))
+        return -EFAULT;
+    return 0;
+}
 
-    return bytes_write;
+/* ioctls of regular files and directories */
+long simplefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case SIMPLEFS_IOC_DEFRAG:
+        return simplefs_ioctl_defrag(file, (void __user *) arg);
+    case FITRIM:
+        return simplefs_ioctl_trim(file, (void __user *) arg);
+    case FS_IOC_GETFSMAP:
+        return simplefs_getfsmap(file_inode(file)->i_sb, (void __user *) arg);
+    default:
+        return -ENOTTY;
+    }
 }
 
 const struct address_space_operations simplefs_aops = {
 #if SIMPLEFS_AT_LEAST(5, 19, 0)
+    .read_folio = simplefs_read_folio,
     .readahead = simplefs_readahead,
 #else
     .readpage = simplefs_readpage,
 #endif
 #if !SIMPLEFS_AT_LEAST(6, 15, 0)
     .writepage = simplefs_writepage,
+#endif
+    .writepages = simplefs_writepages,
+#if SIMPLEFS_AT_LEAST(5, 18, 0)
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = block_invalidate_folio,
+#else
+    .set_page_dirty = __set_page_dirty_buffers,
+    .invalidatepage = block_invalidatepage,
 #endif
     .write_begin = simplefs_write_begin,
     .write_end = simplefs_write_end,
+    .bmap = simplefs_bmap,
+    .direct_IO = simplefs_direct_IO,
 };
 
 const struct file_operations simplefs_file_ops = {
     .owner = THIS_MODULE,
     .open = simplefs_open,
-    .read = simplefs_read,
-    .write = simplefs_write,
+    .read_iter = generic_file_read_iter,
+    .write_iter = simplefs_write_iter,
     .llseek = generic_file_llseek,
-    .fsync = generic_file_fsync,
+    .mmap = generic_file_readonly_mmap,
+    .fsync = simplefs_fsync,
+    .unlocked_ioctl = simplefs_ioctl,
+#if SIMPLEFS_AT_LEAST(5, 5, 0)
+    .compat_ioctl = compat_ptr_ioctl,
+#endif
+#if SIMPLEFS_AT_LEAST(4, 20, 0)
+    .remap_file_range = simplefs_remap_file_range,
+#endif
 };
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "simplefs.h"
+
+/* Space map of a mounted simplefs, from FS_IOC_GETFSMAP: the metadata
+ * regions, then the free space as a histogram of free run sizes, as
+ * e2freefrag prints it. With -v, every record.
+ */
+
+#define NR_RECS 1024
+#define NR_BUCKETS 32
+
+static const char *owner_name(uint64_t owner)
+{
+    switch (owner) {
+    case SIMPLEFS_FMR_OWN_SB:
+        return "superblock";
+    case SIMPLEFS_FMR_OWN_INODES:
+        return "inode store";
+    case SIMPLEFS_FMR_OWN_IFREE:
+        return "ifree bitmap";
+    case SIMPLEFS_FMR_OWN_BFREE:
+        return "bfree bitmap";
+    case FMR_OWN_FREE:
+        return "free";
+    default:
+        return "data";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct fsmap_head *head;
+    struct fsmap *rec;
+    struct statfs sfs;
+    uint64_t total = 0, used = 0, free_blocks = 0, nr_free = 0, max_free = 0;
+    uint64_t runs[NR_BUCKETS] = {0}, blocks[NR_BUCKETS] = {0};
+    uint32_t bs, i;
+    int fd, verbose = 0, opt, last = 0;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt != 'v') {
+            fprintf(stderr, "Usage: %s [-v] mountpoint\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        verbose = 1;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-v] mountpoint\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstatfs(fd, &sfs)) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (sfs.f_type != SIMPLEFS_MAGIC) {
+        fprintf(stderr, "%s: not on a simplefs partition\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    bs = sfs.f_bsize;
+
+    head = calloc(1, sizeof(*head) + NR_RECS * sizeof(struct fsmap));
+    if (!head) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    head->fmh_count = NR_RECS;
+    head->fmh_keys[1].fmr_device = UINT32_MAX;
+    head->fmh_keys[1].fmr_physical = UINT64_MAX;
+
+    /* One page of records at a time, the last one as the next low key */
+    while (!last) {
+        if (ioctl(fd, FS_IOC_GETFSMAP, head) < 0) {
+            perror("FS_IOC_GETFSMAP");
+            return EXIT_FAILURE;
+        }
+        if (!head->fmh_entries)
+            break;
+        for (i = 0; i < head->fmh_entries; i++) {
+            uint64_t len;
+            int b = 0;
+
+            rec = &head->fmh_recs[i];
+            len = rec->fmr_length / bs;
+            total += len;
+            if (rec->fmr_flags & FMR_OF_LAST)
+                last = 1;
+            if (verbose)
+                printf("%12llu %12llu %s\n",
+                       (unsigned long long) (rec->fmr_physical / bs),
+                       (unsigned long long) len, owner_name(rec->fmr_owner));
+            else if (rec->fmr_owner != FMR_OWN_FREE &&
+                     rec->fmr_owner != FMR_OWN_UNKNOWN)
+                printf("%-12s %llu-%llu\n", owner_name(rec->fmr_owner),
+                       (unsigned long long) (rec->fmr_physical / bs),
+                       (unsigned long long) ((rec->fmr_physical +
+                                              rec->fmr_length) / bs - 1));
+            if (rec->fmr_owner != FMR_OWN_FREE) {
+                used += len;
+                continue;
+            }
+            while (b < NR_BUCKETS - 1 && len >> (b + 1))
+                b++;
+            runs[b]++;
+            blocks[b] += len;
+            nr_free++;
+            free_blocks += len;
+            if (len > max_free)
+                max_free = len;
+        }
+        head->fmh_keys[0] = head->fmh_recs[head->fmh_entries - 1];
+    }
+
+    printf("\nTotal blocks: %llu\nUsed blocks: %llu\nFree blocks: %llu "
+           "(%.1f%%)\n",
+           (unsigned long long) total, (unsigned long long) used,
+           (unsigned long long) free_blocks,
+           total ? 100.0 * free_blocks / total : 0);
+    printf("Free runs: %llu, largest %llu blocks, average %.1f blocks\n",
+           (unsigned long long) nr_free, (unsigned long long) max_free,
+           nr_free ? (double) free_blocks / nr_free : 0);
+    if (!nr_free)
+        return EXIT_SUCCESS;
+
+    printf("\nHISTOGRAM OF FREE RUN SIZES:\n%16s %12s %12s %8s\n", "blocks",
+           "runs", "free blocks", "% free");
+    for (i = 0; i < NR_BUCKETS; i++) {
+        char range[32];
+
+        if (!runs[i])
+            continue;
+        snprintf(range, sizeof(range), "%llu-%llu", 1ULL << i,
+                 (2ULL << i) - 1);
+        printf("%16s %12llu %12llu %7.2f%%\n", range,
+               (unsigned long long) runs[i], (unsigned long long) blocks[i],
+               100.0 * blocks[i] / free_blocks);
+    }
+    return EXIT_SUCCESS;
+}
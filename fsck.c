@@ -0,0 +1,945 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsimplefs.h"
+
+/* Exit codes, as e2fsck */
+#define FSCK_OK 0
+#define FSCK_NONDESTRUCT 1 /* errors were corrected */
+#define FSCK_UNCORRECTED 4 /* errors were left uncorrected */
+#define FSCK_ERROR 8       /* operational error */
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+/* The inode store and the bitmaps are read in chunks of FSCK_IO_SIZE */
+#define FSCK_IO_SIZE (4 << 20)
+
+/* Raw superblock, and its fields in host order */
+static char *sb_block;
+static struct simplefs_sb_info sbi;
+static uint32_t block_size;
+static uint32_t inodes_per_block;
+static uint32_t first_data_block;
+/* Blocks of the device checked: all of them, but for a striped partition,
+ * whose other devices only hold file data
+ */
+static uint32_t nr_dev_blocks;
+
+static int fd;
+static int repair;
+
+/* Everything found in use by the scan, one bit per block and per inode. They
+ * are the only structures sized by the partition.
+ */
+static uint64_t *used_blocks;
+static uint64_t *used_inodes;   /* i_mode set */
+static uint64_t *linked_inodes; /* named by a directory entry */
+
+/* With SIMPLEFS_FEATURE_REFLINK, the refcount table, and the number of
+ * extents found starting at each block
+ */
+static uint16_t *refcounts;
+static uint32_t *refs_seen;
+
+/* With SIMPLEFS_FEATURE_METADATA_CSUM, the bitmap checksum table */
+static char *csum_table;
+
+/* Inode store blocks to scan, and the next chunk a worker picks */
+static uint32_t nr_scan_blocks;
+static uint32_t next_chunk;
+
+static unsigned long nr_errors, nr_fixed;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Report a problem, fixed or not, from any thread */
+static void report(int fixed, const char *fmt, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&report_lock);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(fixed ? " (fixed)\n" : "\n");
+    if (fixed)
+        nr_fixed++;
+    else
+        nr_errors++;
+    pthread_mutex_unlock(&report_lock);
+}
+
+static int has_csum(void)
+{
+    return sbi.features & SIMPLEFS_FEATURE_METADATA_CSUM;
+}
+
+/* Check the checksum of an inode store, index or directory block. Returns 1
+ * when it was wrong and has been updated, to be written back.
+ */
+static int check_sfs_block_csum(uint32_t block, char *data, const char *what)
+{
+    uint32_t *csum = (uint32_t *) (data + SIMPLEFS_CSUM_OFFSET(block_size));
+    uint32_t crc = sfs_block_csum(block, data, SIMPLEFS_CSUM_OFFSET(block_size));
+
+    if (!has_csum() || le32toh(*csum) == crc)
+        return 0;
+    report(repair, "%s block %u: checksum mismatch", what, block);
+    *csum = htole32(crc);
+    return repair;
+}
+
+static void set_sfs_block_csum(uint32_t block, char *data)
+{
+    if (has_csum())
+        *(uint32_t *) (data + SIMPLEFS_CSUM_OFFSET(block_size)) =
+            htole32(sfs_block_csum(block, data, SIMPLEFS_CSUM_OFFSET(block_size)));
+}
+
+static uint32_t sb_csum(void)
+{
+    return sfs_sb_csum(sb_block, block_size);
+}
+
+/* Checksum slot of a bitmap block in the checksum table */
+static uint32_t *bitmap_csum(uint32_t block)
+{
+    uint32_t per_block = SIMPLEFS_CSUMS_PER_BLOCK(block_size);
+    uint32_t idx = block - 1 - sbi.nr_istore_blocks;
+
+    return (uint32_t *) (csum_table + (idx / per_block) * block_size) +
+           idx % per_block;
+}
+
+static int read_blocks(char *buf, uint32_t block, uint32_t count)
+{
+    return sfs_read_blocks(fd, block_size, buf, block, count);
+}
+
+static int write_blocks(const char *buf, uint32_t block, uint32_t count)
+{
+    return sfs_write_blocks(fd, block_size, buf, block, count);
+}
+
+static int test_bit(const uint64_t *map, uint64_t bit)
+{
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static int test_and_set_bit(uint64_t *map, uint64_t bit)
+{
+    uint64_t mask = 1ULL << (bit % 64);
+
+    return !!(__atomic_fetch_or(&map[bit / 64], mask, __ATOMIC_RELAXED) &
+              mask);
+}
+
+static uint64_t *alloc_bitmap(uint64_t nr_bits)
+{
+    return calloc(DIV_ROUND_UP(nr_bits, 64), sizeof(uint64_t));
+}
+
+/* Claim @count blocks from @start for inode @ino. Returns -1 if they are not
+ * all data blocks.
+ */
+static int claim_blocks(uint32_t ino, uint32_t start, uint32_t count)
+{
+    uint32_t dups = 0, first_dup = 0;
+
+    if (start < first_data_block || !count ||
+        (uint64_t) start + count > sbi.nr_blocks)
+        return -1;
+
+    for (uint32_t b = start; b < start + count; b++) {
+        if (test_and_set_bit(used_blocks, b) && !dups++)
+            first_dup = b;
+    }
+    if (dups)
+        report(0, "inode %u: %u block(s) from %u also used by another inode",
+               ino, dups, first_dup);
+    return 0;
+}
+
+/* Per-worker buffer for index and directory blocks */
+struct worker {
+    pthread_t thread;
+    char *index;
+    char *dir; /* one extent */
+};
+
+/* Walk the entries of directory block @block of inode @ino, marking the
+ * inodes they name. Returns the number of entries.
+ */
+static uint32_t scan_dir_block(uint32_t ino, uint32_t block, char *data)
+{
+    struct simplefs_dir_block *dblock = (struct simplefs_dir_block *) data;
+    uint32_t files_per_block = SIMPLEFS_FILES_PER_BLOCK(block_size);
+    uint32_t fi, nr_blk, nr_files = 0;
+
+    for (fi = 0; fi < files_per_block; fi += nr_blk) {
+        struct simplefs_file *f = &dblock->files[fi];
+        uint32_t child = le32toh(f->inode);
+
+        nr_blk = le32toh(f->nr_blk);
+        if (!nr_blk || nr_blk > files_per_block - fi) {
+            report(0, "directory %u: block %u: corrupt entry %u", ino, block,
+                   fi);
+            break;
+        }
+        if (!child)
+            continue;
+        nr_files++;
+        if (child >= sbi.nr_inodes)
+            report(0, "directory %u: entry '%.*s' names invalid inode %u", ino,
+                   SIMPLEFS_FILENAME_LEN, f->filename, child);
+        else
+            test_and_set_bit(linked_inodes, child);
+    }
+    return nr_files;
+}
+
+/* Check the index block of inode @ino and everything it points to */
+static void scan_index(struct worker *w, uint32_t ino, uint32_t mode,
+                       uint32_t ei_block)
+{
+    struct simplefs_file_ei_block *index =
+        (struct simplefs_file_ei_block *) w->index;
+    uint32_t max_extents = SIMPLEFS_MAX_EXTENTS(block_size);
+    uint32_t nr_files = 0;
+    int dirty = 0;
+
+    if (read_blocks(w->index, ei_block, 1)) {
+        report(0, "inode %u: cannot read index block %u: %s", ino, ei_block,
+               strerror(errno));
+        return;
+    }
+    dirty |= check_sfs_block_csum(ei_block, w->index, "index");
+    if (ei_block >= nr_dev_blocks)
+        report(0, "inode %u: index block %u not on the first device", ino,
+               ei_block);
+
+    for (uint32_t ei = 0; ei < max_extents; ei++) {
+        struct simplefs_extent *ext = &index->extents[ei];
+        uint32_t start = le32toh(ext->ee_start), len = le32toh(ext->ee_len);
+        uint32_t ext_files = 0;
+
+        if (!start)
+            continue;
+        /* Compressed extents take ee_clen blocks from ee_start */
+        if (!S_ISDIR(mode) && le16toh(ext->ee_flags) & SIMPLEFS_EXT_LZ4) {
+            uint32_t clen = le16toh(ext->ee_clen);
+
+            if (!clen || clen >= len)
+                report(0, "inode %u: extent %u compressed to %u of %u blocks",
+                       ino, ei, clen, len);
+            len = clen;
+        }
+        /* Shared extents are claimed by the first file found */
+        if (!S_ISDIR(mode) && refcounts && start < sbi.nr_blocks &&
+            refcounts[start] &&
+            __atomic_fetch_add(&refs_seen[start], 1, __ATOMIC_RELAXED))
+            continue;
+        if (claim_blocks(ino, start, len)) {
+            report(0, "inode %u: extent %u (%u+%u) out of range", ino, ei,
+                   start, len);
+            continue;
+        }
+        if (!S_ISDIR(mode))
+            continue;
+
+        if (len > SIMPLEFS_MAX_BLOCKS_PER_EXTENT) {
+            report(0, "directory %u: extent %u too long (%u blocks)", ino, ei,
+                   len);
+            continue;
+        }
+        if (start + len > nr_dev_blocks) {
+            report(0, "directory %u: extent %u not on the first device", ino,
+                   ei);
+            continue;
+        }
+        if (read_blocks(w->dir, start, len)) {
+            report(0, "directory %u: cannot read blocks %u+%u: %s", ino, start,
+                   len, strerror(errno));
+            continue;
+        }
+        for (uint32_t bi = 0; bi < len; bi++) {
+            char *data = w->dir + bi * block_size;
+            struct simplefs_dir_block *dblock =
+                (struct simplefs_dir_block *) data;
+            int dir_dirty = check_sfs_block_csum(start + bi, data, "directory");
+            uint32_t n = scan_dir_block(ino, start + bi, data);
+
+            if (le32toh(dblock->nr_files) != n) {
+                report(repair, "directory %u: block %u counts %u files, has %u",
+                       ino, start + bi, le32toh(dblock->nr_files), n);
+                dblock->nr_files = htole32(n);
+                set_sfs_block_csum(start + bi, data);
+                dir_dirty = repair;
+            }
+            if (dir_dirty && write_blocks(data, start + bi, 1))
+                report(0, "directory %u: cannot write block %u: %s", ino,
+                       start + bi, strerror(errno));
+            ext_files += n;
+        }
+        if (le32toh(ext->nr_files) != ext_files) {
+            report(repair, "directory %u: extent %u counts %u files, has %u",
+                   ino, ei, le32toh(ext->nr_files), ext_files);
+            ext->nr_files = htole32(ext_files);
+            dirty |= repair;
+        }
+        nr_files += ext_files;
+    }
+
+    if (S_ISDIR(mode) && le32toh(index->nr_files) != nr_files) {
+        report(repair, "directory %u: counts %u files, has %u", ino,
+               le32toh(index->nr_files), nr_files);
+        index->nr_files = htole32(nr_files);
+        dirty |= repair;
+    }
+    if (dirty) {
+        set_sfs_block_csum(ei_block, w->index);
+        if (write_blocks(w->index, ei_block, 1))
+            report(0, "inode %u: cannot write index block %u: %s", ino,
+                   ei_block, strerror(errno));
+    }
+}
+
+static void scan_inode(struct worker *w, uint32_t ino,
+                       const struct simplefs_inode *inode)
+{
+    uint32_t mode = le32toh(inode->i_mode);
+    uint32_t ei_block = le32toh(inode->ei_block);
+
+    if (!mode)
+        return;
+    test_and_set_bit(used_inodes, ino);
+
+    if (S_ISLNK(mode))
+        return;
+    if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+        report(0, "inode %u: unknown file type %#o", ino, mode & S_IFMT);
+        return;
+    }
+    if (claim_blocks(ino, ei_block, 1)) {
+        report(0, "inode %u: index block %u out of range", ino, ei_block);
+        return;
+    }
+    scan_index(w, ino, mode, ei_block);
+}
+
+/* Worker: scans chunks of the inode store until there are none left */
+static void *scan_inodes(void *arg)
+{
+    struct worker *w = arg;
+    uint32_t chunk_blocks = FSCK_IO_SIZE / block_size;
+    char *buf = malloc(FSCK_IO_SIZE);
+
+    if (!buf) {
+        report(0, "out of memory");
+        return NULL;
+    }
+
+    for (;;) {
+        uint32_t first = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED) *
+                         chunk_blocks;
+        uint32_t n, i;
+        int dirty = 0;
+
+        if (first >= nr_scan_blocks)
+            break;
+        n = nr_scan_blocks - first < chunk_blocks ? nr_scan_blocks - first
+                                                  : chunk_blocks;
+        if (read_blocks(buf, 1 + first, n)) {
+            report(0, "cannot read inode store blocks %u+%u: %s", 1 + first, n,
+                   strerror(errno));
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            char *block = buf + i * block_size;
+            uint32_t ino = (first + i) * inodes_per_block;
+
+            dirty |= check_sfs_block_csum(1 + first + i, block, "inode store");
+            for (uint32_t k = 0; k < inodes_per_block; k++, ino++) {
+                if (ino && ino < sbi.nr_inodes)
+                    scan_inode(w, ino, (struct simplefs_inode *) block + k);
+            }
+        }
+        if (dirty && write_blocks(buf, 1 + first, n))
+            report(0, "cannot write inode store blocks %u+%u: %s", 1 + first,
+                   n, strerror(errno));
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* Print bits [@start, @end) of a bitmap with the same problem as one line */
+static void report_range(const char *what, const char *problem, uint64_t start,
+                         uint64_t end)
+{
+    if (end - start == 1)
+        report(repair, "%s %lu %s", what, start, problem);
+    else
+        report(repair, "%ss %lu-%lu %s", what, start, end - 1, problem);
+}
+
+/* Compare the on-disk bitmap of @nr_blocks blocks from block @start, where 1
+ * means free, with the bits found in use by the scan. Rewrites it when
+ * repairing, and returns the number of free bits, or -1 on error.
+ */
+static int64_t check_bitmap(const char *what, uint32_t start,
+                            uint32_t nr_blocks, const uint64_t *used,
+                            uint64_t nr_bits)
+{
+    uint32_t chunk_blocks = FSCK_IO_SIZE / block_size;
+    uint64_t words_per_block = block_size / sizeof(uint64_t);
+    uint64_t nr_words = DIV_ROUND_UP(nr_bits, 64);
+    uint64_t range_start = 0, bit;
+    const char *range = NULL;
+    int64_t nr_free = 0;
+    uint64_t *buf = malloc(FSCK_IO_SIZE);
+
+    if (!buf)
+        return -1;
+
+    for (uint32_t i = 0, n; i < nr_blocks; i += n) {
+        int dirty = 0;
+
+        n = nr_blocks - i < chunk_blocks ? nr_blocks - i : chunk_blocks;
+        if (read_blocks((char *) buf, start + i, n)) {
+            free(buf);
+            return -1;
+        }
+
+        for (uint32_t j = 0; j < n; j++) {
+            char *data = (char *) buf + j * block_size;
+
+            if (has_csum() &&
+                le32toh(*bitmap_csum(start + i + j)) !=
+                    sfs_block_csum(start + i + j, data, block_size)) {
+                report(repair, "%s bitmap block %u: checksum mismatch", what,
+                       start + i + j);
+                dirty = 1;
+            }
+        }
+
+        for (uint64_t k = 0; k < n * words_per_block; k++) {
+            uint64_t w = (uint64_t) i * words_per_block + k;
+            uint64_t mask = ~0ULL, disk, expect, diff;
+
+            if (w >= nr_words)
+                break;
+            if (w == nr_words - 1 && nr_bits % 64)
+                mask = (1ULL << (nr_bits % 64)) - 1;
+            disk = le64toh(buf[k]);
+            expect = ~used[w] & mask;
+            nr_free += __builtin_popcountll(expect);
+            diff = (disk ^ expect) & mask;
+
+            /* Problems are printed as ranges of consecutive bits */
+            for (bit = w * 64; bit < w * 64 + 64 && bit < nr_bits; bit++) {
+                const char *problem = NULL;
+
+                if ((diff >> (bit % 64)) & 1)
+                    problem = test_bit(used, bit) ? "in use but marked free"
+                                                  : "marked in use but unused";
+                else if (!range && !diff)
+                    break;
+                if (problem == range)
+                    continue;
+                if (range)
+                    report_range(what, range, range_start, bit);
+                range = problem;
+                range_start = bit;
+            }
+            if (diff) {
+                buf[k] = htole64(expect | (disk & ~mask));
+                dirty = 1;
+            }
+        }
+
+        if (!repair || !dirty)
+            continue;
+        for (uint32_t j = 0; j < n; j++) {
+            if (has_csum())
+                *bitmap_csum(start + i + j) = htole32(sfs_block_csum(
+                    start + i + j, (char *) buf + j * block_size, block_size));
+        }
+        if (write_blocks((char *) buf, start + i, n)) {
+            free(buf);
+            return -1;
+        }
+    }
+    if (range)
+        report_range(what, range, range_start, nr_bits);
+
+    free(buf);
+    return nr_free;
+}
+
+/* Inode store blocks that can hold inodes in use. With lazy_itable, blocks
+ * past the one of the highest inode marked in use were never written.
+ */
+static int istore_blocks_to_scan(uint32_t *nr)
+{
+    uint32_t start = 1 + sbi.nr_istore_blocks;
+    uint64_t *buf = malloc(block_size);
+    uint64_t last = 0;
+
+    *nr = sbi.nr_istore_blocks;
+    if (!(sbi.features & SIMPLEFS_FEATURE_LAZY_ITABLE)) {
+        free(buf);
+        return 0;
+    }
+    if (!buf)
+        return -1;
+
+    for (uint32_t i = 0; i < sbi.nr_ifree_blocks; i++) {
+        if (read_blocks((char *) buf, start + i, 1)) {
+            free(buf);
+            return -1;
+        }
+        for (uint32_t k = 0; k < block_size / sizeof(uint64_t); k++) {
+            uint64_t used = ~le64toh(buf[k]);
+
+            if (used)
+                last = ((uint64_t) i * block_size / sizeof(uint64_t) + k) * 64 +
+                       63 - __builtin_clzll(used);
+        }
+    }
+    free(buf);
+
+    if (last < sbi.nr_inodes && last / inodes_per_block + 1 < *nr)
+        *nr = last / inodes_per_block + 1;
+    return 0;
+}
+
+/* Warn when the internal journal holds transactions the kernel has not
+ * replayed yet: they may fix what the scan finds, or be broken by a repair.
+ * Returns 1 in that case.
+ */
+static int journal_needs_recovery(void)
+{
+    if (!sfs_journal_needs_recovery(fd, block_size, &sbi))
+        return 0;
+    printf("Journal needs recovery: mount the filesystem to replay it\n");
+    return 1;
+}
+
+/* Read and check the superblock. Returns -1 if the partition cannot be
+ * checked.
+ */
+static int read_superblock(uint64_t size)
+{
+    struct simplefs_sb_info *csb;
+
+    sb_block = malloc(SIMPLEFS_MAX_BLOCK_SIZE);
+    if (!sb_block)
+        return -1;
+    block_size = SIMPLEFS_MIN_BLOCK_SIZE;
+    if (read_blocks(sb_block, SIMPLEFS_SB_BLOCK_NR, 1))
+        return -1;
+
+    csb = (struct simplefs_sb_info *) sb_block;
+    if (le32toh(csb->magic) != SIMPLEFS_MAGIC) {
+        fprintf(stderr, "Wrong magic number\n");
+        return -1;
+    }
+    block_size = le32toh(csb->block_size) ?: SIMPLEFS_BLOCK_SIZE;
+    if (block_size < SIMPLEFS_MIN_BLOCK_SIZE ||
+        block_size > SIMPLEFS_MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1))) {
+        fprintf(stderr, "Invalid block size %u\n", block_size);
+        return -1;
+    }
+    if (read_blocks(sb_block, SIMPLEFS_SB_BLOCK_NR, 1))
+        return -1;
+
+    sbi.nr_blocks = le32toh(csb->nr_blocks);
+    sbi.nr_inodes = le32toh(csb->nr_inodes);
+    sbi.nr_istore_blocks = le32toh(csb->nr_istore_blocks);
+    sbi.nr_ifree_blocks = le32toh(csb->nr_ifree_blocks);
+    sbi.nr_bfree_blocks = le32toh(csb->nr_bfree_blocks);
+    sbi.nr_free_inodes = le32toh(csb->nr_free_inodes);
+    sbi.nr_free_blocks = le32toh(csb->nr_free_blocks);
+    sbi.journal_ino = le32toh(csb->journal_ino);
+    sbi.features = le32toh(csb->features);
+    sbi.refcount_start = le32toh(csb->refcount_start);
+    sbi.nr_refcount_blocks = le32toh(csb->nr_refcount_blocks);
+    sbi.nr_devices = le32toh(csb->nr_devices);
+    for (uint32_t i = 0; i < SIMPLEFS_MAX_DEVICES; i++)
+        sbi.dev_blocks[i] = le32toh(csb->dev_blocks[i]);
+    sbi.csum_start = le32toh(csb->csum_start);
+    sbi.nr_csum_blocks = le32toh(csb->nr_csum_blocks);
+    inodes_per_block = SIMPLEFS_INODES_PER_BLOCK(block_size);
+    first_data_block = 1 + sbi.nr_istore_blocks + sbi.nr_ifree_blocks +
+                       sbi.nr_bfree_blocks;
+
+    if (sbi.features & ~SIMPLEFS_FEATURE_ALL) {
+        fprintf(stderr, "Unsupported features %#x\n",
+                sbi.features & ~SIMPLEFS_FEATURE_ALL);
+        return -1;
+    }
+    nr_dev_blocks = sbi.nr_blocks;
+    if (!(sbi.features & SIMPLEFS_FEATURE_STRIPE)) {
+        if (sbi.features & SIMPLEFS_FEATURE_METADATA_DEV) {
+            fprintf(stderr, "Metadata device without a data device\n");
+            return -1;
+        }
+        sbi.nr_devices = 1;
+    } else {
+        uint64_t total = 0;
+
+        if (sbi.nr_devices < 2 || sbi.nr_devices > SIMPLEFS_MAX_DEVICES) {
+            fprintf(stderr, "Invalid number of devices %u\n", sbi.nr_devices);
+            return -1;
+        }
+        for (uint32_t i = 0; i < sbi.nr_devices; i++)
+            total += sbi.dev_blocks[i];
+        if (total != sbi.nr_blocks) {
+            fprintf(stderr, "Device sizes do not add up to the partition\n");
+            return -1;
+        }
+        nr_dev_blocks = sbi.dev_blocks[0];
+    }
+    if ((uint64_t) nr_dev_blocks * block_size > size ||
+        sbi.nr_istore_blocks !=
+            DIV_ROUND_UP(sbi.nr_inodes, inodes_per_block) ||
+        sbi.nr_ifree_blocks !=
+            DIV_ROUND_UP(sbi.nr_inodes, (uint64_t) block_size * 8) ||
+        sbi.nr_bfree_blocks !=
+            DIV_ROUND_UP(sbi.nr_blocks, (uint64_t) block_size * 8) ||
+        (uint64_t) first_data_block >= nr_dev_blocks || sbi.nr_inodes < 2) {
+        fprintf(stderr, "Inconsistent partition layout in the superblock\n");
+        return -1;
+    }
+    if ((sbi.features & SIMPLEFS_FEATURE_REFLINK) &&
+        (sbi.nr_refcount_blocks !=
+             DIV_ROUND_UP(sbi.nr_blocks,
+                          SIMPLEFS_REFCOUNTS_PER_BLOCK(block_size)) ||
+         sbi.refcount_start < first_data_block ||
+         (uint64_t) sbi.refcount_start + sbi.nr_refcount_blocks >
+             sbi.nr_blocks)) {
+        fprintf(stderr, "Invalid refcount table at block %u\n",
+                sbi.refcount_start);
+        return -1;
+    }
+    if (has_csum() &&
+        (sbi.nr_csum_blocks !=
+             DIV_ROUND_UP(sbi.nr_ifree_blocks + sbi.nr_bfree_blocks,
+                          SIMPLEFS_CSUMS_PER_BLOCK(block_size)) ||
+         sbi.csum_start < first_data_block ||
+         (uint64_t) sbi.csum_start + sbi.nr_csum_blocks > sbi.nr_blocks)) {
+        fprintf(stderr, "Invalid bitmap checksum table at block %u\n",
+                sbi.csum_start);
+        return -1;
+    }
+    if (has_csum() && le32toh(csb->checksum) != sb_csum())
+        report(repair, "superblock: checksum mismatch");
+    return 0;
+}
+
+/* Read the refcount table, if any. Returns -1 on error. */
+static int read_refcounts(void)
+{
+    uint32_t per_block = SIMPLEFS_REFCOUNTS_PER_BLOCK(block_size);
+    char *buf;
+
+    if (!(sbi.features & SIMPLEFS_FEATURE_REFLINK))
+        return 0;
+    buf = malloc(block_size);
+    refcounts = calloc(sbi.nr_blocks, sizeof(*refcounts));
+    refs_seen = calloc(sbi.nr_blocks, sizeof(*refs_seen));
+    if (!buf || !refcounts || !refs_seen) {
+        free(buf);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < sbi.nr_refcount_blocks; i++) {
+        uint32_t block = sbi.refcount_start + i;
+        uint16_t *counts = (uint16_t *) buf;
+
+        if (read_blocks(buf, block, 1)) {
+            free(buf);
+            return -1;
+        }
+        if (check_sfs_block_csum(block, buf, "refcount") &&
+            write_blocks(buf, block, 1))
+            report(0, "cannot write refcount block %u: %s", block,
+                   strerror(errno));
+        for (uint32_t k = 0;
+             k < per_block && (uint64_t) i * per_block + k < sbi.nr_blocks; k++)
+            refcounts[i * per_block + k] = le16toh(counts[k]);
+    }
+    free(buf);
+    return 0;
+}
+
+/* Read the bitmap checksum table, if any. Returns -1 on error. */
+static int read_csum_table(void)
+{
+    if (!has_csum())
+        return 0;
+    csum_table = malloc((size_t) sbi.nr_csum_blocks * block_size);
+    if (!csum_table ||
+        read_blocks(csum_table, sbi.csum_start, sbi.nr_csum_blocks))
+        return -1;
+
+    for (uint32_t i = 0; i < sbi.nr_csum_blocks; i++) {
+        uint32_t block = sbi.csum_start + i;
+        char *data = csum_table + (size_t) i * block_size;
+
+        if (check_sfs_block_csum(block, data, "checksum table") &&
+            write_blocks(data, block, 1))
+            report(0, "cannot write checksum table block %u: %s", block,
+                   strerror(errno));
+    }
+    return 0;
+}
+
+/* Write back the bitmap checksum table after the bitmaps were repaired */
+static int write_csum_table(void)
+{
+    for (uint32_t i = 0; i < sbi.nr_csum_blocks; i++)
+        set_sfs_block_csum(sbi.csum_start + i,
+                           csum_table + (size_t) i * block_size);
+    return write_blocks(csum_table, sbi.csum_start, sbi.nr_csum_blocks);
+}
+
+/* Compare the extents found shared with the refcount table */
+static void check_refcounts(void)
+{
+    for (uint32_t b = 0; b < sbi.nr_blocks; b++) {
+        if (refcounts[b] && refs_seen[b] != refcounts[b] + 1u)
+            report(0, "block %u: extent shared by %u file(s), refcount %u", b,
+                   refs_seen[b], refcounts[b] + 1u);
+    }
+}
+
+/* Cross-check the directory tree with the inodes in use */
+static void check_links(void)
+{
+    for (uint64_t w = 0; w < DIV_ROUND_UP(sbi.nr_inodes, 64); w++) {
+        uint64_t diff = used_inodes[w] ^ linked_inodes[w];
+
+        while (diff) {
+            uint32_t ino = w * 64 + __builtin_ctzll(diff);
+
+            diff &= diff - 1;
+            if (ino == SIMPLEFS_ROOT_INO || ino == sbi.journal_ino)
+                continue;
+            if (test_bit(used_inodes, ino))
+                report(0, "inode %u is not linked in any directory", ino);
+            else
+                report(0, "directory entry names free inode %u", ino);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timespec t0, t1;
+    int opt, ret = FSCK_ERROR;
+
+    while ((opt = getopt(argc, argv, "j:ny")) != -1) {
+        switch (opt) {
+        case 'j': {
+            char *end;
+            nr_threads = strtol(optarg, &end, 10);
+            if (*end || nr_threads < 1 || nr_threads > 1024) {
+                fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                return FSCK_ERROR;
+            }
+            break;
+        }
+        case 'n':
+            repair = 0;
+            break;
+        case 'y':
+            repair = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+    usage:
+        fprintf(stderr,
+                "Usage: %s [-n | -y] [-j threads] disk\n"
+                "\t-n  check only, do not change anything (default)\n"
+                "\t-y  repair the problems found\n"
+                "\t-j  number of threads scanning the inode store "
+                "(default: one per CPU)\n",
+                argv[0]);
+        return FSCK_ERROR;
+    }
+    if (nr_threads < 1)
+        nr_threads = 1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    /* Open disk image */
+    fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+        perror("open():");
+        return FSCK_ERROR;
+    }
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf)) {
+        perror("fstat():");
+        goto fclose;
+    }
+    uint64_t size = stat_buf.st_size;
+    if ((stat_buf.st_mode & S_IFMT) == S_IFBLK &&
+        ioctl(fd, BLKGETSIZE64, &size)) {
+        perror("BLKGETSIZE64:");
+        goto fclose;
+    }
+
+    if (read_superblock(size))
+        goto fclose;
+    if (journal_needs_recovery() && repair) {
+        fprintf(stderr, "Not repairing before the journal is replayed\n");
+        repair = 0;
+    }
+    if (istore_blocks_to_scan(&nr_scan_blocks)) {
+        perror("read ifree bitmap:");
+        goto fclose;
+    }
+    if (read_refcounts()) {
+        perror("read refcount table:");
+        goto fclose;
+    }
+    if (read_csum_table()) {
+        perror("read checksum table:");
+        goto fclose;
+    }
+
+    used_blocks = alloc_bitmap(sbi.nr_blocks);
+    used_inodes = alloc_bitmap(sbi.nr_inodes);
+    linked_inodes = alloc_bitmap(sbi.nr_inodes);
+    struct worker *workers = calloc(nr_threads, sizeof(*workers));
+    if (!used_blocks || !used_inodes || !linked_inodes || !workers) {
+        fprintf(stderr, "Out of memory\n");
+        goto free_maps;
+    }
+
+    /* Pass 1: inodes, index and directory blocks, in parallel */
+    long i, nr_started = 0;
+    for (i = 0; i < nr_threads; i++) {
+        workers[i].index = malloc(block_size);
+        workers[i].dir = malloc(SIMPLEFS_MAX_BLOCKS_PER_EXTENT * block_size);
+        if (!workers[i].index || !workers[i].dir ||
+            pthread_create(&workers[i].thread, NULL, scan_inodes, &workers[i]))
+            break;
+        nr_started++;
+    }
+    for (i = 0; i < nr_started; i++)
+        pthread_join(workers[i].thread, NULL);
+    for (i = 0; i < nr_threads; i++) {
+        free(workers[i].index);
+        free(workers[i].dir);
+    }
+    free(workers);
+    workers = NULL;
+    if (!nr_started) {
+        fprintf(stderr, "Cannot start the scan\n");
+        goto free_maps;
+    }
+
+    /* Pass 2: directory tree, and shared extents */
+    test_and_set_bit(linked_inodes, SIMPLEFS_ROOT_INO);
+    if (!test_bit(used_inodes, SIMPLEFS_ROOT_INO))
+        report(0, "root inode is free");
+    check_links();
+    if (refcounts) {
+        if (claim_blocks(0, sbi.refcount_start, sbi.nr_refcount_blocks))
+            report(0, "refcount table out of range");
+        check_refcounts();
+    }
+    if (csum_table &&
+        claim_blocks(0, sbi.csum_start, sbi.nr_csum_blocks))
+        report(0, "checksum table out of range");
+
+    /* Pass 3: bitmaps. Inode 0 and the metadata blocks are never free. */
+    test_and_set_bit(used_inodes, 0);
+    for (uint32_t b = 0; b < first_data_block; b++)
+        test_and_set_bit(used_blocks, b);
+    /* So are the headers of the other devices */
+    for (uint32_t i = 1, b = 0; i < sbi.nr_devices; i++) {
+        b += sbi.dev_blocks[i - 1];
+        test_and_set_bit(used_blocks, b);
+    }
+    int64_t nr_free_inodes =
+        check_bitmap("inode", 1 + sbi.nr_istore_blocks, sbi.nr_ifree_blocks,
+                     used_inodes, sbi.nr_inodes);
+    int64_t nr_free_blocks =
+        check_bitmap("block", 1 + sbi.nr_istore_blocks + sbi.nr_ifree_blocks,
+                     sbi.nr_bfree_blocks, used_blocks, sbi.nr_blocks);
+    if (nr_free_inodes < 0 || nr_free_blocks < 0) {
+        perror("check_bitmap():");
+        goto free_maps;
+    }
+
+    /* The kernel recounts free inodes and blocks at mount: stale counters
+     * are fixed when repairing, but are not errors.
+     */
+    struct simplefs_sb_info *csb = (struct simplefs_sb_info *) sb_block;
+    csb->nr_free_inodes = htole32(nr_free_inodes);
+    csb->nr_free_blocks = htole32(nr_free_blocks);
+    if (repair) {
+        if (csum_table && write_csum_table()) {
+            perror("write checksum table:");
+            goto free_maps;
+        }
+        if (has_csum())
+            csb->checksum = htole32(sb_csum());
+        if (write_blocks(sb_block, SIMPLEFS_SB_BLOCK_NR, 1) || fsync(fd)) {
+            perror("write superblock:");
+            goto free_maps;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%s: %lu/%u inodes, %lu/%u blocks, %u inode store blocks scanned "
+           "by %ld threads in %.3f s\n",
+           argv[optind], sbi.nr_inodes - nr_free_inodes, sbi.nr_inodes,
+           sbi.nr_blocks - nr_free_blocks, sbi.nr_blocks, nr_scan_blocks,
+           nr_started,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    if (nr_errors)
+        printf("%lu error(s) left uncorrected, %lu fixed\n", nr_errors,
+               nr_fixed);
+    else if (nr_fixed)
+        printf("%lu error(s) fixed\n", nr_fixed);
+
+    ret = nr_errors ? FSCK_UNCORRECTED : nr_fixed ? FSCK_NONDESTRUCT : FSCK_OK;
+free_maps:
+    free(workers);
+    free(used_blocks);
+    free(used_inodes);
+    free(linked_inodes);
+fclose:
+    free(refcounts);
+    free(refs_seen);
+    free(csum_table);
+    free(sb_block);
+    close(fd);
+
+    return ret;
+}
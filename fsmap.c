@@ -0,0 +1,204 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/fs.h>
+#include <linux/fsmap.h>
+#include <linux/kernel.h>
+#include <linux/sched/signal.h>
+#include <linux/uaccess.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* FS_IOC_GETFSMAP: the layout of the partition, as one record per region of
+ * metadata (superblock, inode store, ifree and bfree bitmaps) followed by one
+ * record per run of free or used blocks of the data area, in the order of the
+ * disk. simplefs keeps no reverse map, so used data blocks, the internal
+ * journal included, have no owner. On a striped partition, each device is
+ * reported on its own, with the offsets of that device, in the order of the
+ * device numbers as the keys are; the metadata is all on the first device.
+ *
+ * Records overlapping [low key end, high key] are reported, clipped to it,
+ * up to fmh_count of them; userspace asks for the rest with the last record
+ * as the next low key. With fmh_count 0, the records are only counted.
+ *
+ * The runs are read from the in-memory bfree bitmap without stopping
+ * allocations: on a live partition, the map is a snapshot that may be off
+ * where blocks were allocated or freed during the call. A call walks the
+ * bitmap a word at a time from the low key, and stops once the buffer is
+ * full, so that paging through a large partition stays cheap.
+ */
+
+struct simplefs_fsmap_info {
+    struct fsmap_head head;
+    struct fsmap_head __user *arg;
+    uint64_t low;   /* first block to report */
+    uint64_t high;  /* last block to report */
+    uint64_t start; /* first block of the partition on the device */
+    uint64_t end;   /* past its last block */
+    uint32_t dev;
+    bool last; /* the device reported last */
+};
+
+/* Report blocks [bno, bno + len) of @owner. Returns 1 once the buffer of
+ * userspace is full.
+ */
+static int simplefs_fsmap_rec(struct super_block *sb,
+                              struct simplefs_fsmap_info *info,
+                              uint64_t bno,
+                              uint64_t len,
+                              uint64_t owner)
+{
+    uint64_t end = bno + len;
+    struct fsmap rec;
+
+    if (end <= info->low || bno > info->high)
+        return 0;
+    if (info->head.fmh_count &&
+        info->head.fmh_entries == info->head.fmh_count)
+        return 1;
+
+    bno = max(bno, info->low);
+    end = min(end, info->high + 1);
+    if (info->head.fmh_count) {
+        memset(&rec, 0, sizeof(rec));
+        rec.fmr_device = info->dev;
+        rec.fmr_flags = FMR_OF_SPECIAL_OWNER;
+        if (info->last && end == info->end)
+            rec.fmr_flags |= FMR_OF_LAST;
+        rec.fmr_physical = (bno - info->start) << sb->s_blocksize_bits;
+        rec.fmr_owner = owner;
+        rec.fmr_length = (end - bno) << sb->s_blocksize_bits;
+        if (copy_to_user(&info->arg->fmh_recs[info->head.fmh_entries], &rec,
+                         sizeof(rec)))
+            return -EFAULT;
+    }
+    info->head.fmh_entries++;
+    return 0;
+}
+
+/* The runs of free and used blocks of the data area */
+static int simplefs_fsmap_data(struct super_block *sb,
+                               struct simplefs_fsmap_info *info)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    unsigned long *map = sbi->bfree_bitmap;
+    unsigned long bit, next, end;
+    unsigned int runs = 0;
+    int ret;
+
+    /* A run holding the low key is clipped to it anyway */
+    bit = max_t(uint64_t, info->low,
+                simplefs_bfree_start(sbi) + sbi->nr_bfree_blocks);
+    end = min_t(uint64_t, sbi->nr_blocks, info->high + 1);
+
+    while (bit < end) {
+        bool free = test_bit(bit, map);
+
+        next = free ? find_next_zero_bit(map, sbi->nr_blocks, bit)
+                    : find_next_bit(map, sbi->nr_blocks, bit);
+        ret = simplefs_fsmap_rec(sb, info, bit, next - bit,
+                                 free ? FMR_OWN_FREE : FMR_OWN_UNKNOWN);
+        if (ret)
+            return ret;
+        bit = next;
+
+        if (!(++runs % 1024)) {
+            if (fatal_signal_pending(current))
+                return -EINTR;
+            cond_resched();
+        }
+    }
+    return 0;
+}
+
+/* The records of device @i of the partition, numbered @dev, within the keys */
+static int simplefs_fsmap_dev(struct super_block *sb,
+                              struct simplefs_fsmap_info *info,
+                              uint32_t i,
+                              uint32_t dev)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct fsmap *keys = info->head.fmh_keys;
+    uint64_t low = 0, high = sbi->dev_blocks[i] - 1;
+    uint32_t start;
+    int ret;
+
+    /* The low key is the last record returned, or where to start */
+    if (dev == keys[0].fmr_device)
+        low = (keys[0].fmr_physical + keys[0].fmr_length) >>
+              sb->s_blocksize_bits;
+    if (dev == keys[1].fmr_device)
+        high = min_t(uint64_t, high,
+                     keys[1].fmr_physical >> sb->s_blocksize_bits);
+    if (low > high)
+        return 0;
+    simplefs_stripe_member(sb, i, &start);
+    info->dev = dev;
+    info->start = start;
+    info->end = start + sbi->dev_blocks[i];
+    info->low = start + low;
+    info->high = start + high;
+
+    if (i)
+        return simplefs_fsmap_data(sb, info);
+    ret = simplefs_fsmap_rec(sb, info, SIMPLEFS_SB_BLOCK_NR, 1,
+                             SIMPLEFS_FMR_OWN_SB);
+    if (!ret)
+        ret = simplefs_fsmap_rec(sb, info, 1, sbi->nr_istore_blocks,
+                                 SIMPLEFS_FMR_OWN_INODES);
+    if (!ret)
+        ret = simplefs_fsmap_rec(sb, info, simplefs_ifree_start(sbi),
+                                 sbi->nr_ifree_blocks, SIMPLEFS_FMR_OWN_IFREE);
+    if (!ret)
+        ret = simplefs_fsmap_rec(sb, info, simplefs_bfree_start(sbi),
+                                 sbi->nr_bfree_blocks, SIMPLEFS_FMR_OWN_BFREE);
+    if (!ret)
+        ret = simplefs_fsmap_data(sb, info);
+    return ret;
+}
+
+int simplefs_getfsmap(struct super_block *sb, struct fsmap_head __user *arg)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_fsmap_info info = {.arg = arg};
+    struct fsmap *keys = info.head.fmh_keys;
+    uint32_t devs[SIMPLEFS_MAX_DEVICES], order[SIMPLEFS_MAX_DEVICES];
+    uint32_t i, j, start;
+    int ret = 0;
+
+    if (copy_from_user(&info.head, arg, sizeof(info.head)))
+        return -EFAULT;
+    if (info.head.fmh_iflags & ~FMH_IF_VALID ||
+        memchr_inv(info.head.fmh_reserved, 0,
+                   sizeof(info.head.fmh_reserved)) ||
+        keys[0].fmr_device > keys[1].fmr_device ||
+        (keys[0].fmr_device == keys[1].fmr_device &&
+         keys[0].fmr_physical > keys[1].fmr_physical) ||
+        keys[0].fmr_physical + keys[0].fmr_length < keys[0].fmr_physical)
+        return -EINVAL;
+    info.head.fmh_entries = 0;
+    info.head.fmh_oflags = FMH_OF_DEV_T;
+
+    /* The devices sorted by number */
+    for (i = 0; i < sbi->nr_devices; i++) {
+        devs[i] = new_encode_dev(simplefs_stripe_member(sb, i, &start)->bd_dev);
+        for (j = i; j && devs[order[j - 1]] > devs[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    for (j = 0; j < sbi->nr_devices && !ret; j++) {
+        i = order[j];
+        if (devs[i] < keys[0].fmr_device)
+            continue;
+        if (devs[i] > keys[1].fmr_device)
+            break;
+        info.last = j == sbi->nr_devices - 1;
+        ret = simplefs_fsmap_dev(sb, &info, i, devs[i]);
+    }
+    if (ret < 0)
+        return ret;
+
+    if (copy_to_user(arg, &info.head, sizeof(info.head)))
+        return -EFAULT;
+    return 0;
+}
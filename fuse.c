@@ -0,0 +1,669 @@
+/* simplefs-fuse: mount a simplefs image in user space through libsimplefs,
+ * to benchmark and profile the on-disk format and its algorithms without
+ * the kernel module.
+ *
+ * libfuse runs the requests on several threads. Lookups, reads and
+ * directory listings share fs_lock; anything that changes the partition
+ * takes it exclusively. There is no journal: data and metadata are written
+ * in place, and the bitmaps and the superblock on fsync and at unmount.
+ */
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsimplefs.h"
+
+static struct sfs fs;
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Resolve @path to an inode, and its last component to its parent directory
+ * when @parent is set. Returns -ENOENT if a component does not exist.
+ */
+static int resolve(const char *path,
+                   uint32_t *ino,
+                   struct simplefs_inode *inode,
+                   uint32_t *parent,
+                   const char **name)
+{
+    char component[SIMPLEFS_FILENAME_LEN];
+    uint32_t cur = SIMPLEFS_ROOT_INO;
+    int ret = sfs_read_inode(&fs, cur, inode);
+
+    while (!ret) {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
+        size_t len = strcspn(path, "/");
+        if (len >= sizeof(component))
+            return -ENAMETOOLONG;
+        if (!S_ISDIR(inode->i_mode))
+            return -ENOTDIR;
+        memcpy(component, path, len);
+        component[len] = '\0';
+        if (parent) {
+            *parent = cur;
+            *name = path;
+        }
+        ret = sfs_dir_lookup(&fs, inode, component, &cur);
+        if (!ret)
+            ret = sfs_read_inode(&fs, cur, inode);
+        path += len;
+    }
+    *ino = cur;
+    return ret;
+}
+
+/* Split @path into its parent directory, which must exist, and the name it
+ * creates, which must not
+ */
+static int resolve_new(const char *path,
+                       uint32_t *dir_ino,
+                       struct simplefs_inode *dir,
+                       const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir_path = strndup(path, slash - path + 1);
+    uint32_t ino;
+    int ret;
+
+    if (!dir_path)
+        return -ENOMEM;
+    *name = slash + 1;
+    ret = resolve(dir_path, dir_ino, dir, NULL, NULL);
+    free(dir_path);
+    if (ret)
+        return ret;
+    if (!S_ISDIR(dir->i_mode))
+        return -ENOTDIR;
+    if (strlen(*name) >= SIMPLEFS_FILENAME_LEN)
+        return -ENAMETOOLONG;
+    ret = sfs_dir_lookup(&fs, dir, *name, &ino);
+    return ret == -ENOENT ? 0 : ret ? ret : -EEXIST;
+}
+
+/* Update the times of a directory whose entries changed, and its link count
+ * by @nlink
+ */
+static int touch_dir(uint32_t ino, struct simplefs_inode *dir, int nlink)
+{
+    dir->i_nlink += nlink;
+    dir->i_mtime = dir->i_ctime = time(NULL);
+    return sfs_write_inode(&fs, ino, dir);
+}
+
+static void fill_stat(uint32_t ino,
+                      const struct simplefs_inode *inode,
+                      struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    st->st_mode = inode->i_mode;
+    st->st_nlink = inode->i_nlink;
+    st->st_uid = inode->i_uid;
+    st->st_gid = inode->i_gid;
+    st->st_size = inode->i_size;
+    st->st_blksize = fs.block_size;
+    st->st_blocks = (blkcnt_t) inode->i_blocks * (fs.block_size / 512);
+    st->st_atime = inode->i_atime;
+    st->st_mtime = inode->i_mtime;
+    st->st_ctime = inode->i_ctime;
+}
+
+static void *sfs_fuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    (void) conn;
+    /* Inode numbers are stable: report them, and keep paths of open files
+     * resolvable by libfuse only
+     */
+    cfg->use_ino = 1;
+    cfg->nullpath_ok = 1;
+    return NULL;
+}
+
+static void sfs_fuse_destroy(void *data)
+{
+    (void) data;
+    sfs_sync(&fs);
+}
+
+static int sfs_fuse_getattr(const char *path,
+                            struct stat *st,
+                            struct fuse_file_info *fi)
+{
+    struct simplefs_inode inode;
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    if (fi) {
+        ino = fi->fh;
+        ret = sfs_read_inode(&fs, ino, &inode);
+    } else {
+        ret = resolve(path, &ino, &inode, NULL, NULL);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    if (!ret)
+        fill_stat(ino, &inode, st);
+    return ret;
+}
+
+static int sfs_fuse_readlink(const char *path, char *buf, size_t size)
+{
+    struct simplefs_inode inode;
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    ret = resolve(path, &ino, &inode, NULL, NULL);
+    pthread_rwlock_unlock(&fs_lock);
+    if (ret)
+        return ret;
+    if (!S_ISLNK(inode.i_mode))
+        return -EINVAL;
+    inode.i_data[sizeof(inode.i_data) - 1] = '\0';
+    snprintf(buf, size, "%s", inode.i_data);
+    return 0;
+}
+
+/* New inode @mode named @path, a symbolic link to @target if given */
+static int make_node(const char *path,
+                     mode_t mode,
+                     const char *target,
+                     uint32_t *new_ino)
+{
+    struct fuse_context *ctx = fuse_get_context();
+    struct simplefs_inode dir, inode;
+    uint32_t dir_ino, ino;
+    const char *name;
+    int ret;
+
+    if (target && strlen(target) >= sizeof(inode.i_data))
+        return -ENAMETOOLONG;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    ret = resolve_new(path, &dir_ino, &dir, &name);
+    if (ret)
+        goto unlock;
+    ret = sfs_new_inode(&fs, mode, &ino, &inode);
+    if (ret)
+        goto unlock;
+    inode.i_uid = ctx->uid;
+    inode.i_gid = ctx->gid;
+    if (target) {
+        strcpy(inode.i_data, target);
+        inode.i_size = strlen(target);
+    }
+    ret = sfs_write_inode(&fs, ino, &inode);
+    if (!ret)
+        ret = sfs_dir_add(&fs, &dir, name, ino);
+    if (ret) {
+        sfs_free_file(&fs, ino, &inode);
+        goto unlock;
+    }
+    ret = touch_dir(dir_ino, &dir, S_ISDIR(mode));
+    if (new_ino)
+        *new_ino = ino;
+unlock:
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static int sfs_fuse_mkdir(const char *path, mode_t mode)
+{
+    return make_node(path, S_IFDIR | (mode & 07777), NULL, NULL);
+}
+
+static int sfs_fuse_symlink(const char *target, const char *path)
+{
+    return make_node(path, S_IFLNK | 0777, target, NULL);
+}
+
+static int sfs_fuse_create(const char *path,
+                           mode_t mode,
+                           struct fuse_file_info *fi)
+{
+    uint32_t ino;
+    int ret = make_node(path, S_IFREG | (mode & 07777), NULL, &ino);
+
+    if (!ret)
+        fi->fh = ino;
+    return ret;
+}
+
+/* Remove the entry @path, and the inode with its last link. Directories must
+ * be empty. Called with fs_lock held exclusively.
+ */
+static int remove_entry(const char *path, int is_dir)
+{
+    struct simplefs_inode dir, inode;
+    uint32_t dir_ino, ino;
+    const char *name;
+    int ret;
+
+    ret = resolve(path, &ino, &inode, &dir_ino, &name);
+    if (ret)
+        return ret;
+    if (ino == SIMPLEFS_ROOT_INO)
+        return -EBUSY;
+    if (is_dir && !S_ISDIR(inode.i_mode))
+        return -ENOTDIR;
+    if (!is_dir && S_ISDIR(inode.i_mode))
+        return -EISDIR;
+    if (is_dir) {
+        struct simplefs_file_ei_block *index = malloc(fs.block_size);
+
+        ret = index ? sfs_read_meta(&fs, inode.ei_block, index) : -ENOMEM;
+        if (!ret && index->nr_files)
+            ret = -ENOTEMPTY;
+        free(index);
+        if (ret)
+            return ret;
+    }
+
+    ret = sfs_read_inode(&fs, dir_ino, &dir);
+    if (!ret)
+        ret = sfs_dir_remove(&fs, &dir, name, ino);
+    if (!ret)
+        ret = touch_dir(dir_ino, &dir, is_dir ? -1 : 0);
+    if (ret)
+        return ret;
+    if (is_dir || inode.i_nlink <= 1)
+        return sfs_free_file(&fs, ino, &inode);
+    inode.i_nlink--;
+    inode.i_ctime = time(NULL);
+    return sfs_write_inode(&fs, ino, &inode);
+}
+
+static int sfs_fuse_unlink(const char *path)
+{
+    int ret;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    ret = remove_entry(path, 0);
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static int sfs_fuse_rmdir(const char *path)
+{
+    int ret;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    ret = remove_entry(path, 1);
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static int sfs_fuse_rename(const char *from, const char *to, unsigned int flags)
+{
+    struct simplefs_inode old_dir, new_dir, inode, target;
+    uint32_t old_dir_ino, new_dir_ino, ino, target_ino;
+    const char *old_name, *new_name;
+    int ret;
+
+    /* as simplefs_rename() */
+    if (flags & ~RENAME_NOREPLACE)
+        return -EINVAL;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    ret = resolve(from, &ino, &inode, &old_dir_ino, &old_name);
+    if (ret)
+        goto unlock;
+    if (ino == SIMPLEFS_ROOT_INO) {
+        ret = -EBUSY;
+        goto unlock;
+    }
+    ret = resolve_new(to, &new_dir_ino, &new_dir, &new_name);
+    if (ret == -EEXIST && !(flags & RENAME_NOREPLACE)) {
+        /* Replace the target: an empty directory by a directory, or a
+         * non-directory by a non-directory
+         */
+        ret = resolve(to, &target_ino, &target, NULL, NULL);
+        if (ret)
+            goto unlock;
+        if (target_ino == ino)
+            goto unlock;
+        if (S_ISDIR(target.i_mode) != S_ISDIR(inode.i_mode)) {
+            ret = S_ISDIR(target.i_mode) ? -EISDIR : -ENOTDIR;
+            goto unlock;
+        }
+        ret = remove_entry(to, S_ISDIR(target.i_mode));
+        if (!ret)
+            ret = sfs_read_inode(&fs, new_dir_ino, &new_dir);
+    }
+    if (ret)
+        goto unlock;
+
+    /* Moving a directory into itself would detach it */
+    if (S_ISDIR(inode.i_mode) && !strncmp(to, from, strlen(from)) &&
+        to[strlen(from)] == '/') {
+        ret = -EINVAL;
+        goto unlock;
+    }
+
+    ret = sfs_dir_add(&fs, &new_dir, new_name, ino);
+    if (ret)
+        goto unlock;
+    ret = touch_dir(new_dir_ino, &new_dir, S_ISDIR(inode.i_mode));
+    if (!ret)
+        ret = sfs_read_inode(&fs, old_dir_ino, &old_dir);
+    if (!ret)
+        ret = sfs_dir_remove(&fs, &old_dir, old_name, ino);
+    if (!ret)
+        ret = touch_dir(old_dir_ino, &old_dir, -S_ISDIR(inode.i_mode));
+unlock:
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static int sfs_fuse_link(const char *from, const char *to)
+{
+    struct simplefs_inode dir, inode;
+    uint32_t dir_ino, ino;
+    const char *name;
+    int ret;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    ret = resolve(from, &ino, &inode, NULL, NULL);
+    if (!ret && S_ISDIR(inode.i_mode))
+        ret = -EPERM;
+    if (!ret)
+        ret = resolve_new(to, &dir_ino, &dir, &name);
+    if (!ret)
+        ret = sfs_dir_add(&fs, &dir, name, ino);
+    if (!ret)
+        ret = touch_dir(dir_ino, &dir, 0);
+    if (!ret) {
+        inode.i_nlink++;
+        inode.i_ctime = time(NULL);
+        ret = sfs_write_inode(&fs, ino, &inode);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+/* Read-modify-write of the inode of @path or @fi */
+static int update_inode(const char *path,
+                        struct fuse_file_info *fi,
+                        void (*update)(struct simplefs_inode *, const void *),
+                        const void *arg)
+{
+    struct simplefs_inode inode;
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    if (fi) {
+        ino = fi->fh;
+        ret = sfs_read_inode(&fs, ino, &inode);
+    } else {
+        ret = resolve(path, &ino, &inode, NULL, NULL);
+    }
+    if (!ret) {
+        update(&inode, arg);
+        inode.i_ctime = time(NULL);
+        ret = sfs_write_inode(&fs, ino, &inode);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static void set_mode(struct simplefs_inode *inode, const void *arg)
+{
+    inode->i_mode = (inode->i_mode & S_IFMT) | (*(const mode_t *) arg & 07777);
+}
+
+static int sfs_fuse_chmod(const char *path,
+                          mode_t mode,
+                          struct fuse_file_info *fi)
+{
+    return update_inode(path, fi, set_mode, &mode);
+}
+
+static void set_owner(struct simplefs_inode *inode, const void *arg)
+{
+    const uid_t *ids = arg;
+
+    if (ids[0] != (uid_t) -1)
+        inode->i_uid = ids[0];
+    if (ids[1] != (uid_t) -1)
+        inode->i_gid = ids[1];
+}
+
+static int sfs_fuse_chown(const char *path,
+                          uid_t uid,
+                          gid_t gid,
+                          struct fuse_file_info *fi)
+{
+    uid_t ids[2] = {uid, gid};
+
+    return update_inode(path, fi, set_owner, ids);
+}
+
+static void set_times(struct simplefs_inode *inode, const void *arg)
+{
+    const struct timespec *tv = arg;
+    time_t now = time(NULL);
+
+    if (tv[0].tv_nsec != UTIME_OMIT)
+        inode->i_atime = tv[0].tv_nsec == UTIME_NOW ? now : tv[0].tv_sec;
+    if (tv[1].tv_nsec != UTIME_OMIT)
+        inode->i_mtime = tv[1].tv_nsec == UTIME_NOW ? now : tv[1].tv_sec;
+}
+
+static int sfs_fuse_utimens(const char *path,
+                            const struct timespec tv[2],
+                            struct fuse_file_info *fi)
+{
+    return update_inode(path, fi, set_times, tv);
+}
+
+static int sfs_fuse_truncate(const char *path,
+                             off_t size,
+                             struct fuse_file_info *fi)
+{
+    struct simplefs_inode inode;
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_wrlock(&fs_lock);
+    if (fi) {
+        ino = fi->fh;
+        ret = sfs_read_inode(&fs, ino, &inode);
+    } else {
+        ret = resolve(path, &ino, &inode, NULL, NULL);
+    }
+    if (!ret)
+        ret = S_ISDIR(inode.i_mode) ? -EISDIR
+                                    : sfs_truncate(&fs, ino, &inode, size);
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static int sfs_fuse_open(const char *path, struct fuse_file_info *fi)
+{
+    struct simplefs_inode inode;
+    uint32_t ino;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs_lock);
+    ret = resolve(path, &ino, &inode, NULL, NULL);
+    pthread_rwlock_unlock(&fs_lock);
+    if (ret)
+        return ret;
+    if (S_ISDIR(inode.i_mode))
+        return -EISDIR;
+    fi->fh = ino;
+    if (fi->flags & O_TRUNC)
+        return sfs_fuse_truncate(NULL, 0, fi);
+    return 0;
+}
+
+static int sfs_fuse_read(const char *path,
+                         char *buf,
+                         size_t size,
+                         off_t off,
+                         struct fuse_file_info *fi)
+{
+    struct simplefs_inode inode;
+    ssize_t ret;
+
+    (void) path;
+    pthread_rwlock_rdlock(&fs_lock);
+    ret = sfs_read_inode(&fs, fi->fh, &inode);
+    if (!ret)
+        ret = sfs_file_read(&fs, &inode, buf, size, off);
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static int sfs_fuse_write(const char *path,
+                          const char *buf,
+                          size_t size,
+                          off_t off,
+                          struct fuse_file_info *fi)
+{
+    struct simplefs_inode inode;
+    ssize_t ret;
+
+    (void) path;
+    pthread_rwlock_wrlock(&fs_lock);
+    ret = sfs_read_inode(&fs, fi->fh, &inode);
+    if (!ret) {
+        if (fi->flags & O_APPEND)
+            off = inode.i_size;
+        ret = sfs_file_write(&fs, fi->fh, &inode, buf, size, off);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return ret;
+}
+
+static int sfs_fuse_statfs(const char *path, struct statvfs *st)
+{
+    (void) path;
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = st->f_frsize = fs.block_size;
+    st->f_blocks = fs.sbi.nr_blocks;
+    st->f_bfree = st->f_bavail = fs.sbi.nr_free_blocks;
+    st->f_files = fs.sbi.nr_inodes;
+    st->f_ffree = st->f_favail = fs.sbi.nr_free_inodes;
+    st->f_namemax = SIMPLEFS_FILENAME_LEN - 1;
+    return 0;
+}
+
+/* The bitmaps and the superblock are the only state not written in place */
+static int sfs_fuse_fsync(const char *path,
+                          int datasync,
+                          struct fuse_file_info *fi)
+{
+    (void) path;
+    (void) datasync;
+    (void) fi;
+    return sfs_sync(&fs);
+}
+
+struct readdir_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
+
+static int readdir_fill(void *ctx, const char *name, uint32_t ino)
+{
+    struct readdir_ctx *r = ctx;
+    struct stat st = {.st_ino = ino};
+
+    return r->filler(r->buf, name, &st, 0, 0) ? 1 : 0;
+}
+
+static int sfs_fuse_readdir(const char *path,
+                            void *buf,
+                            fuse_fill_dir_t filler,
+                            off_t off,
+                            struct fuse_file_info *fi,
+                            enum fuse_readdir_flags flags)
+{
+    struct readdir_ctx r = {.buf = buf, .filler = filler};
+    struct simplefs_inode dir;
+    uint32_t ino;
+    int ret;
+
+    (void) off;
+    (void) fi;
+    (void) flags;
+    pthread_rwlock_rdlock(&fs_lock);
+    ret = resolve(path, &ino, &dir, NULL, NULL);
+    if (!ret && !S_ISDIR(dir.i_mode))
+        ret = -ENOTDIR;
+    if (!ret) {
+        filler(buf, ".", NULL, 0, 0);
+        filler(buf, "..", NULL, 0, 0);
+        ret = sfs_dir_iterate(&fs, &dir, readdir_fill, &r);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return ret < 0 ? ret : 0;
+}
+
+static const struct fuse_operations sfs_fuse_ops = {
+    .init = sfs_fuse_init,
+    .destroy = sfs_fuse_destroy,
+    .getattr = sfs_fuse_getattr,
+    .readlink = sfs_fuse_readlink,
+    .mkdir = sfs_fuse_mkdir,
+    .symlink = sfs_fuse_symlink,
+    .create = sfs_fuse_create,
+    .unlink = sfs_fuse_unlink,
+    .rmdir = sfs_fuse_rmdir,
+    .rename = sfs_fuse_rename,
+    .link = sfs_fuse_link,
+    .chmod = sfs_fuse_chmod,
+    .chown = sfs_fuse_chown,
+    .utimens = sfs_fuse_utimens,
+    .truncate = sfs_fuse_truncate,
+    .open = sfs_fuse_open,
+    .read = sfs_fuse_read,
+    .write = sfs_fuse_write,
+    .statfs = sfs_fuse_statfs,
+    .fsync = sfs_fuse_fsync,
+    .readdir = sfs_fuse_readdir,
+};
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    if (argc < 3 || argv[1][0] == '-') {
+        fprintf(stderr,
+                "Usage: %s disk mountpoint [FUSE options]\n"
+                "\t-f  stay in the foreground\n"
+                "\t-s  single threaded\n"
+                "\t-o  mount options, e.g. -o clone_fd,max_threads=N\n",
+                argv[0]);
+        return 1;
+    }
+
+    ret = sfs_open(&fs, argv[1], 1);
+    if (ret) {
+        fprintf(stderr, "%s: %s%s\n", argv[1], strerror(-ret),
+                ret == -EUCLEAN ? " (mount it with the kernel module to "
+                                  "replay its journal, or run fsck)"
+                                : "");
+        return 1;
+    }
+
+    /* libfuse gets the arguments but the disk */
+    argv[1] = argv[0];
+    ret = fuse_main(argc - 1, argv + 1, &sfs_fuse_ops, NULL);
+    sfs_close(&fs);
+    return ret;
+}
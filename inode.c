@@ -27,8 +27,8 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
     struct simplefs_inode_info *ci = NULL;
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct buffer_head *bh = NULL;
-    uint32_t inode_block = (ino / SIMPLEFS_INODES_PER_BLOCK) + 1;
-    uint32_t inode_shift = ino % SIMPLEFS_INODES_PER_BLOCK;
+    uint32_t inode_block = (ino / simplefs_inodes_per_block(sb)) + 1;
+    uint32_t inode_shift = ino % simplefs_inodes_per_block(sb);
     int ret;
 
     /* Fail if ino is out of range */
@@ -46,7 +46,7 @@ struct inode *simplefs_iget(struct super_block *sb, unsigned long ino)
 
     ci = SIMPLEFS_INODE(inode);
     /* Read inode from disk and initialize */
-    bh = sb_bread(sb, inode_block);
+    bh = simplefs_bread(sb, inode_block);
     if (!bh) {
         ret = -EIO;
         goto failed;
@@ -134,19 +134,19 @@ static struct dentry *simplefs_lookup(struct inode *dir,
         return ERR_PTR(-ENAMETOOLONG);
 
     /* Read the directory block on disk */
-    bh = sb_bread(sb, ci_dir->ei_block);
+    bh = simplefs_bread(sb, ci_dir->ei_block);
     if (!bh)
         return ERR_PTR(-EIO);
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
 
     /* Search for the file in directory */
-    for (ei = 0; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
+    for (ei = 0; ei < simplefs_max_extents(sb); ei++) {
         if (!eblock->extents[ei].ee_start)
             break;
 
         /* Iterate blocks in extent */
         for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
-            bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+            bh2 = simplefs_bread(sb, eblock->extents[ei].ee_start + bi);
             if (!bh2) {
                 brelse(bh);
                 return ERR_PTR(-EIO);
@@ -192,6 +192,46 @@ search_end:
     return NULL;
 }
 
+/* Lazy itable: zero the inode store block holding @ino in the running handle
+ * if no inode of it was ever used, before @ino is read.
+ */
+int simplefs_init_itable_block(struct super_block *sb, uint32_t ino)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t block = ino / simplefs_inodes_per_block(sb) + 1;
+    handle_t *handle = sbi->journal ? journal_current_handle() : NULL;
+    struct buffer_head *bh;
+    int ret = 0;
+
+    if (!simplefs_has_lazy_itable(sb) || block < READ_ONCE(sbi->itable_init))
+        return 0;
+
+    mutex_lock(&sbi->itable_lock);
+    if (block < sbi->itable_init)
+        goto unlock;
+
+    /* Nothing worth reading: the block is garbage */
+    bh = sb_getblk(sb, block);
+    if (!bh) {
+        ret = -ENOMEM;
+        goto unlock;
+    }
+    ret = simplefs_journal_get_create_access(handle, bh);
+    if (!ret) {
+        lock_buffer(bh);
+        memset(bh->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        ret = simplefs_journal_dirty_metadata(handle, sb, bh);
+    }
+    brelse(bh);
+    if (!ret)
+        WRITE_ONCE(sbi->itable_init, block + 1);
+unlock:
+    mutex_unlock(&sbi->itable_lock);
+    return ret;
+}
+
 /* Find and construct a new inode.
  *
  * @dir: the inode of the parent directory where the new inode is supposed to
@@ -231,7 +271,7 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
         return ERR_PTR(-ENOSPC);
 
     /* Get a new free inode */
-    ino = get_free_inode(sbi);
+    ino = get_free_inode(sb);
     if (!ino)
         return ERR_PTR(-ENOSPC);
 
@@ -284,7 +324,7 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
     inode->i_blocks = 1;
     if (S_ISDIR(mode)) {
         ci->ei_block = bno;
-        inode->i_size = SIMPLEFS_BLOCK_SIZE;
+        inode->i_size = sb->s_blocksize;
         inode->i_fop = &simplefs_dir_ops;
         set_nlink(inode, 2); /* . and .. */
     } else if (S_ISREG(mode)) {
@@ -310,20 +350,21 @@ static struct inode *simplefs_new_inode(struct inode *dir, mode_t mode)
 put_inode:
     iput(inode);
 put_ino:
-    put_inode(sbi, ino);
+    put_inode(sb, ino);
 
     return ERR_PTR(ret);
 }
 
 static uint32_t simplefs_get_available_ext_idx(
+    struct super_block *sb,
     int *dir_nr_files,
     struct simplefs_file_ei_block *eblock)
 {
     int ei = 0;
     uint32_t first_empty_blk = -1;
-    for (ei = 0; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
+    for (ei = 0; ei < simplefs_max_extents(sb); ei++) {
         if (eblock->extents[ei].ee_start &&
-            eblock->extents[ei].nr_files != SIMPLEFS_FILES_PER_EXT) {
+            eblock->extents[ei].nr_files != simplefs_files_per_ext(sb)) {
             first_empty_blk = ei;
             break;
         } else if (!eblock->extents[ei].ee_start) {
@@ -340,16 +381,19 @@ static uint32_t simplefs_get_available_ext_idx(
     return first_empty_blk;
 }
 
-static int simplefs_put_new_ext(struct super_block *sb,
+static int simplefs_put_new_ext(handle_t *handle,
+                                struct super_block *sb,
                                 uint32_t ei,
                                 struct simplefs_file_ei_block *eblock)
 {
-    int bno, bi;
+    int bno, bi, ret;
     struct buffer_head *bh;
     struct simplefs_dir_block *dblock;
     bno = get_free_blocks(sb, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
     if (!bno)
         return -ENOSPC;
+    /* New directory blocks are not described by fast commits */
+    simplefs_fc_mark_ineligible(sb, handle);
 
     eblock->extents[ei].ee_start = bno;
     eblock->extents[ei].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
@@ -365,21 +409,30 @@ static int simplefs_put_new_ext(struct super_block *sb,
         if (!bh)
             return -EIO;
 
+        ret = simplefs_journal_get_create_access(handle, bh);
+        if (ret) {
+            brelse(bh);
+            return -EIO;
+        }
         dblock = (struct simplefs_dir_block *) bh->b_data;
-        memset(dblock, 0, sizeof(struct simplefs_dir_block));
-        dblock->files[0].nr_blk = SIMPLEFS_FILES_PER_BLOCK;
+        memset(dblock, 0, sb->s_blocksize);
+        dblock->files[0].nr_blk = simplefs_files_per_block(sb);
+        ret = simplefs_journal_dirty_metadata(handle, sb, bh);
         brelse(bh);
+        if (ret)
+            return -EIO;
     }
     return 0;
 }
 
-static void simplefs_set_file_into_dir(struct simplefs_dir_block *dblock,
+static void simplefs_set_file_into_dir(struct super_block *sb,
+                                       struct simplefs_dir_block *dblock,
                                        uint32_t inode_no,
                                        const char *name)
 {
     int fi = 0;
     if (dblock->nr_files != 0 && dblock->files[0].inode != 0) {
-        for (fi = 0; fi < SIMPLEFS_FILES_PER_BLOCK - 1; fi++) {
+        for (fi = 0; fi < simplefs_files_per_block(sb) - 1; fi++) {
             if (dblock->files[fi].nr_blk != 1)
                 break;
         }
@@ -401,6 +454,220 @@ static void simplefs_set_file_into_dir(struct simplefs_dir_block *dblock,
     dblock->nr_files++;
 }
 
+/* Clear entry @fi of @dblock, giving its slots to the entry before it */
+static void simplefs_clear_file_in_dir(struct simplefs_dir_block *dblock,
+                                       int fi)
+{
+    dblock->files[fi].inode = 0;
+    /* merge the empty data */
+    for (int i = fi - 1; i >= 0; i--) {
+        if (dblock->files[i].inode != 0 || i == 0) {
+            dblock->files[i].nr_blk += dblock->files[fi].nr_blk;
+            break;
+        }
+    }
+    dblock->nr_files--;
+}
+
+/* Fast commit replay: find the entry @name of @ino in the directory whose
+ * index block is @eblock. Returns 1 with the extent, the directory block and
+ * the entry in @ext, @bh and @pos, 0 if there is no such entry, or an error.
+ */
+static int simplefs_replay_find(struct super_block *sb,
+                                struct simplefs_file_ei_block *eblock,
+                                uint32_t ino,
+                                const char *name,
+                                int *ext,
+                                struct buffer_head **bh,
+                                int *pos)
+{
+    struct simplefs_dir_block *dblock;
+    int ei, bi, fi, blk_nr_files;
+
+    for (ei = 0; ei < simplefs_max_extents(sb); ei++) {
+        if (!eblock->extents[ei].ee_start)
+            break;
+        for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
+            *bh = simplefs_bread(sb, eblock->extents[ei].ee_start + bi);
+            if (!*bh)
+                return -EIO;
+            dblock = (struct simplefs_dir_block *) (*bh)->b_data;
+            blk_nr_files = dblock->nr_files;
+            for (fi = 0; blk_nr_files && fi < simplefs_files_per_block(sb) &&
+                         dblock->files[fi].nr_blk;
+                 fi += dblock->files[fi].nr_blk) {
+                if (!dblock->files[fi].inode)
+                    continue;
+                if (dblock->files[fi].inode == ino &&
+                    !strncmp(dblock->files[fi].filename, name,
+                             SIMPLEFS_FILENAME_LEN)) {
+                    *ext = ei;
+                    *pos = fi;
+                    return 1;
+                }
+                blk_nr_files--;
+            }
+            brelse(*bh);
+        }
+    }
+    *bh = NULL;
+    return 0;
+}
+
+/* Read the index block of the directory @dir at fast commit replay */
+static struct buffer_head *simplefs_replay_dir(struct super_block *sb,
+                                               uint32_t dir)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_inode *disk_inode;
+    struct buffer_head *bh;
+    uint32_t ei_block;
+
+    bh = simplefs_bread(sb, dir / simplefs_inodes_per_block(sb) + 1);
+    if (!bh)
+        return ERR_PTR(-EIO);
+    disk_inode = (struct simplefs_inode *) bh->b_data;
+    ei_block = disk_inode[dir % simplefs_inodes_per_block(sb)].ei_block;
+    brelse(bh);
+
+    if (!ei_block || ei_block >= sbi->nr_blocks)
+        return ERR_PTR(-EUCLEAN);
+    bh = simplefs_bread(sb, ei_block);
+    return bh ? bh : ERR_PTR(-EIO);
+}
+
+/* Fast commit replay of simplefs_create() for a regular file when @create is
+ * set: add @name to the directory @dir if it is not there yet and clear the
+ * index block of @ino. Without @create, replay of a link or of the new name of
+ * a rename, which only adds the entry. Runs at mount, before any inode is
+ * read, so it works on raw blocks.
+ */
+int simplefs_replay_dirent(struct super_block *sb,
+                           uint32_t dir,
+                           uint32_t ino,
+                           const char *name,
+                           bool create)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_inode *disk_inode;
+    struct simplefs_file_ei_block *eblock;
+    struct simplefs_dir_block *dblock;
+    struct buffer_head *bh, *bh2 = NULL;
+    uint32_t ei_block = 0, avail;
+    int dir_nr_files, ei, bi, fi, ret = 0;
+
+    if (dir >= sbi->nr_inodes || ino >= sbi->nr_inodes)
+        return -EUCLEAN;
+
+    if (create) {
+        bh = simplefs_bread(sb, ino / simplefs_inodes_per_block(sb) + 1);
+        if (!bh)
+            return -EIO;
+        disk_inode = (struct simplefs_inode *) bh->b_data;
+        ei_block = disk_inode[ino % simplefs_inodes_per_block(sb)].ei_block;
+        brelse(bh);
+        if (!ei_block || ei_block >= sbi->nr_blocks)
+            return -EUCLEAN;
+    }
+
+    bh = simplefs_replay_dir(sb, dir);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
+    eblock = (struct simplefs_file_ei_block *) bh->b_data;
+
+    /* Already replayed, e.g. by a mount interrupted during replay */
+    ret = simplefs_replay_find(sb, eblock, ino, name, &ei, &bh2, &fi);
+    if (ret) {
+        brelse(bh2);
+        ret = ret < 0 ? ret : 0;
+        goto release;
+    }
+
+    /* Logged entries never allocate directory blocks */
+    dir_nr_files = eblock->nr_files;
+    avail = simplefs_get_available_ext_idx(sb, &dir_nr_files, eblock);
+    if (eblock->nr_files == simplefs_max_subfiles(sb) ||
+        avail >= simplefs_max_extents(sb) || !eblock->extents[avail].ee_start) {
+        ret = -EUCLEAN;
+        goto release;
+    }
+
+    for (bi = 0; bi < eblock->extents[avail].ee_len; bi++) {
+        bh2 = simplefs_bread(sb, eblock->extents[avail].ee_start + bi);
+        if (!bh2) {
+            ret = -EIO;
+            goto release;
+        }
+        dblock = (struct simplefs_dir_block *) bh2->b_data;
+        if (dblock->nr_files != simplefs_files_per_block(sb))
+            break;
+        brelse(bh2);
+        bh2 = NULL;
+    }
+    if (!bh2) {
+        ret = -EUCLEAN;
+        goto release;
+    }
+
+    simplefs_set_file_into_dir(sb, dblock, ino, name);
+    eblock->extents[avail].nr_files++;
+    eblock->nr_files++;
+    simplefs_journal_dirty_metadata(NULL, sb, bh2);
+    simplefs_journal_dirty_metadata(NULL, sb, bh);
+    brelse(bh2);
+
+    if (!create)
+        goto release;
+    bh2 = sb_bread(sb, ei_block);
+    if (!bh2) {
+        ret = -EIO;
+        goto release;
+    }
+    memset(bh2->b_data, 0, sb->s_blocksize);
+    simplefs_journal_dirty_metadata(NULL, sb, bh2);
+    brelse(bh2);
+
+release:
+    brelse(bh);
+    return ret;
+}
+
+/* Fast commit replay of the removal of @name, an entry of @ino, from the
+ * directory @dir by unlink or rename, if not replayed yet.
+ */
+int simplefs_replay_unlink(struct super_block *sb,
+                           uint32_t dir,
+                           uint32_t ino,
+                           const char *name)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_file_ei_block *eblock;
+    struct buffer_head *bh, *bh2;
+    int ei, fi, ret;
+
+    if (dir >= sbi->nr_inodes || ino >= sbi->nr_inodes)
+        return -EUCLEAN;
+
+    bh = simplefs_replay_dir(sb, dir);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
+    eblock = (struct simplefs_file_ei_block *) bh->b_data;
+
+    ret = simplefs_replay_find(sb, eblock, ino, name, &ei, &bh2, &fi);
+    if (ret > 0) {
+        simplefs_clear_file_in_dir(
+            (struct simplefs_dir_block *) bh2->b_data, fi);
+        eblock->extents[ei].nr_files--;
+        eblock->nr_files--;
+        simplefs_journal_dirty_metadata(NULL, sb, bh2);
+        simplefs_journal_dirty_metadata(NULL, sb, bh);
+        brelse(bh2);
+        ret = 0;
+    }
+    brelse(bh);
+    return ret;
+}
+
 /* Create a file or directory in this way:
  *   - check filename length and if the parent directory is not full
  *   - create the new inode (allocate inode and blocks)
@@ -433,6 +700,7 @@ static int simplefs_create(struct inode *dir,
     struct simplefs_dir_block *dblock;
     char *fblock;
     struct buffer_head *bh, *bh2;
+    handle_t *handle;
     uint32_t dir_nr_files = 0, avail;
 #if SIMPLEFS_AT_LEAST(6, 6, 0) && SIMPLEFS_LESS_EQUAL(6, 7, 0)
     struct timespec64 cur_time;
@@ -447,17 +715,27 @@ static int simplefs_create(struct inode *dir,
     /* Read parent directory index */
     ci_dir = SIMPLEFS_INODE(dir);
     sb = dir->i_sb;
-    bh = sb_bread(sb, ci_dir->ei_block);
-    if (!bh)
-        return -EIO;
+    handle = simplefs_journal_start(sb, SIMPLEFS_CREATE_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
+    bh = simplefs_bread(sb, ci_dir->ei_block);
+    if (!bh) {
+        ret = -EIO;
+        goto stop;
+    }
 
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
     /* Check if parent directory is full */
-    if (eblock->nr_files == SIMPLEFS_MAX_SUBFILES) {
+    if (eblock->nr_files == simplefs_max_subfiles(sb)) {
         ret = -EMLINK;
         goto end;
     }
 
+    ret = simplefs_journal_get_write_access(handle, bh);
+    if (ret)
+        goto end;
+
     /* Get a new free inode */
     inode = simplefs_new_inode(dir, mode);
     if (IS_ERR(inode)) {
@@ -473,23 +751,30 @@ static int simplefs_create(struct inode *dir,
         ret = -EIO;
         goto iput;
     }
+    ret = simplefs_journal_get_create_access(handle, bh2);
+    if (ret) {
+        brelse(bh2);
+        goto iput;
+    }
     fblock = (char *) bh2->b_data;
-    memset(fblock, 0, SIMPLEFS_BLOCK_SIZE);
-    mark_buffer_dirty(bh2);
+    memset(fblock, 0, sb->s_blocksize);
+    ret = simplefs_journal_dirty_metadata(handle, sb, bh2);
     brelse(bh2);
+    if (ret)
+        goto iput;
 
     dir_nr_files = eblock->nr_files;
-    avail = simplefs_get_available_ext_idx(&dir_nr_files, eblock);
+    avail = simplefs_get_available_ext_idx(sb, &dir_nr_files, eblock);
 
     /* Validate avail index is within bounds */
-    if (avail >= SIMPLEFS_MAX_EXTENTS) {
+    if (avail >= simplefs_max_extents(sb)) {
         ret = -EMLINK;
         goto iput;
     }
 
     /* if there is not any empty space, alloc new one */
     if (!dir_nr_files && !eblock->extents[avail].ee_start) {
-        ret = simplefs_put_new_ext(sb, avail, eblock);
+        ret = simplefs_put_new_ext(handle, sb, avail, eblock);
         switch (ret) {
         case -ENOSPC:
             ret = -ENOSPC;
@@ -504,31 +789,43 @@ static int simplefs_create(struct inode *dir,
     /* TODO: fix from 8 to dynamic value */
     /* Find which simplefs_dir_block has free space */
     for (bi = 0; bi < eblock->extents[avail].ee_len; bi++) {
-        bh2 = sb_bread(sb, eblock->extents[avail].ee_start + bi);
+        bh2 = simplefs_bread(sb, eblock->extents[avail].ee_start + bi);
         if (!bh2) {
             ret = -EIO;
             goto put_block;
         }
         dblock = (struct simplefs_dir_block *) bh2->b_data;
-        if (dblock->nr_files != SIMPLEFS_FILES_PER_BLOCK)
+        if (dblock->nr_files != simplefs_files_per_block(sb))
             break;
         else
             brelse(bh2);
     }
 
+    ret = simplefs_journal_get_write_access(handle, bh2);
+    if (ret) {
+        brelse(bh2);
+        goto put_block;
+    }
+
     /* write the file info into simplefs_dir_block */
-    simplefs_set_file_into_dir(dblock, inode->i_ino, dentry->d_name.name);
+    simplefs_set_file_into_dir(sb, dblock, inode->i_ino, dentry->d_name.name);
 
     eblock->extents[avail].nr_files++;
     eblock->nr_files++;
-    mark_buffer_dirty(bh2);
-    mark_buffer_dirty(bh);
+    simplefs_journal_dirty_metadata(handle, sb, bh2);
+    simplefs_journal_dirty_metadata(handle, sb, bh);
     brelse(bh2);
     brelse(bh);
 
     /* Update stats and mark dir and new inode dirty */
     mark_inode_dirty(inode);
 
+    /* A new directory comes with blocks of its own, only log files */
+    if (S_ISREG(mode))
+        simplefs_fc_log_dirent(handle, dir, inode->i_ino, dentry->d_name.name);
+    else
+        simplefs_fc_mark_ineligible(sb, handle);
+
 #if SIMPLEFS_AT_LEAST(6, 7, 0)
     simple_inode_init_ts(dir);
 #elif SIMPLEFS_AT_LEAST(6, 6, 0)
@@ -546,24 +843,28 @@ static int simplefs_create(struct inode *dir,
     /* setup dentry */
     d_instantiate(dentry, inode);
 
-    return 0;
+    return simplefs_journal_stop(handle);
 
 put_block:
     if (alloc && eblock->extents[avail].ee_start) {
-        put_blocks(SIMPLEFS_SB(sb), eblock->extents[avail].ee_start,
+        put_blocks(sb, eblock->extents[avail].ee_start,
                    eblock->extents[avail].ee_len);
         memset(&eblock->extents[avail], 0, sizeof(struct simplefs_extent));
     }
 iput:
-    put_blocks(SIMPLEFS_SB(sb), SIMPLEFS_INODE(inode)->ei_block, 1);
-    put_inode(SIMPLEFS_SB(sb), inode->i_ino);
+    put_blocks(sb, SIMPLEFS_INODE(inode)->ei_block, 1);
+    put_inode(sb, inode->i_ino);
     iput(inode);
 end:
     brelse(bh);
+stop:
+    simplefs_journal_stop(handle);
     return ret;
 }
 
-static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
+static int simplefs_remove_from_dir(handle_t *handle,
+                                    struct inode *dir,
+                                    struct dentry *dentry)
 {
     struct super_block *sb = dir->i_sb;
     struct inode *inode = d_inode(dentry);
@@ -574,7 +875,7 @@ static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
     int ret = 0, found = false;
 
     /* Read parent directory index */
-    bh = sb_bread(sb, SIMPLEFS_INODE(dir)->ei_block);
+    bh = simplefs_bread(sb, SIMPLEFS_INODE(dir)->ei_block);
     if (!bh)
         return -EIO;
 
@@ -585,32 +886,33 @@ static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
         if (eblock->extents[ei].ee_start) {
             dir_nr_files -= eblock->extents[ei].nr_files;
             for (bi = 0; bi < eblock->extents[ei].ee_len; bi++) {
-                bh2 = sb_bread(sb, eblock->extents[ei].ee_start + bi);
+                bh2 = simplefs_bread(sb, eblock->extents[ei].ee_start + bi);
                 if (!bh2) {
                     ret = -EIO;
                     goto release_bh;
                 }
                 dirblk = (struct simplefs_dir_block *) bh2->b_data;
                 int blk_nr_files = dirblk->nr_files;
-                for (fi = 0; blk_nr_files && fi < SIMPLEFS_FILES_PER_BLOCK;) {
+                for (fi = 0;
+                     blk_nr_files && fi < simplefs_files_per_block(sb);) {
                     if (dirblk->files[fi].inode) {
                         if (dirblk->files[fi].inode == inode->i_ino &&
                             !strcmp(dirblk->files[fi].filename,
                                     dentry->d_name.name)) {
-                            found = true;
-                            dirblk->files[fi].inode = 0;
-                            /* merge the empty data */
-                            for (int i = fi - 1; i >= 0; i--) {
-                                if (dirblk->files[i].inode != 0 || i == 0) {
-                                    dirblk->files[i].nr_blk +=
-                                        dirblk->files[fi].nr_blk;
-                                    break;
-                                }
+                            ret = simplefs_journal_get_write_access(handle,
+                                                                    bh2);
+                            if (!ret)
+                                ret = simplefs_journal_get_write_access(handle,
+                                                                        bh);
+                            if (ret) {
+                                brelse(bh2);
+                                goto release_bh;
                             }
-                            dirblk->nr_files--;
+                            found = true;
+                            simplefs_clear_file_in_dir(dirblk, fi);
                             eblock->extents[ei].nr_files--;
                             eblock->nr_files--;
-                            mark_buffer_dirty(bh2);
+                            simplefs_journal_dirty_metadata(handle, sb, bh2);
                             brelse(bh2);
                             found = true;
                             goto found_data;
@@ -625,7 +927,7 @@ static int simplefs_remove_from_dir(struct inode *dir, struct dentry *dentry)
     }
 found_data:
     if (found) {
-        mark_buffer_dirty(bh);
+        simplefs_journal_dirty_metadata(handle, sb, bh);
     }
 release_bh:
     brelse(bh);
@@ -647,18 +949,25 @@ static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
     struct buffer_head *bh = NULL, *bh2 = NULL;
     struct simplefs_file_ei_block *file_block = NULL;
     char *block;
+    handle_t *handle;
 #if SIMPLEFS_AT_LEAST(6, 6, 0) && SIMPLEFS_LESS_EQUAL(6, 7, 0)
     struct timespec64 cur_time;
 #endif
     int ei = 0, bi = 0;
-    int ret = 0;
+    int ret = 0, err;
 
     uint32_t ino = inode->i_ino;
-    uint32_t bno = 0;
+    uint32_t bno = 0, len;
+
+    handle = simplefs_journal_start_revoke(sb, SIMPLEFS_UNLINK_CREDITS(sb),
+                                           SIMPLEFS_UNLINK_REVOKES(sb));
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
 
-    ret = simplefs_remove_from_dir(dir, dentry);
+    ret = simplefs_remove_from_dir(handle, dir, dentry);
     if (ret != 0)
-        return ret;
+        goto stop;
+    simplefs_fc_log_unlink(handle, dir, ino, dentry->d_name.name);
 
     if (S_ISLNK(inode->i_mode))
         goto clean_inode;
@@ -682,46 +991,91 @@ static int simplefs_unlink(struct inode *dir, struct dentry *dentry)
 
     if (inode->i_nlink > 1) {
         inode_dec_link_count(inode);
-        return ret;
+        goto stop;
+    }
+
+    /* Drop the cached data first, once the committing transaction is done
+     * writing it.
+     */
+    if (S_ISREG(inode->i_mode)) {
+        simplefs_journal_begin_truncate(inode, 0);
+        truncate_inode_pages(&inode->i_data, 0);
     }
 
     /* Cleans up pointed blocks when unlinking a file. If reading the index
      * block fails, the inode is cleaned up regardless, resulting in the
-     * permanent loss of this file's blocks. If scrubbing a data block fails,
-     * do not terminate the operation (as it is already too late); instead,
-     * release the block and proceed.
+     * permanent loss of this file's blocks. If scrubbing a data block or
+     * releasing an extent fails, do not terminate the operation (as it is
+     * already too late); instead, proceed and return the error.
      */
     bno = SIMPLEFS_INODE(inode)->ei_block;
-    bh = sb_bread(sb, bno);
+    bh = simplefs_bread(sb, bno);
     if (!bh)
         goto clean_inode;
     file_block = (struct simplefs_file_ei_block *) bh->b_data;
 
-    for (ei = 0; ei < SIMPLEFS_MAX_EXTENTS; ei++) {
+    for (ei = 0; ei < simplefs_max_extents(sb); ei++) {
         if (!file_block->extents[ei].ee_start)
             break;
 
-        put_blocks(sbi, file_block->extents[ei].ee_start,
-                   file_block->extents[ei].ee_len);
-
-        /* Scrub the extent */
-        for (bi = 0; bi < file_block->extents[ei].ee_len; bi++) {
-            bh2 = sb_bread(sb, file_block->extents[ei].ee_start + bi);
-            if (!bh2)
-                continue;
-            block = (char *) bh2->b_data;
-            memset(block, 0, SIMPLEFS_BLOCK_SIZE);
-            mark_buffer_dirty(bh2);
-            brelse(bh2);
+        /* Compressed extents of regular files take ee_clen blocks */
+        len = S_ISDIR(inode->i_mode)
+                  ? file_block->extents[ei].ee_len
+                  : simplefs_ext_blocks(&file_block->extents[ei]);
+        /* Without a journal, scrub the extent before it can be reused.
+         * Journaled partitions leave their blocks alone, as a scrub could
+         * reach the disk before the unlink commits: blocks are zeroed when
+         * allocated again. Shared extents keep their data for the other
+         * files, and blocks of the other devices of a striped partition are
+         * only zeroed when allocated again.
+         */
+        if (!handle &&
+            file_block->extents[ei].ee_start < sbi->dev_blocks[0] &&
+            !simplefs_refcount_shared(sb, file_block->extents[ei].ee_start)) {
+            for (bi = 0; bi < len; bi++) {
+                bh2 = sb_bread(sb, file_block->extents[ei].ee_start + bi);
+                if (!bh2)
+                    continue;
+                block = (char *) bh2->b_data;
+                memset(block, 0, sb->s_blocksize);
+                mark_buffer_dirty(bh2);
+                brelse(bh2);
+            }
+        }
+
+        /* Directory blocks are metadata: revoke them, so that replaying an
+         * older transaction never lands over reused blocks.
+         */
+        if (handle && S_ISDIR(inode->i_mode)) {
+            err = simplefs_journal_revoke(handle, sb,
+                                          file_block->extents[ei].ee_start,
+                                          file_block->extents[ei].ee_len);
+            if (err)
+                ret = err;
         }
+
+        err = put_blocks(sb, file_block->extents[ei].ee_start, len);
+        if (err)
+            ret = err;
     }
 
-    /* Scrub index block */
-    memset(file_block, 0, SIMPLEFS_BLOCK_SIZE);
-    mark_buffer_dirty(bh);
-    brelse(bh);
+    /* Scrub index block, or revoke it on a journaled partition */
+    if (handle) {
+        brelse(bh);
+        simplefs_journal_revoke(handle, sb, bno, 1);
+    } else {
+        memset(file_block, 0, sb->s_blocksize);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
 
 clean_inode:
+    /* Directory blocks and extent refcounts are not described by the log */
+    if (S_ISDIR(inode->i_mode) || sbi->refcount)
+        simplefs_fc_mark_ineligible(sb, handle);
+    else
+        simplefs_fc_log_free(handle, inode);
+
     /* Cleanup inode and mark dirty */
     inode->i_blocks = 0;
     SIMPLEFS_INODE(inode)->ei_block = 0;
@@ -743,11 +1097,19 @@ clean_inode:
     inode_dec_link_count(inode);
 
     /* Free inode and index block from bitmap */
-    if (!S_ISLNK(inode->i_mode))
-        put_blocks(sbi, bno, 1);
+    if (!S_ISLNK(inode->i_mode)) {
+        err = put_blocks(sb, bno, 1);
+        if (err)
+            ret = err;
+    }
     inode->i_mode = 0;
-    put_inode(sbi, ino);
+    mark_inode_dirty(inode);
+    err = put_inode(sb, ino);
+    if (err)
+        ret = err;
 
+stop:
+    simplefs_journal_stop(handle);
     return ret;
 }
 
@@ -779,6 +1141,7 @@ static int simplefs_rename(struct inode *old_dir,
     struct buffer_head *bh_new = NULL, *bh2 = NULL;
     struct simplefs_file_ei_block *eblock_new = NULL;
     struct simplefs_dir_block *dblock = NULL;
+    handle_t *handle;
 
 #if SIMPLEFS_AT_LEAST(6, 6, 0) && SIMPLEFS_LESS_EQUAL(6, 7, 0)
     struct timespec64 cur_time;
@@ -795,18 +1158,26 @@ static int simplefs_rename(struct inode *old_dir,
     if (strlen(new_dentry->d_name.name) > SIMPLEFS_FILENAME_LEN)
         return -ENAMETOOLONG;
 
+    /* new directory entry, old one removed, both parents */
+    handle = simplefs_journal_start(
+        sb, 2 * SIMPLEFS_DIRENT_CREDITS + 2 * SIMPLEFS_INODE_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
     /* Fail if new_dentry exists or if new_dir is full */
-    bh_new = sb_bread(sb, ci_new->ei_block);
-    if (!bh_new)
-        return -EIO;
+    bh_new = simplefs_bread(sb, ci_new->ei_block);
+    if (!bh_new) {
+        ret = -EIO;
+        goto stop;
+    }
 
     eblock_new = (struct simplefs_file_ei_block *) bh_new->b_data;
-    for (ei = 0; new_pos < 0 && ei < SIMPLEFS_MAX_EXTENTS; ei++) {
+    for (ei = 0; new_pos < 0 && ei < simplefs_max_extents(sb); ei++) {
         if (!eblock_new->extents[ei].ee_start)
             break;
 
         for (bi = 0; new_pos < 0 && bi < eblock_new->extents[ei].ee_len; bi++) {
-            bh2 = sb_bread(sb, eblock_new->extents[ei].ee_start + bi);
+            bh2 = simplefs_bread(sb, eblock_new->extents[ei].ee_start + bi);
             if (!bh2) {
                 ret = -EIO;
                 goto release_new;
@@ -821,9 +1192,17 @@ static int simplefs_rename(struct inode *old_dir,
                         !strncmp(dblock->files[fi].filename,
                                  old_dentry->d_name.name,
                                  SIMPLEFS_FILENAME_LEN)) {
-                        strncpy(dblock->files[fi].filename,
-                                new_dentry->d_name.name, SIMPLEFS_FILENAME_LEN);
-                        mark_buffer_dirty(bh2);
+                        ret = simplefs_journal_get_write_access(handle, bh2);
+                        if (!ret) {
+                            strncpy(dblock->files[fi].filename,
+                                    new_dentry->d_name.name,
+                                    SIMPLEFS_FILENAME_LEN);
+                            simplefs_journal_dirty_metadata(handle, sb, bh2);
+                            simplefs_fc_log_unlink(handle, old_dir, src->i_ino,
+                                                   old_dentry->d_name.name);
+                            simplefs_fc_log_link(handle, new_dir, src->i_ino,
+                                                 new_dentry->d_name.name);
+                        }
                         brelse(bh2);
                         goto release_new;
                     }
@@ -852,7 +1231,7 @@ static int simplefs_rename(struct inode *old_dir,
     }
 
     /* If new directory is full, fail */
-    if (new_pos < 0 && eblock_new->nr_files == SIMPLEFS_FILES_PER_EXT) {
+    if (new_pos < 0 && eblock_new->nr_files == simplefs_files_per_ext(sb)) {
         ret = -EMLINK;
         goto release_new;
     }
@@ -860,6 +1239,10 @@ static int simplefs_rename(struct inode *old_dir,
     /* insert in new parent directory */
     /* Get new freeblocks for extent if needed*/
     if (new_pos < 0) {
+        ret = simplefs_journal_get_write_access(handle, bh_new);
+        if (ret)
+            goto release_new;
+        simplefs_fc_mark_ineligible(sb, handle);
         bno = get_free_blocks(sb, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
         if (!bno) {
             ret = -ENOSPC;
@@ -871,19 +1254,24 @@ static int simplefs_rename(struct inode *old_dir,
             ei ? eblock_new->extents[ei - 1].ee_block +
                      eblock_new->extents[ei - 1].ee_len
                : 0;
-        bh2 = sb_bread(sb, eblock_new->extents[ei].ee_start + 0);
+        bh2 = simplefs_bread(sb, eblock_new->extents[ei].ee_start + 0);
         if (!bh2) {
             ret = -EIO;
             goto put_block;
         }
         dblock = (struct simplefs_dir_block *) bh2->b_data;
-        mark_buffer_dirty(bh_new);
+        simplefs_journal_dirty_metadata(handle, sb, bh_new);
         new_pos = 0;
     }
+    ret = simplefs_journal_get_write_access(handle, bh2);
+    if (ret) {
+        brelse(bh2);
+        goto put_block;
+    }
     dblock->files[new_pos].inode = src->i_ino;
     strncpy(dblock->files[new_pos].filename, new_dentry->d_name.name,
             SIMPLEFS_FILENAME_LEN);
-    mark_buffer_dirty(bh2);
+    simplefs_journal_dirty_metadata(handle, sb, bh2);
     brelse(bh2);
 
     /* Update new parent inode metadata */
@@ -903,9 +1291,12 @@ static int simplefs_rename(struct inode *old_dir,
     mark_inode_dirty(new_dir);
 
     /* remove target from old parent directory */
-    ret = simplefs_remove_from_dir(old_dir, old_dentry);
+    ret = simplefs_remove_from_dir(handle, old_dir, old_dentry);
     if (ret != 0)
         goto release_new;
+    simplefs_fc_log_unlink(handle, old_dir, src->i_ino,
+                           old_dentry->d_name.name);
+    simplefs_fc_log_link(handle, new_dir, src->i_ino, new_dentry->d_name.name);
 
         /* Update old parent inode metadata */
 #if SIMPLEFS_AT_LEAST(6, 7, 0)
@@ -923,16 +1314,19 @@ static int simplefs_rename(struct inode *old_dir,
         drop_nlink(old_dir);
     mark_inode_dirty(old_dir);
 
-    return ret;
+    brelse(bh_new);
+    return simplefs_journal_stop(handle);
 
 put_block:
-    if (eblock_new->extents[ei].ee_start) {
-        put_blocks(SIMPLEFS_SB(sb), eblock_new->extents[ei].ee_start,
+    if (bno && eblock_new->extents[ei].ee_start) {
+        put_blocks(sb, eblock_new->extents[ei].ee_start,
                    eblock_new->extents[ei].ee_len);
         memset(&eblock_new->extents[ei], 0, sizeof(struct simplefs_extent));
     }
 release_new:
     brelse(bh_new);
+stop:
+    simplefs_journal_stop(handle);
     return ret;
 }
 
@@ -981,7 +1375,7 @@ static int simplefs_rmdir(struct inode *dir, struct dentry *dentry)
     if (inode->i_nlink > 2)
         return -ENOTEMPTY;
 
-    bh = sb_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
+    bh = simplefs_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
     if (!bh)
         return -EIO;
 
@@ -1006,33 +1400,45 @@ static int simplefs_link(struct dentry *old_dentry,
     struct simplefs_file_ei_block *eblock = NULL;
     struct simplefs_dir_block *dblock;
     struct buffer_head *bh = NULL, *bh2 = NULL;
+    handle_t *handle;
     int ret = 0, alloc = false;
-    int ei = 0, bi = 0;
+    int bi = 0;
     uint32_t avail;
 
-    bh = sb_bread(sb, ci_dir->ei_block);
-    if (!bh)
-        return -EIO;
+    handle = simplefs_journal_start(
+        sb, SIMPLEFS_DIRENT_CREDITS + 2 * SIMPLEFS_INODE_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
+    bh = simplefs_bread(sb, ci_dir->ei_block);
+    if (!bh) {
+        ret = -EIO;
+        goto stop;
+    }
 
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
-    if (eblock->nr_files == SIMPLEFS_MAX_SUBFILES) {
+    if (eblock->nr_files == simplefs_max_subfiles(sb)) {
         ret = -EMLINK;
         printk(KERN_INFO "directory is full");
         goto end;
     }
 
+    ret = simplefs_journal_get_write_access(handle, bh);
+    if (ret)
+        goto end;
+
     int dir_nr_files = eblock->nr_files;
-    avail = simplefs_get_available_ext_idx(&dir_nr_files, eblock);
+    avail = simplefs_get_available_ext_idx(sb, &dir_nr_files, eblock);
 
     /* Validate avail index is within bounds */
-    if (avail >= SIMPLEFS_MAX_EXTENTS) {
+    if (avail >= simplefs_max_extents(sb)) {
         ret = -EMLINK;
         goto end;
     }
 
     /* if there is not any empty space, alloc new one */
     if (!dir_nr_files && !eblock->extents[avail].ee_start) {
-        ret = simplefs_put_new_ext(sb, avail, eblock);
+        ret = simplefs_put_new_ext(handle, sb, avail, eblock);
         switch (ret) {
         case -ENOSPC:
             ret = -ENOSPC;
@@ -1047,41 +1453,55 @@ static int simplefs_link(struct dentry *old_dentry,
     /* TODO: fix from 8 to dynamic value */
     /* Find which simplefs_dir_block has free space */
     for (bi = 0; bi < eblock->extents[avail].ee_len; bi++) {
-        bh2 = sb_bread(sb, eblock->extents[avail].ee_start + bi);
+        bh2 = simplefs_bread(sb, eblock->extents[avail].ee_start + bi);
         if (!bh2) {
             ret = -EIO;
             goto put_block;
         }
         dblock = (struct simplefs_dir_block *) bh2->b_data;
-        if (dblock->nr_files != SIMPLEFS_FILES_PER_BLOCK)
+        if (dblock->nr_files != simplefs_files_per_block(sb))
             break;
         else
             brelse(bh2);
     }
 
+    ret = simplefs_journal_get_write_access(handle, bh2);
+    if (ret) {
+        brelse(bh2);
+        goto put_block;
+    }
+
     /* write the file info into simplefs_dir_block */
-    simplefs_set_file_into_dir(dblock, old_inode->i_ino, dentry->d_name.name);
+    simplefs_set_file_into_dir(sb, dblock, old_inode->i_ino,
+                               dentry->d_name.name);
+    if (alloc)
+        simplefs_fc_mark_ineligible(sb, handle);
+    else
+        simplefs_fc_log_link(handle, dir, old_inode->i_ino,
+                             dentry->d_name.name);
 
     eblock->extents[avail].nr_files++;
     eblock->nr_files++;
-    mark_buffer_dirty(bh2);
-    mark_buffer_dirty(bh);
+    simplefs_journal_dirty_metadata(handle, sb, bh2);
+    simplefs_journal_dirty_metadata(handle, sb, bh);
     brelse(bh2);
     brelse(bh);
 
     inode_inc_link_count(old_inode);
     ihold(old_inode);
     d_instantiate(dentry, old_inode);
-    return ret;
+    return simplefs_journal_stop(handle);
 
 put_block:
-    if (alloc && eblock->extents[ei].ee_start) {
-        put_blocks(SIMPLEFS_SB(sb), eblock->extents[ei].ee_start,
-                   eblock->extents[ei].ee_len);
-        memset(&eblock->extents[ei], 0, sizeof(struct simplefs_extent));
+    if (alloc && eblock->extents[avail].ee_start) {
+        put_blocks(sb, eblock->extents[avail].ee_start,
+                   eblock->extents[avail].ee_len);
+        memset(&eblock->extents[avail], 0, sizeof(struct simplefs_extent));
     }
 end:
     brelse(bh);
+stop:
+    simplefs_journal_stop(handle);
     return ret;
 }
 
@@ -1103,16 +1523,29 @@ static int simplefs_symlink(struct inode *dir,
 {
     struct super_block *sb = dir->i_sb;
     unsigned int l = strlen(symname) + 1;
-    struct inode *inode = simplefs_new_inode(dir, S_IFLNK | S_IRWXUGO);
-    struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
+    struct inode *inode;
+    struct simplefs_inode_info *ci;
     struct simplefs_inode_info *ci_dir = SIMPLEFS_INODE(dir);
     struct simplefs_file_ei_block *eblock = NULL;
     struct simplefs_dir_block *dblock = NULL;
     struct buffer_head *bh = NULL, *bh2 = NULL;
+    handle_t *handle;
     int ret = 0, alloc = false;
-    int ei = 0, bi = 0;
+    int bi = 0;
     uint32_t avail;
 
+    handle = simplefs_journal_start(sb, SIMPLEFS_CREATE_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    simplefs_fc_mark_ineligible(sb, handle);
+
+    inode = simplefs_new_inode(dir, S_IFLNK | S_IRWXUGO);
+    if (IS_ERR(inode)) {
+        ret = PTR_ERR(inode);
+        goto stop;
+    }
+    ci = SIMPLEFS_INODE(inode);
+
     /* Check if symlink content is not too long */
     if (l > sizeof(ci->i_data)) {
         ret = -ENAMETOOLONG;
@@ -1120,31 +1553,35 @@ static int simplefs_symlink(struct inode *dir,
     }
 
     /* fill directory data block */
-    bh = sb_bread(sb, ci_dir->ei_block);
+    bh = simplefs_bread(sb, ci_dir->ei_block);
     if (!bh) {
         ret = -EIO;
         goto iput;
     }
     eblock = (struct simplefs_file_ei_block *) bh->b_data;
 
-    if (eblock->nr_files == SIMPLEFS_MAX_SUBFILES) {
+    if (eblock->nr_files == simplefs_max_subfiles(sb)) {
         ret = -EMLINK;
         printk(KERN_INFO "directory is full");
         goto iput;
     }
 
+    ret = simplefs_journal_get_write_access(handle, bh);
+    if (ret)
+        goto iput;
+
     int dir_nr_files = eblock->nr_files;
-    avail = simplefs_get_available_ext_idx(&dir_nr_files, eblock);
+    avail = simplefs_get_available_ext_idx(sb, &dir_nr_files, eblock);
 
     /* Validate avail index is within bounds */
-    if (avail >= SIMPLEFS_MAX_EXTENTS) {
+    if (avail >= simplefs_max_extents(sb)) {
         ret = -EMLINK;
         goto iput;
     }
 
     /* if there is not any empty space, alloc new one */
     if (!dir_nr_files && !eblock->extents[avail].ee_start) {
-        ret = simplefs_put_new_ext(sb, avail, eblock);
+        ret = simplefs_put_new_ext(handle, sb, avail, eblock);
         switch (ret) {
         case -ENOSPC:
             ret = -ENOSPC;
@@ -1159,25 +1596,31 @@ static int simplefs_symlink(struct inode *dir,
     /* TODO: fix from 8 to dynamic value */
     /* Find which simplefs_dir_block has free space */
     for (bi = 0; bi < eblock->extents[avail].ee_len; bi++) {
-        bh2 = sb_bread(sb, eblock->extents[avail].ee_start + bi);
+        bh2 = simplefs_bread(sb, eblock->extents[avail].ee_start + bi);
         if (!bh2) {
             ret = -EIO;
             goto put_block;
         }
         dblock = (struct simplefs_dir_block *) bh2->b_data;
-        if (dblock->nr_files != SIMPLEFS_FILES_PER_BLOCK)
+        if (dblock->nr_files != simplefs_files_per_block(sb))
             break;
         else
             brelse(bh2);
     }
 
+    ret = simplefs_journal_get_write_access(handle, bh2);
+    if (ret) {
+        brelse(bh2);
+        goto put_block;
+    }
+
     /* write the file info into simplefs_dir_block */
-    simplefs_set_file_into_dir(dblock, inode->i_ino, dentry->d_name.name);
+    simplefs_set_file_into_dir(sb, dblock, inode->i_ino, dentry->d_name.name);
 
     eblock->extents[avail].nr_files++;
     eblock->nr_files++;
-    mark_buffer_dirty(bh2);
-    mark_buffer_dirty(bh);
+    simplefs_journal_dirty_metadata(handle, sb, bh2);
+    simplefs_journal_dirty_metadata(handle, sb, bh);
     brelse(bh2);
     brelse(bh);
 
@@ -1186,19 +1629,20 @@ static int simplefs_symlink(struct inode *dir,
     inode->i_size = l - 1;
     mark_inode_dirty(inode);
     d_instantiate(dentry, inode);
-    return 0;
+    return simplefs_journal_stop(handle);
 
 put_block:
-    if (alloc && eblock->extents[ei].ee_start) {
-        put_blocks(SIMPLEFS_SB(sb), eblock->extents[ei].ee_start,
-                   eblock->extents[ei].ee_len);
-        memset(&eblock->extents[ei], 0, sizeof(struct simplefs_extent));
+    if (alloc && eblock->extents[avail].ee_start) {
+        put_blocks(sb, eblock->extents[avail].ee_start,
+                   eblock->extents[avail].ee_len);
+        memset(&eblock->extents[avail], 0, sizeof(struct simplefs_extent));
     }
 iput:
-    put_blocks(SIMPLEFS_SB(sb), ci->ei_block, 1);
-    put_inode(SIMPLEFS_SB(sb), inode->i_ino);
+    put_inode(sb, inode->i_ino);
     iput(inode);
     brelse(bh);
+stop:
+    simplefs_journal_stop(handle);
     return ret;
 }
 
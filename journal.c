@@ -0,0 +1,288 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+
+#include "simplefs.h"
+
+/* Thin wrappers around the jbd2 handle API. When the partition is mounted
+ * without a journal, simplefs_journal_start() returns NULL and the other
+ * helpers fall back to plain buffer dirtying, so callers do not have to care
+ * whether journaling is enabled.
+ */
+
+handle_t *simplefs_journal_start(struct super_block *sb, int nblocks)
+{
+    return simplefs_journal_start_revoke(sb, nblocks, 0);
+}
+
+/* Same as simplefs_journal_start(), also reserving room for @revokes revoke
+ * records. Needed by operations that free metadata blocks.
+ */
+handle_t *simplefs_journal_start_revoke(struct super_block *sb,
+                                        int nblocks,
+                                        int revokes)
+{
+    journal_t *journal = SIMPLEFS_SB(sb)->journal;
+
+    if (!journal)
+        return NULL;
+    if (is_journal_aborted(journal))
+        return ERR_PTR(-EROFS);
+
+#if SIMPLEFS_AT_LEAST(5, 5, 0)
+    return jbd2__journal_start(journal, nblocks, 0, revokes, GFP_NOFS, 0, 0);
+#else
+    return jbd2_journal_start(journal, nblocks);
+#endif
+}
+
+int simplefs_journal_stop(handle_t *handle)
+{
+    if (!handle)
+        return 0;
+    return jbd2_journal_stop(handle);
+}
+
+/* Must be called before modifying an existing metadata block */
+int simplefs_journal_get_write_access(handle_t *handle, struct buffer_head *bh)
+{
+    int err;
+
+    if (!handle)
+        return 0;
+    err = jbd2_journal_get_write_access(handle, bh);
+    if (err)
+        pr_err("journal write access to block %llu failed: %d\n",
+               (unsigned long long) bh->b_blocknr, err);
+    return err;
+}
+
+/* Must be called before filling a freshly allocated metadata block */
+int simplefs_journal_get_create_access(handle_t *handle,
+                                       struct buffer_head *bh)
+{
+    int err;
+
+    if (!handle)
+        return 0;
+    err = jbd2_journal_get_create_access(handle, bh);
+    if (err)
+        pr_err("journal create access to block %llu failed: %d\n",
+               (unsigned long long) bh->b_blocknr, err);
+    return err;
+}
+
+/* Log a modified metadata block in the running transaction. Without a journal
+ * the buffer is simply marked dirty and left to writeback. Either way, its
+ * checksum is updated first.
+ */
+int simplefs_journal_dirty_metadata(handle_t *handle,
+                                    struct super_block *sb,
+                                    struct buffer_head *bh)
+{
+    int err;
+
+    simplefs_csum_set(sb, bh);
+    if (!handle) {
+        mark_buffer_dirty(bh);
+        return 0;
+    }
+    err = jbd2_journal_dirty_metadata(handle, bh);
+    if (err)
+        pr_err("journal dirty of block %llu failed: %d\n",
+               (unsigned long long) bh->b_blocknr, err);
+    return err;
+}
+
+/* Revoke @len metadata blocks starting at @bno before they are freed, so that
+ * replaying an older transaction never writes stale metadata over whatever
+ * the blocks hold next. Nothing to do without a journal.
+ */
+int simplefs_journal_revoke(handle_t *handle,
+                            struct super_block *sb,
+                            uint32_t bno,
+                            uint32_t len)
+{
+    struct buffer_head *bh;
+    uint32_t i;
+    int err;
+
+    if (!handle)
+        return 0;
+
+    for (i = 0; i < len; i++) {
+        /* jbd2_journal_revoke() consumes the reference on a cached buffer */
+        bh = sb_find_get_block(sb, bno + i);
+        err = jbd2_journal_revoke(handle, bno + i, bh);
+        if (err) {
+            pr_err("journal revoke of block %u failed: %d\n", bno + i, err);
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* Copy the in-memory bits [bit, bit + len) of a free bitmap into its on-disk
+ * blocks, starting at block @first, and log them in the running handle along
+ * with the checksum table blocks holding their checksums. Without a journal
+ * the bitmaps keep being written back by sync_fs only.
+ */
+int simplefs_journal_bitmap(struct super_block *sb,
+                            unsigned long *bitmap,
+                            uint32_t first,
+                            uint32_t bit,
+                            uint32_t len)
+{
+    handle_t *handle = journal_current_handle();
+    struct buffer_head *bh, *table_bh = NULL;
+    uint32_t bits_per_block = sb->s_blocksize * 8;
+    uint32_t i;
+    int err = 0;
+
+    if (!SIMPLEFS_SB(sb)->journal || !handle || !len)
+        return 0;
+
+    for (i = bit / bits_per_block; i <= (bit + len - 1) / bits_per_block;
+         i++) {
+        /* A run straddles at most two table blocks */
+        if (simplefs_has_metadata_csum(sb) &&
+            (!table_bh ||
+             table_bh->b_blocknr != simplefs_csum_table(sb, first + i))) {
+            if (table_bh) {
+                err = simplefs_journal_dirty_metadata(handle, sb, table_bh);
+                brelse(table_bh);
+                table_bh = NULL;
+                if (err)
+                    break;
+            }
+            table_bh = simplefs_bread(sb, simplefs_csum_table(sb, first + i));
+            if (!table_bh) {
+                err = -EIO;
+                break;
+            }
+            err = simplefs_journal_get_write_access(handle, table_bh);
+            if (err)
+                break;
+        }
+
+        bh = sb_bread(sb, first + i);
+        if (!bh) {
+            err = -EIO;
+            break;
+        }
+
+        err = simplefs_journal_get_write_access(handle, bh);
+        if (!err) {
+            memcpy(bh->b_data, (void *) bitmap + i * sb->s_blocksize,
+                   sb->s_blocksize);
+            if (table_bh)
+                simplefs_csum_bitmap(sb, table_bh, bh);
+            err = simplefs_journal_dirty_metadata(handle, sb, bh);
+        }
+        brelse(bh);
+        if (err)
+            break;
+    }
+
+    if (table_bh && !err)
+        err = simplefs_journal_dirty_metadata(handle, sb, table_bh);
+    brelse(table_bh);
+    return err;
+}
+
+/* Inodes or blocks freed by a transaction, kept from the allocators until it
+ * commits, like ext4_free_data: if the transaction was lost in a crash, the
+ * file freeing them would come back, pointing at whatever reused them.
+ */
+struct simplefs_free_data {
+    struct list_head list;
+    unsigned long *pending; /* ifree_pending or bfree_pending */
+    uint32_t bit;
+    uint32_t len;
+};
+
+/* Called by put_inode() and put_blocks() before they set bits [bit, bit + len)
+ * of a free bitmap: mark them in @pending, the map of that bitmap, until the
+ * running transaction commits. Without a journal they are free at once.
+ */
+void simplefs_journal_free(struct super_block *sb,
+                           unsigned long *pending,
+                           uint32_t bit,
+                           uint32_t len)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    handle_t *handle = journal_current_handle();
+    struct simplefs_free_data *fd;
+
+    if (!pending || !handle)
+        return;
+
+    fd = kmalloc(sizeof(*fd), GFP_NOFS | __GFP_NOFAIL);
+    fd->pending = pending;
+    fd->bit = bit;
+    fd->len = len;
+    spin_lock(&sbi->pending_lock);
+    bitmap_set(pending, bit, len);
+    list_add_tail(&fd->list, &handle->h_transaction->t_private_list);
+    spin_unlock(&sbi->pending_lock);
+    /* Pairs with simplefs_busy_bit(): pending before it is seen free */
+    smp_mb();
+}
+
+/* j_commit_callback: what @txn freed can be reused */
+void simplefs_journal_commit_callback(journal_t *journal, transaction_t *txn)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(journal->j_private);
+    struct simplefs_free_data *fd, *next;
+    LIST_HEAD(freed);
+
+    spin_lock(&sbi->pending_lock);
+    list_splice_init(&txn->t_private_list, &freed);
+    list_for_each_entry (fd, &freed, list)
+        bitmap_clear(fd->pending, fd->bit, fd->len);
+    spin_unlock(&sbi->pending_lock);
+
+    list_for_each_entry_safe (fd, next, &freed, list)
+        kfree(fd);
+}
+
+/* data=ordered: have the transaction of @handle write out the file range
+ * [start, start + len), held by the run of blocks at @bno, before it commits,
+ * so that a crash never exposes newly allocated blocks with stale content.
+ * Nothing to do with data=writeback.
+ */
+int simplefs_journal_inode_ranges(handle_t *handle,
+                                  struct inode *inode,
+                                  loff_t start,
+                                  loff_t len,
+                                  uint32_t bno)
+{
+    int ret;
+
+    if (!handle || !len ||
+        SIMPLEFS_SB(inode->i_sb)->s_mount_opt & SIMPLEFS_MOUNT_DATA_WRITEBACK)
+        return 0;
+    ret = jbd2_journal_inode_ranges_for_write(
+        handle, &SIMPLEFS_INODE(inode)->i_jinode, start, len);
+    if (!ret)
+        simplefs_stripe_order(handle, inode->i_sb, bno);
+    return ret;
+}
+
+/* Must be called before the blocks of @inode past @new_size are freed: data
+ * still being written by the committing transaction is flushed first.
+ */
+int simplefs_journal_begin_truncate(struct inode *inode, loff_t new_size)
+{
+    journal_t *journal = SIMPLEFS_SB(inode->i_sb)->journal;
+
+    if (!journal)
+        return 0;
+    return jbd2_journal_begin_ordered_truncate(
+        journal, &SIMPLEFS_INODE(inode)->i_jinode, new_size);
+}
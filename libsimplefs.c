@@ -0,0 +1,1326 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsimplefs.h"
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+
+/* crc32c, table driven: fsck runs the whole inode store through it */
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        crc32c_table[i] = crc;
+    }
+}
+
+uint32_t sfs_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&crc32c_once, crc32c_init);
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+uint32_t sfs_block_csum(uint32_t block, const void *data, size_t len)
+{
+    uint32_t nr = htole32(block);
+
+    return sfs_crc32c(sfs_crc32c(~0, &nr, sizeof(nr)), data, len);
+}
+
+uint32_t sfs_sb_csum(const char *sb_block, uint32_t block_size)
+{
+    size_t off = offsetof(struct simplefs_sb_info, checksum);
+    uint32_t crc = sfs_block_csum(SIMPLEFS_SB_BLOCK_NR, sb_block, off);
+
+    off += sizeof(uint32_t);
+    return sfs_crc32c(crc, sb_block + off, block_size - off);
+}
+
+/* Transfer @len bytes at byte offset @off, retrying short transfers */
+static int rw_bytes(int fd, void *buf, size_t len, uint64_t off, int write)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t ret = write ? pwrite(fd, p, len, off) : pread(fd, p, len, off);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            if (!ret)
+                errno = EIO;
+            return -1;
+        }
+        p += ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+int sfs_read_blocks(int fd,
+                    uint32_t block_size,
+                    void *buf,
+                    uint32_t block,
+                    uint32_t count)
+{
+    return rw_bytes(fd, buf, (size_t) count * block_size,
+                    (uint64_t) block * block_size, 0);
+}
+
+int sfs_write_blocks(int fd,
+                     uint32_t block_size,
+                     const void *buf,
+                     uint32_t block,
+                     uint32_t count)
+{
+    return rw_bytes(fd, (void *) buf, (size_t) count * block_size,
+                    (uint64_t) block * block_size, 1);
+}
+
+int sfs_journal_needs_recovery(int fd,
+                               uint32_t block_size,
+                               const struct simplefs_sb_info *sbi)
+{
+    uint32_t ino = sbi->journal_ino;
+    uint32_t ipb = SIMPLEFS_INODES_PER_BLOCK(block_size);
+    uint32_t first_data_block = 1 + sbi->nr_istore_blocks +
+                                sbi->nr_ifree_blocks + sbi->nr_bfree_blocks;
+    char *buf = malloc(block_size);
+    int ret = 0;
+
+    if (!ino || ino >= sbi->nr_inodes || !buf)
+        goto end;
+
+    if (sfs_read_blocks(fd, block_size, buf, 1 + ino / ipb, 1))
+        goto end;
+    struct simplefs_inode *inode = (struct simplefs_inode *) buf + ino % ipb;
+    uint32_t ei_block = le32toh(inode->ei_block);
+    if (ei_block < first_data_block || ei_block >= sbi->nr_blocks ||
+        sfs_read_blocks(fd, block_size, buf, ei_block, 1))
+        goto end;
+    uint32_t start =
+        le32toh(((struct simplefs_file_ei_block *) buf)->extents[0].ee_start);
+    if (start < first_data_block || start >= sbi->nr_blocks ||
+        sfs_read_blocks(fd, block_size, buf, start, 1))
+        goto end;
+
+    /* jbd2 superblock, big-endian: s_start is 0 for a clean journal */
+    uint32_t *jsb = (uint32_t *) buf;
+    ret = be32toh(jsb[0]) == JBD2_MAGIC_NUMBER && be32toh(jsb[7]);
+end:
+    free(buf);
+    return ret;
+}
+
+/* In-memory bitmaps, as the kernel bitmap API */
+static uint32_t find_next_bit(const unsigned long *map,
+                              uint32_t size,
+                              uint32_t bit)
+{
+    while (bit < size) {
+        unsigned long word = map[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG);
+
+        if (word) {
+            bit += __builtin_ctzl(word);
+            return bit < size ? bit : size;
+        }
+        bit = (bit / BITS_PER_LONG + 1) * BITS_PER_LONG;
+    }
+    return size;
+}
+
+static void bitmap_set(unsigned long *map, uint32_t start, uint32_t len)
+{
+    for (uint32_t bit = start; bit < start + len; bit++)
+        map[bit / BITS_PER_LONG] |= 1UL << (bit % BITS_PER_LONG);
+}
+
+static void bitmap_clear(unsigned long *map, uint32_t start, uint32_t len)
+{
+    for (uint32_t bit = start; bit < start + len; bit++)
+        map[bit / BITS_PER_LONG] &= ~(1UL << (bit % BITS_PER_LONG));
+}
+
+static uint32_t bitmap_weight(const unsigned long *map, uint32_t size)
+{
+    uint32_t weight = 0;
+
+    for (uint32_t bit = find_next_bit(map, size, 0); bit < size;
+         bit = find_next_bit(map, size, bit + 1))
+        weight++;
+    return weight;
+}
+
+/* get_first_free_bits() of bitmap.h */
+static uint32_t get_first_free_bits(unsigned long *freemap,
+                                    uint32_t size,
+                                    uint32_t len)
+{
+    uint32_t bit, prev = 0, count = 0;
+
+    for (bit = find_next_bit(freemap, size, 0); bit < size;
+         bit = find_next_bit(freemap, size, bit + 1)) {
+        if (prev != bit - 1)
+            count = 0;
+        prev = bit;
+        if (++count == len) {
+            bitmap_clear(freemap, bit - len + 1, len);
+            return bit - len + 1;
+        }
+    }
+    return 0;
+}
+
+/* Start and length of the free run at or after @bit, 0 long if none */
+static uint32_t next_free_run(const unsigned long *freemap,
+                              uint32_t size,
+                              uint32_t bit,
+                              uint32_t *len)
+{
+    uint32_t start = find_next_bit(freemap, size, bit), end = start;
+
+    while (end < size &&
+           freemap[end / BITS_PER_LONG] & (1UL << (end % BITS_PER_LONG)))
+        end++;
+    *len = end - start;
+    return start;
+}
+
+/* Next fit: the first run of @len free bits from @*cursor on, then from the
+ * start. @*cursor moves past the run.
+ */
+static uint32_t get_next_free_bits(unsigned long *freemap,
+                                   uint32_t size,
+                                   uint32_t len,
+                                   uint32_t *cursor)
+{
+    uint32_t from = *cursor < size ? *cursor : 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t start, run, end = pass ? from : size;
+
+        /* A run across @from is cut on the first pass, whole on the second */
+        for (start = next_free_run(freemap, size, pass ? 0 : from, &run);
+             start < end;
+             start = next_free_run(freemap, size, start + run, &run)) {
+            if (run >= len && start) {
+                bitmap_clear(freemap, start, len);
+                *cursor = start + len;
+                return start;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Best fit: the shortest run of at least @len free bits, the lowest of
+ * those that are as short
+ */
+static uint32_t get_best_free_bits(unsigned long *freemap,
+                                   uint32_t size,
+                                   uint32_t len)
+{
+    uint32_t start, run, best = 0, best_run = UINT32_MAX;
+
+    for (start = next_free_run(freemap, size, 0, &run); start < size;
+         start = next_free_run(freemap, size, start + run, &run)) {
+        if (run >= len && run < best_run && start) {
+            best = start;
+            best_run = run;
+            if (run == len)
+                break;
+        }
+    }
+    if (best)
+        bitmap_clear(freemap, best, len);
+    return best;
+}
+
+/* Mark the bitmap blocks holding bits @start to @start + @len - 1 for
+ * sfs_sync(). @first is 0 for the ifree bitmap.
+ */
+static void mark_bitmap_dirty(struct sfs *fs,
+                              uint32_t first,
+                              uint32_t start,
+                              uint32_t len)
+{
+    uint32_t bits = fs->block_size * 8;
+
+    for (uint32_t i = start / bits; i <= (start + len - 1) / bits; i++)
+        fs->bitmap_dirty[first + i] = 1;
+}
+
+static int has_csum(struct sfs *fs)
+{
+    return fs->sbi.features & SIMPLEFS_FEATURE_METADATA_CSUM;
+}
+
+static uint32_t first_data_block(struct sfs *fs)
+{
+    return 1 + fs->sbi.nr_istore_blocks + fs->sbi.nr_ifree_blocks +
+           fs->sbi.nr_bfree_blocks;
+}
+
+/* simplefs_itable_used() of super.c */
+static uint32_t itable_used(struct sfs *fs)
+{
+    struct simplefs_sb_info *sbi = &fs->sbi;
+    uint32_t ino = sbi->nr_inodes, last;
+
+    while (ino && (sbi->ifree_bitmap[(ino - 1) / BITS_PER_LONG] >>
+                   ((ino - 1) % BITS_PER_LONG)) &
+                      1)
+        ino--;
+    if (!ino)
+        return 1;
+    last = (ino - 1) / SIMPLEFS_INODES_PER_BLOCK(fs->block_size) + 2;
+    return last < sbi->nr_istore_blocks + 1 ? last : sbi->nr_istore_blocks + 1;
+}
+
+/* Checksum slot of a bitmap block in the checksum table */
+static uint32_t *bitmap_csum(struct sfs *fs, uint32_t block)
+{
+    uint32_t per_block = SIMPLEFS_CSUMS_PER_BLOCK(fs->block_size);
+    uint32_t idx = block - 1 - fs->sbi.nr_istore_blocks;
+
+    return (uint32_t *) (fs->csum_table +
+                         (size_t) (idx / per_block) * fs->block_size) +
+           idx % per_block;
+}
+
+/* Read the bitmap checksum table, checking the checksum of its blocks */
+static int read_csum_table(struct sfs *fs)
+{
+    struct simplefs_sb_info *sbi = &fs->sbi;
+
+    if (sbi->nr_csum_blocks !=
+            DIV_ROUND_UP(sbi->nr_ifree_blocks + sbi->nr_bfree_blocks,
+                         SIMPLEFS_CSUMS_PER_BLOCK(fs->block_size)) ||
+        sbi->csum_start < first_data_block(fs) ||
+        (uint64_t) sbi->csum_start + sbi->nr_csum_blocks > sbi->nr_blocks)
+        return -EUCLEAN;
+    fs->csum_table = malloc((size_t) sbi->nr_csum_blocks * fs->block_size);
+    if (!fs->csum_table)
+        return -ENOMEM;
+    for (uint32_t i = 0; i < sbi->nr_csum_blocks; i++) {
+        int ret = sfs_read_meta(fs, sbi->csum_start + i,
+                                fs->csum_table + (size_t) i * fs->block_size);
+
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Read the bitmap blocks from @start into @map, checking their checksums */
+static int read_bitmap(struct sfs *fs,
+                       unsigned long *map,
+                       uint32_t start,
+                       uint32_t count)
+{
+    char *data = (char *) map;
+
+    if (sfs_read_blocks(fs->fd, fs->block_size, data, start, count))
+        return -errno;
+    if (!has_csum(fs))
+        return 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t block = start + i;
+
+        if (le32toh(*bitmap_csum(fs, block)) !=
+            sfs_block_csum(block, data + (size_t) i * fs->block_size,
+                           fs->block_size))
+            return -EBADMSG;
+    }
+    return 0;
+}
+
+int sfs_open(struct sfs *fs, const char *path, int writable)
+{
+    struct simplefs_sb_info *sbi = &fs->sbi, *csb;
+    uint32_t bs, ipb;
+    struct stat st;
+    int ret;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fs->fd < 0)
+        return -errno;
+    ret = -ENOMEM;
+    fs->sb_block = malloc(SIMPLEFS_MAX_BLOCK_SIZE);
+    if (!fs->sb_block)
+        goto err;
+
+    /* The block size is in the first SIMPLEFS_MIN_BLOCK_SIZE bytes */
+    ret = -EIO;
+    if (sfs_read_blocks(fs->fd, SIMPLEFS_MIN_BLOCK_SIZE, fs->sb_block,
+                        SIMPLEFS_SB_BLOCK_NR, 1))
+        goto err;
+    csb = (struct simplefs_sb_info *) fs->sb_block;
+    ret = -EINVAL;
+    if (csb->magic != SIMPLEFS_MAGIC)
+        goto err;
+    bs = csb->block_size ?: SIMPLEFS_BLOCK_SIZE;
+    if (bs < SIMPLEFS_MIN_BLOCK_SIZE || bs > SIMPLEFS_MAX_BLOCK_SIZE ||
+        (bs & (bs - 1)))
+        goto err;
+    fs->block_size = bs;
+    ret = -EIO;
+    if (sfs_read_blocks(fs->fd, bs, fs->sb_block, SIMPLEFS_SB_BLOCK_NR, 1))
+        goto err;
+
+    memcpy(sbi, csb, offsetof(struct simplefs_sb_info, ifree_bitmap));
+    /* Compressed and shared extents, and data on other devices, are only
+     * handled by the kernel driver
+     */
+    ret = -EOPNOTSUPP;
+    if (sbi->features & ~SIMPLEFS_FEATURE_ALL ||
+        sbi->features & (SIMPLEFS_FEATURE_COMPRESSION |
+                         SIMPLEFS_FEATURE_REFLINK | SIMPLEFS_FEATURE_STRIPE))
+        goto err;
+    ret = -EUCLEAN;
+    ipb = SIMPLEFS_INODES_PER_BLOCK(bs);
+    if (fstat(fs->fd, &st) ||
+        (S_ISREG(st.st_mode) && (uint64_t) sbi->nr_blocks * bs > st.st_size) ||
+        sbi->nr_istore_blocks != DIV_ROUND_UP(sbi->nr_inodes, ipb) ||
+        sbi->nr_ifree_blocks !=
+            DIV_ROUND_UP(sbi->nr_inodes, (uint64_t) bs * 8) ||
+        sbi->nr_bfree_blocks !=
+            DIV_ROUND_UP(sbi->nr_blocks, (uint64_t) bs * 8) ||
+        first_data_block(fs) >= sbi->nr_blocks || sbi->nr_inodes < 2)
+        goto err;
+    ret = -EBADMSG;
+    if (has_csum(fs) && csb->checksum != sfs_sb_csum(fs->sb_block, bs))
+        goto err;
+
+    /* Unreplayed transactions would be lost, or undo what we write */
+    ret = -EUCLEAN;
+    if (writable && sfs_journal_needs_recovery(fs->fd, bs, sbi))
+        goto err;
+
+    ret = -ENOMEM;
+    sbi->ifree_bitmap = malloc((size_t) sbi->nr_ifree_blocks * bs);
+    sbi->bfree_bitmap = malloc((size_t) sbi->nr_bfree_blocks * bs);
+    fs->bitmap_dirty = calloc(sbi->nr_ifree_blocks + sbi->nr_bfree_blocks, 1);
+    if (!sbi->ifree_bitmap || !sbi->bfree_bitmap || !fs->bitmap_dirty)
+        goto err;
+    if (has_csum(fs)) {
+        ret = read_csum_table(fs);
+        if (ret)
+            goto err;
+    }
+    ret = read_bitmap(fs, sbi->ifree_bitmap, 1 + sbi->nr_istore_blocks,
+                      sbi->nr_ifree_blocks);
+    if (!ret)
+        ret = read_bitmap(fs, sbi->bfree_bitmap,
+                          1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks,
+                          sbi->nr_bfree_blocks);
+    if (ret)
+        goto err;
+
+    /* As a journaled mount, trust the bitmaps over the counters */
+    sbi->nr_free_inodes = bitmap_weight(sbi->ifree_bitmap, sbi->nr_inodes);
+    sbi->nr_free_blocks = bitmap_weight(sbi->bfree_bitmap, sbi->nr_blocks);
+    if (sbi->features & SIMPLEFS_FEATURE_LAZY_ITABLE)
+        fs->itable_init = itable_used(fs);
+    pthread_mutex_init(&fs->lock, NULL);
+    return 0;
+
+err:
+    free(sbi->ifree_bitmap);
+    free(sbi->bfree_bitmap);
+    free(fs->bitmap_dirty);
+    free(fs->csum_table);
+    free(fs->sb_block);
+    close(fs->fd);
+    return ret;
+}
+
+int sfs_sync(struct sfs *fs)
+{
+    struct simplefs_sb_info *sbi = &fs->sbi;
+    struct simplefs_sb_info *csb = (struct simplefs_sb_info *) fs->sb_block;
+    uint32_t per_block = SIMPLEFS_CSUMS_PER_BLOCK(fs->block_size);
+    uint32_t bs = fs->block_size;
+    uint32_t table_first = UINT32_MAX, table_end = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->lock);
+    for (uint32_t i = 0; i < sbi->nr_ifree_blocks + sbi->nr_bfree_blocks;
+         i++) {
+        uint32_t block = 1 + sbi->nr_istore_blocks + i;
+        char *data = i < sbi->nr_ifree_blocks
+                         ? (char *) sbi->ifree_bitmap + (size_t) i * bs
+                         : (char *) sbi->bfree_bitmap +
+                               (size_t) (i - sbi->nr_ifree_blocks) * bs;
+
+        if (!fs->bitmap_dirty[i])
+            continue;
+        if (has_csum(fs)) {
+            *bitmap_csum(fs, block) = htole32(sfs_block_csum(block, data, bs));
+            if (i / per_block < table_first)
+                table_first = i / per_block;
+            table_end = i / per_block + 1;
+        }
+        if (sfs_write_blocks(fs->fd, bs, data, block, 1)) {
+            ret = -errno;
+            goto unlock;
+        }
+        fs->bitmap_dirty[i] = 0;
+    }
+    /* The checksums of the bitmap blocks just written */
+    for (uint32_t t = table_first; t < table_end; t++) {
+        ret = sfs_write_meta(fs, sbi->csum_start + t,
+                             fs->csum_table + (size_t) t * bs);
+        if (ret)
+            goto unlock;
+    }
+
+    csb->nr_free_inodes = sbi->nr_free_inodes;
+    csb->nr_free_blocks = sbi->nr_free_blocks;
+    if (has_csum(fs))
+        csb->checksum = sfs_sb_csum(fs->sb_block, bs);
+    if (sfs_write_blocks(fs->fd, bs, fs->sb_block, SIMPLEFS_SB_BLOCK_NR, 1) ||
+        fsync(fs->fd))
+        ret = -errno;
+unlock:
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+void sfs_close(struct sfs *fs)
+{
+    pthread_mutex_destroy(&fs->lock);
+    free(fs->sbi.ifree_bitmap);
+    free(fs->sbi.bfree_bitmap);
+    free(fs->bitmap_dirty);
+    free(fs->csum_table);
+    free(fs->sb_block);
+    close(fs->fd);
+}
+
+int sfs_read_meta(struct sfs *fs, uint32_t block, void *buf)
+{
+    uint32_t off = SIMPLEFS_CSUM_OFFSET(fs->block_size);
+
+    if (!block || block >= fs->sbi.nr_blocks)
+        return -EUCLEAN;
+    if (sfs_read_blocks(fs->fd, fs->block_size, buf, block, 1))
+        return -errno;
+    if (has_csum(fs) &&
+        le32toh(*(uint32_t *) ((char *) buf + off)) !=
+            sfs_block_csum(block, buf, off))
+        return -EBADMSG;
+    return 0;
+}
+
+int sfs_write_meta(struct sfs *fs, uint32_t block, void *buf)
+{
+    uint32_t off = SIMPLEFS_CSUM_OFFSET(fs->block_size);
+
+    if (!block || block >= fs->sbi.nr_blocks)
+        return -EUCLEAN;
+    if (has_csum(fs))
+        *(uint32_t *) ((char *) buf + off) =
+            htole32(sfs_block_csum(block, buf, off));
+    if (sfs_write_blocks(fs->fd, fs->block_size, buf, block, 1))
+        return -errno;
+    return 0;
+}
+
+int sfs_read_inode(struct sfs *fs, uint32_t ino, struct simplefs_inode *inode)
+{
+    uint32_t ipb = SIMPLEFS_INODES_PER_BLOCK(fs->block_size);
+    uint32_t block = 1 + ino / ipb;
+    char *buf;
+    int ret;
+
+    if (!ino || ino >= fs->sbi.nr_inodes)
+        return -ESTALE;
+    /* Lazy itable: blocks never used hold garbage */
+    if ((fs->sbi.features & SIMPLEFS_FEATURE_LAZY_ITABLE) &&
+        block >= __atomic_load_n(&fs->itable_init, __ATOMIC_ACQUIRE)) {
+        memset(inode, 0, sizeof(*inode));
+        return 0;
+    }
+    buf = malloc(fs->block_size);
+    if (!buf)
+        return -ENOMEM;
+    ret = sfs_read_meta(fs, block, buf);
+    if (!ret)
+        memcpy(inode, (struct simplefs_inode *) buf + ino % ipb,
+               sizeof(*inode));
+    free(buf);
+    return ret;
+}
+
+int sfs_write_inode(struct sfs *fs,
+                    uint32_t ino,
+                    const struct simplefs_inode *inode)
+{
+    uint32_t ipb = SIMPLEFS_INODES_PER_BLOCK(fs->block_size);
+    uint32_t block = 1 + ino / ipb;
+    char *buf;
+    int ret;
+
+    if (!ino || ino >= fs->sbi.nr_inodes)
+        return -ESTALE;
+    buf = malloc(fs->block_size);
+    if (!buf)
+        return -ENOMEM;
+    /* Inodes sharing the block are updated by other threads */
+    pthread_mutex_lock(&fs->lock);
+    ret = sfs_read_meta(fs, block, buf);
+    if (!ret) {
+        memcpy((struct simplefs_inode *) buf + ino % ipb, inode,
+               sizeof(*inode));
+        ret = sfs_write_meta(fs, block, buf);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    free(buf);
+    return ret;
+}
+
+/* simplefs_init_itable_block(), under fs->lock */
+static int init_itable_block(struct sfs *fs, uint32_t ino)
+{
+    uint32_t block = 1 + ino / SIMPLEFS_INODES_PER_BLOCK(fs->block_size);
+    char *buf;
+    int ret;
+
+    if (!(fs->sbi.features & SIMPLEFS_FEATURE_LAZY_ITABLE) ||
+        block < fs->itable_init)
+        return 0;
+    buf = calloc(1, fs->block_size);
+    if (!buf)
+        return -ENOMEM;
+    ret = sfs_write_meta(fs, block, buf);
+    free(buf);
+    if (!ret)
+        __atomic_store_n(&fs->itable_init, block + 1, __ATOMIC_RELEASE);
+    return ret;
+}
+
+uint32_t sfs_alloc_inode(struct sfs *fs)
+{
+    struct simplefs_sb_info *sbi = &fs->sbi;
+    uint32_t ino;
+
+    pthread_mutex_lock(&fs->lock);
+    ino = get_first_free_bits(sbi->ifree_bitmap, sbi->nr_inodes, 1);
+    if (ino && init_itable_block(fs, ino)) {
+        bitmap_set(sbi->ifree_bitmap, ino, 1);
+        ino = 0;
+    }
+    if (ino) {
+        sbi->nr_free_inodes--;
+        mark_bitmap_dirty(fs, 0, ino, 1);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return ino;
+}
+
+void sfs_free_inode(struct sfs *fs, uint32_t ino)
+{
+    struct simplefs_sb_info *sbi = &fs->sbi;
+
+    if (!ino || ino >= sbi->nr_inodes)
+        return;
+    pthread_mutex_lock(&fs->lock);
+    bitmap_set(sbi->ifree_bitmap, ino, 1);
+    sbi->nr_free_inodes++;
+    mark_bitmap_dirty(fs, 0, ino, 1);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+/* Zero @count blocks from @start, as sb_issue_zeroout() */
+static int zero_blocks(struct sfs *fs, uint32_t start, uint32_t count)
+{
+    char *buf = calloc(count, fs->block_size);
+    int ret = 0;
+
+    if (!buf)
+        return -ENOMEM;
+    if (sfs_write_blocks(fs->fd, fs->block_size, buf, start, count))
+        ret = -errno;
+    free(buf);
+    return ret;
+}
+
+uint32_t sfs_alloc_blocks(struct sfs *fs, uint32_t len)
+{
+    struct simplefs_sb_info *sbi = &fs->sbi;
+    uint32_t bno;
+
+    pthread_mutex_lock(&fs->lock);
+    switch (fs->alloc_policy) {
+    case SFS_ALLOC_NEXT_FIT:
+        bno = get_next_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, len,
+                                 &fs->alloc_cursor);
+        break;
+    case SFS_ALLOC_BEST_FIT:
+        bno = get_best_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, len);
+        break;
+    default:
+        bno = get_first_free_bits(sbi->bfree_bitmap, sbi->nr_blocks, len);
+    }
+    if (bno) {
+        sbi->nr_free_blocks -= len;
+        mark_bitmap_dirty(fs, sbi->nr_ifree_blocks, bno, len);
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    if (bno && zero_blocks(fs, bno, len)) {
+        sfs_free_blocks(fs, bno, len);
+        return 0;
+    }
+    return bno;
+}
+
+void sfs_free_blocks(struct sfs *fs, uint32_t start, uint32_t len)
+{
+    struct simplefs_sb_info *sbi = &fs->sbi;
+
+    if (start < first_data_block(fs) || start + len > sbi->nr_blocks)
+        return;
+    pthread_mutex_lock(&fs->lock);
+    bitmap_set(sbi->bfree_bitmap, start, len);
+    sbi->nr_free_blocks += len;
+    mark_bitmap_dirty(fs, sbi->nr_ifree_blocks, start, len);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+int sfs_new_inode(struct sfs *fs,
+                  uint32_t mode,
+                  uint32_t *ino,
+                  struct simplefs_inode *inode)
+{
+    uint32_t bno = 0;
+    int ret;
+
+    if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode))
+        return -EINVAL;
+    *ino = sfs_alloc_inode(fs);
+    if (!*ino)
+        return -ENOSPC;
+
+    memset(inode, 0, sizeof(*inode));
+    inode->i_mode = mode;
+    inode->i_nlink = 1;
+    inode->i_ctime = inode->i_atime = inode->i_mtime = time(NULL);
+    if (S_ISLNK(mode))
+        return 0;
+
+    /* The index block, zeroed and checksummed */
+    char *buf = calloc(1, fs->block_size);
+    ret = -ENOMEM;
+    if (!buf)
+        goto put_inode;
+    ret = -ENOSPC;
+    bno = sfs_alloc_blocks(fs, 1);
+    if (!bno)
+        goto put_inode;
+    ret = sfs_write_meta(fs, bno, buf);
+    if (ret)
+        goto put_inode;
+    free(buf);
+
+    inode->ei_block = bno;
+    inode->i_blocks = 1;
+    if (S_ISDIR(mode)) {
+        inode->i_size = fs->block_size;
+        inode->i_nlink = 2;
+    }
+    return 0;
+
+put_inode:
+    if (bno)
+        sfs_free_blocks(fs, bno, 1);
+    sfs_free_inode(fs, *ino);
+    free(buf);
+    return ret;
+}
+
+int sfs_free_file(struct sfs *fs, uint32_t ino, struct simplefs_inode *inode)
+{
+    uint32_t max = SIMPLEFS_MAX_EXTENTS(fs->block_size);
+    struct simplefs_file_ei_block *index;
+    int ret = 0;
+
+    if (S_ISLNK(inode->i_mode))
+        goto clean_inode;
+    index = malloc(fs->block_size);
+    if (!index)
+        return -ENOMEM;
+    /* As simplefs_unlink(), an unreadable index leaks the blocks */
+    if (!sfs_read_meta(fs, inode->ei_block, index)) {
+        for (uint32_t ei = 0; ei < max && index->extents[ei].ee_start; ei++)
+            sfs_free_blocks(fs, index->extents[ei].ee_start,
+                            index->extents[ei].ee_len);
+    }
+    free(index);
+    sfs_free_blocks(fs, inode->ei_block, 1);
+
+clean_inode:
+    memset(inode, 0, sizeof(*inode));
+    ret = sfs_write_inode(fs, ino, inode);
+    sfs_free_inode(fs, ino);
+    return ret;
+}
+
+/* Extent of @index holding @iblock, or the first unused one */
+static uint32_t find_extent(struct sfs *fs,
+                            struct simplefs_file_ei_block *index,
+                            uint32_t iblock)
+{
+    return simplefs_ext_search(index, SIMPLEFS_MAX_EXTENTS(fs->block_size),
+                               iblock);
+}
+
+ssize_t sfs_file_read(struct sfs *fs,
+                      const struct simplefs_inode *inode,
+                      void *buf,
+                      size_t size,
+                      uint64_t off)
+{
+    uint32_t bs = fs->block_size, max = SIMPLEFS_MAX_EXTENTS(bs);
+    struct simplefs_file_ei_block *index;
+    size_t done = 0;
+    int ret;
+
+    if (off >= inode->i_size)
+        return 0;
+    if (size > inode->i_size - off)
+        size = inode->i_size - off;
+    index = malloc(bs);
+    if (!index)
+        return -ENOMEM;
+    ret = sfs_read_meta(fs, inode->ei_block, index);
+    if (ret)
+        goto end;
+
+    while (done < size) {
+        uint64_t pos = off + done;
+        uint32_t iblock = pos / bs;
+        uint32_t ei = find_extent(fs, index, iblock);
+        size_t len = size - done;
+
+        if (ei >= max || !index->extents[ei].ee_start) {
+            /* Past the last extent, e.g. after a truncate up */
+            memset((char *) buf + done, 0, len);
+        } else {
+            struct simplefs_extent *ext = &index->extents[ei];
+            uint64_t end = (uint64_t) (ext->ee_block + ext->ee_len) * bs;
+
+            if (len > end - pos)
+                len = end - pos;
+            if (rw_bytes(fs->fd, (char *) buf + done, len,
+                         (uint64_t) (ext->ee_start + iblock - ext->ee_block) *
+                                 bs +
+                             pos % bs,
+                         0)) {
+                ret = -errno;
+                break;
+            }
+        }
+        done += len;
+    }
+end:
+    free(index);
+    return done ? (ssize_t) done : ret;
+}
+
+/* Allocate extent @ei of a file, following the previous one, as
+ * simplefs_file_get_block()
+ */
+static int new_file_extent(struct sfs *fs,
+                           struct simplefs_file_ei_block *index,
+                           uint32_t ei)
+{
+    uint32_t bno = sfs_alloc_blocks(fs, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+
+    if (!bno)
+        return -ENOSPC;
+    index->extents[ei].ee_start = bno;
+    index->extents[ei].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    index->extents[ei].ee_block =
+        ei ? index->extents[ei - 1].ee_block + index->extents[ei - 1].ee_len
+           : 0;
+    return 0;
+}
+
+ssize_t sfs_file_write(struct sfs *fs,
+                       uint32_t ino,
+                       struct simplefs_inode *inode,
+                       const void *buf,
+                       size_t size,
+                       uint64_t off)
+{
+    uint32_t bs = fs->block_size, max = SIMPLEFS_MAX_EXTENTS(bs);
+    struct simplefs_file_ei_block *index;
+    size_t done = 0;
+    int ret, dirty = 0;
+
+    if (!size)
+        return 0;
+    if (off + size > SIMPLEFS_MAX_FILESIZE(bs) || off + size > UINT32_MAX)
+        return -EFBIG;
+    index = malloc(bs);
+    if (!index)
+        return -ENOMEM;
+    ret = sfs_read_meta(fs, inode->ei_block, index);
+    if (ret)
+        goto end;
+
+    while (done < size) {
+        uint64_t pos = off + done;
+        uint32_t iblock = pos / bs;
+        uint32_t ei = find_extent(fs, index, iblock);
+        size_t len = size - done;
+
+        /* Extents are contiguous: allocate up to the one of @iblock */
+        while (ei < max && !index->extents[ei].ee_start) {
+            ret = new_file_extent(fs, index, ei);
+            if (ret)
+                goto write_index;
+            dirty = 1;
+            if (iblock < index->extents[ei].ee_block +
+                             SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+                break;
+            ei++;
+        }
+        if (ei >= max) {
+            ret = -EFBIG;
+            break;
+        }
+
+        struct simplefs_extent *ext = &index->extents[ei];
+        uint64_t end = (uint64_t) (ext->ee_block + ext->ee_len) * bs;
+        if (len > end - pos)
+            len = end - pos;
+        if (rw_bytes(fs->fd, (char *) buf + done, len,
+                     (uint64_t) (ext->ee_start + iblock - ext->ee_block) * bs +
+                         pos % bs,
+                     1)) {
+            ret = -errno;
+            break;
+        }
+        done += len;
+    }
+
+write_index:
+    if (dirty) {
+        int err = sfs_write_meta(fs, inode->ei_block, index);
+        if (err)
+            ret = err;
+    }
+    if (done) {
+        if (off + done > inode->i_size)
+            inode->i_size = off + done;
+        inode->i_blocks = DIV_ROUND_UP(inode->i_size, bs) + 1;
+        inode->i_mtime = inode->i_ctime = time(NULL);
+        int err = sfs_write_inode(fs, ino, inode);
+        if (err)
+            ret = err;
+    }
+end:
+    free(index);
+    return done ? (ssize_t) done : ret;
+}
+
+int sfs_truncate(struct sfs *fs,
+                 uint32_t ino,
+                 struct simplefs_inode *inode,
+                 uint64_t size)
+{
+    uint32_t bs = fs->block_size, max = SIMPLEFS_MAX_EXTENTS(bs);
+    struct simplefs_file_ei_block *index;
+    int ret = 0;
+
+    if (!S_ISREG(inode->i_mode))
+        return -EINVAL;
+    if (size > SIMPLEFS_MAX_FILESIZE(bs) || size > UINT32_MAX)
+        return -EFBIG;
+
+    /* Shrinking frees the extents past the new size as simplefs_write_end(),
+     * and zeroes the rest of the last one: blocks past i_size stay zeroed
+     * for a later truncate up.
+     */
+    if (size < inode->i_size) {
+        uint32_t nr_blocks = DIV_ROUND_UP(size, bs);
+        int dirty = 0;
+
+        index = malloc(bs);
+        if (!index)
+            return -ENOMEM;
+        ret = sfs_read_meta(fs, inode->ei_block, index);
+        for (uint32_t ei = 0; !ret && ei < max; ei++) {
+            struct simplefs_extent *ext = &index->extents[ei];
+            uint64_t end = (uint64_t) (ext->ee_block + ext->ee_len) * bs;
+
+            if (!ext->ee_start)
+                break;
+            if (ext->ee_block >= nr_blocks) {
+                sfs_free_blocks(fs, ext->ee_start, ext->ee_len);
+                memset(ext, 0, sizeof(*ext));
+                dirty = 1;
+            } else if (size < end) {
+                size_t len = end - size;
+                char *zero = calloc(1, len);
+
+                if (!zero ||
+                    rw_bytes(fs->fd, zero, len,
+                             (uint64_t) (ext->ee_start + size / bs -
+                                         ext->ee_block) *
+                                     bs +
+                                 size % bs,
+                             1))
+                    ret = zero ? -errno : -ENOMEM;
+                free(zero);
+            }
+        }
+        if (!ret && dirty)
+            ret = sfs_write_meta(fs, inode->ei_block, index);
+        free(index);
+        if (ret)
+            return ret;
+    }
+
+    inode->i_size = size;
+    inode->i_blocks = DIV_ROUND_UP(size, bs) + 1;
+    inode->i_mtime = inode->i_ctime = time(NULL);
+    return sfs_write_inode(fs, ino, inode);
+}
+
+int sfs_dir_iterate(struct sfs *fs,
+                    const struct simplefs_inode *dir,
+                    sfs_filldir_t fill,
+                    void *ctx)
+{
+    uint32_t bs = fs->block_size, max = SIMPLEFS_MAX_EXTENTS(bs);
+    uint32_t fpb = SIMPLEFS_FILES_PER_BLOCK(bs);
+    struct simplefs_file_ei_block *index = malloc(bs);
+    struct simplefs_dir_block *dblock = malloc(bs);
+    char name[SIMPLEFS_FILENAME_LEN + 1];
+    uint32_t remaining;
+    int ret;
+
+    ret = -ENOMEM;
+    if (!index || !dblock)
+        goto end;
+    ret = sfs_read_meta(fs, dir->ei_block, index);
+    if (ret)
+        goto end;
+
+    remaining = index->nr_files;
+    for (uint32_t ei = 0; remaining && ei < max; ei++) {
+        struct simplefs_extent *ext = &index->extents[ei];
+
+        if (!ext->ee_start)
+            continue;
+        for (uint32_t bi = 0; remaining && bi < ext->ee_len; bi++) {
+            ret = sfs_read_meta(fs, ext->ee_start + bi, dblock);
+            if (ret)
+                goto end;
+            for (uint32_t fi = 0; fi < fpb;) {
+                struct simplefs_file *f = &dblock->files[fi];
+
+                if (f->inode) {
+                    remaining--;
+                    memcpy(name, f->filename, SIMPLEFS_FILENAME_LEN);
+                    name[SIMPLEFS_FILENAME_LEN] = '\0';
+                    ret = fill(ctx, name, f->inode);
+                    if (ret)
+                        goto end;
+                }
+                if (!f->nr_blk) {
+                    ret = -EUCLEAN;
+                    goto end;
+                }
+                fi += f->nr_blk;
+            }
+        }
+    }
+    ret = 0;
+end:
+    free(index);
+    free(dblock);
+    return ret;
+}
+
+struct lookup_ctx {
+    const char *name;
+    uint32_t ino;
+};
+
+static int lookup_fill(void *ctx, const char *name, uint32_t ino)
+{
+    struct lookup_ctx *l = ctx;
+
+    if (strncmp(name, l->name, SIMPLEFS_FILENAME_LEN))
+        return 0;
+    l->ino = ino;
+    return 1;
+}
+
+int sfs_dir_lookup(struct sfs *fs,
+                   const struct simplefs_inode *dir,
+                   const char *name,
+                   uint32_t *ino)
+{
+    struct lookup_ctx l = {.name = name};
+    int ret = sfs_dir_iterate(fs, dir, lookup_fill, &l);
+
+    if (ret < 0)
+        return ret;
+    if (!ret)
+        return -ENOENT;
+    *ino = l.ino;
+    return 0;
+}
+
+/* simplefs_get_available_ext_idx() of inode.c */
+static uint32_t get_available_ext_idx(struct sfs *fs,
+                                      int *dir_nr_files,
+                                      struct simplefs_file_ei_block *eblock)
+{
+    uint32_t max = SIMPLEFS_MAX_EXTENTS(fs->block_size);
+    uint32_t fpe = SIMPLEFS_FILES_PER_EXT(fs->block_size);
+    uint32_t first_empty_blk = -1;
+
+    for (uint32_t ei = 0; ei < max; ei++) {
+        if (eblock->extents[ei].ee_start &&
+            eblock->extents[ei].nr_files != fpe) {
+            first_empty_blk = ei;
+            break;
+        } else if (!eblock->extents[ei].ee_start) {
+            if (first_empty_blk == -1)
+                first_empty_blk = ei;
+        } else {
+            *dir_nr_files -= eblock->extents[ei].nr_files;
+            if (first_empty_blk == -1 && !*dir_nr_files)
+                first_empty_blk = ei + 1;
+        }
+        if (!*dir_nr_files)
+            break;
+    }
+    return first_empty_blk;
+}
+
+/* simplefs_put_new_ext() of inode.c */
+static int put_new_ext(struct sfs *fs,
+                       uint32_t ei,
+                       struct simplefs_file_ei_block *eblock)
+{
+    struct simplefs_dir_block *dblock;
+    uint32_t bno;
+    int ret = 0;
+
+    bno = sfs_alloc_blocks(fs, SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+    if (!bno)
+        return -ENOSPC;
+    eblock->extents[ei].ee_start = bno;
+    eblock->extents[ei].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    eblock->extents[ei].ee_block =
+        ei ? eblock->extents[ei - 1].ee_block + eblock->extents[ei - 1].ee_len
+           : 0;
+    eblock->extents[ei].nr_files = 0;
+
+    dblock = calloc(1, fs->block_size);
+    if (!dblock)
+        return -ENOMEM;
+    dblock->files[0].nr_blk = SIMPLEFS_FILES_PER_BLOCK(fs->block_size);
+    for (uint32_t bi = 0; !ret && bi < eblock->extents[ei].ee_len; bi++)
+        ret = sfs_write_meta(fs, bno + bi, dblock);
+    free(dblock);
+    return ret;
+}
+
+/* simplefs_set_file_into_dir() of inode.c */
+static void set_file_into_dir(struct sfs *fs,
+                              struct simplefs_dir_block *dblock,
+                              uint32_t inode_no,
+                              const char *name)
+{
+    uint32_t fpb = SIMPLEFS_FILES_PER_BLOCK(fs->block_size);
+    uint32_t fi = 0;
+
+    if (dblock->nr_files != 0 && dblock->files[0].inode != 0) {
+        for (fi = 0; fi < fpb - 1; fi++) {
+            if (dblock->files[fi].nr_blk != 1)
+                break;
+        }
+        dblock->files[fi + 1].inode = inode_no;
+        dblock->files[fi + 1].nr_blk = dblock->files[fi].nr_blk - 1;
+        strncpy(dblock->files[fi + 1].filename, name,
+                SIMPLEFS_FILENAME_LEN - 1);
+        dblock->files[fi + 1].filename[SIMPLEFS_FILENAME_LEN - 1] = '\0';
+        dblock->files[fi].nr_blk = 1;
+    } else {
+        dblock->files[0].inode = inode_no;
+        strncpy(dblock->files[0].filename, name, SIMPLEFS_FILENAME_LEN - 1);
+        dblock->files[0].filename[SIMPLEFS_FILENAME_LEN - 1] = '\0';
+    }
+    dblock->nr_files++;
+}
+
+int sfs_dir_add(struct sfs *fs,
+                const struct simplefs_inode *dir,
+                const char *name,
+                uint32_t ino)
+{
+    uint32_t bs = fs->block_size, max = SIMPLEFS_MAX_EXTENTS(bs);
+    uint32_t fpb = SIMPLEFS_FILES_PER_BLOCK(bs);
+    struct simplefs_file_ei_block *eblock = malloc(bs);
+    struct simplefs_dir_block *dblock = malloc(bs);
+    struct simplefs_extent *ext = NULL;
+    uint32_t avail, bi;
+    int dir_nr_files, alloc = 0, ret;
+
+    ret = -ENAMETOOLONG;
+    if (strlen(name) >= SIMPLEFS_FILENAME_LEN)
+        goto end;
+    ret = -ENOMEM;
+    if (!eblock || !dblock)
+        goto end;
+    ret = sfs_read_meta(fs, dir->ei_block, eblock);
+    if (ret)
+        goto end;
+    ret = -EMLINK;
+    if (eblock->nr_files == SIMPLEFS_MAX_SUBFILES(bs))
+        goto end;
+
+    dir_nr_files = eblock->nr_files;
+    avail = get_available_ext_idx(fs, &dir_nr_files, eblock);
+    if (avail >= max)
+        goto end;
+    ext = &eblock->extents[avail];
+
+    /* if there is not any empty space, alloc new one */
+    if (!dir_nr_files && !ext->ee_start) {
+        ret = put_new_ext(fs, avail, eblock);
+        if (ret)
+            goto put_block;
+        alloc = 1;
+    }
+
+    /* Find which simplefs_dir_block has free space */
+    for (bi = 0; bi < ext->ee_len; bi++) {
+        ret = sfs_read_meta(fs, ext->ee_start + bi, dblock);
+        if (ret)
+            goto put_block;
+        if (dblock->nr_files != fpb)
+            break;
+    }
+    ret = -EUCLEAN;
+    if (bi == ext->ee_len)
+        goto put_block;
+
+    set_file_into_dir(fs, dblock, ino, name);
+    ext->nr_files++;
+    eblock->nr_files++;
+    ret = sfs_write_meta(fs, ext->ee_start + bi, dblock);
+    if (!ret)
+        ret = sfs_write_meta(fs, dir->ei_block, eblock);
+    goto end;
+
+put_block:
+    if (alloc && ext->ee_start)
+        sfs_free_blocks(fs, ext->ee_start, ext->ee_len);
+end:
+    free(eblock);
+    free(dblock);
+    return ret;
+}
+
+int sfs_dir_remove(struct sfs *fs,
+                   const struct simplefs_inode *dir,
+                   const char *name,
+                   uint32_t ino)
+{
+    uint32_t bs = fs->block_size, max = SIMPLEFS_MAX_EXTENTS(bs);
+    uint32_t fpb = SIMPLEFS_FILES_PER_BLOCK(bs);
+    struct simplefs_file_ei_block *eblock = malloc(bs);
+    struct simplefs_dir_block *dirblk = malloc(bs);
+    int ret;
+
+    ret = -ENOMEM;
+    if (!eblock || !dirblk)
+        goto end;
+    ret = sfs_read_meta(fs, dir->ei_block, eblock);
+    if (ret)
+        goto end;
+
+    uint32_t dir_nr_files = eblock->nr_files;
+    for (uint32_t ei = 0; dir_nr_files && ei < max; ei++) {
+        struct simplefs_extent *ext = &eblock->extents[ei];
+
+        if (!ext->ee_start)
+            continue;
+        dir_nr_files -= ext->nr_files;
+        for (uint32_t bi = 0; bi < ext->ee_len; bi++) {
+            ret = sfs_read_meta(fs, ext->ee_start + bi, dirblk);
+            if (ret)
+                goto end;
+            uint32_t blk_nr_files = dirblk->nr_files;
+            for (uint32_t fi = 0; blk_nr_files && fi < fpb;) {
+                struct simplefs_file *f = &dirblk->files[fi];
+
+                if (f->inode) {
+                    if (f->inode == ino &&
+                        !strncmp(f->filename, name, SIMPLEFS_FILENAME_LEN)) {
+                        f->inode = 0;
+                        /* merge the empty data */
+                        for (int i = fi - 1; i >= 0; i--) {
+                            if (dirblk->files[i].inode != 0 || i == 0) {
+                                dirblk->files[i].nr_blk += f->nr_blk;
+                                break;
+                            }
+                        }
+                        dirblk->nr_files--;
+                        ext->nr_files--;
+                        eblock->nr_files--;
+                        ret = sfs_write_meta(fs, ext->ee_start + bi, dirblk);
+                        if (!ret)
+                            ret = sfs_write_meta(fs, dir->ei_block, eblock);
+                        goto end;
+                    }
+                    blk_nr_files--;
+                }
+                if (!f->nr_blk) {
+                    ret = -EUCLEAN;
+                    goto end;
+                }
+                fi += f->nr_blk;
+            }
+        }
+    }
+    ret = -ENOENT;
+end:
+    free(eblock);
+    free(dirblk);
+    return ret;
+}
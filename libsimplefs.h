@@ -0,0 +1,160 @@
+#ifndef LIBSIMPLEFS_H
+#define LIBSIMPLEFS_H
+
+/* Userspace access to simplefs partitions, shared by mkfs.simplefs,
+ * fsck.simplefs and simplefs-fuse.
+ *
+ * The low-level helpers (checksums, block I/O) work on raw, little-endian
+ * blocks. The sfs_* filesystem calls follow the kernel module instead: the
+ * same structures in host order, the same allocator (bitmap.h), the same
+ * extent search (extent.c, built in) and the same directory block handling
+ * (inode.c), so that format and algorithm changes can be tried and profiled
+ * here before they go into the module. There is no journal: every change is
+ * written in place, the bitmaps and the superblock by sfs_sync().
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "simplefs.h"
+
+#define SIMPLEFS_ROOT_INO 1
+
+/* crc32c (Castagnoli), without pre or post inversion like the kernel
+ * crc32c()
+ */
+uint32_t sfs_crc32c(uint32_t crc, const void *data, size_t len);
+
+/* Checksum of @len bytes of block @block, see SIMPLEFS_CSUM_OFFSET() */
+uint32_t sfs_block_csum(uint32_t block, const void *data, size_t len);
+
+/* Superblock checksum: the whole block but the checksum field */
+uint32_t sfs_sb_csum(const char *sb_block, uint32_t block_size);
+
+/* Read or write @count blocks of @block_size bytes at block @block. Return
+ * -1 with errno set on failure, EIO for a short read.
+ */
+int sfs_read_blocks(int fd,
+                    uint32_t block_size,
+                    void *buf,
+                    uint32_t block,
+                    uint32_t count);
+int sfs_write_blocks(int fd,
+                     uint32_t block_size,
+                     const void *buf,
+                     uint32_t block,
+                     uint32_t count);
+
+/* Whether the internal journal of the partition described by @sbi (host
+ * order) holds transactions the kernel has not replayed yet
+ */
+int sfs_journal_needs_recovery(int fd,
+                               uint32_t block_size,
+                               const struct simplefs_sb_info *sbi);
+
+/* Block allocation policies of sfs_alloc_blocks(). The kernel has first
+ * fit; the others are there to compare it with, e.g. with script/aging.
+ */
+enum sfs_alloc_policy {
+    SFS_ALLOC_FIRST_FIT, /* the lowest free run, as get_first_free_bits() */
+    SFS_ALLOC_NEXT_FIT,  /* the first free run after the last allocation */
+    SFS_ALLOC_BEST_FIT,  /* the shortest free run that is long enough */
+};
+
+/* An open partition. The free bitmaps and counters live in sbi, as in the
+ * kernel. @lock serializes allocations and inode store updates; callers
+ * serialize changes to a given file or directory themselves.
+ */
+struct sfs {
+    int fd;
+    uint32_t block_size;
+    struct simplefs_sb_info sbi; /* host order, with the in-memory bitmaps */
+    char *sb_block;              /* superblock as read from disk */
+    uint8_t *bitmap_dirty;       /* per bitmap block, ifree blocks first */
+    char *csum_table;            /* bitmap checksums, with metadata_csum */
+    uint32_t itable_init;        /* first inode store block never used */
+    enum sfs_alloc_policy alloc_policy; /* first fit after sfs_open() */
+    uint32_t alloc_cursor;              /* next fit: end of the last run */
+    pthread_mutex_t lock;
+};
+
+/* Open @path, read-write if @writable: -EUCLEAN if its journal needs
+ * recovery. Calls return 0 or a negative errno.
+ */
+int sfs_open(struct sfs *fs, const char *path, int writable);
+int sfs_sync(struct sfs *fs);
+void sfs_close(struct sfs *fs);
+
+/* Index, directory and inode store blocks, with their checksums verified or
+ * set. @buf is one block.
+ */
+int sfs_read_meta(struct sfs *fs, uint32_t block, void *buf);
+int sfs_write_meta(struct sfs *fs, uint32_t block, void *buf);
+
+int sfs_read_inode(struct sfs *fs, uint32_t ino, struct simplefs_inode *inode);
+int sfs_write_inode(struct sfs *fs,
+                    uint32_t ino,
+                    const struct simplefs_inode *inode);
+
+/* Allocators, as bitmap.h: the lowest free run first, 0 if there is none.
+ * Blocks are zeroed, inode store blocks initialized with lazy_itable.
+ */
+uint32_t sfs_alloc_inode(struct sfs *fs);
+void sfs_free_inode(struct sfs *fs, uint32_t ino);
+uint32_t sfs_alloc_blocks(struct sfs *fs, uint32_t len);
+void sfs_free_blocks(struct sfs *fs, uint32_t start, uint32_t len);
+
+/* Allocate inode @ino of @mode and, but for symbolic links which keep their
+ * target in i_data, its index block. @inode is set up but not written.
+ */
+int sfs_new_inode(struct sfs *fs,
+                  uint32_t mode,
+                  uint32_t *ino,
+                  struct simplefs_inode *inode);
+
+/* Free the blocks and the inode of @ino, whose last link is gone */
+int sfs_free_file(struct sfs *fs, uint32_t ino, struct simplefs_inode *inode);
+
+/* Regular file data. Writes allocate extents like simplefs_file_get_block()
+ * and update @inode on disk. Return the number of bytes or a negative errno.
+ */
+ssize_t sfs_file_read(struct sfs *fs,
+                      const struct simplefs_inode *inode,
+                      void *buf,
+                      size_t size,
+                      uint64_t off);
+ssize_t sfs_file_write(struct sfs *fs,
+                       uint32_t ino,
+                       struct simplefs_inode *inode,
+                       const void *buf,
+                       size_t size,
+                       uint64_t off);
+int sfs_truncate(struct sfs *fs,
+                 uint32_t ino,
+                 struct simplefs_inode *inode,
+                 uint64_t size);
+
+/* Directories. sfs_dir_iterate() stops when @fill returns non-zero and
+ * returns that value.
+ */
+typedef int (*sfs_filldir_t)(void *ctx, const char *name, uint32_t ino);
+int sfs_dir_iterate(struct sfs *fs,
+                    const struct simplefs_inode *dir,
+                    sfs_filldir_t fill,
+                    void *ctx);
+int sfs_dir_lookup(struct sfs *fs,
+                   const struct simplefs_inode *dir,
+                   const char *name,
+                   uint32_t *ino);
+int sfs_dir_add(struct sfs *fs,
+                const struct simplefs_inode *dir,
+                const char *name,
+                uint32_t ino);
+int sfs_dir_remove(struct sfs *fs,
+                   const struct simplefs_inode *dir,
+                   const char *name,
+                   uint32_t ino);
+
+#endif /* LIBSIMPLEFS_H */
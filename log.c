@@ -0,0 +1,465 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/pagemap.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* Log-structured allocation, with the log mount option, for devices where
+ * small random writes are expensive: SMR disks, cheap flash.
+ *
+ * The data area is cut into segments of SIMPLEFS_LOG_SEGMENT_BLOCKS blocks.
+ * File data is appended at the head of the log, in a segment that was
+ * entirely free when the head reached it, and a write to an extent outside
+ * that segment first moves the extent to the head, see
+ * simplefs_unshare_range(): overwrites are sequential too. Metadata is not
+ * moved: its updates are appended to the journal, and checkpointed in place.
+ * Its blocks (index, directory and refcount blocks) are kept out of the log,
+ * in the blocks before the first segment and after the last one, then in
+ * segments of their own, taken from the end of the partition.
+ *
+ * Moved extents leave holes in older segments. A background cleaner runs
+ * every SIMPLEFS_LOG_CLEAN_INTERVAL, or as soon as no segment is entirely
+ * free: it picks the least used segments and moves the extents in them to
+ * the head. There is no reverse map, so it walks the inodes in use.
+ * Segments a run could not free, holding shared extents or metadata written
+ * before the mount, are left alone until they are free.
+ *
+ * Every block allocated is zeroed before its data is written, see
+ * get_free_blocks_in(): both writes count in the write amplification.
+ */
+
+#define SIMPLEFS_LOG_SEGMENT_BLOCKS 512 /* a multiple of BITS_PER_LONG */
+#define SIMPLEFS_LOG_CLEAN_INTERVAL (30 * HZ)
+#define SIMPLEFS_LOG_MIN_FREE 10    /* % of segments kept entirely free */
+#define SIMPLEFS_LOG_MAX_USED 50    /* % of blocks in use of a victim */
+#define SIMPLEFS_LOG_MAX_VICTIMS 16 /* segments cleaned per run */
+
+struct simplefs_log {
+    struct super_block *sb;
+    spinlock_t lock;        /* protects head, seg_end and stopped */
+    uint32_t head;          /* next block of the open segment */
+    uint32_t seg_end;       /* end of the open segment, 0 if none */
+    uint32_t first_seg;     /* first segment past the bitmaps */
+    uint32_t nr_segs;       /* whole segments of the partition */
+    unsigned long *victims; /* segments being cleaned */
+    unsigned long *meta;    /* segments of metadata blocks */
+    unsigned long *pinned;  /* segments the cleaner could not free */
+    bool stopped;           /* the cleaner is not queued any more */
+    struct delayed_work work;
+
+    /* Shown in /proc/self/mountstats */
+    atomic64_t user_bytes;   /* written by write() */
+    atomic64_t log_blocks;   /* appended to the log */
+    atomic64_t zero_blocks;  /* zeroed before they were appended */
+    atomic64_t nr_full;      /* times no segment was entirely free */
+    atomic64_t clean_runs;   /* cleaner runs that had victims */
+    atomic64_t clean_segs;   /* segments the cleaner freed */
+    atomic64_t clean_blocks; /* blocks moved by the cleaner */
+    atomic64_t clean_inodes; /* inodes scanned by the cleaner */
+    atomic64_t clean_ns;     /* time spent cleaning */
+};
+
+/* Blocks of segment @seg in use */
+static uint32_t simplefs_log_seg_used(struct super_block *sb, uint32_t seg)
+{
+    unsigned long *map = SIMPLEFS_SB(sb)->bfree_bitmap;
+
+    return SIMPLEFS_LOG_SEGMENT_BLOCKS -
+           bitmap_weight(map + seg * (SIMPLEFS_LOG_SEGMENT_BLOCKS /
+                                      BITS_PER_LONG),
+                         SIMPLEFS_LOG_SEGMENT_BLOCKS);
+}
+
+/* Open the first entirely free segment after the open one, which ends at
+ * @end. Returns false if there is none.
+ */
+static bool simplefs_log_open_next(struct simplefs_log *log, uint32_t end)
+{
+    uint32_t seg = DIV_ROUND_UP(end, SIMPLEFS_LOG_SEGMENT_BLOCKS), i;
+
+    for (i = log->first_seg; i < log->nr_segs; i++, seg++) {
+        if (seg < log->first_seg || seg >= log->nr_segs)
+            seg = log->first_seg;
+        if (test_bit(seg, log->victims) || test_bit(seg, log->meta) ||
+            simplefs_log_seg_used(log->sb, seg))
+            continue;
+
+        spin_lock(&log->lock);
+        /* Unless another writer opened one meanwhile */
+        if (log->seg_end == end) {
+            log->head = seg * SIMPLEFS_LOG_SEGMENT_BLOCKS;
+            log->seg_end = log->head + SIMPLEFS_LOG_SEGMENT_BLOCKS;
+        }
+        spin_unlock(&log->lock);
+        return true;
+    }
+    return false;
+}
+
+/* Blocks for file data, at the head of the log. Returns 0 when no segment is
+ * entirely free: the caller allocates anywhere until the cleaner frees one.
+ */
+uint32_t simplefs_log_alloc(struct super_block *sb, uint32_t len)
+{
+    struct simplefs_log *log = SIMPLEFS_SB(sb)->log;
+    uint32_t head, end, bno;
+
+    for (;;) {
+        spin_lock(&log->lock);
+        head = log->head;
+        end = log->seg_end;
+        spin_unlock(&log->lock);
+        if (!end)
+            return 0;
+
+        bno = get_free_blocks_in(sb, len, head, end);
+        if (bno) {
+            spin_lock(&log->lock);
+            if (log->seg_end == end && bno + len > log->head)
+                log->head = bno + len;
+            spin_unlock(&log->lock);
+            atomic64_add(len, &log->log_blocks);
+            atomic64_add(len, &log->zero_blocks);
+            return bno;
+        }
+        if (!simplefs_log_open_next(log, end))
+            break;
+    }
+
+    spin_lock(&log->lock);
+    if (log->seg_end == end) {
+        log->seg_end = 0;
+        atomic64_inc(&log->nr_full);
+        if (!log->stopped)
+            mod_delayed_work(system_wq, &log->work, 0);
+    }
+    spin_unlock(&log->lock);
+    return 0;
+}
+
+/* Blocks for metadata, out of the log: before the first segment or after
+ * the last one, else in a segment of metadata, else in a new one from the
+ * end of the partition. Returns 0 if there is none: the caller allocates
+ * anywhere.
+ */
+uint32_t simplefs_log_alloc_meta(struct super_block *sb, uint32_t len)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_log *log = sbi->log;
+    uint32_t seg, bno;
+    bool open;
+
+    bno = get_free_blocks_in(sb, len, 0,
+                             log->first_seg * SIMPLEFS_LOG_SEGMENT_BLOCKS);
+    if (!bno)
+        bno = get_free_blocks_in(sb, len,
+                                 log->nr_segs * SIMPLEFS_LOG_SEGMENT_BLOCKS,
+                                 sbi->dev_blocks[0]);
+    if (bno || len > SIMPLEFS_LOG_SEGMENT_BLOCKS)
+        return bno;
+
+    for_each_set_bit (seg, log->meta, log->nr_segs) {
+        bno = get_free_blocks_in(sb, len, seg * SIMPLEFS_LOG_SEGMENT_BLOCKS,
+                                 (seg + 1) * SIMPLEFS_LOG_SEGMENT_BLOCKS);
+        if (bno)
+            return bno;
+    }
+    for (seg = log->nr_segs; seg-- > log->first_seg;) {
+        /* Claimed first, so that simplefs_log_open_next() skips it */
+        if (test_bit(seg, log->victims) || test_and_set_bit(seg, log->meta))
+            continue;
+        spin_lock(&log->lock);
+        open = log->seg_end == (seg + 1) * SIMPLEFS_LOG_SEGMENT_BLOCKS;
+        spin_unlock(&log->lock);
+        if (open || simplefs_log_seg_used(sb, seg)) {
+            clear_bit(seg, log->meta);
+            continue;
+        }
+        bno = get_free_blocks_in(sb, len, seg * SIMPLEFS_LOG_SEGMENT_BLOCKS,
+                                 (seg + 1) * SIMPLEFS_LOG_SEGMENT_BLOCKS);
+        if (bno)
+            return bno;
+        clear_bit(seg, log->meta);
+    }
+    return 0;
+}
+
+/* Whether a write to the extent at @bno first moves it to the head. Extents
+ * of the open segment are written in place, as are all of them while no
+ * segment is free.
+ */
+bool simplefs_log_cow(struct super_block *sb, uint32_t bno)
+{
+    struct simplefs_log *log = SIMPLEFS_SB(sb)->log;
+    bool cow;
+
+    if (!log)
+        return false;
+    spin_lock(&log->lock);
+    cow = log->seg_end && (bno >= log->seg_end ||
+                           bno < log->seg_end - SIMPLEFS_LOG_SEGMENT_BLOCKS);
+    spin_unlock(&log->lock);
+    return cow;
+}
+
+/* Whether the extent at @bno is in a segment being cleaned */
+bool simplefs_log_victim(struct super_block *sb, uint32_t bno)
+{
+    struct simplefs_log *log = SIMPLEFS_SB(sb)->log;
+    uint32_t seg = bno / SIMPLEFS_LOG_SEGMENT_BLOCKS;
+
+    return log && seg < log->nr_segs && test_bit(seg, log->victims);
+}
+
+/* Account @bytes written by write() */
+void simplefs_log_written(struct super_block *sb, size_t bytes)
+{
+    struct simplefs_log *log = SIMPLEFS_SB(sb)->log;
+
+    if (log)
+        atomic64_add(bytes, &log->user_bytes);
+}
+
+/* Mark the least used segments as victims, if less than
+ * SIMPLEFS_LOG_MIN_FREE percent of the segments are entirely free. Returns
+ * the number of victims.
+ */
+static uint32_t simplefs_log_pick(struct simplefs_log *log)
+{
+    uint32_t segs[SIMPLEFS_LOG_MAX_VICTIMS], used[SIMPLEFS_LOG_MAX_VICTIMS];
+    uint32_t seg, open, u, i, n = 0, nr_free = 0;
+
+    spin_lock(&log->lock);
+    open = log->seg_end ? log->seg_end / SIMPLEFS_LOG_SEGMENT_BLOCKS - 1
+                        : UINT_MAX;
+    spin_unlock(&log->lock);
+
+    for (seg = log->first_seg; seg < log->nr_segs; seg++) {
+        u = simplefs_log_seg_used(log->sb, seg);
+        if (!u) {
+            clear_bit(seg, log->pinned);
+            nr_free++;
+            continue;
+        }
+        if (seg == open || test_bit(seg, log->meta) ||
+            test_bit(seg, log->pinned) ||
+            u * 100 > SIMPLEFS_LOG_SEGMENT_BLOCKS * SIMPLEFS_LOG_MAX_USED)
+            continue;
+        if (n == SIMPLEFS_LOG_MAX_VICTIMS) {
+            if (u >= used[n - 1])
+                continue;
+            n--;
+        }
+        /* Sorted by blocks in use */
+        for (i = n++; i && used[i - 1] > u; i--) {
+            segs[i] = segs[i - 1];
+            used[i] = used[i - 1];
+        }
+        segs[i] = seg;
+        used[i] = u;
+        cond_resched();
+    }
+
+    if (nr_free * 100 >=
+        (log->nr_segs - log->first_seg) * SIMPLEFS_LOG_MIN_FREE)
+        return 0;
+    for (i = 0; i < n; i++)
+        set_bit(segs[i], log->victims);
+    return n;
+}
+
+/* Move the data of the victims to the head, walking the inodes in use */
+static void simplefs_log_clean(struct simplefs_log *log)
+{
+    struct super_block *sb = log->sb;
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t ino = 1, seg;
+    struct inode *inode;
+    int moved;
+
+    while ((ino = find_next_zero_bit(sbi->ifree_bitmap, sbi->nr_inodes,
+                                     ino)) < sbi->nr_inodes &&
+           !READ_ONCE(log->stopped)) {
+        if (ino == sbi->journal_ino)
+            goto next;
+        inode = simplefs_iget(sb, ino);
+        if (IS_ERR(inode))
+            goto next;
+        atomic64_inc(&log->clean_inodes);
+
+        /* Inodes being created are still zeroed on disk */
+        inode_lock(inode);
+        moved = 0;
+        if (S_ISREG(inode->i_mode) && inode->i_nlink &&
+            SIMPLEFS_INODE(inode)->ei_block)
+            moved = simplefs_log_move_extents(inode);
+        inode_unlock(inode);
+        if (moved > 0) {
+            atomic64_add(moved, &log->clean_blocks);
+            filemap_fdatawrite(inode->i_mapping);
+        }
+        iput(inode);
+    next:
+        ino++;
+        cond_resched();
+    }
+
+    /* The moved extents are only final once their transaction commits */
+    if (sbi->journal)
+        jbd2_journal_force_commit(sbi->journal);
+    for_each_set_bit (seg, log->victims, log->nr_segs) {
+        if (!simplefs_log_seg_used(sb, seg))
+            atomic64_inc(&log->clean_segs);
+        else
+            set_bit(seg, log->pinned);
+    }
+    bitmap_zero(log->victims, log->nr_segs);
+}
+
+static void simplefs_log_work(struct work_struct *work)
+{
+    struct simplefs_log *log =
+        container_of(to_delayed_work(work), struct simplefs_log, work);
+    struct super_block *sb = log->sb;
+    u64 start = ktime_get_ns();
+
+    /* Blocks freed since the log was last full may make a free segment */
+    if (!READ_ONCE(log->seg_end))
+        simplefs_log_open_next(log, 0);
+    if (!sb_rdonly(sb) && sb_start_write_trylock(sb)) {
+        if (simplefs_log_pick(log)) {
+            atomic64_inc(&log->clean_runs);
+            simplefs_log_clean(log);
+            atomic64_add(ktime_get_ns() - start, &log->clean_ns);
+            if (!READ_ONCE(log->seg_end))
+                simplefs_log_open_next(log, 0);
+        }
+        sb_end_write(sb);
+    }
+
+    spin_lock(&log->lock);
+    if (!log->stopped)
+        schedule_delayed_work(&log->work, SIMPLEFS_LOG_CLEAN_INTERVAL);
+    spin_unlock(&log->lock);
+}
+
+/* super_operations.show_stats: counters of the log, in /proc/self/mountstats */
+int simplefs_log_show_stats(struct seq_file *m, struct dentry *root)
+{
+    struct super_block *sb = root->d_sb;
+    struct simplefs_log *log = SIMPLEFS_SB(sb)->log;
+    uint64_t user, appended, zeroed, wa;
+    uint32_t seg, nr_free = 0;
+
+    if (!log)
+        return 0;
+    for (seg = log->first_seg; seg < log->nr_segs; seg++) {
+        if (!simplefs_log_seg_used(sb, seg))
+            nr_free++;
+    }
+    user = DIV_ROUND_UP_ULL(atomic64_read(&log->user_bytes), sb->s_blocksize);
+    appended = atomic64_read(&log->log_blocks);
+    zeroed = atomic64_read(&log->zero_blocks);
+    /* Blocks written to the log per block written, in hundredths */
+    wa = user ? div64_u64((appended + zeroed) * 100, user) : 0;
+
+    seq_printf(m,
+               "\n\tlog: segments=%u free_segments=%u written_blocks=%llu "
+               "appended_blocks=%llu zeroed_blocks=%llu "
+               "write_amplification=%llu.%02llu full=%llu",
+               log->nr_segs - log->first_seg, nr_free, user, appended, zeroed,
+               wa / 100, wa % 100, (u64) atomic64_read(&log->nr_full));
+    seq_printf(m,
+               "\n\tcleaner: runs=%llu freed_segments=%llu moved_blocks=%llu "
+               "scanned_inodes=%llu time_us=%llu",
+               (u64) atomic64_read(&log->clean_runs),
+               (u64) atomic64_read(&log->clean_segs),
+               (u64) atomic64_read(&log->clean_blocks),
+               (u64) atomic64_read(&log->clean_inodes),
+               div_u64(atomic64_read(&log->clean_ns), NSEC_PER_USEC));
+    return 0;
+}
+
+/* Set up the log if mounted with the log option. Needs the bfree bitmap. */
+int simplefs_log_init(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_log *log;
+
+    if (!(sbi->s_mount_opt & SIMPLEFS_MOUNT_LOG))
+        return 0;
+    /* Compressed and striped extents are placed by their own rules */
+    if (simplefs_has_stripe(sb) || sbi->s_mount_opt & SIMPLEFS_MOUNT_COMPRESS) {
+        pr_err("log not supported with compress or on several devices\n");
+        return -EINVAL;
+    }
+
+    log = kzalloc(sizeof(*log), GFP_KERNEL);
+    if (!log)
+        return -ENOMEM;
+    log->nr_segs = sbi->nr_blocks / SIMPLEFS_LOG_SEGMENT_BLOCKS;
+    log->first_seg =
+        DIV_ROUND_UP(simplefs_bfree_start(sbi) + sbi->nr_bfree_blocks,
+                     SIMPLEFS_LOG_SEGMENT_BLOCKS);
+    log->first_seg = min(log->first_seg, log->nr_segs);
+    log->victims = kcalloc(BITS_TO_LONGS(log->nr_segs + 1),
+                           sizeof(unsigned long), GFP_KERNEL);
+    log->meta = kcalloc(BITS_TO_LONGS(log->nr_segs + 1),
+                        sizeof(unsigned long), GFP_KERNEL);
+    log->pinned = kcalloc(BITS_TO_LONGS(log->nr_segs + 1),
+                          sizeof(unsigned long), GFP_KERNEL);
+    if (!log->victims || !log->meta || !log->pinned) {
+        kfree(log->victims);
+        kfree(log->meta);
+        kfree(log->pinned);
+        kfree(log);
+        return -ENOMEM;
+    }
+    log->sb = sb;
+    spin_lock_init(&log->lock);
+    INIT_DELAYED_WORK(&log->work, simplefs_log_work);
+    sbi->log = log;
+
+    if (!simplefs_log_open_next(log, 0))
+        pr_warn("log: no free segment of %u blocks yet\n",
+                SIMPLEFS_LOG_SEGMENT_BLOCKS);
+    schedule_delayed_work(&log->work, SIMPLEFS_LOG_CLEAN_INTERVAL);
+    return 0;
+}
+
+/* Stop the cleaner. Called at unmount before the inodes are evicted. */
+void simplefs_log_stop(struct super_block *sb)
+{
+    struct simplefs_log *log = SIMPLEFS_SB(sb)->log;
+
+    if (!log)
+        return;
+    spin_lock(&log->lock);
+    log->stopped = true;
+    spin_unlock(&log->lock);
+    cancel_delayed_work_sync(&log->work);
+}
+
+void simplefs_log_release(struct super_block *sb)
+{
+    struct simplefs_log *log = SIMPLEFS_SB(sb)->log;
+
+    if (!log)
+        return;
+    simplefs_log_stop(sb);
+    SIMPLEFS_SB(sb)->log = NULL;
+    kfree(log->victims);
+    kfree(log->meta);
+    kfree(log->pinned);
+    kfree(log);
+}
@@ -1,23 +1,32 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
+#include <pthread.h>
+#include <search.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/random.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "simplefs.h"
+#include "libsimplefs.h"
 
 struct superblock {
     union {
         struct simplefs_sb_info info;
-        char padding[SIMPLEFS_BLOCK_SIZE]; /* Padding to match block size */
+        char padding[SIMPLEFS_MAX_BLOCK_SIZE]; /* Room for any block size */
     };
 };
 
-_Static_assert(sizeof(struct superblock) == SIMPLEFS_BLOCK_SIZE);
+_Static_assert(sizeof(struct superblock) == SIMPLEFS_MAX_BLOCK_SIZE);
 
 /**
  * DIV_ROUND_UP - round up a division
@@ -28,23 +37,257 @@ _Static_assert(sizeof(struct superblock) == SIMPLEFS_BLOCK_SIZE);
  */
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
-static struct superblock *write_superblock(int fd, struct stat *fstats)
+/* Inode reserved for the internal journal */
+#define SIMPLEFS_JOURNAL_INO 2
+
+/* Minimal jbd2 on-disk superblock, big-endian (see include/linux/jbd2.h). The
+ * rest of the block is left zeroed.
+ */
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+#define JBD2_SUPERBLOCK_V2 4
+#define JBD2_MIN_JOURNAL_BLOCKS 1024
+
+struct jbd2_superblock {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;
+    uint32_t s_first;
+    uint32_t s_sequence;
+    uint32_t s_start;
+    uint32_t s_errno;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t s_uuid[16];
+    uint32_t s_nr_users;
+};
+
+/* Block size in bytes, selected with -b */
+static uint32_t block_size = SIMPLEFS_BLOCK_SIZE;
+
+/* Default journal size in blocks for a partition of @size bytes, following
+ * the mke2fs defaults for 4 KiB blocks. Zero when the partition is too small
+ * to hold a journal.
+ */
+static uint32_t default_journal_blocks(uint64_t size)
+{
+    uint64_t mb = size >> 20;
+    uint32_t journal_mb;
+
+    if (mb < 8)
+        return 0;
+    if (mb < 128)
+        journal_mb = 4;
+    else if (mb < 1024)
+        journal_mb = 16;
+    else if (mb < 2048)
+        journal_mb = 32;
+    else if (mb < 16384)
+        journal_mb = 64;
+    else if (mb < 32768)
+        journal_mb = 128;
+    else if (mb < 65536)
+        journal_mb = 256;
+    else if (mb < 131072)
+        journal_mb = 512;
+    else
+        journal_mb = 1024;
+
+    uint32_t nr = journal_mb * (1024 * 1024 / block_size);
+    return nr < JBD2_MIN_JOURNAL_BLOCKS ? JBD2_MIN_JOURNAL_BLOCKS : nr;
+}
+
+/* Largest journal, bounded by the 32-bit inode size */
+#define SIMPLEFS_MAX_JOURNAL_MB 1024
+
+/* Journal size in blocks, set by write_superblock() */
+static uint32_t nr_journal_blocks;
+
+/* Inodes and blocks in use, all at the start of the partition: the ones of
+ * the metadata, root and journal set by write_superblock(), followed by the
+ * tree of -d laid out by layout_tree().
+ */
+static uint32_t nr_used_inodes;
+static uint32_t nr_used_blocks;
+
+/* SIMPLEFS_FEATURE_* flags selected with -O */
+static uint32_t features;
+
+/* Devices of a striped partition: the disk, then the ones of -D. Their sizes
+ * are set by open_member() and write_superblock().
+ */
+static const char *member_paths[SIMPLEFS_MAX_DEVICES];
+static int member_fds[SIMPLEFS_MAX_DEVICES];
+static uint32_t dev_blocks[SIMPLEFS_MAX_DEVICES];
+static uint32_t nr_devices = 1;
+
+/* Store the checksum of an inode store, index or directory block */
+static void set_sfs_block_csum(uint32_t block, char *data)
+{
+    if (!(features & SIMPLEFS_FEATURE_METADATA_CSUM))
+        return;
+    *(uint32_t *) (data + SIMPLEFS_CSUM_OFFSET(block_size)) =
+        htole32(sfs_block_csum(block, data, SIMPLEFS_CSUM_OFFSET(block_size)));
+}
+
+/* Blocks of the bitmap checksum table, set by write_superblock() and filled
+ * by write_bitmap()
+ */
+static char *csum_table;
+
+/* Store the checksum of a bitmap block in the checksum table */
+static void set_bitmap_csum(struct superblock *sb,
+                            uint32_t block,
+                            const char *data)
+{
+    uint32_t per_block = SIMPLEFS_CSUMS_PER_BLOCK(block_size);
+    uint32_t idx = block - 1 - le32toh(sb->info.nr_istore_blocks);
+
+    if (!(features & SIMPLEFS_FEATURE_METADATA_CSUM))
+        return;
+    ((uint32_t *) (csum_table + (size_t) (idx / per_block) * block_size))
+        [idx % per_block] = htole32(sfs_block_csum(block, data, block_size));
+}
+
+/* Formatting writes in chunks of MKFS_IO_BLOCKS blocks */
+#define MKFS_IO_SIZE (4 << 20)
+#define MKFS_IO_BLOCKS (MKFS_IO_SIZE / block_size)
+
+/* Whether the disk is a block device, set by main() */
+static int is_blkdev;
+
+/* Write @count blocks from @buf, starting at block @block */
+static int write_blocks(int fd, const char *buf, uint32_t block, uint32_t count)
+{
+    return sfs_write_blocks(fd, block_size, buf, block, count);
+}
+
+/* Zero @count blocks from block @block, letting the device or the filesystem
+ * holding the image do it when it can: BLKZEROOUT uses the device write-zeroes
+ * or unmap commands, and punching a hole in an image file frees its blocks.
+ */
+static int zero_blocks(int fd, uint32_t block, uint32_t count)
+{
+    uint64_t range[2] = {(uint64_t) block * block_size,
+                         (uint64_t) count * block_size};
+
+    if (!count)
+        return 0;
+    if (is_blkdev ? !ioctl(fd, BLKZEROOUT, range)
+                  : !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                               range[0], range[1]))
+        return 0;
+
+    /* Not supported: write zeroes */
+    char *buf = calloc(MKFS_IO_BLOCKS, block_size);
+    if (!buf)
+        return -1;
+    int ret = 0;
+    for (uint32_t n; count && !ret; block += n, count -= n) {
+        n = count < MKFS_IO_BLOCKS ? count : MKFS_IO_BLOCKS;
+        ret = write_blocks(fd, buf, block, n);
+    }
+    free(buf);
+    return ret;
+}
+
+/* First data block: holds the root directory index block */
+static uint32_t first_data_block(struct superblock *sb)
+{
+    return 1 + le32toh(sb->info.nr_istore_blocks) +
+           le32toh(sb->info.nr_ifree_blocks) +
+           le32toh(sb->info.nr_bfree_blocks);
+}
+
+static struct superblock *write_superblock(int fd,
+                                           struct stat *fstats,
+                                           long journal_mb,
+                                           uint32_t nr_inodes)
 {
     struct superblock *sb = malloc(sizeof(struct superblock));
     if (!sb)
         return NULL;
 
-    uint32_t nr_blocks = fstats->st_size / SIMPLEFS_BLOCK_SIZE;
-    uint32_t nr_inodes = nr_blocks;
-    uint32_t mod = nr_inodes % SIMPLEFS_INODES_PER_BLOCK;
+    /* Metadata is on this device, the data of striped files on all of them */
+    uint32_t nr_dev_blocks = fstats->st_size / block_size;
+    uint64_t total = nr_dev_blocks;
+    for (uint32_t i = 1; i < nr_devices; i++)
+        total += dev_blocks[i];
+    if (total > UINT32_MAX) {
+        fprintf(stderr, "Too many blocks (%llu) over the devices\n",
+                (unsigned long long) total);
+        free(sb);
+        errno = EFBIG;
+        return NULL;
+    }
+    uint32_t nr_blocks = total;
+    uint32_t inodes_per_block = SIMPLEFS_INODES_PER_BLOCK(block_size);
+    dev_blocks[0] = nr_dev_blocks;
+
+    /* One inode per block by default: each file takes at least an index block.
+     * The count is rounded up to fill the last inode store block.
+     */
+    if (!nr_inodes)
+        nr_inodes = nr_dev_blocks;
+    if (nr_inodes < 3)
+        nr_inodes = 3;
+    if (nr_inodes > UINT32_MAX - inodes_per_block)
+        nr_inodes = UINT32_MAX - inodes_per_block;
+    uint32_t mod = nr_inodes % inodes_per_block;
     if (mod)
-        nr_inodes += SIMPLEFS_INODES_PER_BLOCK - mod;
-    uint32_t nr_istore_blocks =
-        DIV_ROUND_UP(nr_inodes, SIMPLEFS_INODES_PER_BLOCK);
-    uint32_t nr_ifree_blocks = DIV_ROUND_UP(nr_inodes, SIMPLEFS_BLOCK_SIZE * 8);
-    uint32_t nr_bfree_blocks = DIV_ROUND_UP(nr_blocks, SIMPLEFS_BLOCK_SIZE * 8);
-    uint32_t nr_data_blocks =
-        nr_blocks - nr_istore_blocks - nr_ifree_blocks - nr_bfree_blocks;
+        nr_inodes += inodes_per_block - mod;
+    uint32_t nr_istore_blocks = nr_inodes / inodes_per_block;
+    uint32_t nr_ifree_blocks = DIV_ROUND_UP(nr_inodes, block_size * 8);
+    uint32_t nr_bfree_blocks = DIV_ROUND_UP(nr_blocks, block_size * 8);
+    uint32_t nr_csum_blocks = 0;
+    if (features & SIMPLEFS_FEATURE_METADATA_CSUM)
+        nr_csum_blocks = DIV_ROUND_UP(nr_ifree_blocks + nr_bfree_blocks,
+                                      SIMPLEFS_CSUMS_PER_BLOCK(block_size));
+    if ((uint64_t) nr_istore_blocks + nr_ifree_blocks + nr_bfree_blocks +
+            nr_csum_blocks + 4 >
+        nr_dev_blocks) {
+        fprintf(stderr, "Too many inodes (%u) for %u blocks\n", nr_inodes,
+                nr_dev_blocks);
+        free(sb);
+        errno = EINVAL;
+        return NULL;
+    }
+    /* The checksum table follows the journal, see below */
+    uint32_t nr_data_blocks = nr_dev_blocks - nr_istore_blocks -
+                              nr_ifree_blocks - nr_bfree_blocks -
+                              nr_csum_blocks;
+
+    /* The journal takes an index block and a contiguous run of data blocks */
+    uint32_t max_journal_blocks = nr_data_blocks / 2 - 2;
+    if (journal_mb < 0) {
+        nr_journal_blocks = default_journal_blocks(fstats->st_size);
+        if (nr_journal_blocks > max_journal_blocks)
+            nr_journal_blocks = 0;
+    } else {
+        nr_journal_blocks = journal_mb * (1024 * 1024 / block_size);
+    }
+    if (nr_journal_blocks && (nr_journal_blocks < JBD2_MIN_JOURNAL_BLOCKS ||
+                              nr_journal_blocks > max_journal_blocks)) {
+        fprintf(stderr,
+                "Journal size must be between %d and %u blocks, or 0 to "
+                "disable it\n",
+                JBD2_MIN_JOURNAL_BLOCKS, max_journal_blocks);
+        free(sb);
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t nr_journal_inodes = 0;
+    if (nr_journal_blocks) {
+        nr_data_blocks -= 1 + nr_journal_blocks;
+        nr_journal_inodes = 1;
+    }
+    /* Inode 0 is reserved, and the root index block is the first data block.
+     * nr_data_blocks does not count the superblock.
+     */
+    nr_used_inodes = 2 + nr_journal_inodes;
+    nr_used_blocks = nr_dev_blocks - nr_data_blocks + 2;
 
     memset(sb, 0, sizeof(struct superblock));
     sb->info = (struct simplefs_sb_info){
@@ -54,195 +297,630 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         .nr_istore_blocks = htole32(nr_istore_blocks),
         .nr_ifree_blocks = htole32(nr_ifree_blocks),
         .nr_bfree_blocks = htole32(nr_bfree_blocks),
-        .nr_free_inodes = htole32(nr_inodes - 1),
-        .nr_free_blocks = htole32(nr_data_blocks - 1),
+        .nr_free_inodes = htole32(nr_inodes - nr_used_inodes),
+        .nr_free_blocks = htole32(nr_blocks - nr_used_blocks - nr_devices + 1),
+        .journal_ino = htole32(nr_journal_inodes ? SIMPLEFS_JOURNAL_INO : 0),
+        .features = htole32(features),
+        .block_size = htole32(block_size),
     };
+    if (nr_csum_blocks) {
+        csum_table = calloc(nr_csum_blocks, block_size);
+        if (!csum_table) {
+            free(sb);
+            return NULL;
+        }
+        sb->info.csum_start = htole32(nr_used_blocks - nr_csum_blocks);
+        sb->info.nr_csum_blocks = htole32(nr_csum_blocks);
+    }
+    if (nr_devices > 1) {
+        sb->info.nr_devices = htole32(nr_devices);
+        if (getrandom(&sb->info.set_id, sizeof(sb->info.set_id), 0) !=
+            sizeof(sb->info.set_id))
+            sb->info.set_id = htole32(time(NULL) ^ getpid());
+        for (uint32_t i = 0; i < nr_devices; i++)
+            sb->info.dev_blocks[i] = htole32(dev_blocks[i]);
+    }
 
-    int ret = write(fd, sb, sizeof(struct superblock));
-    if (ret != sizeof(struct superblock)) {
+    if (write_blocks(fd, sb->padding, SIMPLEFS_SB_BLOCK_NR, 1)) {
         free(sb);
         return NULL;
     }
 
     printf(
-        "Superblock: (%ld)\n"
+        "Superblock: (%u)\n"
         "\tmagic=%#x\n"
         "\tnr_blocks=%u\n"
         "\tnr_inodes=%u (istore=%u blocks)\n"
         "\tnr_ifree_blocks=%u\n"
         "\tnr_bfree_blocks=%u\n"
         "\tnr_free_inodes=%u\n"
-        "\tnr_free_blocks=%u\n",
-        sizeof(struct superblock), sb->info.magic, sb->info.nr_blocks,
+        "\tnr_free_blocks=%u\n"
+        "\tjournal_ino=%u (%u blocks)\n"
+        "\tfeatures=%#x\n",
+        block_size, sb->info.magic, sb->info.nr_blocks,
         sb->info.nr_inodes, sb->info.nr_istore_blocks, sb->info.nr_ifree_blocks,
         sb->info.nr_bfree_blocks, sb->info.nr_free_inodes,
-        sb->info.nr_free_blocks);
+        sb->info.nr_free_blocks, sb->info.journal_ino, nr_journal_blocks,
+        sb->info.features);
+    if (nr_devices > 1)
+        printf("\tnr_devices=%u (set %#x)\n", nr_devices,
+               le32toh(sb->info.set_id));
 
     return sb;
 }
 
-static int write_inode_store(int fd, struct superblock *sb)
+/* Rewrite the superblock once the free counts are known */
+static int update_superblock(int fd, struct superblock *sb)
+{
+    sb->info.nr_free_inodes =
+        htole32(le32toh(sb->info.nr_inodes) - nr_used_inodes);
+    /* Block 0 of the other devices holds their header */
+    sb->info.nr_free_blocks = htole32(le32toh(sb->info.nr_blocks) -
+                                      nr_used_blocks - nr_devices + 1);
+
+    if (features & SIMPLEFS_FEATURE_METADATA_CSUM)
+        sb->info.checksum = htole32(sfs_sb_csum(sb->padding, block_size));
+
+    return write_blocks(fd, sb->padding, SIMPLEFS_SB_BLOCK_NR, 1);
+}
+
+/* Open device @i of a striped partition, given with -D, and size it */
+static int open_member(uint32_t i, int discard)
 {
-    /* Allocate a block of zeroed-out memory space for the inode storage. */
-    char *block = malloc(SIMPLEFS_BLOCK_SIZE);
+    struct stat st;
+    uint64_t size;
+    int fd = open(member_paths[i], O_RDWR);
+
+    if (fd == -1 || fstat(fd, &st)) {
+        perror(member_paths[i]);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    member_fds[i] = fd;
+    size = st.st_size;
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size)) {
+            perror("BLKGETSIZE64:");
+            return -1;
+        }
+        if (discard) {
+            uint64_t range[2] = {0, size};
+
+            ioctl(fd, BLKDISCARD, range);
+        }
+    }
+    if (size / block_size < 2 * SIMPLEFS_MAX_BLOCKS_PER_EXTENT ||
+        size / block_size > UINT32_MAX) {
+        fprintf(stderr, "%s: unsupported size %llu\n", member_paths[i],
+                (unsigned long long) size);
+        return -1;
+    }
+    dev_blocks[i] = size / block_size;
+    return 0;
+}
+
+/* Write the header of the other devices of a striped partition */
+static int write_members(struct superblock *sb)
+{
+    char *block = calloc(1, block_size);
+    struct simplefs_member_sb *msb = (struct simplefs_member_sb *) block;
+
     if (!block)
         return -1;
+    for (uint32_t i = 1; i < nr_devices; i++) {
+        msb->magic = htole32(SIMPLEFS_MEMBER_MAGIC);
+        msb->set_id = sb->info.set_id;
+        msb->index = htole32(i);
+        msb->nr_blocks = htole32(dev_blocks[i]);
+        if (sfs_write_blocks(member_fds[i], block_size, block, 0, 1)) {
+            perror(member_paths[i]);
+            free(block);
+            return -1;
+        }
+        printf("Device %u: %s, %u blocks\n", i, member_paths[i],
+               dev_blocks[i]);
+    }
+    free(block);
+    return 0;
+}
 
-    memset(block, 0, SIMPLEFS_BLOCK_SIZE);
+/* Tree given with -d: scan_tree() reads it, layout_tree() gives its inodes
+ * numbers and blocks in the order of a depth-first walk, right after the
+ * journal, and write_tree() writes them out.
+ */
+struct tree_inode;
 
-    /* Root inode (inode 1) */
-    struct simplefs_inode *inode = (struct simplefs_inode *) block;
-    uint32_t first_data_block = 1 + le32toh(sb->info.nr_bfree_blocks) +
-                                le32toh(sb->info.nr_ifree_blocks) +
-                                le32toh(sb->info.nr_istore_blocks);
+struct tree_entry {
+    const char *name;
+    struct tree_inode *inode;
+};
 
+struct tree_inode {
+    char *path; /* in the source tree */
+    struct stat st;
+    uint32_t ino;
+    uint32_t ei_block;  /* index block, followed by the blocks below */
+    uint32_t start;     /* first data or directory block */
+    uint32_t nr_blocks; /* data or directory blocks */
+    uint32_t nlink;
+    struct tree_entry *entries; /* of a directory, sorted by name */
+    uint32_t nr_entries;
+    char link[32]; /* target of a symbolic link, see simplefs_inode.i_data */
+};
+
+static struct tree_inode *tree_root;
+static struct tree_inode **tree_inodes; /* by inode number */
+static uint32_t tree_inodes_size;
+static uint32_t nr_tree_inodes;
+static void *tree_links; /* tsearch() tree of the hard-linked files */
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct tree_entry *) a)->name,
+                  ((const struct tree_entry *) b)->name);
+}
+
+static int compare_links(const void *a, const void *b)
+{
+    const struct stat *x = &((const struct tree_inode *) a)->st;
+    const struct stat *y = &((const struct tree_inode *) b)->st;
+
+    if (x->st_dev != y->st_dev)
+        return x->st_dev < y->st_dev ? -1 : 1;
+    return x->st_ino < y->st_ino ? -1 : x->st_ino > y->st_ino;
+}
+
+/* Read the file at @path, and everything below if it is a directory */
+static struct tree_inode *scan_tree(char *path, const struct stat *st)
+{
+    struct tree_inode *ti = calloc(1, sizeof(*ti));
+    if (!ti)
+        return NULL;
+    ti->path = path;
+    ti->st = *st;
+
+    if (S_ISLNK(st->st_mode)) {
+        ssize_t len = readlink(path, ti->link, sizeof(ti->link));
+        if (len < 0) {
+            perror(path);
+            return NULL;
+        }
+        if (len == sizeof(ti->link)) {
+            fprintf(stderr, "%s: link target longer than %zu bytes\n", path,
+                    sizeof(ti->link) - 1);
+            return NULL;
+        }
+        return ti;
+    }
+    if (S_ISREG(st->st_mode)) {
+        if (st->st_size > SIMPLEFS_MAX_FILESIZE(block_size)) {
+            fprintf(stderr, "%s: larger than %lu bytes\n", path,
+                    SIMPLEFS_MAX_FILESIZE(block_size));
+            return NULL;
+        }
+        return ti;
+    }
+
+    /* Directory: "." and the ".." of its subdirectories link to it */
+    ti->nlink = 1;
+    DIR *dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return NULL;
+    }
+
+    uint32_t size = 0;
+    struct dirent *de;
+    while ((errno = 0, de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        char *child;
+        if (asprintf(&child, "%s/%s", path, de->d_name) < 0)
+            goto error;
+        if (strlen(de->d_name) >= SIMPLEFS_FILENAME_LEN) {
+            fprintf(stderr, "%s: name longer than %d bytes\n", child,
+                    SIMPLEFS_FILENAME_LEN - 1);
+            goto error;
+        }
+        struct stat cst;
+        if (lstat(child, &cst)) {
+            perror(child);
+            goto error;
+        }
+        if (!S_ISDIR(cst.st_mode) && !S_ISREG(cst.st_mode) &&
+            !S_ISLNK(cst.st_mode)) {
+            fprintf(stderr, "%s: skipped, not a directory, regular file or "
+                            "symbolic link\n",
+                    child);
+            free(child);
+            continue;
+        }
+        if (ti->nr_entries == SIMPLEFS_MAX_SUBFILES(block_size)) {
+            fprintf(stderr, "%s: more than %lu entries\n", path,
+                    SIMPLEFS_MAX_SUBFILES(block_size));
+            goto error;
+        }
+
+        /* Hard links share the inode of the first name found */
+        struct tree_inode key = {.st = cst}, *ci = NULL;
+        if (!S_ISDIR(cst.st_mode) && cst.st_nlink > 1) {
+            struct tree_inode **found = tfind(&key, &tree_links, compare_links);
+            if (found)
+                ci = *found;
+        }
+        if (!ci) {
+            ci = scan_tree(child, &cst);
+            if (!ci)
+                goto error;
+            if (!S_ISDIR(cst.st_mode) && cst.st_nlink > 1 &&
+                !tsearch(ci, &tree_links, compare_links))
+                goto error;
+        }
+        ci->nlink++;
+        if (S_ISDIR(cst.st_mode))
+            ti->nlink++;
+
+        if (ti->nr_entries == size) {
+            size = size ? 2 * size : 16;
+            struct tree_entry *entries =
+                realloc(ti->entries, size * sizeof(*entries));
+            if (!entries)
+                goto error;
+            ti->entries = entries;
+        }
+        ti->entries[ti->nr_entries++] = (struct tree_entry){
+            .name = child + strlen(path) + 1,
+            .inode = ci,
+        };
+    }
+    if (errno) {
+        perror(path);
+        goto error;
+    }
+    closedir(dir);
+
+    qsort(ti->entries, ti->nr_entries, sizeof(*ti->entries), compare_entries);
+    return ti;
+
+error:
+    closedir(dir);
+    return NULL;
+}
+
+/* Reserve @count blocks after the ones in use */
+static int alloc_tree_blocks(struct superblock *sb,
+                             struct tree_inode *ti,
+                             uint32_t count,
+                             uint32_t *block)
+{
+    if (count > dev_blocks[0] - nr_used_blocks) {
+        fprintf(stderr, "No space left for %s\n", ti->path);
+        return -1;
+    }
+    *block = nr_used_blocks;
+    nr_used_blocks += count;
+    return 0;
+}
+
+/* Give @ti the next inode, then its index block followed by its data or
+ * directory blocks. The root keeps inode 1 and the first data block.
+ */
+static int layout_inode(struct superblock *sb, struct tree_inode *ti)
+{
+    if (S_ISDIR(ti->st.st_mode))
+        ti->nr_blocks = DIV_ROUND_UP(ti->nr_entries,
+                                     SIMPLEFS_FILES_PER_EXT(block_size)) *
+                        SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+    else if (S_ISREG(ti->st.st_mode))
+        ti->nr_blocks = DIV_ROUND_UP(ti->st.st_size, block_size);
+
+    if (ti == tree_root) {
+        ti->ino = SIMPLEFS_ROOT_INO;
+        ti->ei_block = first_data_block(sb);
+    } else {
+        if (nr_used_inodes == le32toh(sb->info.nr_inodes)) {
+            fprintf(stderr, "No inode left for %s\n", ti->path);
+            return -1;
+        }
+        ti->ino = nr_used_inodes++;
+        if (!S_ISLNK(ti->st.st_mode) &&
+            alloc_tree_blocks(sb, ti, 1, &ti->ei_block))
+            return -1;
+    }
+    if (ti->nr_blocks && alloc_tree_blocks(sb, ti, ti->nr_blocks, &ti->start))
+        return -1;
+
+    if (ti->ino >= tree_inodes_size) {
+        uint32_t size = tree_inodes_size ? 2 * tree_inodes_size : 1024;
+        struct tree_inode **inodes =
+            realloc(tree_inodes, size * sizeof(*inodes));
+        if (!inodes)
+            return -1;
+        memset(inodes + tree_inodes_size, 0,
+               (size - tree_inodes_size) * sizeof(*inodes));
+        tree_inodes = inodes;
+        tree_inodes_size = size;
+    }
+    tree_inodes[ti->ino] = ti;
+    nr_tree_inodes++;
+    return 0;
+}
+
+/* Lay out the entries of directory @dir, then its subdirectories, so that the
+ * files of a directory are next to each other.
+ */
+static int layout_tree(struct superblock *sb, struct tree_inode *dir)
+{
+    uint32_t i;
+
+    for (i = 0; i < dir->nr_entries; i++) {
+        if (!dir->entries[i].inode->ino &&
+            layout_inode(sb, dir->entries[i].inode))
+            return -1;
+    }
+    for (i = 0; i < dir->nr_entries; i++) {
+        if (S_ISDIR(dir->entries[i].inode->st.st_mode) &&
+            layout_tree(sb, dir->entries[i].inode))
+            return -1;
+    }
+    return 0;
+}
+
+static void fill_tree_inode(struct tree_inode *ti, struct simplefs_inode *inode)
+{
+    uint32_t mode = ti->st.st_mode;
+
+    inode->i_mode = htole32(mode);
+    inode->i_uid = htole32(ti->st.st_uid);
+    inode->i_gid = htole32(ti->st.st_gid);
+    inode->i_ctime = htole32(ti->st.st_ctime);
+    inode->i_atime = htole32(ti->st.st_atime);
+    inode->i_mtime = htole32(ti->st.st_mtime);
+    inode->i_nlink = htole32(ti->nlink);
+    inode->ei_block = htole32(ti->ei_block);
+    if (S_ISDIR(mode)) {
+        inode->i_size = htole32(block_size);
+        inode->i_blocks = htole32(1);
+    } else if (S_ISREG(mode)) {
+        inode->i_size = htole32(ti->st.st_size);
+        inode->i_blocks = htole32(ti->nr_blocks + 1);
+    } else {
+        inode->i_size = htole32(strlen(ti->link));
+        memcpy(inode->i_data, ti->link, sizeof(inode->i_data));
+    }
+}
+
+/* Fill inode @ino, one of the nr_used_inodes first inodes */
+static void fill_inode(struct superblock *sb,
+                       uint32_t ino,
+                       struct simplefs_inode *inode)
+{
     /* Designate inode 1 as the root inode.
      * When the system uses the glibc, the readdir function will skip over
      * inode 0. Additionally, the VFS layer avoids using inode 0 to prevent
      * potential issues.
      */
-    inode += 1;
-    inode->i_mode = htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR |
-                            S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
-    inode->i_uid = 0;
-    inode->i_gid = 0;
-    inode->i_size = htole32(SIMPLEFS_BLOCK_SIZE);
-    inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
-    inode->i_blocks = htole32(1);
-    inode->i_nlink = htole32(2);
-    inode->ei_block = htole32(first_data_block);
-
-    int ret = write(fd, block, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
-        ret = -1;
-        goto end;
+    if (ino == SIMPLEFS_ROOT_INO && !tree_root) {
+        inode->i_mode = htole32(S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH |
+                                S_IWUSR | S_IWGRP | S_IXUSR | S_IXGRP |
+                                S_IXOTH);
+        inode->i_uid = 0;
+        inode->i_gid = 0;
+        inode->i_size = htole32(block_size);
+        inode->i_ctime = inode->i_atime = inode->i_mtime = htole32(0);
+        inode->i_blocks = htole32(1);
+        inode->i_nlink = htole32(2);
+        inode->ei_block = htole32(first_data_block(sb));
+        return;
     }
 
-    /* Clear all memory blocks allocated for inode storage. */
-    memset(block, 0, SIMPLEFS_BLOCK_SIZE);
-    uint32_t i;
-    for (i = 1; i < sb->info.nr_istore_blocks; i++) {
-        ret = write(fd, block, SIMPLEFS_BLOCK_SIZE);
-        if (ret != SIMPLEFS_BLOCK_SIZE) {
-            ret = -1;
-            goto end;
-        }
+    /* Journal inode: a regular file right after the root index block, not
+     * linked into any directory.
+     */
+    if (ino && ino == le32toh(sb->info.journal_ino)) {
+        inode->i_mode = htole32(S_IFREG | S_IRUSR | S_IWUSR);
+        inode->i_size = htole32(nr_journal_blocks * block_size);
+        inode->i_blocks = htole32(nr_journal_blocks + 1);
+        inode->i_nlink = htole32(1);
+        inode->ei_block = htole32(first_data_block(sb) + 1);
+        return;
     }
-    ret = 0;
 
-    printf(
-        "Inode store: wrote %d blocks\n"
-        "\tinode size = %ld B\n",
-        i, sizeof(struct simplefs_inode));
-
-end:
-    free(block);
-    return ret;
+    if (ino && tree_inodes[ino])
+        fill_tree_inode(tree_inodes[ino], inode);
 }
 
-static int write_ifree_blocks(int fd, struct superblock *sb)
+static int write_inode_store(int fd, struct superblock *sb)
 {
-    char *block = malloc(SIMPLEFS_BLOCK_SIZE);
+    uint32_t nr_istore_blocks = le32toh(sb->info.nr_istore_blocks);
+
+    /* Only the first block holds inodes in use. Other blocks are zeroed, and
+     * written out only when they need a checksum. With lazy_itable, the
+     * kernel zeroes them on first use instead.
+     */
+    uint32_t nr_written = 1;
+    if ((features & SIMPLEFS_FEATURE_METADATA_CSUM) &&
+        !(features & SIMPLEFS_FEATURE_LAZY_ITABLE))
+        nr_written = nr_istore_blocks;
+
+    /* With -d, the blocks holding the inodes of the tree as well */
+    uint32_t nr_used_istore =
+        DIV_ROUND_UP(nr_used_inodes, SIMPLEFS_INODES_PER_BLOCK(block_size));
+    if (nr_written < nr_used_istore)
+        nr_written = nr_used_istore;
+
+    /* Allocate zeroed-out memory space for the inode storage. */
+    uint32_t nr_buf_blocks =
+        nr_written < MKFS_IO_BLOCKS ? nr_written : MKFS_IO_BLOCKS;
+    char *block = calloc(nr_buf_blocks, block_size);
     if (!block)
         return -1;
 
-    uint64_t *ifree = (uint64_t *) block;
-
-    /* Set all bits to 1 */
-    memset(ifree, 0xff, SIMPLEFS_BLOCK_SIZE);
+    int ret = 0;
+    uint32_t i, n;
+    for (i = 0; i < nr_written; i += n) {
+        n = nr_written - i < MKFS_IO_BLOCKS ? nr_written - i : MKFS_IO_BLOCKS;
+        for (uint32_t j = 0; j < n; j++) {
+            char *data = block + j * block_size;
+            uint32_t ino = (i + j) * SIMPLEFS_INODES_PER_BLOCK(block_size);
 
-    /* The initial ifree block holds the first inode marked as in-use. */
-    ifree[0] = htole64(0xfffffffffffffffc);
-    int ret = write(fd, ifree, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
-        ret = -1;
-        goto end;
+            for (uint32_t k = 0; k < SIMPLEFS_INODES_PER_BLOCK(block_size) &&
+                                 ino < nr_used_inodes;
+                 k++, ino++)
+                fill_inode(sb, ino, (struct simplefs_inode *) data + k);
+            set_sfs_block_csum(1 + i + j, data);
+        }
+        ret = write_blocks(fd, block, 1 + i, n);
+        if (ret)
+            goto end;
+        /* Clear the inodes for the next chunks */
+        memset(block, 0, (size_t) n * block_size);
     }
 
-    /* All free blocks in the inode bitmap except the one containing the first
-     * two inodes.
-     */
-    ifree[0] = 0xffffffffffffffff;
-    uint32_t i;
-    for (i = 1; i < le32toh(sb->info.nr_ifree_blocks); i++) {
-        ret = write(fd, ifree, SIMPLEFS_BLOCK_SIZE);
-        if (ret != SIMPLEFS_BLOCK_SIZE) {
-            ret = -1;
+    if (!(features & SIMPLEFS_FEATURE_LAZY_ITABLE)) {
+        ret = zero_blocks(fd, 1 + nr_written, nr_istore_blocks - nr_written);
+        if (ret)
             goto end;
-        }
     }
-    ret = 0;
 
-    printf("Ifree blocks: wrote %d blocks\n", i);
+    printf(
+        "Inode store: wrote %u blocks%s\n"
+        "\tinode size = %ld B\n",
+        nr_written,
+        (features & SIMPLEFS_FEATURE_LAZY_ITABLE) ? ", others zeroed on use"
+        : nr_written < nr_istore_blocks            ? ", zeroed the others"
+                                                   : "",
+        sizeof(struct simplefs_inode));
 
 end:
     free(block);
-
     return ret;
 }
 
-static int write_bfree_blocks(int fd, struct superblock *sb)
+/* Fill bitmap block @i of a bitmap whose first @nr_used bits are in use */
+static void fill_bitmap_block(uint32_t i, char *block, uint32_t nr_used)
 {
-    uint32_t nr_used = le32toh(sb->info.nr_istore_blocks) +
-                       le32toh(sb->info.nr_ifree_blocks) +
-                       le32toh(sb->info.nr_bfree_blocks) + 2;
+    uint64_t *map = (uint64_t *) block;
+    uint64_t first = (uint64_t) i * block_size * 8;
+    uint64_t bit;
 
-    char *block = malloc(SIMPLEFS_BLOCK_SIZE);
-    if (!block)
-        return -1;
-    uint64_t *bfree = (uint64_t *) block;
+    /* Set all bits to 1 */
+    memset(map, 0xff, block_size);
+    for (bit = first; bit < nr_used && bit < first + block_size * 8; bit++)
+        map[(bit - first) / 64] &= htole64(~(1ULL << (bit % 64)));
+}
+
+/* Fill bitmap block @i of the ifree bitmap */
+static void fill_ifree_block(struct superblock *sb, uint32_t i, char *block)
+{
+    /* The first inodes are in use: 0, the root, the journal, if any, and the
+     * tree of -d.
+     */
+    fill_bitmap_block(i, block, nr_used_inodes);
+}
 
+/* Fill bitmap block @i of the bfree bitmap */
+static void fill_bfree_block(struct superblock *sb, uint32_t i, char *block)
+{
     /* The first blocks refer to the superblock (metadata about the fs), inode
      * store (where inode data is stored), ifree (list of free inodes), bfree
-     * (list of free data blocks), and one data block marked as used.
+     * (list of free data blocks), the root index block, the journal and the
+     * tree of -d. They may span several bitmap blocks.
      */
-    memset(bfree, 0xff, SIMPLEFS_BLOCK_SIZE);
-    uint32_t i = 0;
-    while (nr_used) {
-        uint64_t line = 0xffffffffffffffff;
-        for (uint64_t mask = 0x1; mask; mask <<= 1) {
-            line &= ~mask;
-            nr_used--;
-            if (!nr_used)
-                break;
-        }
-        bfree[i] = htole64(line);
-        i++;
-    }
-    int ret = write(fd, bfree, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
-        ret = -1;
-        goto end;
+    fill_bitmap_block(i, block, nr_used_blocks);
+
+    /* So is block 0 of the other devices, their header */
+    uint64_t first = (uint64_t) i * block_size * 8, start = 0;
+    uint64_t *map = (uint64_t *) block;
+    for (uint32_t k = 1; k < nr_devices; k++) {
+        start += dev_blocks[k - 1];
+        if (start >= first && start < first + block_size * 8)
+            map[(start - first) / 64] &= htole64(~(1ULL << (start % 64)));
     }
+}
 
-    /* other blocks */
-    memset(bfree, 0xff, SIMPLEFS_BLOCK_SIZE);
-    for (i = 1; i < le32toh(sb->info.nr_bfree_blocks); i++) {
-        ret = write(fd, bfree, SIMPLEFS_BLOCK_SIZE);
-        if (ret != SIMPLEFS_BLOCK_SIZE) {
-            ret = -1;
-            goto end;
+/* Write the @count blocks of a bitmap starting at block @start, in chunks */
+static int write_bitmap(int fd,
+                        struct superblock *sb,
+                        uint32_t start,
+                        uint32_t count,
+                        void (*fill)(struct superblock *, uint32_t, char *))
+{
+    uint32_t nr_buf_blocks = count < MKFS_IO_BLOCKS ? count : MKFS_IO_BLOCKS;
+    char *buf = malloc((size_t) nr_buf_blocks * block_size);
+    if (!buf)
+        return -1;
+
+    int ret = 0;
+    uint32_t i, n;
+    for (i = 0; i < count && !ret; i += n) {
+        n = count - i < MKFS_IO_BLOCKS ? count - i : MKFS_IO_BLOCKS;
+        for (uint32_t j = 0; j < n; j++) {
+            char *block = buf + j * block_size;
+
+            fill(sb, i + j, block);
+            set_bitmap_csum(sb, start + i + j, block);
         }
+        ret = write_blocks(fd, buf, start + i, n);
     }
-    ret = 0;
-
-    printf("Bfree blocks: wrote %d blocks\n", i);
-end:
-    free(block);
 
+    free(buf);
     return ret;
 }
 
+static int write_ifree_blocks(int fd, struct superblock *sb)
+{
+    uint32_t nr_ifree_blocks = le32toh(sb->info.nr_ifree_blocks);
+
+    if (write_bitmap(fd, sb, 1 + le32toh(sb->info.nr_istore_blocks),
+                     nr_ifree_blocks, fill_ifree_block))
+        return -1;
+
+    printf("Ifree blocks: wrote %u blocks\n", nr_ifree_blocks);
+    return 0;
+}
+
+static int write_bfree_blocks(int fd, struct superblock *sb)
+{
+    uint32_t nr_bfree_blocks = le32toh(sb->info.nr_bfree_blocks);
+
+    if (write_bitmap(fd, sb,
+                     1 + le32toh(sb->info.nr_istore_blocks) +
+                         le32toh(sb->info.nr_ifree_blocks),
+                     nr_bfree_blocks, fill_bfree_block))
+        return -1;
+
+    printf("Bfree blocks: wrote %u blocks\n", nr_bfree_blocks);
+    return 0;
+}
+
+/* Write the bitmap checksum table, once write_bitmap() filled it */
+static int write_csum_table(int fd, struct superblock *sb)
+{
+    uint32_t start = le32toh(sb->info.csum_start);
+    uint32_t count = le32toh(sb->info.nr_csum_blocks);
+
+    for (uint32_t i = 0; i < count; i++)
+        set_sfs_block_csum(start + i, csum_table + (size_t) i * block_size);
+    if (write_blocks(fd, csum_table, start, count))
+        return -1;
+
+    printf("Checksum table: wrote %u blocks at block %u\n", count, start);
+    return 0;
+}
+
 static int write_data_blocks(int fd, struct superblock *sb)
 {
-    char *buffer = calloc(1, SIMPLEFS_BLOCK_SIZE);
+    char *buffer = calloc(1, block_size);
     if (!buffer) {
         perror("Failed to allocate memory");
         return -1;
     }
 
-    ssize_t ret = write(fd, buffer, SIMPLEFS_BLOCK_SIZE);
-    if (ret != SIMPLEFS_BLOCK_SIZE) {
+    set_sfs_block_csum(first_data_block(sb), buffer);
+    if (write_blocks(fd, buffer, first_data_block(sb), 1)) {
         perror("Failed to write data block");
         free(buffer);
         return -1;
@@ -252,15 +930,353 @@ static int write_data_blocks(int fd, struct superblock *sb)
     return 0;
 }
 
+static int write_journal(int fd, struct superblock *sb)
+{
+    uint32_t journal_start = first_data_block(sb) + 2;
+    int ret = -1;
+
+    char *block = calloc(1, block_size);
+    if (!block)
+        return -1;
+
+    /* Journal index block: one extent covering the whole journal */
+    struct simplefs_file_ei_block *index =
+        (struct simplefs_file_ei_block *) block;
+    index->extents[0].ee_block = 0;
+    index->extents[0].ee_len = htole32(nr_journal_blocks);
+    index->extents[0].ee_start = htole32(journal_start);
+    set_sfs_block_csum(first_data_block(sb) + 1, block);
+    if (write_blocks(fd, block, first_data_block(sb) + 1, 1))
+        goto end;
+
+    /* jbd2 superblock of a clean, empty journal */
+    memset(block, 0, block_size);
+    struct jbd2_superblock *jsb = (struct jbd2_superblock *) block;
+    jsb->h_magic = htobe32(JBD2_MAGIC_NUMBER);
+    jsb->h_blocktype = htobe32(JBD2_SUPERBLOCK_V2);
+    jsb->s_blocksize = htobe32(block_size);
+    jsb->s_maxlen = htobe32(nr_journal_blocks);
+    jsb->s_first = htobe32(1);
+    jsb->s_sequence = htobe32(1);
+    jsb->s_nr_users = htobe32(1);
+    srand(time(NULL) ^ getpid());
+    for (int i = 0; i < sizeof(jsb->s_uuid); i++)
+        jsb->s_uuid[i] = rand();
+    if (write_blocks(fd, block, journal_start, 1))
+        goto end;
+
+    /* Clear the log itself */
+    if (zero_blocks(fd, journal_start + 1, nr_journal_blocks - 1))
+        goto end;
+    ret = 0;
+
+    printf("Journal: wrote %u blocks at block %u\n", nr_journal_blocks,
+           journal_start);
+end:
+    free(block);
+    return ret;
+}
+
+/* Fill the extents of the index block of @ti: its blocks, in extents of
+ * SIMPLEFS_MAX_BLOCKS_PER_EXTENT blocks.
+ */
+static void fill_tree_index(struct tree_inode *ti, char *block)
+{
+    struct simplefs_file_ei_block *index =
+        (struct simplefs_file_ei_block *) block;
+    uint32_t files_per_ext = SIMPLEFS_FILES_PER_EXT(block_size);
+    uint32_t ei, done;
+
+    memset(block, 0, block_size);
+    for (ei = 0, done = 0; done < ti->nr_blocks;
+         ei++, done += SIMPLEFS_MAX_BLOCKS_PER_EXTENT) {
+        struct simplefs_extent *ext = &index->extents[ei];
+        uint32_t len = ti->nr_blocks - done;
+
+        if (len > SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+            len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+        ext->ee_block = htole32(done);
+        ext->ee_len = htole32(len);
+        ext->ee_start = htole32(ti->start + done);
+        if (S_ISDIR(ti->st.st_mode))
+            ext->nr_files = htole32(ti->nr_entries - ei * files_per_ext <
+                                            files_per_ext
+                                        ? ti->nr_entries - ei * files_per_ext
+                                        : files_per_ext);
+    }
+    if (S_ISDIR(ti->st.st_mode))
+        index->nr_files = htole32(ti->nr_entries);
+    set_sfs_block_csum(ti->ei_block, block);
+}
+
+/* Directory blocks of @ti, packed: every block is full but the last ones */
+static int write_tree_dir(int fd, struct tree_inode *ti, char *buf)
+{
+    uint32_t files_per_block = SIMPLEFS_FILES_PER_BLOCK(block_size);
+    uint32_t i, n, e = 0;
+
+    for (i = 0; i < ti->nr_blocks; i += n) {
+        n = ti->nr_blocks - i < MKFS_IO_BLOCKS ? ti->nr_blocks - i
+                                                : MKFS_IO_BLOCKS;
+        memset(buf, 0, (size_t) n * block_size);
+        for (uint32_t j = 0; j < n; j++) {
+            char *block = buf + j * block_size;
+            struct simplefs_dir_block *dblock =
+                (struct simplefs_dir_block *) block;
+            uint32_t fi;
+
+            for (fi = 0; fi < files_per_block && e < ti->nr_entries;
+                 fi++, e++) {
+                struct simplefs_file *f = &dblock->files[fi];
+
+                f->inode = htole32(ti->entries[e].inode->ino);
+                f->nr_blk = htole32(1);
+                strcpy(f->filename, ti->entries[e].name);
+            }
+            /* The last entry, or the first of an empty block, spans the free
+             * slots after it.
+             */
+            dblock->nr_files = htole32(fi);
+            dblock->files[fi ? fi - 1 : 0].nr_blk =
+                htole32(files_per_block - (fi ? fi - 1 : 0));
+            set_sfs_block_csum(ti->start + i + j, block);
+        }
+        if (write_blocks(fd, buf, ti->start + i, n))
+            return -1;
+    }
+    return 0;
+}
+
+/* Data blocks of @ti, copied from its source file */
+static int write_tree_file(int fd, struct tree_inode *ti, char *buf)
+{
+    int src = open(ti->path, O_RDONLY);
+    if (src < 0)
+        return -1;
+
+    int ret = 0;
+    off_t off = 0;
+    uint32_t i, n;
+    for (i = 0; i < ti->nr_blocks && !ret; i += n) {
+        n = ti->nr_blocks - i < MKFS_IO_BLOCKS ? ti->nr_blocks - i
+                                                : MKFS_IO_BLOCKS;
+        size_t len = (size_t) n * block_size, done = 0;
+
+        while (done < len) {
+            ssize_t got = pread(src, buf + done, len - done, off + done);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0) {
+                ret = -1;
+                break;
+            }
+            if (!got)
+                break;
+            done += got;
+        }
+        /* Zero the end of the last block, or what the file lost since it was
+         * scanned.
+         */
+        memset(buf + done, 0, len - done);
+        off += len;
+        if (!ret)
+            ret = write_blocks(fd, buf, ti->start + i, n);
+    }
+
+    close(src);
+    return ret;
+}
+
+struct tree_worker {
+    pthread_t thread;
+    int fd;
+};
+
+/* Next inode for the workers of write_tree(), and whether one failed */
+static uint32_t tree_next_ino = SIMPLEFS_ROOT_INO;
+static int tree_error;
+
+/* Worker: writes the index, directory and data blocks of the next inodes.
+ * They were laid out in inode order, so the writes stream through the disk.
+ */
+static void *write_tree_worker(void *arg)
+{
+    struct tree_worker *w = arg;
+    char *index = malloc(((size_t) MKFS_IO_BLOCKS + 1) * block_size);
+    char *buf = index + block_size;
+
+    if (!index) {
+        __atomic_store_n(&tree_error, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    while (!__atomic_load_n(&tree_error, __ATOMIC_RELAXED)) {
+        uint32_t ino = __atomic_fetch_add(&tree_next_ino, 1, __ATOMIC_RELAXED);
+        struct tree_inode *ti;
+        int ret = 0;
+
+        if (ino >= nr_used_inodes)
+            break;
+        ti = ino < tree_inodes_size ? tree_inodes[ino] : NULL;
+        if (!ti || S_ISLNK(ti->st.st_mode))
+            continue;
+
+        fill_tree_index(ti, index);
+        ret = write_blocks(w->fd, index, ti->ei_block, 1);
+        if (!ret)
+            ret = S_ISDIR(ti->st.st_mode) ? write_tree_dir(w->fd, ti, buf)
+                                          : write_tree_file(w->fd, ti, buf);
+        if (ret) {
+            perror(ti->path);
+            __atomic_store_n(&tree_error, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(index);
+    return NULL;
+}
+
+/* Write the tree of -d, with one thread per CPU reading the files */
+static int write_tree(int fd)
+{
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct tree_worker *workers;
+    long i, nr_started = 0;
+
+    if (nr_threads < 1)
+        nr_threads = 1;
+    workers = calloc(nr_threads, sizeof(*workers));
+    if (!workers)
+        return -1;
+
+    for (i = 0; i < nr_threads; i++) {
+        workers[i].fd = fd;
+        if (pthread_create(&workers[i].thread, NULL, write_tree_worker,
+                           &workers[i]))
+            break;
+        nr_started++;
+    }
+    for (i = 0; i < nr_started; i++)
+        pthread_join(workers[i].thread, NULL);
+    free(workers);
+
+    if (!nr_started || tree_error)
+        return -1;
+
+    printf("Tree: wrote %u inodes, up to block %u\n", nr_tree_inodes,
+           nr_used_blocks);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s disk\n", argv[0]);
+    long journal_mb = -1;
+    const char *root_dir = NULL;
+    uint64_t bytes_per_inode = 0;
+    uint32_t nr_inodes = 0;
+    int discard = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:d:D:i:j:KN:O:")) != -1) {
+        char *end;
+
+        switch (opt) {
+        case 'b': {
+            unsigned long size = strtoul(optarg, &end, 10);
+            if (*end || size < SIMPLEFS_MIN_BLOCK_SIZE ||
+                size > SIMPLEFS_MAX_BLOCK_SIZE || (size & (size - 1))) {
+                fprintf(stderr, "Invalid block size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            block_size = size;
+            break;
+        }
+        case 'd':
+            root_dir = optarg;
+            break;
+        case 'D':
+            if (nr_devices == SIMPLEFS_MAX_DEVICES) {
+                fprintf(stderr, "At most %d devices\n", SIMPLEFS_MAX_DEVICES);
+                return EXIT_FAILURE;
+            }
+            member_paths[nr_devices++] = optarg;
+            break;
+        case 'i':
+            bytes_per_inode = strtoull(optarg, &end, 10);
+            if (*end || bytes_per_inode < SIMPLEFS_MIN_BLOCK_SIZE) {
+                fprintf(stderr, "Invalid bytes per inode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'j':
+            journal_mb = strtol(optarg, &end, 10);
+            if (*end || journal_mb < 0 ||
+                journal_mb > SIMPLEFS_MAX_JOURNAL_MB) {
+                fprintf(stderr, "Invalid journal size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'K':
+            discard = 0;
+            break;
+        case 'N': {
+            unsigned long n = strtoul(optarg, &end, 10);
+            if (*end || !n || n > UINT32_MAX) {
+                fprintf(stderr, "Invalid number of inodes: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            nr_inodes = n;
+            break;
+        }
+        case 'O':
+            for (char *f = strtok(optarg, ","); f; f = strtok(NULL, ",")) {
+                if (!strcmp(f, "metadata_csum")) {
+                    features |= SIMPLEFS_FEATURE_METADATA_CSUM;
+                } else if (!strcmp(f, "lazy_itable")) {
+                    features |= SIMPLEFS_FEATURE_LAZY_ITABLE;
+                } else if (!strcmp(f, "metadata_dev")) {
+                    features |= SIMPLEFS_FEATURE_METADATA_DEV;
+                } else {
+                    fprintf(stderr, "Unknown feature: %s\n", f);
+                    return EXIT_FAILURE;
+                }
+            }
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+    usage:
+        fprintf(stderr,
+                "Usage: %s [-b block-size] [-d root-directory] [-D device]... "
+                "[-i bytes-per-inode] [-j journal-size-MiB] [-K] [-N inodes] "
+                "[-O feature[,...]] disk\n"
+                "\t-b  block size in bytes, a power of 2 from %d to %d "
+                "(default: %d)\n"
+                "\t-d  copy the contents of a directory into the root\n"
+                "\t-D  stripe the data of files over this device too, "
+                "up to %d devices\n"
+                "\t-i  one inode per this many bytes of the disk (default: "
+                "one per block)\n"
+                "\t-j  internal journal size in MiB, 0 for no journal "
+                "(default: scaled with the disk size)\n"
+                "\t-K  do not discard the blocks of a device\n"
+                "\t-N  number of inodes, overrides -i\n"
+                "\t-O  enable features:\n"
+                "\t    metadata_csum  crc32c checksums of all metadata "
+                "blocks\n"
+                "\t    lazy_itable    leave the inode store to be zeroed by "
+                "the kernel on first use\n"
+                "\t    metadata_dev   keep the disk for metadata, file data "
+                "goes to the -D devices\n",
+                argv[0], SIMPLEFS_MIN_BLOCK_SIZE, SIMPLEFS_MAX_BLOCK_SIZE,
+                SIMPLEFS_BLOCK_SIZE, SIMPLEFS_MAX_DEVICES);
         return EXIT_FAILURE;
     }
 
     /* Open disk image */
-    int fd = open(argv[1], O_RDWR);
+    int fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("open():");
         return EXIT_FAILURE;
@@ -285,10 +1301,11 @@ int main(int argc, char **argv)
             goto fclose;
         }
         stat_buf.st_size = blk_size;
+        is_blkdev = 1;
     }
 
     /* Verify if the file system image has sufficient size. */
-    long int min_size = 100 * SIMPLEFS_BLOCK_SIZE;
+    long int min_size = 100 * block_size;
     if (stat_buf.st_size < min_size) {
         fprintf(stderr, "File is not large enough (size=%ld, min size=%ld)\n",
                 stat_buf.st_size, min_size);
@@ -296,14 +1313,76 @@ int main(int argc, char **argv)
         goto fclose;
     }
 
+    /* Read the tree to copy before writing anything */
+    if (root_dir) {
+        struct stat st;
+        char *path = strdup(root_dir);
+
+        if (!path || lstat(root_dir, &st) || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "%s: not a directory\n", root_dir);
+            ret = EXIT_FAILURE;
+            goto fclose;
+        }
+        tree_root = scan_tree(path, &st);
+        if (!tree_root) {
+            ret = EXIT_FAILURE;
+            goto fclose;
+        }
+        /* The root is its own parent */
+        tree_root->nlink++;
+    }
+
+    /* Let the device know that all of its blocks are unused, as mke2fs does.
+     * This is advisory: blocks are still zeroed where it matters.
+     */
+    if (is_blkdev && discard) {
+        uint64_t range[2] = {0, stat_buf.st_size};
+
+        if (!ioctl(fd, BLKDISCARD, range))
+            printf("Discarded device blocks\n");
+    }
+
+    /* Metadata stays on the disk, file data is striped over all devices */
+    for (uint32_t i = 1; i < nr_devices; i++) {
+        if (open_member(i, discard)) {
+            ret = EXIT_FAILURE;
+            goto fclose;
+        }
+    }
+    if (nr_devices > 1) {
+        features |= SIMPLEFS_FEATURE_STRIPE;
+    } else if (features & SIMPLEFS_FEATURE_METADATA_DEV) {
+        fprintf(stderr, "metadata_dev needs a data device, see -D\n");
+        ret = EXIT_FAILURE;
+        goto fclose;
+    }
+
+    if (!nr_inodes && bytes_per_inode) {
+        uint64_t n = stat_buf.st_size / bytes_per_inode;
+        nr_inodes = n > UINT32_MAX ? UINT32_MAX : n;
+    }
+
     /* Write superblock (block 0) */
-    struct superblock *sb = write_superblock(fd, &stat_buf);
+    struct superblock *sb =
+        write_superblock(fd, &stat_buf, journal_mb, nr_inodes);
     if (!sb) {
         perror("write_superblock():");
         ret = EXIT_FAILURE;
         goto fclose;
     }
 
+    if (write_members(sb)) {
+        ret = EXIT_FAILURE;
+        goto free_sb;
+    }
+
+    /* Give the tree its inodes and blocks, after the journal */
+    if (tree_root &&
+        (layout_inode(sb, tree_root) || layout_tree(sb, tree_root))) {
+        ret = EXIT_FAILURE;
+        goto free_sb;
+    }
+
     /* Write inode store blocks (from block 1) */
     ret = write_inode_store(fd, sb);
     if (ret) {
@@ -328,17 +1407,61 @@ int main(int argc, char **argv)
         goto free_sb;
     }
 
-    /* clear a root index block */
-    ret = write_data_blocks(fd, sb);
+    /* Write the checksums of the bitmaps */
+    if (csum_table) {
+        ret = write_csum_table(fd, sb);
+        if (ret) {
+            perror("write_csum_table()");
+            ret = EXIT_FAILURE;
+            goto free_sb;
+        }
+    }
+
+    /* clear a root index block, written by write_tree() with -d */
+    if (!tree_root) {
+        ret = write_data_blocks(fd, sb);
+        if (ret) {
+            perror("write_data_blocks():");
+            ret = EXIT_FAILURE;
+            goto free_sb;
+        }
+    }
+
+    /* Write the internal journal, right after the root index block */
+    if (le32toh(sb->info.journal_ino)) {
+        ret = write_journal(fd, sb);
+        if (ret) {
+            perror("write_journal():");
+            ret = EXIT_FAILURE;
+            goto free_sb;
+        }
+    }
+
+    /* Copy the tree of -d */
+    if (tree_root) {
+        ret = write_tree(fd);
+        if (ret) {
+            fprintf(stderr, "write_tree(): failed\n");
+            ret = EXIT_FAILURE;
+            goto free_sb;
+        }
+    }
+
+    ret = update_superblock(fd, sb);
     if (ret) {
-        perror("write_data_blocks():");
+        perror("update_superblock():");
         ret = EXIT_FAILURE;
         goto free_sb;
     }
 
 free_sb:
+    free(csum_table);
     free(sb);
 fclose:
+    for (uint32_t i = 1; i < nr_devices; i++) {
+        if (member_fds[i] > 0)
+            close(member_fds[i]);
+    }
     close(fd);
 
     return ret;
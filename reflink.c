@@ -0,0 +1,587 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* Extents shared by several regular files, made by FIDEDUPERANGE.
+ *
+ * Deduplication works on whole extents: the extent of the destination is
+ * pointed at the blocks of the source, and the source blocks get one more
+ * reference in the refcount table. The table is created by the first
+ * deduplication, as a run of data blocks recorded in the superblock, and
+ * is kept in memory like the bitmaps. put_blocks() drops a reference of a
+ * shared extent instead of freeing it, so unlink, truncate, defragmentation
+ * and compression need no change.
+ *
+ * Shared and compressed extents are never written in place: write_begin
+ * first moves the extent to a private run, its data in dirty pages, see
+ * simplefs_unshare_range(). Direct writes fall back to the page cache.
+ */
+
+struct simplefs_refcount {
+    spinlock_t lock;  /* serializes updates of counts */
+    uint16_t *counts; /* per block, as on disk */
+};
+
+/* Serializes the creation of the table */
+static DEFINE_MUTEX(simplefs_refcount_mutex);
+
+static uint16_t simplefs_refcount(struct super_block *sb, uint32_t bno)
+{
+    struct simplefs_refcount *rc = SIMPLEFS_SB(sb)->refcount;
+
+    return rc ? READ_ONCE(rc->counts[bno]) : 0;
+}
+
+/* Copy the in-memory refcount block holding @bno into its on-disk block and
+ * log it in the running handle
+ */
+static int simplefs_refcount_write(struct super_block *sb, uint32_t bno)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_refcount *rc = sbi->refcount;
+    handle_t *handle = journal_current_handle();
+    uint32_t per_block = SIMPLEFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize);
+    uint32_t i = bno / per_block;
+    uint32_t nr = min(per_block, sbi->nr_blocks - i * per_block);
+    struct buffer_head *bh;
+    int err;
+
+    bh = simplefs_bread(sb, sbi->refcount_start + i);
+    if (!bh)
+        return -EIO;
+    err = simplefs_journal_get_write_access(handle, bh);
+    if (!err) {
+        spin_lock(&rc->lock);
+        memcpy(bh->b_data, rc->counts + i * per_block, nr * sizeof(uint16_t));
+        spin_unlock(&rc->lock);
+        err = simplefs_journal_dirty_metadata(handle, sb, bh);
+    }
+    brelse(bh);
+    return err;
+}
+
+/* Take one more reference to the extent starting at @bno */
+static int simplefs_refcount_get(struct super_block *sb, uint32_t bno)
+{
+    struct simplefs_refcount *rc = SIMPLEFS_SB(sb)->refcount;
+    int err;
+
+    spin_lock(&rc->lock);
+    if (rc->counts[bno] == U16_MAX) {
+        spin_unlock(&rc->lock);
+        return -EMLINK;
+    }
+    rc->counts[bno]++;
+    spin_unlock(&rc->lock);
+
+    err = simplefs_refcount_write(sb, bno);
+    if (err) {
+        spin_lock(&rc->lock);
+        rc->counts[bno]--;
+        spin_unlock(&rc->lock);
+    }
+    return err;
+}
+
+/* Whether other files share the extent starting at @bno */
+bool simplefs_refcount_shared(struct super_block *sb, uint32_t bno)
+{
+    return bno < SIMPLEFS_SB(sb)->nr_blocks && simplefs_refcount(sb, bno);
+}
+
+/* Called by put_blocks(): drop a reference to the extent starting at @bno.
+ * Returns false if the caller holds the last one and frees the blocks.
+ */
+bool simplefs_refcount_put(struct super_block *sb, uint32_t bno)
+{
+    struct simplefs_refcount *rc = SIMPLEFS_SB(sb)->refcount;
+
+    if (!rc || bno >= SIMPLEFS_SB(sb)->nr_blocks)
+        return false;
+    spin_lock(&rc->lock);
+    if (!rc->counts[bno]) {
+        spin_unlock(&rc->lock);
+        return false;
+    }
+    rc->counts[bno]--;
+    spin_unlock(&rc->lock);
+
+    if (simplefs_refcount_write(sb, bno))
+        pr_err("failed to update the refcount of block %u\n", bno);
+    return true;
+}
+
+static struct simplefs_refcount *simplefs_refcount_alloc(struct super_block *sb)
+{
+    struct simplefs_refcount *rc = kzalloc(sizeof(*rc), GFP_KERNEL);
+
+    if (!rc)
+        return NULL;
+    rc->counts = kvcalloc(SIMPLEFS_SB(sb)->nr_blocks, sizeof(uint16_t),
+                          GFP_KERNEL);
+    if (!rc->counts) {
+        kfree(rc);
+        return NULL;
+    }
+    spin_lock_init(&rc->lock);
+    return rc;
+}
+
+/* Read the refcount table at mount, if the partition has one */
+int simplefs_refcount_load(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t per_block = SIMPLEFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize);
+    struct simplefs_refcount *rc;
+    struct buffer_head *bh;
+    uint32_t i;
+
+    if (!simplefs_has_reflink(sb))
+        return 0;
+    if (sbi->nr_refcount_blocks != DIV_ROUND_UP(sbi->nr_blocks, per_block) ||
+        sbi->refcount_start <
+            simplefs_bfree_start(sbi) + sbi->nr_bfree_blocks ||
+        (uint64_t) sbi->refcount_start + sbi->nr_refcount_blocks >
+            sbi->nr_blocks) {
+        pr_err("invalid refcount table at block %u\n", sbi->refcount_start);
+        return -EUCLEAN;
+    }
+
+    rc = simplefs_refcount_alloc(sb);
+    if (!rc)
+        return -ENOMEM;
+    for (i = 0; i < sbi->nr_refcount_blocks; i++) {
+        bh = simplefs_bread(sb, sbi->refcount_start + i);
+        if (!bh) {
+            kvfree(rc->counts);
+            kfree(rc);
+            return -EIO;
+        }
+        memcpy(rc->counts + i * per_block, bh->b_data,
+               min(per_block, sbi->nr_blocks - i * per_block) *
+                   sizeof(uint16_t));
+        brelse(bh);
+    }
+    sbi->refcount = rc;
+    return 0;
+}
+
+void simplefs_refcount_release(struct super_block *sb)
+{
+    struct simplefs_refcount *rc = SIMPLEFS_SB(sb)->refcount;
+
+    if (!rc)
+        return;
+    SIMPLEFS_SB(sb)->refcount = NULL;
+    kvfree(rc->counts);
+    kfree(rc);
+}
+
+/* Create the refcount table, zeroed, and record it in the superblock */
+static int simplefs_refcount_create(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    uint32_t nr = DIV_ROUND_UP(sbi->nr_blocks,
+                               SIMPLEFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize));
+    struct simplefs_sb_info *disk_sb;
+    struct simplefs_refcount *rc;
+    struct buffer_head *bh, *sb_bh;
+    handle_t *handle;
+    uint32_t start = 0, i;
+    int ret = 0;
+
+    if (sbi->refcount)
+        return 0;
+    mutex_lock(&simplefs_refcount_mutex);
+    if (sbi->refcount)
+        goto unlock;
+
+    ret = -ENOMEM;
+    rc = simplefs_refcount_alloc(sb);
+    if (!rc)
+        goto unlock;
+    handle = simplefs_journal_start(sb, SIMPLEFS_BITMAP_CREDITS + 1);
+    if (IS_ERR(handle)) {
+        ret = PTR_ERR(handle);
+        goto free;
+    }
+    ret = -ENOSPC;
+    start = get_free_blocks(sb, nr);
+    if (!start)
+        goto stop;
+
+    /* The run is zeroed already, but for the checksums. The blocks are not
+     * in use before the superblock names them.
+     */
+    for (i = 0; simplefs_has_metadata_csum(sb) && i < nr; i++) {
+        bh = sb_getblk(sb, start + i);
+        if (!bh) {
+            ret = -ENOMEM;
+            goto put;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        simplefs_journal_dirty_metadata(NULL, sb, bh);
+        ret = sync_dirty_buffer(bh);
+        brelse(bh);
+        if (ret)
+            goto put;
+    }
+
+    ret = -EIO;
+    sb_bh = sb_bread(sb, SIMPLEFS_SB_BLOCK_NR);
+    if (!sb_bh)
+        goto put;
+    ret = simplefs_journal_get_write_access(handle, sb_bh);
+    if (ret) {
+        brelse(sb_bh);
+        goto put;
+    }
+    sbi->features |= SIMPLEFS_FEATURE_REFLINK;
+    sbi->refcount_start = start;
+    sbi->nr_refcount_blocks = nr;
+    disk_sb = (struct simplefs_sb_info *) sb_bh->b_data;
+    disk_sb->features = sbi->features;
+    disk_sb->refcount_start = start;
+    disk_sb->nr_refcount_blocks = nr;
+    ret = simplefs_journal_dirty_metadata(handle, sb, sb_bh);
+    brelse(sb_bh);
+    sbi->refcount = rc;
+    rc = NULL;
+    goto stop;
+
+put:
+    put_blocks(sb, start, nr);
+stop:
+    simplefs_journal_stop(handle);
+free:
+    if (rc) {
+        kvfree(rc->counts);
+        kfree(rc);
+    }
+unlock:
+    mutex_unlock(&simplefs_refcount_mutex);
+    return ret;
+}
+
+/* Move extent @ei, shared or compressed, to a run of its own, its data in
+ * dirty pages
+ */
+static int simplefs_unshare_extent(struct inode *inode,
+                                   struct buffer_head *bh_index,
+                                   uint32_t ei)
+{
+    struct super_block *sb = inode->i_sb;
+    struct address_space *mapping = inode->i_mapping;
+    struct simplefs_file_ei_block *index =
+        (struct simplefs_file_ei_block *) bh_index->b_data;
+    struct simplefs_extent *ext = &index->extents[ei], old;
+    /* Blocks are at most a page */
+    struct folio *folios[SIMPLEFS_MAX_BLOCKS_PER_EXTENT];
+    loff_t start = (loff_t) ext->ee_block << sb->s_blocksize_bits;
+    loff_t pos = start, end = start + ((loff_t) ext->ee_len
+                                       << sb->s_blocksize_bits);
+    handle_t *handle;
+    uint32_t bno;
+    int i, n = 0, ret;
+
+    if (ext->ee_len > SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+        return -EIO;
+
+    /* Through the page cache, which decompresses */
+    while (pos < end) {
+        struct folio *folio =
+            read_mapping_folio(mapping, pos >> PAGE_SHIFT, NULL);
+
+        if (IS_ERR(folio)) {
+            ret = PTR_ERR(folio);
+            goto put;
+        }
+        folios[n++] = folio;
+        pos = folio_pos(folio) + folio_size(folio);
+    }
+
+    handle = simplefs_journal_start(sb, SIMPLEFS_UNSHARE_CREDITS);
+    if (IS_ERR(handle)) {
+        ret = PTR_ERR(handle);
+        goto put;
+    }
+    ret = -ENOSPC;
+    bno = get_free_data_blocks(sb, ext->ee_len, ei);
+    if (!bno)
+        goto stop;
+    ret = simplefs_journal_get_write_access(handle, bh_index);
+    if (ret) {
+        put_blocks(sb, bno, ext->ee_len);
+        goto stop;
+    }
+    simplefs_fc_mark_ineligible(sb, handle);
+    old = *ext;
+    ext->ee_start = bno;
+    ext->ee_clen = 0;
+    ext->ee_flags = 0;
+    ret = simplefs_journal_dirty_metadata(handle, sb, bh_index);
+    if (!ret)
+        ret = put_blocks(sb, old.ee_start, simplefs_ext_blocks(&old));
+
+    /* The pages hold the only copy of the data of the new run: they are
+     * written, and their buffers mapped again, before the commit.
+     */
+    for (i = 0; i < n; i++) {
+        struct buffer_head *head, *bh;
+
+        folio_lock(folios[i]);
+        head = folio_buffers(folios[i]);
+        if (head) {
+            bh = head;
+            do {
+                clear_buffer_mapped(bh);
+                bh = bh->b_this_page;
+            } while (bh != head);
+        }
+        folio_mark_dirty(folios[i]);
+        folio_unlock(folios[i]);
+    }
+    simplefs_journal_inode_ranges(handle, inode, start, end - start, bno);
+stop:
+    simplefs_journal_stop(handle);
+put:
+    for (i = 0; i < n; i++)
+        folio_put(folios[i]);
+    return ret;
+}
+
+/* Called by simplefs_write_begin(), inode locked, before writing to
+ * [pos, pos + len)
+ */
+int simplefs_unshare_range(struct inode *inode, loff_t pos, loff_t len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    struct buffer_head *bh_index;
+    uint32_t ei, last;
+    int ret = 0;
+
+    if ((!simplefs_has_compression(sb) && !simplefs_has_reflink(sb) &&
+         !SIMPLEFS_SB(sb)->log) ||
+        !len)
+        return 0;
+
+    bh_index = simplefs_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
+    if (!bh_index)
+        return -EIO;
+    index = (struct simplefs_file_ei_block *) bh_index->b_data;
+    last = (pos + len - 1) >> sb->s_blocksize_bits;
+
+    for (ei = simplefs_ext_search(index, simplefs_max_extents(sb),
+                                  pos >> sb->s_blocksize_bits);
+         ei < simplefs_max_extents(sb) && index->extents[ei].ee_start &&
+         index->extents[ei].ee_block <= last;
+         ei++) {
+        ext = &index->extents[ei];
+        if (ext->ee_flags & SIMPLEFS_EXT_LZ4 ||
+            simplefs_refcount(sb, ext->ee_start) ||
+            simplefs_log_cow(sb, ext->ee_start)) {
+            ret = simplefs_unshare_extent(inode, bh_index, ei);
+            if (ret)
+                break;
+        }
+    }
+    brelse(bh_index);
+    return ret;
+}
+
+/* Called by the cleaner of the log, inode locked: move the extents of @inode
+ * in segments being cleaned to the head of the log. Shared extents stay.
+ * Returns the number of blocks moved.
+ */
+int simplefs_log_move_extents(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct simplefs_file_ei_block *index;
+    struct simplefs_extent *ext;
+    struct buffer_head *bh_index;
+    uint32_t ei;
+    int moved = 0;
+
+    bh_index = simplefs_bread(sb, SIMPLEFS_INODE(inode)->ei_block);
+    if (!bh_index)
+        return -EIO;
+    index = (struct simplefs_file_ei_block *) bh_index->b_data;
+
+    for (ei = 0;
+         ei < simplefs_max_extents(sb) && index->extents[ei].ee_start; ei++) {
+        ext = &index->extents[ei];
+        if (!simplefs_log_victim(sb, ext->ee_start) ||
+            simplefs_refcount(sb, ext->ee_start))
+            continue;
+        if (simplefs_unshare_extent(inode, bh_index, ei))
+            break;
+        moved += ext->ee_len;
+    }
+    brelse(bh_index);
+    return moved;
+}
+
+#if SIMPLEFS_AT_LEAST(4, 20, 0)
+/* Point the extent of @bh_out starting at file block @iblock_out at the
+ * blocks of the extent of @bh_in starting at @iblock_in, the data of both
+ * being the same over @nr_blocks blocks. Both extents must start there and
+ * span no more than that, so that only compared data gets shared.
+ */
+static int simplefs_dedup_extent(struct super_block *sb,
+                                 struct buffer_head *bh_in,
+                                 uint32_t iblock_in,
+                                 struct buffer_head *bh_out,
+                                 uint32_t iblock_out,
+                                 uint32_t nr_blocks)
+{
+    struct simplefs_file_ei_block *index_in =
+        (struct simplefs_file_ei_block *) bh_in->b_data;
+    struct simplefs_file_ei_block *index_out =
+        (struct simplefs_file_ei_block *) bh_out->b_data;
+    uint32_t ei_in =
+        simplefs_ext_search(index_in, simplefs_max_extents(sb), iblock_in);
+    uint32_t ei_out =
+        simplefs_ext_search(index_out, simplefs_max_extents(sb), iblock_out);
+    struct simplefs_extent *src, *dst, old;
+    handle_t *handle;
+    int ret;
+
+    if (ei_in >= simplefs_max_extents(sb) ||
+        ei_out >= simplefs_max_extents(sb))
+        return -EINVAL;
+    src = &index_in->extents[ei_in];
+    dst = &index_out->extents[ei_out];
+    if (!src->ee_start || !dst->ee_start || src->ee_block != iblock_in ||
+        dst->ee_block != iblock_out || src->ee_len != dst->ee_len ||
+        src->ee_len > nr_blocks)
+        return -EINVAL;
+    if (src->ee_start == dst->ee_start)
+        return 0;
+
+    handle = simplefs_journal_start(sb, SIMPLEFS_DEDUP_CREDITS);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+    ret = simplefs_journal_get_write_access(handle, bh_out);
+    if (ret)
+        goto stop;
+    ret = simplefs_refcount_get(sb, src->ee_start);
+    if (ret)
+        goto stop;
+    simplefs_fc_mark_ineligible(sb, handle);
+    old = *dst;
+    dst->ee_start = src->ee_start;
+    dst->ee_clen = src->ee_clen;
+    dst->ee_flags = src->ee_flags;
+    ret = simplefs_journal_dirty_metadata(handle, sb, bh_out);
+    if (!ret)
+        ret = put_blocks(sb, old.ee_start, simplefs_ext_blocks(&old));
+stop:
+    simplefs_journal_stop(handle);
+    return ret;
+}
+
+/* FIDEDUPERANGE. The ranges start at extent boundaries, and are whole
+ * extents but for the last extents of both files; longer ranges are
+ * shortened to whole extents. Extents not starting at the same offsets in
+ * both ranges, as after an append to a file with a short last extent, stop
+ * the deduplication. Returns the number of bytes deduplicated.
+ */
+loff_t simplefs_remap_file_range(struct file *file_in,
+                                 loff_t pos_in,
+                                 struct file *file_out,
+                                 loff_t pos_out,
+                                 loff_t len,
+                                 unsigned int remap_flags)
+{
+    struct inode *inode_in = file_inode(file_in);
+    struct inode *inode_out = file_inode(file_out);
+    struct super_block *sb = inode_out->i_sb;
+    loff_t ext_bytes = (loff_t) SIMPLEFS_MAX_BLOCKS_PER_EXTENT
+                       << sb->s_blocksize_bits;
+    struct buffer_head *bh_in = NULL, *bh_out = NULL;
+    loff_t off, done = 0;
+    bool tail = true;
+    int ret;
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+        return -EINVAL;
+    /* Clones are not supported, only deduplication */
+    if (!(remap_flags & REMAP_FILE_DEDUP))
+        return -EOPNOTSUPP;
+    if ((pos_in | pos_out) & (ext_bytes - 1))
+        return -EINVAL;
+
+    lock_two_nondirectories(inode_in, inode_out);
+#if SIMPLEFS_AT_LEAST(5, 16, 0)
+    filemap_invalidate_lock_two(inode_in->i_mapping, inode_out->i_mapping);
+#endif
+
+    /* Writes back both ranges and compares them */
+    ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+                                        &len, remap_flags);
+    if (ret < 0 || !len)
+        goto unlock;
+    if (pos_in + len != i_size_read(inode_in) ||
+        pos_out + len != i_size_read(inode_out)) {
+        len &= ~(ext_bytes - 1);
+        tail = false;
+    }
+    if (!len)
+        goto unlock;
+
+    ret = simplefs_refcount_create(sb);
+    if (ret)
+        goto unlock;
+    ret = -EIO;
+    bh_in = simplefs_bread(sb, SIMPLEFS_INODE(inode_in)->ei_block);
+    bh_out = simplefs_bread(sb, SIMPLEFS_INODE(inode_out)->ei_block);
+    if (!bh_in || !bh_out)
+        goto release;
+
+    for (off = 0; off < len; off += ext_bytes) {
+        /* Past the end of both files, the last extents were not compared */
+        uint32_t nr_blocks =
+            tail && off + ext_bytes >= len
+                ? UINT_MAX
+                : (min(ext_bytes, len - off) + sb->s_blocksize - 1) >>
+                      sb->s_blocksize_bits;
+
+        ret = simplefs_dedup_extent(sb, bh_in,
+                                    (pos_in + off) >> sb->s_blocksize_bits,
+                                    bh_out,
+                                    (pos_out + off) >> sb->s_blocksize_bits,
+                                    nr_blocks);
+        if (ret)
+            break;
+        done = min(off + ext_bytes, len);
+    }
+    /* The cached pages of the destination map its old blocks */
+    if (done)
+        truncate_inode_pages_range(inode_out->i_mapping, pos_out,
+                                   pos_out + done - 1);
+
+release:
+    brelse(bh_in);
+    brelse(bh_out);
+unlock:
+#if SIMPLEFS_AT_LEAST(5, 16, 0)
+    filemap_invalidate_unlock_two(inode_in->i_mapping, inode_out->i_mapping);
+#endif
+    unlock_two_nondirectories(inode_in, inode_out);
+    return done ? done : ret;
+}
+#endif
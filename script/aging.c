@@ -0,0 +1,610 @@
+/* aging: ages a simplefs image through libsimplefs, Geriatrix style, and
+ * reports how fragmented it gets (see script/aging.sh).
+ *
+ * Files whose sizes are drawn from a distribution are created until @fullness
+ * percent of the blocks free at the start are used. Then @ops operations
+ * churn them: creates, appends, truncates and deletes in the proportions of
+ * the mix, with deletes taking over while the partition is fuller than the
+ * target. After the fill, every @interval operations and at the end, prints a
+ * JSON object with the free space fragmentation of the bfree bitmap, the
+ * extents and fragments per file and the layout score; the last one also
+ * has the sequential read throughput of all the files, with the image out of
+ * the page cache. The allocation policy of libsimplefs can be changed, to
+ * compare others with the first fit of the kernel.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libsimplefs.h"
+
+#define FILES_PER_DIR 1000
+#define IO_SIZE (1 << 20)
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
+
+enum { OP_CREATE, OP_APPEND, OP_TRUNCATE, OP_DELETE, NR_OPS };
+
+struct file {
+    uint32_t ino;
+    uint32_t dir; /* index in dirs */
+    uint32_t id;  /* name: f<id> */
+};
+
+struct dir {
+    uint32_t ino;
+    uint32_t nr_files;
+};
+
+static struct sfs fs;
+static struct file *files;
+static uint32_t nr_files, max_files, next_id;
+static struct dir *dirs;
+static uint32_t nr_dirs, dir_cursor;
+static char *io_buf;
+static uint64_t target_used, initial_free, max_size;
+static uint64_t nr_enospc;
+
+/* Size distribution */
+static enum { DIST_LOGNORMAL, DIST_UNIFORM, DIST_FIXED } dist;
+static double dist_a = 16384, dist_b = 2; /* median and sigma, min and max */
+static const char *dist_name = "lognormal:16k,2";
+
+static unsigned int mix[NR_OPS] = {4, 3, 1, 2};
+static const char *policy_name = "first";
+static const char *label = "";
+static unsigned long seed;
+
+/* xorshift64*, reproducible for a given seed */
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform in (0, 1) */
+static double rng_unit(void)
+{
+    return ((rng() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static uint64_t draw_size(void)
+{
+    double size;
+
+    switch (dist) {
+    case DIST_LOGNORMAL:
+        /* Box-Muller */
+        size = dist_a * exp(dist_b * sqrt(-2 * log(rng_unit())) *
+                            cos(2 * M_PI * rng_unit()));
+        break;
+    case DIST_UNIFORM:
+        size = dist_a + rng_unit() * (dist_b - dist_a);
+        break;
+    default:
+        size = dist_a;
+    }
+    return size < max_size ? (uint64_t) size : max_size;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t used_blocks(void)
+{
+    return initial_free - fs.sbi.nr_free_blocks;
+}
+
+/* A directory with room for one more file, made if there is none */
+static int get_dir(uint32_t *d)
+{
+    struct simplefs_inode root, inode;
+    uint32_t ino;
+    char name[32];
+    int ret;
+
+    for (uint32_t i = 0; i < nr_dirs; i++) {
+        uint32_t k = (dir_cursor + i) % nr_dirs;
+
+        if (dirs[k].nr_files < FILES_PER_DIR) {
+            *d = dir_cursor = k;
+            return 0;
+        }
+    }
+
+    struct dir *new_dirs = realloc(dirs, (nr_dirs + 1) * sizeof(*dirs));
+    if (!new_dirs)
+        return -ENOMEM;
+    dirs = new_dirs;
+    ret = sfs_read_inode(&fs, SIMPLEFS_ROOT_INO, &root);
+    if (ret)
+        return ret;
+    ret = sfs_new_inode(&fs, S_IFDIR | 0755, &ino, &inode);
+    if (ret)
+        return ret;
+    snprintf(name, sizeof(name), "aging%u", nr_dirs);
+    ret = sfs_write_inode(&fs, ino, &inode);
+    if (!ret)
+        ret = sfs_dir_add(&fs, &root, name, ino);
+    if (ret) {
+        sfs_free_file(&fs, ino, &inode);
+        return ret;
+    }
+    root.i_nlink++;
+    root.i_mtime = root.i_ctime = time(NULL);
+    ret = sfs_write_inode(&fs, SIMPLEFS_ROOT_INO, &root);
+    if (ret)
+        return ret;
+    dirs[nr_dirs].ino = ino;
+    dirs[nr_dirs].nr_files = 0;
+    *d = dir_cursor = nr_dirs++;
+    return 0;
+}
+
+/* Write @len bytes at the end of @f */
+static int append(struct file *f, uint64_t len)
+{
+    struct simplefs_inode inode;
+    int ret = sfs_read_inode(&fs, f->ino, &inode);
+
+    if (ret)
+        return ret;
+    if (len > max_size - inode.i_size)
+        len = max_size - inode.i_size;
+    while (len) {
+        size_t n = len < IO_SIZE ? len : IO_SIZE;
+        ssize_t done =
+            sfs_file_write(&fs, f->ino, &inode, io_buf, n, inode.i_size);
+
+        if (done < 0)
+            return done;
+        len -= done;
+    }
+    return 0;
+}
+
+static int do_create(void)
+{
+    struct simplefs_inode dir, inode;
+    struct file *f;
+    uint32_t d, ino;
+    char name[32];
+    int ret;
+
+    if (nr_files == max_files) {
+        uint32_t n = max_files ? max_files * 2 : 1024;
+        struct file *new_files = realloc(files, n * sizeof(*files));
+
+        if (!new_files)
+            return -ENOMEM;
+        files = new_files;
+        max_files = n;
+    }
+    ret = get_dir(&d);
+    if (ret)
+        return ret;
+    ret = sfs_read_inode(&fs, dirs[d].ino, &dir);
+    if (ret)
+        return ret;
+    ret = sfs_new_inode(&fs, S_IFREG | 0644, &ino, &inode);
+    if (ret)
+        return ret;
+    snprintf(name, sizeof(name), "f%u", next_id);
+    ret = sfs_write_inode(&fs, ino, &inode);
+    if (!ret)
+        ret = sfs_dir_add(&fs, &dir, name, ino);
+    if (ret) {
+        sfs_free_file(&fs, ino, &inode);
+        return ret;
+    }
+
+    f = &files[nr_files++];
+    f->ino = ino;
+    f->dir = d;
+    f->id = next_id++;
+    dirs[d].nr_files++;
+    /* Out of space halfway, the file keeps what was written */
+    return append(f, draw_size());
+}
+
+static int do_append(struct file *f)
+{
+    return append(f, draw_size());
+}
+
+static int do_truncate(struct file *f)
+{
+    struct simplefs_inode inode;
+    int ret = sfs_read_inode(&fs, f->ino, &inode);
+
+    if (ret || !inode.i_size)
+        return ret;
+    return sfs_truncate(&fs, f->ino, &inode, rng() % inode.i_size);
+}
+
+static int do_delete(struct file *f)
+{
+    struct simplefs_inode dir, inode;
+    char name[32];
+    int ret;
+
+    snprintf(name, sizeof(name), "f%u", f->id);
+    ret = sfs_read_inode(&fs, dirs[f->dir].ino, &dir);
+    if (!ret)
+        ret = sfs_read_inode(&fs, f->ino, &inode);
+    if (!ret)
+        ret = sfs_dir_remove(&fs, &dir, name, f->ino);
+    if (!ret)
+        ret = sfs_free_file(&fs, f->ino, &inode);
+    if (ret)
+        return ret;
+    dirs[f->dir].nr_files--;
+    *f = files[--nr_files];
+    return 0;
+}
+
+/* One operation: a delete if the partition is over the target */
+static int age_once(int fill)
+{
+    unsigned int total = 0, pick;
+    int op = OP_CREATE, ret;
+
+    if (used_blocks() >= target_used)
+        op = OP_DELETE;
+    else if (!fill && nr_files) {
+        for (int i = 0; i < NR_OPS; i++)
+            total += mix[i];
+        pick = rng() % total;
+        for (op = 0; pick >= mix[op]; op++)
+            pick -= mix[op];
+    }
+    if (op != OP_CREATE && !nr_files)
+        return 0;
+
+    struct file *f = &files[nr_files ? rng() % nr_files : 0];
+    switch (op) {
+    case OP_CREATE:
+        ret = do_create();
+        break;
+    case OP_APPEND:
+        ret = do_append(f);
+        break;
+    case OP_TRUNCATE:
+        ret = do_truncate(f);
+        break;
+    default:
+        ret = do_delete(f);
+    }
+    if (ret == -ENOSPC && !fill) {
+        nr_enospc++;
+        /* Make room, which the next operation would do anyway */
+        if (nr_files)
+            ret = do_delete(&files[rng() % nr_files]);
+        else
+            ret = 0;
+    }
+    return ret;
+}
+
+static int test_bit(const unsigned long *map, uint32_t bit)
+{
+    return !!(map[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG)));
+}
+
+/* Free space and file layout, as a JSON object */
+static int report(const char *phase, uint64_t ops, int read)
+{
+    struct simplefs_sb_info *sbi = &fs.sbi;
+    uint32_t first = 1 + sbi->nr_istore_blocks + sbi->nr_ifree_blocks +
+                     sbi->nr_bfree_blocks;
+    uint32_t max = SIMPLEFS_MAX_EXTENTS(fs.block_size);
+    uint64_t free_blocks = 0, free_runs = 0, run_max = 0, short_free = 0;
+    uint64_t nr_extents = 0, nr_frags = 0, frag_max = 0, contiguous = 0;
+    uint64_t blocks = 0, gaps = 0, nonempty = 0;
+    struct simplefs_file_ei_block *index = malloc(fs.block_size);
+    int ret = 0;
+
+    if (!index)
+        return -ENOMEM;
+
+    /* Free runs of the data area */
+    for (uint32_t bit = first; bit < sbi->nr_blocks;) {
+        uint32_t run = 0;
+
+        while (bit < sbi->nr_blocks && !test_bit(sbi->bfree_bitmap, bit))
+            bit++;
+        while (bit < sbi->nr_blocks && test_bit(sbi->bfree_bitmap, bit)) {
+            bit++;
+            run++;
+        }
+        if (!run)
+            break;
+        free_runs++;
+        free_blocks += run;
+        if (run > run_max)
+            run_max = run;
+        if (run < SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+            short_free += run;
+    }
+
+    /* Extents, and fragments: runs of physically contiguous extents */
+    for (uint32_t i = 0; i < nr_files; i++) {
+        struct simplefs_inode inode;
+        uint64_t frags = 0, next = 0, len = 0;
+
+        ret = sfs_read_inode(&fs, files[i].ino, &inode);
+        if (!ret)
+            ret = sfs_read_meta(&fs, inode.ei_block, index);
+        if (ret)
+            goto end;
+        for (uint32_t ei = 0; ei < max && index->extents[ei].ee_start; ei++) {
+            struct simplefs_extent *ext = &index->extents[ei];
+
+            if (ext->ee_start != next)
+                frags++;
+            next = ext->ee_start + ext->ee_len;
+            len += ext->ee_len;
+            nr_extents++;
+        }
+        nr_frags += frags;
+        if (frags > frag_max)
+            frag_max = frags;
+        if (len) {
+            nonempty++;
+            contiguous += frags == 1;
+            blocks += len - 1;
+            gaps += frags - 1;
+        }
+    }
+
+    printf("{\"label\": \"%s\", \"policy\": \"%s\", \"dist\": \"%s\", "
+           "\"seed\": %lu, \"phase\": \"%s\", \"ops\": %lu, \"files\": %u, "
+           "\"used_pct\": %.2f, \"free_blocks\": %lu, \"free_runs\": %lu, "
+           "\"free_run_avg\": %.2f, \"free_run_max\": %lu, "
+           "\"short_free_pct\": %.2f, \"extents_per_file\": %.2f, "
+           "\"fragments_per_file\": %.3f, \"fragments_max\": %lu, "
+           "\"contiguous_pct\": %.2f, \"layout_score\": %.4f, \"enospc\": %lu",
+           label, policy_name, dist_name, seed, phase, ops, nr_files,
+           100.0 * used_blocks() / initial_free, free_blocks, free_runs,
+           free_runs ? (double) free_blocks / free_runs : 0, run_max,
+           free_blocks ? 100.0 * short_free / free_blocks : 0,
+           nr_files ? (double) nr_extents / nr_files : 0,
+           nonempty ? (double) nr_frags / nonempty : 0, frag_max,
+           nonempty ? 100.0 * contiguous / nonempty : 100,
+           blocks ? 1 - (double) gaps / blocks : 1, nr_enospc);
+
+    if (read) {
+        uint64_t bytes = 0, t0;
+
+        /* Cold reads: the image out of the page cache */
+        ret = sfs_sync(&fs);
+        if (ret)
+            goto end;
+        fsync(fs.fd);
+        posix_fadvise(fs.fd, 0, 0, POSIX_FADV_DONTNEED);
+        t0 = now_ns();
+        for (uint32_t i = 0; i < nr_files; i++) {
+            struct simplefs_inode inode;
+            ssize_t n;
+
+            ret = sfs_read_inode(&fs, files[i].ino, &inode);
+            for (uint64_t off = 0; !ret && off < inode.i_size; off += n) {
+                n = sfs_file_read(&fs, &inode, io_buf, IO_SIZE, off);
+                if (n <= 0)
+                    ret = n ? n : -EIO;
+            }
+            if (ret)
+                goto end;
+            bytes += inode.i_size;
+        }
+        double seconds = (now_ns() - t0) / 1e9;
+        printf(", \"read_bytes\": %lu, \"read_seconds\": %.3f, "
+               "\"read_mib_s\": %.1f",
+               bytes, seconds, bytes / 1048576.0 / seconds);
+    }
+    printf("}\n");
+    fflush(stdout);
+end:
+    free(index);
+    return ret;
+}
+
+/* Sizes in bytes, with an optional k, m or g */
+static int parse_size(const char *s, char **end, double *size)
+{
+    *size = strtod(s, end);
+    switch (**end) {
+    case 'g':
+    case 'G':
+        *size *= 1024;
+        /* fall through */
+    case 'm':
+    case 'M':
+        *size *= 1024;
+        /* fall through */
+    case 'k':
+    case 'K':
+        *size *= 1024;
+        (*end)++;
+    }
+    return *end == s || *size < 0 ? -1 : 0;
+}
+
+static int parse_dist(const char *s)
+{
+    char *end;
+
+    dist_name = s;
+    if (!strncmp(s, "lognormal:", 10)) {
+        dist = DIST_LOGNORMAL;
+        if (parse_size(s + 10, &end, &dist_a) || *end != ',')
+            return -1;
+        dist_b = strtod(end + 1, &end);
+        return *end || dist_b <= 0 ? -1 : 0;
+    }
+    if (!strncmp(s, "uniform:", 8)) {
+        dist = DIST_UNIFORM;
+        if (parse_size(s + 8, &end, &dist_a) || *end != ',' ||
+            parse_size(end + 1, &end, &dist_b))
+            return -1;
+        return *end || dist_b < dist_a ? -1 : 0;
+    }
+    if (!strncmp(s, "fixed:", 6)) {
+        dist = DIST_FIXED;
+        return parse_size(s + 6, &end, &dist_a) || *end ? -1 : 0;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long nr_ops = 100000, interval = 0;
+    double fullness = 80;
+    enum sfs_alloc_policy policy = SFS_ALLOC_FIRST_FIT;
+    int opt, ret;
+    char c;
+
+    seed = time(NULL);
+    while ((opt = getopt(argc, argv, "f:o:i:d:m:a:s:l:")) != -1) {
+        char *end;
+
+        switch (opt) {
+        case 'f':
+            fullness = strtod(optarg, &end);
+            if (*end || fullness <= 0 || fullness > 100)
+                goto usage;
+            break;
+        case 'o':
+            nr_ops = strtoul(optarg, &end, 10);
+            if (*end)
+                goto usage;
+            break;
+        case 'i':
+            interval = strtoul(optarg, &end, 10);
+            if (*end)
+                goto usage;
+            break;
+        case 'd':
+            if (parse_dist(optarg))
+                goto usage;
+            break;
+        case 'm':
+            if (sscanf(optarg, "%u,%u,%u,%u%c", &mix[OP_CREATE],
+                       &mix[OP_APPEND], &mix[OP_TRUNCATE], &mix[OP_DELETE],
+                       &c) != 4 ||
+                !(mix[OP_CREATE] + mix[OP_APPEND] + mix[OP_TRUNCATE] +
+                  mix[OP_DELETE]))
+                goto usage;
+            break;
+        case 'a':
+            policy_name = optarg;
+            if (!strcmp(optarg, "first"))
+                policy = SFS_ALLOC_FIRST_FIT;
+            else if (!strcmp(optarg, "next"))
+                policy = SFS_ALLOC_NEXT_FIT;
+            else if (!strcmp(optarg, "best"))
+                policy = SFS_ALLOC_BEST_FIT;
+            else
+                goto usage;
+            break;
+        case 's':
+            seed = strtoul(optarg, &end, 10);
+            if (*end)
+                goto usage;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+    usage:
+        fprintf(stderr,
+                "Usage: %s [-f fullness] [-o ops] [-i interval] [-d dist] "
+                "[-m mix] [-a policy] [-s seed] [-l label] image\n"
+                "\t-f  percent of the free blocks to fill (default: 80)\n"
+                "\t-o  operations after the fill (default: 100000)\n"
+                "\t-i  report every this many operations (default: at the "
+                "end)\n"
+                "\t-d  file and append sizes: lognormal:median,sigma, "
+                "uniform:min,max\n"
+                "\t    or fixed:size, with k, m or g (default: "
+                "lognormal:16k,2)\n"
+                "\t-m  create,append,truncate,delete weights (default: "
+                "4,3,1,2)\n"
+                "\t-a  block allocation policy: first, next or best "
+                "(default: first)\n"
+                "\t-s  random seed (default: the time)\n"
+                "\t-l  label copied to the output\n",
+                argv[0]);
+        return 1;
+    }
+
+    ret = sfs_open(&fs, argv[optind], 1);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+        return 1;
+    }
+    fs.alloc_policy = policy;
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    max_size = SIMPLEFS_MAX_FILESIZE(fs.block_size);
+    if (max_size > UINT32_MAX)
+        max_size = UINT32_MAX;
+    initial_free = fs.sbi.nr_free_blocks;
+    target_used = initial_free * fullness / 100;
+    io_buf = malloc(IO_SIZE);
+    if (!io_buf) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    memset(io_buf, 0xa5, IO_SIZE);
+
+    /* Fill, then churn. Running out of inodes or blocks ends the fill. */
+    unsigned long ops = 0;
+    while (!(ret = age_once(1)) && used_blocks() < target_used)
+        ops++;
+    if (ret == -ENOSPC) {
+        nr_enospc++;
+        ret = 0;
+    }
+    if (!ret)
+        ret = report("fill", ops, 0);
+    for (ops = 1; !ret && ops <= nr_ops; ops++) {
+        ret = age_once(0);
+        if (!ret && interval && ops % interval == 0 && ops < nr_ops)
+            ret = report("age", ops, 0);
+    }
+    if (!ret)
+        ret = report("final", nr_ops, 1);
+    if (ret)
+        fprintf(stderr, "aging: %s\n", strerror(-ret));
+
+    int err = sfs_sync(&fs);
+    if (err && !ret) {
+        fprintf(stderr, "aging: sync: %s\n", strerror(-err));
+        ret = err;
+    }
+    sfs_close(&fs);
+    free(io_buf);
+    free(files);
+    free(dirs);
+    return ret ? 1 : 0;
+}
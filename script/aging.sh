@@ -0,0 +1,118 @@
+#!/usr/bin/env bash
+#
+# Aging benchmark: for every block allocation policy and run, formats a fresh
+# image and ages it with the aging tool (libsimplefs, no mount needed): files
+# are created to the target fullness, then churned by creates, appends,
+# truncates and deletes. Run r uses seed r for every policy, so that they
+# replay the same workload. The free space fragmentation, extents and
+# fragments per file, layout score and sequential read throughput it prints
+# are appended to the result file with the run number; with -k, the aged
+# image is also mounted and all its files read back cold through the kernel
+# module. The label defaults to the current commit.
+#
+# Usage: script/aging.sh [-a "policies ..."] [-r runs] [-f fullness]
+#                        [-n ops] [-i interval] [-d dist] [-m mix]
+#                        [-s image-MiB] [-l label] [-k] [-o results.jsonl]
+#   -a  of first (the kernel), next and best
+#   -k  also time reading the aged files through the kernel module
+
+SIMPLEFS_MOD=simplefs.ko
+MKFS=${MKFS:-mkfs.simplefs}
+AGING=${AGING:-aging}
+IMAGE=${IMAGE:-aging.img}
+MNT=aging_mnt
+
+POLICIES="first next best"
+RUNS=3
+FULLNESS=80
+OPS=100000
+INTERVAL=10000
+DIST=lognormal:16k,2
+MIX=4,3,1,2
+IMAGESIZE=256
+LABEL=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+KERNEL=0
+RESULTS=aging_results.jsonl
+
+while getopts "a:r:f:n:i:d:m:s:l:ko:" opt; do
+    case $opt in
+    a) POLICIES=$OPTARG ;;
+    r) RUNS=$OPTARG ;;
+    f) FULLNESS=$OPTARG ;;
+    n) OPS=$OPTARG ;;
+    i) INTERVAL=$OPTARG ;;
+    d) DIST=$OPTARG ;;
+    m) MIX=$OPTARG ;;
+    s) IMAGESIZE=$OPTARG ;;
+    l) LABEL=$OPTARG ;;
+    k) KERNEL=1 ;;
+    o) RESULTS=$OPTARG ;;
+    *) sed -n '13,17p' "$0"; exit 1 ;;
+    esac
+done
+
+if [ "$EUID" -eq 0 ]
+  then echo "Don't run this script as root"
+  exit
+fi
+
+cleanup() {
+    [ $KERNEL -eq 1 ] && sudo umount $MNT 2>/dev/null
+}
+
+# Read every file of the mounted image with the caches dropped
+kernel_read() {
+    local policy=$1 run=$2 bytes t0 t1
+
+    sudo mount -t simplefs -o loop $IMAGE $MNT || return 1
+    sync
+    echo 3 | sudo tee /proc/sys/vm/drop_caches >/dev/null
+    bytes=$(sudo du -sb $MNT | cut -f1)
+    t0=$(date +%s.%N)
+    sudo find $MNT -type f -exec cat {} + >/dev/null || return 1
+    t1=$(date +%s.%N)
+    cleanup
+    awk -v l="$LABEL" -v p=$policy -v r=$run -v b=$bytes -v t0=$t0 \
+        -v t1=$t1 'BEGIN {
+        s = t1 - t0
+        printf "{\"run\": %d, \"label\": \"%s\", \"policy\": \"%s\", " \
+               "\"phase\": \"kernel_read\", \"read_bytes\": %d, " \
+               "\"read_seconds\": %.3f, \"read_mib_s\": %.1f}\n",
+               r, l, p, b, s, b / 1048576 / s }' | tee -a $RESULTS
+}
+
+# One run: fresh image, aging, then the kernel read
+run_once() {
+    local policy=$1 run=$2 status
+
+    dd if=/dev/zero of=$IMAGE bs=1M count=$IMAGESIZE status=none &&
+        ./$MKFS $IMAGE >/dev/null || return 1
+    ./$AGING -a $policy -s $run -f $FULLNESS -o $OPS -i $INTERVAL \
+        -d $DIST -m $MIX -l "$LABEL" $IMAGE |
+        sed "s/^{/{\"run\": $run, /" | tee -a $RESULTS
+    status=${PIPESTATUS[0]}
+    [ $status -ne 0 ] && return $status
+    [ $KERNEL -eq 1 ] && { kernel_read $policy $run || return 1; }
+    return 0
+}
+
+trap cleanup EXIT
+if [ $KERNEL -eq 1 ]; then
+    mkdir -p $MNT
+    cleanup
+    sudo rmmod simplefs 2>/dev/null
+    (modinfo $SIMPLEFS_MOD >/dev/null || exit 1) &&
+        sudo insmod $SIMPLEFS_MOD || exit 1
+fi
+
+failures=0
+for ((run = 1; run <= RUNS; run++)); do
+    for policy in $POLICIES; do
+        run_once $policy $run || failures=$((failures + 1))
+    done
+done
+
+rm -f $IMAGE
+[ $KERNEL -eq 1 ] && rmdir $MNT
+echo "Results appended to $RESULTS, $failures failed run(s)"
+[ $failures -eq 0 ]
@@ -0,0 +1,190 @@
+#!/usr/bin/env bash
+#
+# Crash-recovery harness: runs a metadata workload on a loop device behind
+# dm-flakey, switches the target to drop every write at a random point (a
+# crash as seen by the disk), then remounts the image to measure the journal
+# replay time and the time to a usable mount, and checks the result:
+#   - every file fsync'ed before the crash must be there with its content;
+#   - the whole tree must be readable;
+#   - the kernel must not have logged any simplefs error;
+#   - $FSCK, if set, must accept the image.
+# One JSON object per run is appended to the result file.
+#
+# Usage: script/crash_test.sh [-i runs] [-j "journal MiB ..."]
+#                             [-w "workers ..."] [-t max-crash-ms]
+#                             [-s image-MiB] [-o results.jsonl]
+
+SIMPLEFS_MOD=simplefs.ko
+MKFS=${MKFS:-mkfs.simplefs}
+IMAGE=${IMAGE:-crash.img}
+DM_NAME=simplefs-crash
+MNT=crash_mnt
+
+RUNS=5
+JOURNALS="1 4 16"
+WORKERS="1 4"
+MAX_CRASH_MS=3000
+IMAGESIZE=200
+RESULTS=crash_results.jsonl
+
+while getopts "i:j:w:t:s:o:" opt; do
+    case $opt in
+    i) RUNS=$OPTARG ;;
+    j) JOURNALS=$OPTARG ;;
+    w) WORKERS=$OPTARG ;;
+    t) MAX_CRASH_MS=$OPTARG ;;
+    s) IMAGESIZE=$OPTARG ;;
+    o) RESULTS=$OPTARG ;;
+    *) sed -n '13,15p' "$0"; exit 1 ;;
+    esac
+done
+
+if [ "$EUID" -eq 0 ]
+  then echo "Don't run this script as root"
+  exit
+fi
+
+now_us() {
+    echo $(( $(date +%s%N) / 1000 ))
+}
+
+# Worker $1: creates, renames and removes files in its own directory, and
+# fsyncs every fourth file. Names of fsync'ed files are recorded in $2, on a
+# filesystem that does not crash, only once fsync has returned.
+workload() {
+    local id=$1 log=$2 n=0 dir=$MNT/w$id
+    sudo mkdir -p $dir
+    while :; do
+        n=$((n + 1))
+        if (( n % 4 == 0 )); then
+            echo "w$id/s$n" |
+                sudo dd of=$dir/s$n conv=fsync status=none || break
+            echo "w$id/s$n" >> $log
+        else
+            echo "$n" | sudo tee $dir/f$n >/dev/null || break
+        fi
+        (( n % 8 == 0 )) && { sudo mv $dir/f$((n - 1)) $dir/r$n || break; }
+        (( n % 16 == 0 )) && { sudo rm -f $dir/f$((n - 3)) || break; }
+        (( n % 64 == 0 )) && { sudo mkdir $dir/d$n || break; }
+        echo $n > $log.ops
+    done
+}
+
+cleanup() {
+    sudo umount $MNT 2>/dev/null
+    sudo dmsetup remove $DM_NAME 2>/dev/null
+    [ -n "$LOOP" ] && sudo losetup -d $LOOP 2>/dev/null
+    LOOP=
+}
+
+# Replays the journal of the crashed image and checks it, then prints the
+# JSON fields describing the outcome.
+recover_and_check() {
+    local log=$1 errors=0 lost=0 synced=0 t0 t1 replay_us name result
+    local fsck=skipped
+
+    t0=$(now_us)
+    if ! sudo mount -t simplefs -o loop $IMAGE $MNT; then
+        echo "\"mount_us\": -1, \"replay_us\": -1, \"synced\": 0," \
+             "\"lost\": 0, \"fsck\": \"skipped\", \"result\": \"mount failed\""
+        return 1
+    fi
+    # a stat of the root is the first thing a user does with the mount
+    stat $MNT >/dev/null
+    t1=$(now_us)
+    # printed with pr_debug(), enabled by the dyndbg module parameter
+    replay_us=$(sudo dmesg | grep -o 'simplefs: journal: loaded in [0-9]*' |
+                tail -1 | grep -o '[0-9]*$')
+
+    while read -r name; do
+        synced=$((synced + 1))
+        [ "$(cat $MNT/$name 2>/dev/null)" = "$name" ] || lost=$((lost + 1))
+    done < $log
+    sudo find $MNT -type f -exec cat {} + >/dev/null 2>&1 || errors=1
+    sudo dmesg | tail -50 | grep -q 'simplefs: .*\(error\|mismatch\|failed\)' &&
+        errors=1
+    sudo umount $MNT
+
+    if [ -n "$FSCK" ]; then
+        if sudo $FSCK -n $IMAGE >/dev/null 2>&1; then fsck=clean; else
+            fsck=errors; errors=1
+        fi
+    fi
+
+    (( lost || errors )) && result=inconsistent || result=ok
+    echo "\"mount_us\": $((t1 - t0)), \"replay_us\": ${replay_us:--1}," \
+         "\"synced\": $synced, \"lost\": $lost, \"fsck\": \"$fsck\"," \
+         "\"result\": \"$result\""
+    [ $result = ok ]
+}
+
+# One run: fresh image, workload, crash after $3 ms, recovery
+run_once() {
+    local journal=$1 workers=$2 crash_ms=$3 run=$4 sectors log i pids=()
+    local ops=0 fields status
+
+    dd if=/dev/zero of=$IMAGE bs=1M count=$IMAGESIZE status=none &&
+        ./$MKFS -j $journal $IMAGE >/dev/null || return 1
+    LOOP=$(sudo losetup -f --show $IMAGE) || return 1
+    sectors=$(sudo blockdev --getsz $LOOP)
+    echo "0 $sectors linear $LOOP 0" | sudo dmsetup create $DM_NAME ||
+        return 1
+    sudo mount -t simplefs /dev/mapper/$DM_NAME $MNT || return 1
+
+    log=$(mktemp)
+    for ((i = 0; i < workers; i++)); do
+        workload $i $log.$i >/dev/null 2>&1 &
+        pids+=($!)
+    done
+    sleep $(awk "BEGIN { print $crash_ms / 1000 }")
+
+    # crash: from now on the disk silently drops every write
+    sudo dmsetup suspend --nolockfs $DM_NAME
+    echo "0 $sectors flakey $LOOP 0 0 180 1 drop_writes" |
+        sudo dmsetup load $DM_NAME
+    sudo dmsetup resume $DM_NAME
+    kill ${pids[@]} 2>/dev/null
+    wait ${pids[@]} 2>/dev/null
+
+    for ((i = 0; i < workers; i++)); do
+        cat $log.$i >> $log 2>/dev/null
+        ops=$((ops + $(cat $log.$i.ops 2>/dev/null || echo 0)))
+    done
+    sudo umount $MNT
+    sudo dmsetup remove $DM_NAME
+    sudo losetup -d $LOOP
+    LOOP=
+
+    fields=$(recover_and_check $log)
+    status=$?
+    echo "{\"journal_mb\": $journal, \"workers\": $workers, \"run\": $run," \
+         "\"crash_ms\": $crash_ms, \"ops\": $ops," \
+         "\"ops_per_s\": $((ops * 1000 / (crash_ms > 0 ? crash_ms : 1)))," \
+         "$fields}" | tee -a $RESULTS
+    rm -f $log $log.*
+    return $status
+}
+
+trap cleanup EXIT
+mkdir -p $MNT
+cleanup
+sudo rmmod simplefs 2>/dev/null
+(modinfo $SIMPLEFS_MOD >/dev/null || exit 1) &&
+    sudo insmod $SIMPLEFS_MOD dyndbg=+p &&
+    sudo modprobe dm-flakey || exit 1
+
+failures=0
+for journal in $JOURNALS; do
+    for workers in $WORKERS; do
+        for ((run = 1; run <= RUNS; run++)); do
+            run_once $journal $workers $((RANDOM % MAX_CRASH_MS)) $run ||
+                failures=$((failures + 1))
+            cleanup
+        done
+    done
+done
+
+rm -f $IMAGE
+rmdir $MNT
+echo "Results appended to $RESULTS, $failures inconsistent run(s)"
+[ $failures -eq 0 ]
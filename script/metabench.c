@@ -0,0 +1,355 @@
+/* metabench: metadata operation rates in one directory of a mounted
+ * filesystem, for simplefs baselines (see script/metabench.sh).
+ *
+ * Fills a directory with @entries files from @threads threads, then looks
+ * them up, looks up missing names, stats, lists, renames and removes them.
+ * Each thread takes every @threads-th name, so all of them work on the same
+ * directory. Before the phases that read, the dentry and inode caches are
+ * dropped (root only, see -w) so that they reach the filesystem. Prints one
+ * JSON object per phase.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct worker {
+    pthread_t thread;
+    uint32_t id;
+    uint64_t *lat; /* ns per operation */
+    uint32_t nr_ops;
+    uint32_t nr_errors;
+    uint64_t nr_entries; /* readdir only */
+};
+
+static const char *dir_path;
+static int dir_fd;
+static uint32_t nr_entries = 1000;
+static uint32_t nr_threads = 1;
+static uint32_t nr_passes = 10; /* readdir listings per thread */
+static int warm;                /* keep the caches between phases */
+static const char *label = "";
+
+static struct worker *workers;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* One operation on name @i of the directory. Returns -1 on error. */
+typedef int (*op_t)(struct worker *w, uint32_t i);
+
+static int op_create(struct worker *w, uint32_t i)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "f%u", i);
+    int fd = openat(dir_fd, name, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0)
+        return -1;
+    return close(fd);
+}
+
+static int op_lookup(struct worker *w, uint32_t i)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "f%u", i);
+    return faccessat(dir_fd, name, F_OK, 0);
+}
+
+/* A miss is an error if the name exists */
+static int op_miss(struct worker *w, uint32_t i)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "m%u", i);
+    return !faccessat(dir_fd, name, F_OK, 0) || errno != ENOENT ? -1 : 0;
+}
+
+static int op_stat(struct worker *w, uint32_t i)
+{
+    char name[32];
+    struct stat st;
+
+    snprintf(name, sizeof(name), "f%u", i);
+    return fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW);
+}
+
+/* One full listing; @i is the pass */
+static int op_readdir(struct worker *w, uint32_t i)
+{
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    struct dirent *de;
+    uint64_t n = 0;
+
+    if (!dir) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    while ((de = readdir(dir)))
+        n++;
+    closedir(dir);
+    w->nr_entries += n;
+    return n == (uint64_t) nr_entries + 2 ? 0 : -1;
+}
+
+static int op_rename(struct worker *w, uint32_t i)
+{
+    char from[32], to[32];
+
+    snprintf(from, sizeof(from), "f%u", i);
+    snprintf(to, sizeof(to), "r%u", i);
+    return renameat(dir_fd, from, dir_fd, to);
+}
+
+static int op_unlink(struct worker *w, uint32_t i)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "r%u", i);
+    return unlinkat(dir_fd, name, 0);
+}
+
+struct phase {
+    const char *name;
+    op_t op;
+    int reads; /* drop the caches first */
+};
+
+static const struct phase phases[] = {
+    {"create", op_create, 0},  {"lookup", op_lookup, 1},
+    {"lookup_miss", op_miss, 1}, {"stat", op_stat, 1},
+    {"readdir", op_readdir, 1}, {"rename", op_rename, 0},
+    {"unlink", op_unlink, 0},
+};
+
+static const struct phase *cur_phase;
+
+static void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    int passes = cur_phase->op == op_readdir;
+    uint32_t n = passes ? nr_passes : nr_entries;
+    uint32_t step = passes ? 1 : nr_threads;
+
+    pthread_barrier_wait(&start_barrier);
+    for (uint32_t i = passes ? 0 : w->id; i < n; i += step) {
+        uint64_t t0 = now_ns();
+
+        if (cur_phase->op(w, i))
+            w->nr_errors++;
+        w->lat[w->nr_ops++] = now_ns() - t0;
+    }
+    return NULL;
+}
+
+/* Write back and drop the dentry and inode caches. Returns 1 if they were
+ * dropped.
+ */
+static int drop_caches(void)
+{
+    static int warned;
+    int fd;
+
+    if (warm)
+        return 0;
+    sync();
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd >= 0 && write(fd, "2", 1) == 1) {
+        close(fd);
+        return 1;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (!warned++)
+        fprintf(stderr, "Cannot drop caches (%s): read phases run warm\n",
+                strerror(errno));
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int run_phase(const struct phase *phase, uint64_t *all, int report)
+{
+    uint64_t t0, t1, nr_ops = 0, nr_errors = 0, nr_listed = 0, sum = 0;
+    uint32_t i, started;
+    int cold = phase->reads && drop_caches();
+
+    cur_phase = phase;
+    pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+    for (started = 0; started < nr_threads; started++) {
+        workers[started].nr_ops = 0;
+        workers[started].nr_errors = 0;
+        workers[started].nr_entries = 0;
+        if (pthread_create(&workers[started].thread, NULL, run_worker,
+                           &workers[started]))
+            break;
+    }
+    if (started < nr_threads) {
+        /* Cannot happen once the first phase started all of them */
+        perror("pthread_create():");
+        exit(1);
+    }
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_ns();
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    t1 = now_ns();
+    pthread_barrier_destroy(&start_barrier);
+
+    for (i = 0; i < nr_threads; i++) {
+        memcpy(all + nr_ops, workers[i].lat,
+               workers[i].nr_ops * sizeof(uint64_t));
+        nr_ops += workers[i].nr_ops;
+        nr_errors += workers[i].nr_errors;
+        nr_listed += workers[i].nr_entries;
+    }
+    for (uint64_t k = 0; k < nr_ops; k++)
+        sum += all[k];
+    qsort(all, nr_ops, sizeof(uint64_t), compare_u64);
+
+    double seconds = (t1 - t0) / 1e9;
+    if (!report)
+        return nr_errors ? -1 : 0;
+    printf("{\"label\": \"%s\", \"phase\": \"%s\", \"entries\": %u, "
+           "\"threads\": %u, \"cold\": %s, \"ops\": %lu, \"errors\": %lu, "
+           "\"seconds\": %.6f, \"ops_per_s\": %.1f, \"avg_us\": %.2f, "
+           "\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f",
+           label, phase->name, nr_entries, nr_threads,
+           cold ? "true" : "false", nr_ops, nr_errors,
+           seconds, nr_ops / seconds, nr_ops ? sum / 1e3 / nr_ops : 0,
+           nr_ops ? all[nr_ops / 2] / 1e3 : 0,
+           nr_ops ? all[nr_ops * 99 / 100] / 1e3 : 0,
+           nr_ops ? all[nr_ops - 1] / 1e3 : 0);
+    if (phase->op == op_readdir)
+        printf(", \"entries_per_s\": %.1f", nr_listed / seconds);
+    printf("}\n");
+    fflush(stdout);
+    return nr_errors ? -1 : 0;
+}
+
+/* Whether @name is in the comma-separated @list */
+static int in_list(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+
+    for (const char *p = list; p; p = strchr(p, ',')) {
+        p += *p == ',';
+        if (!strncmp(p, name, len) && (p[len] == ',' || !p[len]))
+            return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "n:t:r:p:l:w")) != -1) {
+        char *end;
+
+        switch (opt) {
+        case 'n':
+            nr_entries = strtoul(optarg, &end, 10);
+            if (*end || !nr_entries)
+                goto usage;
+            break;
+        case 't':
+            nr_threads = strtoul(optarg, &end, 10);
+            if (*end || !nr_threads || nr_threads > 1024)
+                goto usage;
+            break;
+        case 'r':
+            nr_passes = strtoul(optarg, &end, 10);
+            if (*end || !nr_passes)
+                goto usage;
+            break;
+        case 'p':
+            only = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'w':
+            warm = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+    usage:
+        fprintf(stderr,
+                "Usage: %s [-n entries] [-t threads] [-r passes] "
+                "[-p phase,...] [-l label] [-w] dir\n"
+                "\t-n  files in the directory (default: 1000)\n"
+                "\t-t  threads sharing the directory (default: 1)\n"
+                "\t-r  readdir listings per thread (default: 10)\n"
+                "\t-p  phases to report, of create,lookup,lookup_miss,stat,"
+                "readdir,rename,unlink\n"
+                "\t-l  label copied to the output\n"
+                "\t-w  warm: do not drop the caches before reading\n"
+                "dir must be empty; it is left empty\n",
+                argv[0]);
+        return 1;
+    }
+    dir_path = argv[optind];
+    dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        perror(dir_path);
+        return 1;
+    }
+
+    uint32_t max_ops = nr_entries > nr_passes ? nr_entries : nr_passes;
+    uint64_t *all = malloc((size_t) max_ops * nr_threads * sizeof(uint64_t));
+    workers = calloc(nr_threads, sizeof(*workers));
+    if (!all || !workers) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < nr_threads; i++) {
+        workers[i].id = i;
+        workers[i].lat = malloc((size_t) max_ops * sizeof(uint64_t));
+        if (!workers[i].lat) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+    }
+
+    /* Every phase runs, as each one sets up the next: -p only filters */
+    for (size_t p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+        if (run_phase(&phases[p], all, !only || in_list(only, phases[p].name)))
+            ret = 1;
+    }
+    if (ret)
+        fprintf(stderr, "Some operations failed, see \"errors\"\n");
+
+    for (uint32_t i = 0; i < nr_threads; i++)
+        free(workers[i].lat);
+    free(workers);
+    free(all);
+    close(dir_fd);
+    return ret;
+}
@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+#
+# Metadata microbenchmark: for every directory size and thread count, formats
+# a fresh image, mounts it and runs metabench in an empty directory of it:
+# create, lookup (hit and miss), stat, readdir, rename and unlink rates, with
+# the dentry and inode caches dropped before the phases that read. metabench
+# prints one JSON object per phase; the run number and the mount type are
+# added, and the result is appended to the result file. The label defaults to
+# the current commit, to compare runs before and after a change.
+#
+# Usage: script/metabench.sh [-e "entries ..."] [-t "threads ..."] [-i runs]
+#                            [-s image-MiB] [-l label] [-f]
+#                            [-o results.jsonl]
+#   -f  mount with simplefs-fuse instead of the kernel module
+
+SIMPLEFS_MOD=simplefs.ko
+MKFS=${MKFS:-mkfs.simplefs}
+METABENCH=${METABENCH:-metabench}
+FUSE=${FUSE:-simplefs-fuse}
+IMAGE=${IMAGE:-metabench.img}
+MNT=metabench_mnt
+
+# 40920 is the largest directory with 4 KiB blocks
+ENTRIES="1 10 100 1000 10000 40920"
+THREADS="1 2 4 8"
+RUNS=3
+IMAGESIZE=256
+LABEL=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+FS=kernel
+RESULTS=metabench_results.jsonl
+
+while getopts "e:t:i:s:l:fo:" opt; do
+    case $opt in
+    e) ENTRIES=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    i) RUNS=$OPTARG ;;
+    s) IMAGESIZE=$OPTARG ;;
+    l) LABEL=$OPTARG ;;
+    f) FS=fuse ;;
+    o) RESULTS=$OPTARG ;;
+    *) sed -n '11,14p' "$0"; exit 1 ;;
+    esac
+done
+
+if [ "$EUID" -eq 0 ]
+  then echo "Don't run this script as root"
+  exit
+fi
+
+cleanup() {
+    sudo umount $MNT 2>/dev/null
+}
+
+# One run: fresh image, mount, metabench, unmount
+run_once() {
+    local entries=$1 threads=$2 run=$3 status
+
+    dd if=/dev/zero of=$IMAGE bs=1M count=$IMAGESIZE status=none &&
+        ./$MKFS $IMAGE >/dev/null || return 1
+    if [ $FS = fuse ]; then
+        sudo ./$FUSE $IMAGE $MNT -o allow_other || return 1
+    else
+        sudo mount -t simplefs -o loop $IMAGE $MNT || return 1
+    fi
+    sudo mkdir $MNT/bench || return 1
+
+    sudo ./$METABENCH -n $entries -t $threads -l "$LABEL" $MNT/bench |
+        sed "s/^{/{\"run\": $run, \"fs\": \"$FS\", /" | tee -a $RESULTS
+    status=${PIPESTATUS[0]}
+    cleanup
+    return $status
+}
+
+trap cleanup EXIT
+mkdir -p $MNT
+cleanup
+if [ $FS = kernel ]; then
+    sudo rmmod simplefs 2>/dev/null
+    (modinfo $SIMPLEFS_MOD >/dev/null || exit 1) &&
+        sudo insmod $SIMPLEFS_MOD || exit 1
+fi
+
+failures=0
+for entries in $ENTRIES; do
+    for threads in $THREADS; do
+        for ((run = 1; run <= RUNS; run++)); do
+            run_once $entries $threads $run || failures=$((failures + 1))
+        done
+    done
+done
+
+rm -f $IMAGE
+rmdir $MNT
+echo "Results appended to $RESULTS, $failures failed run(s)"
+[ $failures -eq 0 ]
@@ -5,11 +5,14 @@
 . script/test_large_file.sh
 . script/test_remount.sh
 . script/rand_rm_and_create.sh
+. script/test_mount_opts.sh
 
 SIMPLEFS_MOD=simplefs.ko
 IMAGE=$1
 IMAGESIZE=$2
 MKFS=$3
+FSCK=${4:-fsck.simplefs}
+DEDUP=${5:-dedup.simplefs}
 
 if [ "$EUID" -eq 0 ]
   then echo "Don't run this script as root"
@@ -110,7 +113,17 @@ test_op 'rm -rf ./*'
 sleep 1
 popd >/dev/null
 sudo umount test
+
+# test mount options
+test_fstrim
+test_compress
+test_dedup
+test_stripe
+test_log
+
 sudo rmmod simplefs
 
 af_nr_free_blk=$(($(dd if=$IMAGE bs=1 skip=28 count=4 2>/dev/null | hexdump -v -e '1/4 "0x%08x\n"')))
 test $nr_free_blk -eq $af_nr_free_blk || echo "Failed, some blocks are not be reclaimed"
+
+./$FSCK -n $IMAGE >/dev/null || echo "Failed, fsck.simplefs found errors"
@@ -0,0 +1,133 @@
+# Runs with mount options, each on a partition of its own: $OPT_IMAGE, or
+# loop devices when it needs several
+
+OPT_IMAGE=$IMAGE.opts
+
+# make a partition on $OPT_IMAGE and mount it with the options given
+mount_opt_image() {
+    dd if=/dev/zero of=$OPT_IMAGE bs=1M count=$IMAGESIZE status=none
+    ./$MKFS $OPT_IMAGE >/dev/null || { echo "mkfs failed"; exit 1; }
+    sudo mount -t simplefs -o loop${1:+,$1} $OPT_IMAGE test
+}
+
+# unmount $OPT_IMAGE and check it
+umount_opt_image() {
+    sudo umount test || { echo "umount failed"; exit 1; }
+    ./$FSCK -n $OPT_IMAGE >/dev/null || echo "Failed, fsck.simplefs found errors with -o $1"
+    rm -f $OPT_IMAGE
+}
+
+# fstrim gives the free blocks back to the image file
+test_fstrim() {
+    mount_opt_image discard || { echo "Failed to mount with -o discard"; return; }
+    test_op 'dd if=/dev/urandom of=test/trim_file bs=1M count=8 status=none'
+    sync
+    test_op 'rm test/trim_file'
+    sync
+    before=$(du -k $OPT_IMAGE | awk '{print $1}')
+    test_op 'fstrim -v test'
+    after=$(du -k $OPT_IMAGE | awk '{print $1}')
+    echo "image: $before KiB allocated before fstrim, $after KiB after"
+    test $after -lt $before || echo "Failed, fstrim discarded nothing"
+    umount_opt_image discard
+}
+
+# compressible and random data read back the same after a remount
+test_compress() {
+    mount_opt_image compress || { echo "Skipped -o compress, unsupported by the kernel"; return; }
+    ref=$(mktemp -d)
+    yes 0123456789abcdef | head -c 4M > $ref/text
+    dd if=/dev/urandom of=$ref/random bs=1M count=1 status=none
+    cat $ref/text $ref/random $ref/text > $ref/mixed
+    test_op "cp $ref/text $ref/random $ref/mixed test/"
+    sync
+    sudo umount test || { echo "umount failed"; exit 1; }
+    sudo mount -t simplefs -o loop,compress $OPT_IMAGE test || { echo "mount failed"; exit 1; }
+    for f in text random mixed; do
+        cmp -s $ref/$f test/$f || echo "Failed, $f differs after compression"
+    done
+    # compressed extents go back to raw blocks when overwritten
+    test_op "dd if=$ref/random of=test/text bs=4k seek=3 conv=notrunc status=none"
+    dd if=$ref/random of=$ref/text bs=4k seek=3 conv=notrunc status=none
+    sync
+    cmp -s $ref/text test/text || echo "Failed, text differs after an overwrite"
+    rm -rf $ref
+    umount_opt_image compress
+}
+
+# identical files share their blocks, which come back with the last one
+test_dedup() {
+    mount_opt_image "" || { echo "mount failed"; exit 1; }
+    ref=$(mktemp -d)
+    dd if=/dev/urandom of=$ref/data bs=1M count=4 status=none
+    test_op "cp $ref/data test/dup_a"
+    test_op "cp $ref/data test/dup_b"
+    sync
+    before=$(stat -f -c %f test)
+    sudo ./$DEDUP test >/dev/null || echo "Failed, $DEDUP returned an error"
+    sync
+    shared=$(stat -f -c %f test)
+    echo "free blocks: $before before dedup, $shared after"
+    test $shared -gt $before || echo "Failed, no block was deduplicated"
+    test_op 'rm test/dup_b'
+    sync
+    cmp -s $ref/data test/dup_a || echo "Failed, dup_a differs after unlinking dup_b"
+    test_op 'rm test/dup_a'
+    sync
+    after=$(stat -f -c %f test)
+    test $after -ge $(( $shared + 4 * 1024 * 1024 / $SIMPLEFS_BLOCK_SIZE )) || \
+        echo "Failed, shared blocks are not reclaimed"
+    rm -rf $ref
+    umount_opt_image dedup
+}
+
+# a file striped over two loop devices reads back after a remount
+test_stripe() {
+    dd if=/dev/zero of=$OPT_IMAGE bs=1M count=$IMAGESIZE status=none
+    dd if=/dev/zero of=$OPT_IMAGE.1 bs=1M count=$IMAGESIZE status=none
+    loop0=$(sudo losetup -f --show $OPT_IMAGE)
+    loop1=$(sudo losetup -f --show $OPT_IMAGE.1)
+    sudo ./$MKFS -D $loop1 $loop0 >/dev/null || echo "Failed, mkfs on $loop0 and $loop1"
+    if sudo mount -t simplefs -o device=$loop1 $loop0 test; then
+        ref=$(mktemp -d)
+        dd if=/dev/urandom of=$ref/data bs=1M count=16 status=none
+        test_op "cp $ref/data test/striped"
+        sync
+        sudo umount test || { echo "umount failed"; exit 1; }
+        sudo mount -t simplefs -o device=$loop1 $loop0 test || { echo "mount failed"; exit 1; }
+        cmp -s $ref/data test/striped || echo "Failed, striped file differs after a remount"
+        rm -rf $ref
+        sudo umount test || { echo "umount failed"; exit 1; }
+        sudo ./$FSCK -n $loop0 >/dev/null || echo "Failed, fsck.simplefs found errors on a stripe"
+    else
+        echo "Failed to mount $loop0 with device=$loop1"
+    fi
+    sudo losetup -d $loop0 $loop1
+    rm -f $OPT_IMAGE $OPT_IMAGE.1
+}
+
+# overwrites in log mode read back, and the log counters account for them
+test_log() {
+    mount_opt_image log || { echo "Failed to mount with -o log"; return; }
+    ref=$(mktemp -d)
+    dd if=/dev/urandom of=$ref/data bs=1M count=8 status=none
+    test_op "cp $ref/data test/log_file"
+    sync
+    dd if=/dev/urandom of=$ref/block bs=4k count=1 status=none
+    for ((i=0; i<64; i++))
+    do
+        blk=$(( RANDOM % 2048 ))
+        test_op "dd if=$ref/block of=test/log_file bs=4k seek=$blk conv=notrunc status=none"
+        dd if=$ref/block of=$ref/data bs=4k seek=$blk conv=notrunc status=none
+    done
+    sync
+    cmp -s $ref/data test/log_file || echo "Failed, log_file differs after overwrites"
+    stats=$(grep -A2 "mounted on $(realpath test) with fstype simplefs" /proc/self/mountstats)
+    echo "$stats"
+    appended=$(echo "$stats" | sed -n 's/.*appended_blocks=\([0-9]*\).*/\1/p')
+    test -n "$appended" || echo "Failed, no log counters in /proc/self/mountstats"
+    test "${appended:-0}" -ge 2048 || echo "Failed, $appended blocks appended to the log"
+    echo "$stats" | grep -q 'write_amplification=' || echo "Failed, no write amplification reported"
+    rm -rf $ref
+    umount_opt_image log
+}
@@ -6,24 +6,54 @@
 
 #define SIMPLEFS_SB_BLOCK_NR 0
 
-#define SIMPLEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define SIMPLEFS_MAX_EXTENTS \
-    ((SIMPLEFS_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct simplefs_extent))
+/* The block size is chosen by mkfs.simplefs and recorded in the superblock.
+ * Everything sized by it takes the block size as an argument.
+ */
+#define SIMPLEFS_BLOCK_SIZE (1 << 12) /* 4 KiB, default */
+#define SIMPLEFS_MIN_BLOCK_SIZE (1 << 10)
+#define SIMPLEFS_MAX_BLOCK_SIZE (1 << 16)
+
+#define SIMPLEFS_MAX_EXTENTS(bsize) \
+    (((bsize) - sizeof(uint32_t)) / sizeof(struct simplefs_extent))
 #define SIMPLEFS_MAX_BLOCKS_PER_EXTENT 8 /* It can be ~(uint32) 0 */
-#define SIMPLEFS_MAX_SIZES_PER_EXTENT \
-    (SIMPLEFS_MAX_BLOCKS_PER_EXTENT * SIMPLEFS_BLOCK_SIZE)
-#define SIMPLEFS_MAX_FILESIZE                                          \
-    ((uint64_t) SIMPLEFS_MAX_BLOCKS_PER_EXTENT * SIMPLEFS_BLOCK_SIZE * \
-     SIMPLEFS_MAX_EXTENTS)
+#define SIMPLEFS_MAX_FILESIZE(bsize)                       \
+    ((uint64_t) SIMPLEFS_MAX_BLOCKS_PER_EXTENT * (bsize) * \
+     SIMPLEFS_MAX_EXTENTS(bsize))
 
 #define SIMPLEFS_FILENAME_LEN 255
 
-#define SIMPLEFS_FILES_PER_BLOCK \
-    (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_file))
-#define SIMPLEFS_FILES_PER_EXT \
-    (SIMPLEFS_FILES_PER_BLOCK * SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+/* Directory blocks leave room for their checksum */
+#define SIMPLEFS_FILES_PER_BLOCK(bsize) \
+    (((bsize) - 2 * sizeof(uint32_t)) / sizeof(struct simplefs_file))
+#define SIMPLEFS_FILES_PER_EXT(bsize) \
+    (SIMPLEFS_FILES_PER_BLOCK(bsize) * SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
 
-#define SIMPLEFS_MAX_SUBFILES (SIMPLEFS_FILES_PER_EXT * SIMPLEFS_MAX_EXTENTS)
+#define SIMPLEFS_MAX_SUBFILES(bsize) \
+    (SIMPLEFS_FILES_PER_EXT(bsize) * SIMPLEFS_MAX_EXTENTS(bsize))
+
+/* Features, in sb->features */
+#define SIMPLEFS_FEATURE_METADATA_CSUM 0x0001
+#define SIMPLEFS_FEATURE_LAZY_ITABLE 0x0002 /* inode store zeroed on use */
+#define SIMPLEFS_FEATURE_COMPRESSION 0x0004 /* LZ4 extents, see compress.c */
+#define SIMPLEFS_FEATURE_REFLINK 0x0008     /* shared extents, see reflink.c */
+#define SIMPLEFS_FEATURE_STRIPE 0x0010      /* several devices, see stripe.c */
+#define SIMPLEFS_FEATURE_METADATA_DEV 0x0020 /* no file data on the first */
+#define SIMPLEFS_FEATURE_ALL                                          \
+    (SIMPLEFS_FEATURE_METADATA_CSUM | SIMPLEFS_FEATURE_LAZY_ITABLE | \
+     SIMPLEFS_FEATURE_COMPRESSION | SIMPLEFS_FEATURE_REFLINK |       \
+     SIMPLEFS_FEATURE_STRIPE | SIMPLEFS_FEATURE_METADATA_DEV)
+
+/* With SIMPLEFS_FEATURE_METADATA_CSUM, inode store, index and directory blocks
+ * end with a crc32c of the rest of the block, seeded with the block number.
+ * These structures never reach the last 4 bytes. Bitmap blocks are full, so
+ * their checksums are kept in a table of sb->nr_csum_blocks data blocks from
+ * sb->csum_start, ifree blocks first, sized by mkfs.simplefs. Table blocks end
+ * with a checksum of their own. The superblock checksum covers the whole
+ * block.
+ */
+#define SIMPLEFS_CSUM_OFFSET(bsize) ((bsize) - sizeof(uint32_t))
+#define SIMPLEFS_CSUMS_PER_BLOCK(bsize) \
+    (((bsize) - sizeof(uint32_t)) / sizeof(uint32_t))
 
 /* simplefs partition layout
  * +---------------+
@@ -38,7 +68,45 @@
  * |    data       |
  * |      blocks   |  rest of the blocks
  * +---------------+
+ *
+ * mkfs.simplefs also reserves an internal journal: a regular inode
+ * (sb->journal_ino) whose single extent is a contiguous run of data blocks.
+ * It is not linked into any directory.
+ *
+ * With SIMPLEFS_FEATURE_LAZY_ITABLE, only the first inode store block is
+ * written by mkfs: the others are zeroed by the kernel when the first inode
+ * they hold is allocated. Inodes are allocated lowest first, so every block
+ * past the one of the highest inode in use is free.
+ *
+ * With SIMPLEFS_FEATURE_REFLINK, a run of data blocks from
+ * sb->refcount_start holds a uint16_t per block of the partition: for the
+ * first block of an extent shared by several files, the number of files
+ * sharing it besides one. Refcount blocks leave room for their checksum.
+ *
+ * With SIMPLEFS_FEATURE_STRIPE, the partition spans sb->nr_devices block
+ * devices, this one first, of sb->dev_blocks[] blocks each: block numbers
+ * run through the devices in that order, and the bitmaps cover them all.
+ * Metadata stays on the first device, while the data extents of regular
+ * files go round-robin to the devices: extent i to device
+ * i % sb->nr_devices. Block 0 of every other device holds a struct
+ * simplefs_member_sb, and is marked in use.
+ *
+ * With SIMPLEFS_FEATURE_METADATA_DEV as well, the first device only holds
+ * metadata, e.g. on a faster device: extent i of a regular file goes to
+ * device 1 + i % (sb->nr_devices - 1).
  */
+#define SIMPLEFS_REFCOUNTS_PER_BLOCK(bsize) \
+    (((bsize) - sizeof(uint32_t)) / sizeof(uint16_t))
+
+#define SIMPLEFS_MAX_DEVICES 8
+#define SIMPLEFS_MEMBER_MAGIC 0xDEADD15C
+
+struct simplefs_member_sb {
+    uint32_t magic;     /* SIMPLEFS_MEMBER_MAGIC */
+    uint32_t set_id;    /* sb->set_id of the partition */
+    uint32_t index;     /* of the device, from 1 */
+    uint32_t nr_blocks; /* sb->dev_blocks[index] */
+};
 #ifdef __KERNEL__
 #include <linux/jbd2.h>
 #endif
@@ -57,36 +125,44 @@ struct simplefs_inode {
     char i_data[32];   /* store symlink content */
 };
 
-#define SIMPLEFS_INODES_PER_BLOCK \
-    (SIMPLEFS_BLOCK_SIZE / sizeof(struct simplefs_inode))
-
-#ifdef __KERNEL__
-#include <linux/version.h>
-/* compatibility macros */
-#define SIMPLEFS_AT_LEAST(major, minor, rev) \
-    LINUX_VERSION_CODE >= KERNEL_VERSION(major, minor, rev)
-#define SIMPLEFS_LESS_EQUAL(major, minor, rev) \
-    LINUX_VERSION_CODE <= KERNEL_VERSION(major, minor, rev)
-
-/* A 'container' structure that keeps the VFS inode and additional on-disk
- * data.
- */
-struct simplefs_inode_info {
-    uint32_t ei_block; /* Block with list of extents for this file */
-    char i_data[32];
-    struct inode vfs_inode;
-};
+/* Inode store blocks leave room for their checksum */
+#define SIMPLEFS_INODES_PER_BLOCK(bsize) \
+    (((bsize) - sizeof(uint32_t)) / sizeof(struct simplefs_inode))
 
 struct simplefs_extent {
     uint32_t ee_block; /* first logical block extent covers */
     uint32_t ee_len;   /* number of blocks covered by extent */
     uint32_t ee_start; /* first physical block extent covers */
-    uint32_t nr_files; /* Number of files in this extent */
+    union {
+        uint32_t nr_files; /* Number of files in this extent */
+        struct {           /* regular files */
+            uint16_t ee_clen;  /* blocks holding a compressed extent */
+            uint16_t ee_flags; /* SIMPLEFS_EXT_* */
+        };
+    };
+};
+
+/* With SIMPLEFS_FEATURE_COMPRESSION, a full extent of a regular file may be
+ * stored compressed: its ee_len blocks of data are compressed with LZ4 into
+ * ee_clen blocks from ee_start, starting with the size of the compressed
+ * data (struct simplefs_cluster).
+ */
+#define SIMPLEFS_EXT_LZ4 0x0001
+
+struct simplefs_cluster {
+    uint32_t c_size; /* bytes of LZ4 data */
+    char c_data[];
 };
 
+/* Blocks an extent of a regular file takes on disk */
+static inline uint32_t simplefs_ext_blocks(const struct simplefs_extent *ext)
+{
+    return ext->ee_flags & SIMPLEFS_EXT_LZ4 ? ext->ee_clen : ext->ee_len;
+}
+
 struct simplefs_file_ei_block {
     uint32_t nr_files; /* Number of files in directory */
-    struct simplefs_extent extents[SIMPLEFS_MAX_EXTENTS];
+    struct simplefs_extent extents[]; /* SIMPLEFS_MAX_EXTENTS(bsize) */
 };
 
 struct simplefs_file {
@@ -97,7 +173,110 @@ struct simplefs_file {
 
 struct simplefs_dir_block {
     uint32_t nr_files;
-    struct simplefs_file files[SIMPLEFS_FILES_PER_BLOCK];
+    struct simplefs_file files[]; /* SIMPLEFS_FILES_PER_BLOCK(bsize) */
+};
+
+/* Fast commit records, written by fsync to the fast commit area of the jbd2
+ * journal. Each record is a tag-length header followed by its value; values
+ * are padded to 4 bytes and never straddle blocks. A fast commit ends with a
+ * tail record carrying the transaction id and a crc32c of the commit.
+ */
+#define SIMPLEFS_FC_TAG_INODE 1  /* struct simplefs_fc_inode */
+#define SIMPLEFS_FC_TAG_EXTENT 2 /* struct simplefs_fc_extent */
+#define SIMPLEFS_FC_TAG_DIRENT 3 /* struct simplefs_fc_dirent + name */
+#define SIMPLEFS_FC_TAG_PAD 4    /* rest of the block is unused */
+#define SIMPLEFS_FC_TAG_TAIL 5   /* struct simplefs_fc_tail */
+#define SIMPLEFS_FC_TAG_LINK 6   /* struct simplefs_fc_dirent + name */
+#define SIMPLEFS_FC_TAG_UNLINK 7 /* struct simplefs_fc_dirent + name */
+#define SIMPLEFS_FC_TAG_FREE 8   /* struct simplefs_fc_free */
+
+struct simplefs_fc_tl {
+    uint16_t fc_tag;
+    uint16_t fc_len; /* length of the value */
+};
+
+/* Inode image, also marks the inode and its index block in use */
+struct simplefs_fc_inode {
+    uint32_t ino;
+    struct simplefs_inode raw;
+};
+
+/* Extent added to the index block of a file, its blocks marked in use */
+struct simplefs_fc_extent {
+    uint32_t ino;
+    uint32_t ei_block;
+    uint32_t index;
+    struct simplefs_extent extent;
+};
+
+/* Directory entry added to or removed from a directory, followed by the
+ * NUL-padded name. Entries added by SIMPLEFS_FC_TAG_DIRENT are new files,
+ * whose index block is cleared; SIMPLEFS_FC_TAG_LINK adds existing ones.
+ */
+struct simplefs_fc_dirent {
+    uint32_t dir;
+    uint32_t ino;
+};
+
+/* Inode whose last link went away, freed along with its blocks */
+struct simplefs_fc_free {
+    uint32_t ino;
+};
+
+struct simplefs_fc_tail {
+    uint32_t tid;
+    uint32_t crc; /* crc32c of the commit, up to this field */
+};
+
+/* Online defragmentation of a regular file, see simplefs_ioctl_defrag(): its
+ * data moves to one run of contiguous blocks. Fragments are runs of extents
+ * that follow each other on disk.
+ */
+#include <linux/ioctl.h>
+
+#define SIMPLEFS_DEFRAG_DRY_RUN 0x1 /* only count the fragments */
+
+struct simplefs_defrag {
+    uint32_t flags;        /* in: SIMPLEFS_DEFRAG_* */
+    uint32_t frags_before; /* out */
+    uint32_t frags_after;  /* out */
+    uint32_t nr_blocks;    /* out: blocks moved */
+};
+
+#define SIMPLEFS_IOC_DEFRAG _IOWR('S', 1, struct simplefs_defrag)
+
+/* Owners of the FS_IOC_GETFSMAP records of metadata, see simplefs_getfsmap().
+ * Blocks in use past the bitmaps are reported as FMR_OWN_UNKNOWN.
+ */
+#include <linux/fsmap.h>
+
+#define SIMPLEFS_FMR_OWN_SB FMR_OWNER('S', 1)     /* superblock */
+#define SIMPLEFS_FMR_OWN_INODES FMR_OWNER('S', 2) /* inode store */
+#define SIMPLEFS_FMR_OWN_IFREE FMR_OWNER('S', 3)  /* inode free bitmap */
+#define SIMPLEFS_FMR_OWN_BFREE FMR_OWNER('S', 4)  /* block free bitmap */
+
+/* extent functions, also built into libsimplefs */
+extern uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
+                                    uint32_t nr_extents,
+                                    uint32_t iblock);
+
+#ifdef __KERNEL__
+#include <linux/version.h>
+/* compatibility macros */
+#define SIMPLEFS_AT_LEAST(major, minor, rev) \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(major, minor, rev)
+#define SIMPLEFS_LESS_EQUAL(major, minor, rev) \
+    LINUX_VERSION_CODE <= KERNEL_VERSION(major, minor, rev)
+
+/* A 'container' structure that keeps the VFS inode and additional on-disk
+ * data.
+ */
+struct simplefs_inode_info {
+    uint32_t ei_block; /* Block with list of extents for this file */
+    char i_data[32];
+    tid_t i_sync_tid; /* Last transaction that logged this inode */
+    struct jbd2_inode i_jinode; /* data=ordered tracking */
+    struct inode vfs_inode;
 };
 
 /* superblock functions */
@@ -119,13 +298,263 @@ struct dentry *simplefs_mount(struct file_system_type *fs_type,
 extern const struct file_operations simplefs_file_ops;
 extern const struct file_operations simplefs_dir_ops;
 extern const struct address_space_operations simplefs_aops;
+long simplefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
-/* extent functions */
-extern uint32_t simplefs_ext_search(struct simplefs_file_ei_block *index,
-                                    uint32_t iblock);
+/* journal functions */
+handle_t *simplefs_journal_start(struct super_block *sb, int nblocks);
+handle_t *simplefs_journal_start_revoke(struct super_block *sb,
+                                        int nblocks,
+                                        int revokes);
+int simplefs_journal_stop(handle_t *handle);
+int simplefs_journal_get_write_access(handle_t *handle, struct buffer_head *bh);
+int simplefs_journal_get_create_access(handle_t *handle,
+                                       struct buffer_head *bh);
+int simplefs_journal_dirty_metadata(handle_t *handle,
+                                    struct super_block *sb,
+                                    struct buffer_head *bh);
+int simplefs_journal_revoke(handle_t *handle,
+                            struct super_block *sb,
+                            uint32_t bno,
+                            uint32_t len);
+int simplefs_journal_bitmap(struct super_block *sb,
+                            unsigned long *bitmap,
+                            uint32_t first,
+                            uint32_t bit,
+                            uint32_t len);
+void simplefs_journal_free(struct super_block *sb,
+                           unsigned long *pending,
+                           uint32_t bit,
+                           uint32_t len);
+void simplefs_journal_commit_callback(journal_t *journal, transaction_t *txn);
+int simplefs_journal_inode_ranges(handle_t *handle,
+                                  struct inode *inode,
+                                  loff_t start,
+                                  loff_t len,
+                                  uint32_t bno);
+int simplefs_journal_begin_truncate(struct inode *inode, loff_t new_size);
+int simplefs_init_itable_block(struct super_block *sb, uint32_t ino);
+
+/* discard functions */
+int simplefs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+void simplefs_discard_queue(struct super_block *sb, uint32_t bno, uint32_t len);
+int simplefs_discard_init(struct super_block *sb);
+void simplefs_discard_release(struct super_block *sb);
+
+/* compression functions. LZ4 is used when the kernel provides it, on kernels
+ * with the folio API compress.c is written against.
+ */
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS) && \
+    SIMPLEFS_AT_LEAST(6, 3, 0)
+#define SIMPLEFS_HAS_COMPRESSION 1
+/* The extent last decompressed by simplefs_compress_read_folio() */
+struct simplefs_cluster_buf {
+    char *data;
+    uint32_t ee_start;
+};
+int simplefs_compress_read_folio(struct folio *folio,
+                                 struct simplefs_cluster_buf *cb);
+void simplefs_cluster_buf_release(struct simplefs_cluster_buf *cb);
+int simplefs_compress_writepages(struct address_space *mapping,
+                                 struct writeback_control *wbc);
+#else
+#define SIMPLEFS_HAS_COMPRESSION 0
+#endif
+
+/* shared extent functions */
+int simplefs_refcount_load(struct super_block *sb);
+void simplefs_refcount_release(struct super_block *sb);
+bool simplefs_refcount_put(struct super_block *sb, uint32_t bno);
+bool simplefs_refcount_shared(struct super_block *sb, uint32_t bno);
+int simplefs_unshare_range(struct inode *inode, loff_t pos, loff_t len);
+#if SIMPLEFS_AT_LEAST(4, 20, 0)
+loff_t simplefs_remap_file_range(struct file *file_in,
+                                 loff_t pos_in,
+                                 struct file *file_out,
+                                 loff_t pos_out,
+                                 loff_t len,
+                                 unsigned int remap_flags);
+#endif
+
+/* striping functions */
+int simplefs_stripe_init(struct super_block *sb, dev_t *devices);
+void simplefs_stripe_release(struct super_block *sb);
+struct block_device *simplefs_map_block(struct super_block *sb,
+                                        uint32_t *bno);
+struct block_device *simplefs_stripe_member(struct super_block *sb,
+                                            uint32_t i,
+                                            uint32_t *start);
+void simplefs_map_bh(struct buffer_head *bh,
+                     struct super_block *sb,
+                     uint32_t bno);
+int simplefs_issue_zeroout(struct super_block *sb, uint32_t bno, uint32_t len);
+int simplefs_issue_discard(struct super_block *sb, uint32_t bno, uint32_t len);
+int simplefs_stripe_flush(struct super_block *sb);
+void simplefs_stripe_order(handle_t *handle,
+                           struct super_block *sb,
+                           uint32_t bno);
+int simplefs_stripe_flush_ordered(struct super_block *sb, tid_t tid);
+
+/* log-structured allocation functions */
+int simplefs_log_init(struct super_block *sb);
+void simplefs_log_stop(struct super_block *sb);
+void simplefs_log_release(struct super_block *sb);
+uint32_t simplefs_log_alloc(struct super_block *sb, uint32_t len);
+uint32_t simplefs_log_alloc_meta(struct super_block *sb, uint32_t len);
+bool simplefs_log_cow(struct super_block *sb, uint32_t bno);
+bool simplefs_log_victim(struct super_block *sb, uint32_t bno);
+void simplefs_log_written(struct super_block *sb, size_t bytes);
+int simplefs_log_move_extents(struct inode *inode);
+int simplefs_log_show_stats(struct seq_file *m, struct dentry *root);
+
+/* space map functions */
+int simplefs_getfsmap(struct super_block *sb, struct fsmap_head __user *arg);
+
+/* metadata checksum functions */
+struct buffer_head *simplefs_bread(struct super_block *sb, sector_t block);
+void simplefs_csum_set(struct super_block *sb, struct buffer_head *bh);
+sector_t simplefs_csum_table(struct super_block *sb, sector_t block);
+void simplefs_csum_bitmap(struct super_block *sb,
+                          struct buffer_head *table_bh,
+                          struct buffer_head *bh);
+int simplefs_csum_verify_sb(struct super_block *sb, struct buffer_head *bh);
+int simplefs_csum_verify_bitmap(struct super_block *sb, struct buffer_head *bh);
+
+/* fast commit functions */
+int simplefs_fc_init(struct super_block *sb, journal_t *journal);
+void simplefs_fc_enable(struct super_block *sb);
+void simplefs_fc_release(struct super_block *sb);
+int simplefs_fc_commit(struct inode *inode, tid_t tid);
+void simplefs_fc_mark_ineligible(struct super_block *sb, handle_t *handle);
+void simplefs_fc_log_inode(handle_t *handle,
+                           struct inode *inode,
+                           struct simplefs_inode *raw);
+void simplefs_fc_log_extent(handle_t *handle,
+                            struct inode *inode,
+                            uint32_t index,
+                            struct simplefs_extent *extent);
+void simplefs_fc_log_dirent(handle_t *handle,
+                            struct inode *dir,
+                            uint32_t ino,
+                            const char *name);
+void simplefs_fc_log_link(handle_t *handle,
+                          struct inode *dir,
+                          uint32_t ino,
+                          const char *name);
+void simplefs_fc_log_unlink(handle_t *handle,
+                            struct inode *dir,
+                            uint32_t ino,
+                            const char *name);
+void simplefs_fc_log_free(handle_t *handle, struct inode *inode);
+int simplefs_replay_dirent(struct super_block *sb,
+                           uint32_t dir,
+                           uint32_t ino,
+                           const char *name,
+                           bool create);
+int simplefs_replay_unlink(struct super_block *sb,
+                           uint32_t dir,
+                           uint32_t ino,
+                           const char *name);
+
+/* Journal credits, i.e. the number of distinct metadata blocks a handle may
+ * dirty. A run of up to SIMPLEFS_MAX_BLOCKS_PER_EXTENT bits can straddle two
+ * bitmap blocks, whose checksums may live in two checksum table blocks.
+ */
+#define SIMPLEFS_BITMAP_CREDITS 4
+/* inode store block */
+#define SIMPLEFS_INODE_CREDITS 1
+/* bfree bitmap, index block and inode */
+#define SIMPLEFS_ALLOC_CREDITS \
+    (SIMPLEFS_BITMAP_CREDITS + 1 + SIMPLEFS_INODE_CREDITS)
+/* parent index block, a directory block, or a whole new directory extent */
+#define SIMPLEFS_DIRENT_CREDITS \
+    (1 + SIMPLEFS_BITMAP_CREDITS + SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+/* ifree bitmap, new inode, its index block, new directory entry, parent */
+#define SIMPLEFS_CREATE_CREDITS                                      \
+    (1 + SIMPLEFS_INODE_CREDITS + SIMPLEFS_BITMAP_CREDITS + 1 +      \
+     SIMPLEFS_DIRENT_CREDITS + SIMPLEFS_INODE_CREDITS)
+/* freeing every extent of a file may touch every bfree bitmap block */
+#define SIMPLEFS_TRUNCATE_CREDITS(sb)                          \
+    (1 + SIMPLEFS_INODE_CREDITS +                              \
+     min_t(uint32_t, SIMPLEFS_SB(sb)->nr_bfree_blocks + 1,     \
+           SIMPLEFS_BITMAP_CREDITS * simplefs_max_extents(sb)))
+/* directory entry removal, parent, ifree bitmap and truncate */
+#define SIMPLEFS_UNLINK_CREDITS(sb) \
+    (2 + SIMPLEFS_INODE_CREDITS + 1 + SIMPLEFS_TRUNCATE_CREDITS(sb))
+/* the compressed run and index block, then freeing the raw run */
+#define SIMPLEFS_COMPRESS_CREDITS \
+    (SIMPLEFS_ALLOC_CREDITS + SIMPLEFS_BITMAP_CREDITS)
+/* a private run and index block, then freeing or releasing the old run */
+#define SIMPLEFS_UNSHARE_CREDITS \
+    (SIMPLEFS_ALLOC_CREDITS + SIMPLEFS_BITMAP_CREDITS)
+/* index block, refcount block of the source, then freeing the old run */
+#define SIMPLEFS_DEDUP_CREDITS (2 + SIMPLEFS_BITMAP_CREDITS)
+/* the new run and index block, then freeing the old ones */
+#define SIMPLEFS_DEFRAG_CREDITS(sb) \
+    (SIMPLEFS_BITMAP_CREDITS + SIMPLEFS_ALLOC_CREDITS + \
+     SIMPLEFS_TRUNCATE_CREDITS(sb))
+/* index block and every directory block of a removed directory */
+#define SIMPLEFS_UNLINK_REVOKES(sb) \
+    (1 + simplefs_max_extents(sb) * SIMPLEFS_MAX_BLOCKS_PER_EXTENT)
+
+/* Mount options */
+#define SIMPLEFS_MOUNT_FAST_COMMIT 0x0001
+#define SIMPLEFS_MOUNT_BARRIER 0x0002 /* flush caches at commit, default */
+#define SIMPLEFS_MOUNT_JOURNAL_ASYNC_COMMIT 0x0004
+#define SIMPLEFS_MOUNT_DISCARD 0x0008 /* discard freed blocks, see discard.c */
+#define SIMPLEFS_MOUNT_COMPRESS 0x0010 /* compress full extents at writeback */
+#define SIMPLEFS_MOUNT_LOG 0x0020 /* append file data, see log.c */
+#define SIMPLEFS_MOUNT_DATA_WRITEBACK 0x0040 /* file data is not ordered */
+
+/* Default journal tuning, same as ext4 */
+#define SIMPLEFS_DEF_MAX_BATCH_TIME 15000 /* us */
+#define SIMPLEFS_DEF_MIN_BATCH_TIME 0     /* us */
 
 /* Getters for superblock and inode */
 #define SIMPLEFS_SB(sb) (sb->s_fs_info)
+#define simplefs_has_metadata_csum(sb) \
+    (SIMPLEFS_SB(sb)->features & SIMPLEFS_FEATURE_METADATA_CSUM)
+#define simplefs_has_lazy_itable(sb) \
+    (SIMPLEFS_SB(sb)->features & SIMPLEFS_FEATURE_LAZY_ITABLE)
+#define simplefs_has_compression(sb) \
+    (SIMPLEFS_SB(sb)->features & SIMPLEFS_FEATURE_COMPRESSION)
+#define simplefs_has_reflink(sb) \
+    (SIMPLEFS_SB(sb)->features & SIMPLEFS_FEATURE_REFLINK)
+#define simplefs_has_stripe(sb) \
+    (SIMPLEFS_SB(sb)->features & SIMPLEFS_FEATURE_STRIPE)
+#define simplefs_has_metadata_dev(sb) \
+    (SIMPLEFS_SB(sb)->features & SIMPLEFS_FEATURE_METADATA_DEV)
+
+/* Geometry of a mounted partition, see SIMPLEFS_MAX_EXTENTS() and others */
+static inline uint32_t simplefs_max_extents(struct super_block *sb)
+{
+    return SIMPLEFS_MAX_EXTENTS(sb->s_blocksize);
+}
+
+static inline uint32_t simplefs_files_per_block(struct super_block *sb)
+{
+    return SIMPLEFS_FILES_PER_BLOCK(sb->s_blocksize);
+}
+
+static inline uint32_t simplefs_files_per_ext(struct super_block *sb)
+{
+    return SIMPLEFS_FILES_PER_EXT(sb->s_blocksize);
+}
+
+static inline uint32_t simplefs_max_subfiles(struct super_block *sb)
+{
+    return SIMPLEFS_MAX_SUBFILES(sb->s_blocksize);
+}
+
+static inline uint32_t simplefs_inodes_per_block(struct super_block *sb)
+{
+    return SIMPLEFS_INODES_PER_BLOCK(sb->s_blocksize);
+}
+
+static inline size_t simplefs_csum_offset(struct super_block *sb)
+{
+    return SIMPLEFS_CSUM_OFFSET(sb->s_blocksize);
+}
+
 /* Extract a simplefs_inode_info object from a VFS inode */
 #define SIMPLEFS_INODE(inode) \
     (container_of(inode, struct simplefs_inode_info, vfs_inode))
@@ -145,6 +574,22 @@ struct simplefs_sb_info {
     uint32_t nr_free_inodes; /* Number of free inodes */
     uint32_t nr_free_blocks; /* Number of free blocks */
 
+    uint32_t journal_ino; /* Internal journal inode, 0 if none */
+
+    uint32_t features;   /* SIMPLEFS_FEATURE_* flags */
+    uint32_t checksum;   /* crc32c of the superblock, if enabled */
+    uint32_t block_size; /* in bytes, 0 for SIMPLEFS_BLOCK_SIZE */
+
+    uint32_t refcount_start;     /* First refcount block, 0 if none */
+    uint32_t nr_refcount_blocks; /* Number of refcount blocks */
+
+    uint32_t nr_devices; /* Devices of a striped partition, this one first */
+    uint32_t set_id;     /* Written to the other devices, to match them */
+    uint32_t dev_blocks[SIMPLEFS_MAX_DEVICES]; /* Blocks of each device */
+
+    uint32_t csum_start;     /* First bitmap checksum block, 0 if none */
+    uint32_t nr_csum_blocks; /* Number of bitmap checksum blocks */
+
     unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
     unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
 #ifdef __KERNEL__
@@ -156,6 +601,22 @@ struct simplefs_sb_info {
     struct bdev_handle
         *s_journal_bdev_handle; /* v6.7+ external journal device */
 #endif /* SIMPLEFS_AT_LEAST */
+    spinlock_t csum_lock;            /* serializes checksum updates */
+    unsigned long *ifree_pending; /* inodes freed by uncommitted transactions */
+    unsigned long *bfree_pending; /* blocks freed by uncommitted transactions */
+    spinlock_t pending_lock;      /* protects the pending maps */
+    unsigned long s_mount_opt;       /* SIMPLEFS_MOUNT_* flags */
+    unsigned long s_commit_interval; /* jiffies between commits */
+    unsigned int s_max_batch_time;   /* us a commit waits for handles */
+    unsigned int s_min_batch_time;   /* us a commit waits at least */
+    struct simplefs_fc *fc;          /* fast commit state, journaled mounts */
+    uint32_t itable_init;            /* first inode store block never used */
+    struct mutex itable_lock;        /* serializes lazy inode store zeroing */
+    struct simplefs_discard *discard; /* freed extents, discard mount option */
+    unsigned long *discard_bitmap;    /* blocks being discarded, discard.c */
+    struct simplefs_refcount *refcount; /* shared extents, see reflink.c */
+    struct simplefs_stripe *stripe;     /* other devices, see stripe.c */
+    struct simplefs_log *log;           /* log mount option, see log.c */
 #endif /* __KERNEL__ */
 };
 
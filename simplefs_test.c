@@ -0,0 +1,316 @@
+#include <kunit/test.h>
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* KUnit tests of the extent search and the bitmap allocator, checked against
+ * straightforward reference versions on random extent tables and bitmaps,
+ * and microbenchmarks of both with bench=1:
+ *
+ *   insmod simplefs_test.ko bench=1
+ *
+ * reports the ns per simplefs_ext_search() for index blocks of various
+ * sizes, and per get_first_free_bits() at various bitmap fill levels. The
+ * results are in the kernel log and under /sys/kernel/debug/kunit/.
+ *
+ * simplefs_ext_search() is built in rather than linked, as the module does
+ * not export it.
+ */
+#include "extent.c"
+
+#if !SIMPLEFS_AT_LEAST(5, 14, 0)
+#define kunit_skip(test, fmt, ...)                                \
+    do {                                                          \
+        kunit_info(test, "skipped: " fmt "\n", ##__VA_ARGS__); \
+        return;                                                   \
+    } while (0)
+#endif
+
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Run the microbenchmarks (default: false)");
+
+#define NR_ROUNDS 200
+#define MAX_EXTENTS SIMPLEFS_MAX_EXTENTS(SIMPLEFS_BLOCK_SIZE)
+
+/* xorshift32: failures replay with the same seed */
+static u32 rnd(u32 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* An index block of @nr_extents, the first @used of them in use, covering
+ * consecutive logical blocks as simplefs_file_get_block() lays them out.
+ * Returns the number of logical blocks covered.
+ */
+static u32 fill_index(struct simplefs_file_ei_block *index,
+                      u32 nr_extents,
+                      u32 used,
+                      u32 *state)
+{
+    u32 i, iblock = 0;
+
+    memset(index->extents, 0, nr_extents * sizeof(index->extents[0]));
+    for (i = 0; i < used; i++) {
+        index->extents[i].ee_block = iblock;
+        /* mkfs builds longer extents than SIMPLEFS_MAX_BLOCKS_PER_EXTENT */
+        index->extents[i].ee_len = 1 + rnd(state) % 16;
+        index->extents[i].ee_start = 1 + rnd(state) % 1000000;
+        iblock += index->extents[i].ee_len;
+    }
+    return iblock;
+}
+
+/* simplefs_ext_search(), one extent after the other */
+static u32 ref_ext_search(struct simplefs_file_ei_block *index,
+                          u32 nr_extents,
+                          u32 iblock)
+{
+    u32 i;
+
+    for (i = 0; i < nr_extents && index->extents[i].ee_start; i++) {
+        struct simplefs_extent *ext = &index->extents[i];
+
+        if (iblock >= ext->ee_block && iblock < ext->ee_block + ext->ee_len)
+            return i;
+    }
+    return i;
+}
+
+static void ext_search_test(struct kunit *test)
+{
+    struct simplefs_file_ei_block *index;
+    u32 state = 0x5eed, round;
+
+    index = kunit_kzalloc(test,
+                          struct_size(index, extents, MAX_EXTENTS),
+                          GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, index);
+
+    for (round = 0; round < NR_ROUNDS; round++) {
+        /* Index blocks of up to 4 KiB blocks, empty to full */
+        u32 nr_extents = 1 + rnd(&state) % MAX_EXTENTS;
+        u32 used = round % 8 ? rnd(&state) % (nr_extents + 1) : nr_extents;
+        u32 nr_blocks = fill_index(index, nr_extents, used, &state);
+        u32 iblock;
+
+        /* Every block, then some past the last one */
+        for (iblock = 0; iblock < nr_blocks + 16; iblock++) {
+            u32 want = ref_ext_search(index, nr_extents, iblock);
+
+            KUNIT_EXPECT_EQ_MSG(test,
+                                simplefs_ext_search(index, nr_extents, iblock),
+                                want,
+                                "round %u: %u/%u extents, block %u", round,
+                                used, nr_extents, iblock);
+        }
+    }
+}
+
+/* The last extent in use, which the search narrows down to rather than
+ * finds on the way
+ */
+static void ext_search_last_test(struct kunit *test)
+{
+    struct simplefs_file_ei_block *index;
+    u32 i, iblock;
+
+    index = kunit_kzalloc(test, struct_size(index, extents, 4), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, index);
+    for (i = 0; i < 3; i++) {
+        index->extents[i].ee_block = i * SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+        index->extents[i].ee_len = SIMPLEFS_MAX_BLOCKS_PER_EXTENT;
+        index->extents[i].ee_start = 100 + i * 50;
+    }
+    for (iblock = 16; iblock < 24; iblock++)
+        KUNIT_EXPECT_EQ(test, simplefs_ext_search(index, 4, iblock), 2);
+    KUNIT_EXPECT_EQ(test, simplefs_ext_search(index, 4, 24), 3);
+    /* Full: one past the last extent */
+    KUNIT_EXPECT_EQ(test, simplefs_ext_search(index, 3, 24), 3);
+}
+
+/* get_first_free_bits(), one run at a time */
+static u32 ref_first_free_bits(unsigned long *freemap, u32 size, u32 len)
+{
+    u32 start, i;
+
+    for (start = 1; start + len <= size; start++) {
+        for (i = 0; i < len && test_bit(start + i, freemap); i++)
+            ;
+        if (i == len) {
+            bitmap_clear(freemap, start, len);
+            return start;
+        }
+    }
+    return 0;
+}
+
+/* A random bitmap of @size bits, @fill percent of them used. Bit 0 is
+ * always used, as in the superblock.
+ */
+static void fill_bitmap(unsigned long *map, u32 size, u32 fill, u32 *state)
+{
+    u32 bit;
+
+    bitmap_zero(map, size);
+    for (bit = 1; bit < size; bit++) {
+        if (rnd(state) % 100 >= fill)
+            __set_bit(bit, map);
+    }
+}
+
+/* As fill_bitmap(), with the bits in runs as an aged partition has them:
+ * free runs of 1 to 16 bits between used runs as long as it takes
+ */
+static void fill_bitmap_runs(unsigned long *map,
+                             u32 size,
+                             u32 fill,
+                             u32 *state)
+{
+    u32 bit = 1, used = 17 * fill / (100 - min(fill, 99U));
+
+    bitmap_zero(map, size);
+    while (bit < size) {
+        u32 free_len = 1 + rnd(state) % 16;
+
+        bit += used ? rnd(state) % (used + 1) : 0;
+        if (bit >= size)
+            break;
+        bitmap_set(map, bit, min(free_len, size - bit));
+        bit += free_len;
+    }
+}
+
+static void first_free_bits_test(struct kunit *test)
+{
+    const u32 max_size = 4 * SIMPLEFS_BLOCK_SIZE * BITS_PER_BYTE;
+    unsigned long *map, *ref;
+    u32 state = 0xb17, round;
+
+    map = kunit_kcalloc(test, BITS_TO_LONGS(max_size), sizeof(long),
+                        GFP_KERNEL);
+    ref = kunit_kcalloc(test, BITS_TO_LONGS(max_size), sizeof(long),
+                        GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, map);
+    KUNIT_ASSERT_NOT_NULL(test, ref);
+
+    for (round = 0; round < NR_ROUNDS; round++) {
+        /* Sizes that are not a multiple of the word size too */
+        u32 size = 2 + rnd(&state) % (max_size - 1);
+        u32 fill = rnd(&state) % 101;
+        u32 alloc;
+
+        if (round % 2)
+            fill_bitmap_runs(map, size, fill, &state);
+        else
+            fill_bitmap(map, size, fill, &state);
+        bitmap_copy(ref, map, size);
+        /* Allocate until the bitmap runs out of runs of @len */
+        for (alloc = 0; alloc < 64; alloc++) {
+            u32 len = 1 + rnd(&state) % (2 * SIMPLEFS_MAX_BLOCKS_PER_EXTENT);
+            u32 want = ref_first_free_bits(ref, size, len);
+
+            KUNIT_EXPECT_EQ_MSG(test, get_first_free_bits(map, size, len),
+                                want, "round %u: %u bits, %u%% used, len %u",
+                                round, size, fill, len);
+            KUNIT_EXPECT_TRUE_MSG(test, bitmap_equal(map, ref, size),
+                                  "round %u: bitmaps differ", round);
+            if (!want)
+                break;
+        }
+    }
+}
+
+static void ext_search_bench(struct kunit *test)
+{
+    static const u32 sizes[] = {1, 8, 32, 128, MAX_EXTENTS};
+    struct simplefs_file_ei_block *index;
+    u32 state = 0xbe7c, i, k, sink = 0;
+    const u32 iters = 1000000;
+
+    if (!bench)
+        kunit_skip(test, "bench=0");
+    index = kunit_kzalloc(test,
+                          struct_size(index, extents, MAX_EXTENTS),
+                          GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, index);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        u32 nr_blocks = fill_index(index, MAX_EXTENTS, sizes[i], &state);
+        u64 t0 = ktime_get_ns(), ns;
+
+        for (k = 0; k < iters; k++)
+            sink += simplefs_ext_search(index, MAX_EXTENTS,
+                                        rnd(&state) % nr_blocks);
+        ns = ktime_get_ns() - t0;
+        kunit_info(test, "simplefs_ext_search: %u extents used: %llu ns\n",
+                   sizes[i], div_u64(ns, iters));
+    }
+    /* Keep the searches from being optimized out */
+    KUNIT_EXPECT_NE(test, sink, U32_MAX);
+}
+
+static void first_free_bits_bench(struct kunit *test)
+{
+    static const u32 fills[] = {0, 25, 50, 75, 90, 95, 99};
+    static const u32 lens[] = {1, SIMPLEFS_MAX_BLOCKS_PER_EXTENT};
+    /* The bfree bitmap of a 1 GiB partition of 4 KiB blocks */
+    const u32 size = 1 << 18;
+    const u32 iters = 2000;
+    unsigned long *map;
+    u32 state = 0xf1f0, f, l, k;
+
+    if (!bench)
+        kunit_skip(test, "bench=0");
+    map = kunit_kcalloc(test, BITS_TO_LONGS(size), sizeof(long), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, map);
+
+    for (f = 0; f < ARRAY_SIZE(fills); f++) {
+        fill_bitmap_runs(map, size, fills[f], &state);
+        for (l = 0; l < ARRAY_SIZE(lens); l++) {
+            u32 failed = 0;
+            u64 t0 = ktime_get_ns(), ns;
+
+            /* The same first fit every time: the bits are put back */
+            for (k = 0; k < iters; k++) {
+                u32 bit = get_first_free_bits(map, size, lens[l]);
+
+                if (bit)
+                    bitmap_set(map, bit, lens[l]);
+                else
+                    failed++;
+            }
+            ns = ktime_get_ns() - t0;
+            kunit_info(test,
+                       "get_first_free_bits: %u%% used, len %u: %llu ns%s\n",
+                       fills[f], lens[l], div_u64(ns, iters),
+                       failed ? " (no free run)" : "");
+        }
+    }
+}
+
+static struct kunit_case simplefs_test_cases[] = {
+    KUNIT_CASE(ext_search_test),
+    KUNIT_CASE(ext_search_last_test),
+    KUNIT_CASE(first_free_bits_test),
+    KUNIT_CASE(ext_search_bench),
+    KUNIT_CASE(first_free_bits_bench),
+    {},
+};
+
+static struct kunit_suite simplefs_test_suite = {
+    .name = "simplefs",
+    .test_cases = simplefs_test_cases,
+};
+
+kunit_test_suite(simplefs_test_suite);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("KUnit tests and microbenchmarks of simplefs helpers");
@@ -0,0 +1,404 @@
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+
+#include "bitmap.h"
+#include "simplefs.h"
+
+/* Striping of a partition over several block devices, see the layout in
+ * simplefs.h. The first device is the one mounted; the others are given with
+ * the device= mount option, in any order, and recognized by the header in
+ * their block 0. Block numbers of the partition are mapped to a device and a
+ * block of that device when buffers of file data are mapped, zeroed or
+ * discarded; metadata is only ever read from the first device.
+ *
+ * jbd2 only flushes the cache of the first device at commit. With barriers,
+ * the other devices that ordered data of the commit was allocated on are
+ * flushed once, when all of it is written, see
+ * simplefs_finish_inode_data_buffers(); fsync and sync flush them all.
+ */
+
+struct simplefs_member {
+    struct block_device *bdev;
+#if SIMPLEFS_AT_LEAST(6, 9, 0)
+    struct file *bdev_file;
+#elif SIMPLEFS_AT_LEAST(6, 7, 0)
+    struct bdev_handle *bdev_handle;
+#endif
+    uint32_t start; /* first block of the device in the partition */
+};
+
+struct simplefs_stripe {
+    uint32_t nr_devices;
+    struct simplefs_member devs[SIMPLEFS_MAX_DEVICES]; /* [0] is sb->s_bdev */
+    /* Devices holding data ordered by a transaction, by the parity of its
+     * tid: only the running and the committing transactions order data
+     */
+    unsigned long ordered[2];
+};
+
+static int simplefs_member_open(struct super_block *sb,
+                                dev_t dev,
+                                struct simplefs_member *m)
+{
+#if SIMPLEFS_AT_LEAST(6, 9, 0)
+    m->bdev_file = bdev_file_open_by_dev(
+        dev, BLK_OPEN_READ | BLK_OPEN_WRITE | BLK_OPEN_RESTRICT_WRITES, sb,
+        &fs_holder_ops);
+    if (IS_ERR(m->bdev_file))
+        return PTR_ERR(m->bdev_file);
+    m->bdev = file_bdev(m->bdev_file);
+#elif SIMPLEFS_AT_LEAST(6, 8, 0)
+    m->bdev_handle = bdev_open_by_dev(
+        dev, BLK_OPEN_READ | BLK_OPEN_WRITE | BLK_OPEN_RESTRICT_WRITES, sb,
+        &fs_holder_ops);
+    if (IS_ERR(m->bdev_handle))
+        return PTR_ERR(m->bdev_handle);
+    m->bdev = m->bdev_handle->bdev;
+#elif SIMPLEFS_AT_LEAST(6, 7, 0)
+    up_write(&sb->s_umount);
+    m->bdev_handle = bdev_open_by_dev(dev, BLK_OPEN_READ | BLK_OPEN_WRITE, sb,
+                                      &fs_holder_ops);
+    down_write(&sb->s_umount);
+    if (IS_ERR(m->bdev_handle))
+        return PTR_ERR(m->bdev_handle);
+    m->bdev = m->bdev_handle->bdev;
+#elif SIMPLEFS_AT_LEAST(6, 6, 0)
+    up_write(&sb->s_umount);
+    m->bdev = blkdev_get_by_dev(dev, BLK_OPEN_READ | BLK_OPEN_WRITE, sb,
+                                &fs_holder_ops);
+    down_write(&sb->s_umount);
+#elif SIMPLEFS_AT_LEAST(6, 5, 0)
+    m->bdev = blkdev_get_by_dev(dev, BLK_OPEN_READ | BLK_OPEN_WRITE, sb, NULL);
+#else
+    m->bdev =
+        blkdev_get_by_dev(dev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, sb);
+#endif
+#if !SIMPLEFS_AT_LEAST(6, 7, 0)
+    if (IS_ERR(m->bdev))
+        return PTR_ERR(m->bdev);
+#endif
+    return 0;
+}
+
+static void simplefs_member_close(struct super_block *sb,
+                                  struct simplefs_member *m)
+{
+    sync_blockdev(m->bdev);
+    invalidate_bdev(m->bdev);
+#if SIMPLEFS_AT_LEAST(6, 9, 0)
+    fput(m->bdev_file);
+#elif SIMPLEFS_AT_LEAST(6, 7, 0)
+    bdev_release(m->bdev_handle);
+#elif SIMPLEFS_AT_LEAST(6, 5, 0)
+    blkdev_put(m->bdev, sb);
+#else
+    blkdev_put(m->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+#endif
+    m->bdev = NULL;
+}
+
+/* Check the header of an opened device. Returns its index, or an error. */
+static int simplefs_member_check(struct super_block *sb,
+                                 struct simplefs_member *m)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_member_sb *msb;
+    struct buffer_head *bh;
+    uint64_t dev_blocks;
+    int ret;
+
+    if (bdev_logical_block_size(m->bdev) > sb->s_blocksize) {
+        pr_err("block size too small for device %pg\n", m->bdev);
+        return -EINVAL;
+    }
+    if (bdev_read_only(m->bdev) && !sb_rdonly(sb)) {
+        pr_err("device %pg read-only, try mounting with '-o ro'\n", m->bdev);
+        return -EROFS;
+    }
+#if SIMPLEFS_AT_LEAST(6, 9, 0)
+    ret = set_blocksize(m->bdev_file, sb->s_blocksize);
+#else
+    ret = set_blocksize(m->bdev, sb->s_blocksize);
+#endif
+    if (ret)
+        return ret;
+
+    bh = __bread(m->bdev, 0, sb->s_blocksize);
+    if (!bh)
+        return -EIO;
+    msb = (struct simplefs_member_sb *) bh->b_data;
+    ret = msb->index;
+    if (msb->magic != SIMPLEFS_MEMBER_MAGIC || msb->set_id != sbi->set_id) {
+        pr_err("device %pg is not part of this partition\n", m->bdev);
+        ret = -EINVAL;
+    } else if (!msb->index || msb->index >= sbi->nr_devices ||
+               msb->nr_blocks != sbi->dev_blocks[msb->index]) {
+        pr_err("device %pg has an inconsistent header\n", m->bdev);
+        ret = -EINVAL;
+    }
+    brelse(bh);
+    if (ret < 0)
+        return ret;
+
+#if SIMPLEFS_AT_LEAST(5, 16, 0)
+    dev_blocks = bdev_nr_bytes(m->bdev) >> sb->s_blocksize_bits;
+#else
+    dev_blocks = i_size_read(m->bdev->bd_inode) >> sb->s_blocksize_bits;
+#endif
+    if (dev_blocks < sbi->dev_blocks[ret]) {
+        pr_err("device %pg smaller than its %u blocks\n", m->bdev,
+               sbi->dev_blocks[ret]);
+        return -EINVAL;
+    }
+    return ret;
+}
+
+/* Open the other devices of a striped partition: @devices, terminated by a
+ * zero, are the ones of the device= mount options.
+ */
+int simplefs_stripe_init(struct super_block *sb, dev_t *devices)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_stripe *stripe;
+    uint64_t total = 0;
+    uint32_t i;
+    int ret;
+
+    if (!simplefs_has_stripe(sb)) {
+        if (simplefs_has_metadata_dev(sb)) {
+            pr_err("metadata device without a data device\n");
+            return -EINVAL;
+        }
+        if (devices[0]) {
+            pr_err("device= given for a partition on a single device\n");
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (sbi->nr_devices < 2 || sbi->nr_devices > SIMPLEFS_MAX_DEVICES) {
+        pr_err("invalid number of devices %u\n", sbi->nr_devices);
+        return -EINVAL;
+    }
+    for (i = 0; i < sbi->nr_devices; i++)
+        total += sbi->dev_blocks[i];
+    if (total != sbi->nr_blocks ||
+        sbi->dev_blocks[0] <=
+            simplefs_bfree_start(sbi) + sbi->nr_bfree_blocks) {
+        pr_err("inconsistent device sizes\n");
+        return -EINVAL;
+    }
+
+    stripe = kzalloc(sizeof(*stripe), GFP_KERNEL);
+    if (!stripe)
+        return -ENOMEM;
+    stripe->nr_devices = sbi->nr_devices;
+    stripe->devs[0].bdev = sb->s_bdev;
+    for (i = 1; i < stripe->nr_devices; i++)
+        stripe->devs[i].start =
+            stripe->devs[i - 1].start + sbi->dev_blocks[i - 1];
+    sbi->stripe = stripe;
+
+    for (i = 0; devices[i]; i++) {
+        struct simplefs_member m = {};
+
+        ret = simplefs_member_open(sb, devices[i], &m);
+        if (ret) {
+            pr_err("failed to open device unknown-block(%u,%u): %d\n",
+                   MAJOR(devices[i]), MINOR(devices[i]), ret);
+            goto release;
+        }
+        ret = simplefs_member_check(sb, &m);
+        if (ret > 0 && stripe->devs[ret].bdev) {
+            pr_err("device %u given twice\n", ret);
+            ret = -EINVAL;
+        }
+        if (ret < 0) {
+            simplefs_member_close(sb, &m);
+            goto release;
+        }
+        m.start = stripe->devs[ret].start;
+        stripe->devs[ret] = m;
+    }
+    for (i = 1; i < stripe->nr_devices; i++) {
+        if (!stripe->devs[i].bdev) {
+            pr_err("device %u of %u missing, see the device= option\n", i,
+                   stripe->nr_devices);
+            ret = -ENODEV;
+            goto release;
+        }
+    }
+
+    if (simplefs_has_metadata_dev(sb))
+        pr_info("metadata device, data striped over %u devices\n",
+                stripe->nr_devices - 1);
+    else
+        pr_info("striped over %u devices\n", stripe->nr_devices);
+    return 0;
+
+release:
+    simplefs_stripe_release(sb);
+    return ret;
+}
+
+void simplefs_stripe_release(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct simplefs_stripe *stripe = sbi->stripe;
+    uint32_t i;
+
+    if (!stripe)
+        return;
+    for (i = 1; i < stripe->nr_devices; i++) {
+        if (stripe->devs[i].bdev)
+            simplefs_member_close(sb, &stripe->devs[i]);
+    }
+    kfree(stripe);
+    sbi->stripe = NULL;
+}
+
+/* Index of the device holding block @bno of the partition */
+static uint32_t simplefs_member_of(struct simplefs_stripe *stripe, uint32_t bno)
+{
+    uint32_t i;
+
+    for (i = stripe->nr_devices - 1; i && bno < stripe->devs[i].start; i--)
+        ;
+    return i;
+}
+
+/* Device holding block @bno of the partition; @bno becomes the block of that
+ * device
+ */
+struct block_device *simplefs_map_block(struct super_block *sb, uint32_t *bno)
+{
+    struct simplefs_stripe *stripe = SIMPLEFS_SB(sb)->stripe;
+    uint32_t i;
+
+    if (!stripe)
+        return sb->s_bdev;
+    i = simplefs_member_of(stripe, *bno);
+    *bno -= stripe->devs[i].start;
+    return stripe->devs[i].bdev;
+}
+
+/* map_bh() for block @bno of the partition */
+void simplefs_map_bh(struct buffer_head *bh,
+                     struct super_block *sb,
+                     uint32_t bno)
+{
+    struct block_device *bdev = simplefs_map_block(sb, &bno);
+
+    map_bh(bh, sb, bno);
+    bh->b_bdev = bdev;
+}
+
+/* sb_issue_zeroout() and sb_issue_discard() for a run of blocks of the
+ * partition. Runs never span devices, as block 0 of the other devices is
+ * always in use.
+ */
+int simplefs_issue_zeroout(struct super_block *sb, uint32_t bno, uint32_t len)
+{
+    struct block_device *bdev = simplefs_map_block(sb, &bno);
+    unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+
+    return blkdev_issue_zeroout(bdev, (sector_t) bno << shift,
+                                (sector_t) len << shift, GFP_NOFS, 0);
+}
+
+int simplefs_issue_discard(struct super_block *sb, uint32_t bno, uint32_t len)
+{
+    struct block_device *bdev = simplefs_map_block(sb, &bno);
+    unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+
+#if SIMPLEFS_AT_LEAST(5, 19, 0)
+    return blkdev_issue_discard(bdev, (sector_t) bno << shift,
+                                (sector_t) len << shift, GFP_NOFS);
+#else
+    return blkdev_issue_discard(bdev, (sector_t) bno << shift,
+                                (sector_t) len << shift, GFP_NOFS, 0);
+#endif
+}
+
+/* Device @i of the partition, and in @start the first block of the partition
+ * it holds
+ */
+struct block_device *simplefs_stripe_member(struct super_block *sb,
+                                            uint32_t i,
+                                            uint32_t *start)
+{
+    struct simplefs_stripe *stripe = SIMPLEFS_SB(sb)->stripe;
+
+    if (!stripe) {
+        *start = 0;
+        return sb->s_bdev;
+    }
+    *start = stripe->devs[i].start;
+    return stripe->devs[i].bdev;
+}
+
+/* Flush the caches of the devices in @mask */
+static int simplefs_stripe_flush_mask(struct simplefs_stripe *stripe,
+                                      unsigned long mask)
+{
+    uint32_t i;
+    int ret = 0, err;
+
+    for_each_set_bit(i, &mask, stripe->nr_devices) {
+#if SIMPLEFS_AT_LEAST(5, 12, 0)
+        err = blkdev_issue_flush(stripe->devs[i].bdev);
+#else
+        err = blkdev_issue_flush(stripe->devs[i].bdev, GFP_KERNEL);
+#endif
+        if (err && !ret)
+            ret = err;
+    }
+    return ret;
+}
+
+/* Flush the caches of the devices other than the first one */
+int simplefs_stripe_flush(struct super_block *sb)
+{
+    struct simplefs_stripe *stripe = SIMPLEFS_SB(sb)->stripe;
+
+    if (!stripe)
+        return 0;
+    return simplefs_stripe_flush_mask(
+        stripe, GENMASK(stripe->nr_devices - 1, 1));
+}
+
+/* data=ordered: block @bno holds data that the transaction of @handle writes
+ * before it commits. Its device, unless the first one, is then flushed by
+ * simplefs_stripe_flush_ordered(). Runs never span devices.
+ */
+void simplefs_stripe_order(handle_t *handle,
+                           struct super_block *sb,
+                           uint32_t bno)
+{
+    struct simplefs_stripe *stripe = SIMPLEFS_SB(sb)->stripe;
+    uint32_t i;
+
+    if (!stripe)
+        return;
+    i = simplefs_member_of(stripe, bno);
+    if (i)
+        set_bit(i, &stripe->ordered[handle->h_transaction->t_tid & 1]);
+}
+
+/* Flush the devices holding the data ordered by transaction @tid, once all
+ * of it is written, and before its commit block
+ */
+int simplefs_stripe_flush_ordered(struct super_block *sb, tid_t tid)
+{
+    struct simplefs_stripe *stripe = SIMPLEFS_SB(sb)->stripe;
+
+    if (!stripe)
+        return 0;
+    return simplefs_stripe_flush_mask(stripe,
+                                      xchg(&stripe->ordered[tid & 1], 0));
+}
@@ -9,6 +9,8 @@
 
 #include <linux/blkdev.h>
 #include <linux/jbd2.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/namei.h>
 #include <linux/parser.h>
 
@@ -51,17 +53,32 @@ static struct inode *simplefs_alloc_inode(struct super_block *sb)
         return NULL;
 
     inode_init_once(&ci->vfs_inode);
+    jbd2_journal_init_jbd_inode(&ci->i_jinode, &ci->vfs_inode);
     return &ci->vfs_inode;
 }
 
+static void simplefs_evict_inode(struct inode *inode)
+{
+    journal_t *journal = SIMPLEFS_SB(inode->i_sb)->journal;
+
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+    /* Wait for the commit that may still be writing our ordered data */
+    if (journal)
+        jbd2_journal_release_jbd_inode(journal,
+                                       &SIMPLEFS_INODE(inode)->i_jinode);
+}
+
 static void simplefs_destroy_inode(struct inode *inode)
 {
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
     kmem_cache_free(simplefs_inode_cache, ci);
 }
 
-static int simplefs_write_inode(struct inode *inode,
-                                struct writeback_control *wbc)
+/* Copy the VFS inode into its slot of the inode store, logging the block in
+ * @handle when the partition is journaled.
+ */
+static int simplefs_update_inode(handle_t *handle, struct inode *inode)
 {
     struct simplefs_inode *disk_inode;
     struct simplefs_inode_info *ci = SIMPLEFS_INODE(inode);
@@ -69,16 +86,21 @@ static int simplefs_write_inode(struct inode *inode,
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     struct buffer_head *bh;
     uint32_t ino = inode->i_ino;
-    uint32_t inode_block = (ino / SIMPLEFS_INODES_PER_BLOCK) + 1;
-    uint32_t inode_shift = ino % SIMPLEFS_INODES_PER_BLOCK;
+    uint32_t inode_block = (ino / simplefs_inodes_per_block(sb)) + 1;
+    uint32_t inode_shift = ino % simplefs_inodes_per_block(sb);
+    int ret;
 
     if (ino >= sbi->nr_inodes)
         return 0;
 
-    bh = sb_bread(sb, inode_block);
+    bh = simplefs_bread(sb, inode_block);
     if (!bh)
         return -EIO;
 
+    ret = simplefs_journal_get_write_access(handle, bh);
+    if (ret)
+        goto release;
+
     disk_inode = (struct simplefs_inode *) bh->b_data;
     disk_inode += inode_shift;
 
@@ -97,7 +119,7 @@ static int simplefs_write_inode(struct inode *inode,
 
 #if SIMPLEFS_AT_LEAST(6, 7, 0)
     disk_inode->i_atime = inode_get_atime_sec(inode);
-    disk_inode->i_atime = inode_get_mtime_sec(inode);
+    disk_inode->i_mtime = inode_get_mtime_sec(inode);
 #else
     disk_inode->i_atime = inode->i_atime.tv_sec;
     disk_inode->i_mtime = inode->i_mtime.tv_sec;
@@ -107,7 +129,64 @@ static int simplefs_write_inode(struct inode *inode,
     disk_inode->ei_block = ci->ei_block;
     strncpy(disk_inode->i_data, ci->i_data, sizeof(ci->i_data));
 
-    mark_buffer_dirty(bh);
+    ret = simplefs_journal_dirty_metadata(handle, sb, bh);
+    if (handle) {
+        ci->i_sync_tid = handle->h_transaction->t_tid;
+        simplefs_fc_log_inode(handle, inode, disk_inode);
+    }
+
+release:
+    brelse(bh);
+
+    return ret;
+}
+
+/* Log the inode as soon as it is dirtied, within the same transaction as the
+ * operation that changed it. Only used on journaled partitions.
+ */
+static void simplefs_dirty_inode(struct inode *inode, int flags)
+{
+    handle_t *handle;
+
+    if (!SIMPLEFS_SB(inode->i_sb)->journal || flags == I_DIRTY_TIME)
+        return;
+
+    handle = simplefs_journal_start(inode->i_sb, SIMPLEFS_INODE_CREDITS);
+    if (IS_ERR(handle)) {
+        pr_err("failed to log inode %lu: %ld\n", inode->i_ino,
+               PTR_ERR(handle));
+        return;
+    }
+    simplefs_update_inode(handle, inode);
+    simplefs_journal_stop(handle);
+}
+
+static int simplefs_write_inode(struct inode *inode,
+                                struct writeback_control *wbc)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(inode->i_sb);
+    struct buffer_head *bh;
+    uint32_t inode_block =
+        (inode->i_ino / simplefs_inodes_per_block(inode->i_sb)) + 1;
+    int ret;
+
+    /* Journaled inodes were logged by simplefs_dirty_inode(); only wait for
+     * the commit when the caller needs the inode on disk.
+     */
+    if (sbi->journal) {
+        if (wbc->sync_mode != WB_SYNC_ALL || (current->flags & PF_MEMALLOC))
+            return 0;
+        return jbd2_complete_transaction(sbi->journal,
+                                         SIMPLEFS_INODE(inode)->i_sync_tid);
+    }
+
+    ret = simplefs_update_inode(NULL, inode);
+    if (ret || wbc->sync_mode != WB_SYNC_ALL)
+        return ret;
+
+    bh = simplefs_bread(inode->i_sb, inode_block);
+    if (!bh)
+        return -EIO;
     sync_dirty_buffer(bh);
     brelse(bh);
 
@@ -120,6 +199,9 @@ static void simplefs_put_super(struct super_block *sb)
     int aborted = 0;
     int err;
 
+    /* Pending discards wait for the commit of their transaction */
+    simplefs_discard_release(sb);
+    simplefs_log_release(sb);
     if (sbi->journal) {
         aborted = is_journal_aborted(sbi->journal);
         err = jbd2_journal_destroy(sbi->journal);
@@ -128,18 +210,24 @@ static void simplefs_put_super(struct super_block *sb)
             pr_err("Couldn't clean up the journal, error %d\n", -err);
         }
     }
+    simplefs_fc_release(sb);
 
     sync_blockdev(sb->s_bdev);
     invalidate_bdev(sb->s_bdev);
+    simplefs_stripe_release(sb);
 #if SIMPLEFS_AT_LEAST(6, 9, 0)
     if (sbi->s_journal_bdev_file) {
         sync_blockdev(file_bdev(sbi->s_journal_bdev_file));
         invalidate_bdev(file_bdev(sbi->s_journal_bdev_file));
+        fput(sbi->s_journal_bdev_file);
+        sbi->s_journal_bdev_file = NULL;
     }
 #elif SIMPLEFS_AT_LEAST(6, 7, 0)
     if (sbi->s_journal_bdev_handle) {
         sync_blockdev(sbi->s_journal_bdev_handle->bdev);
         invalidate_bdev(sbi->s_journal_bdev_handle->bdev);
+        bdev_release(sbi->s_journal_bdev_handle);
+        sbi->s_journal_bdev_handle = NULL;
     }
 #elif SIMPLEFS_AT_LEAST(6, 6, 0)
     if (sbi->s_journal_bdev) {
@@ -163,25 +251,19 @@ static void simplefs_put_super(struct super_block *sb)
 #endif
 
     if (sbi) {
+        simplefs_refcount_release(sb);
         kfree(sbi->ifree_bitmap);
         kfree(sbi->bfree_bitmap);
+        kfree(sbi->ifree_pending);
+        kfree(sbi->bfree_pending);
         kfree(sbi);
     }
 }
 
-static int simplefs_sync_fs(struct super_block *sb, int wait)
+/* Copy the in-memory counters into the on-disk superblock */
+static void simplefs_fill_disk_sb(struct simplefs_sb_info *sbi,
+                                  struct simplefs_sb_info *disk_sb)
 {
-    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
-    struct simplefs_sb_info *disk_sb;
-    int i;
-
-    /* Flush superblock */
-    struct buffer_head *bh = sb_bread(sb, 0);
-    if (!bh)
-        return -EIO;
-
-    disk_sb = (struct simplefs_sb_info *) bh->b_data;
-
     disk_sb->nr_blocks = sbi->nr_blocks;
     disk_sb->nr_inodes = sbi->nr_inodes;
     disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
@@ -189,45 +271,130 @@ static int simplefs_sync_fs(struct super_block *sb, int wait)
     disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
     disk_sb->nr_free_inodes = sbi->nr_free_inodes;
     disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+    disk_sb->journal_ino = sbi->journal_ino;
+    disk_sb->features = sbi->features;
+    disk_sb->refcount_start = sbi->refcount_start;
+    disk_sb->nr_refcount_blocks = sbi->nr_refcount_blocks;
+}
 
-    mark_buffer_dirty(bh);
-    if (wait)
-        sync_dirty_buffer(bh);
+/* On a journaled partition the bitmaps are logged by every operation, so only
+ * the superblock counters are left to log before kicking a commit.
+ */
+static int simplefs_sync_fs_journal(struct super_block *sb, int wait)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct buffer_head *bh;
+    handle_t *handle;
+    tid_t target;
+    int ret;
+
+    handle = simplefs_journal_start(sb, 1);
+    if (IS_ERR(handle))
+        return PTR_ERR(handle);
+
+    bh = sb_bread(sb, SIMPLEFS_SB_BLOCK_NR);
+    if (!bh) {
+        simplefs_journal_stop(handle);
+        return -EIO;
+    }
+    ret = simplefs_journal_get_write_access(handle, bh);
+    if (!ret) {
+        simplefs_fill_disk_sb(sbi, (struct simplefs_sb_info *) bh->b_data);
+        ret = simplefs_journal_dirty_metadata(handle, sb, bh);
+    }
     brelse(bh);
+    simplefs_journal_stop(handle);
+    if (ret)
+        return ret;
 
-    /* Flush free inodes bitmask */
-    for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + i + 1;
+    if (jbd2_journal_start_commit(sbi->journal, &target) && wait)
+        ret = jbd2_log_wait_commit(sbi->journal, target);
 
-        bh = sb_bread(sb, idx);
-        if (!bh)
-            return -EIO;
+    return ret;
+}
 
-        memcpy(bh->b_data, (void *) sbi->ifree_bitmap + i * SIMPLEFS_BLOCK_SIZE,
-               SIMPLEFS_BLOCK_SIZE);
+/* Write back the @count blocks of a free bitmap starting at block @first, each
+ * checksum table block right after the bitmap blocks it covers.
+ */
+static int simplefs_sync_bitmap(struct super_block *sb,
+                                unsigned long *bitmap,
+                                uint32_t first,
+                                uint32_t count,
+                                int wait)
+{
+    struct buffer_head *bh, *table_bh = NULL;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (simplefs_has_metadata_csum(sb) && !table_bh) {
+            table_bh = sb_bread(sb, simplefs_csum_table(sb, first + i));
+            if (!table_bh)
+                return -EIO;
+        }
 
+        bh = sb_bread(sb, first + i);
+        if (!bh) {
+            brelse(table_bh);
+            return -EIO;
+        }
+        memcpy(bh->b_data, (void *) bitmap + i * sb->s_blocksize,
+               sb->s_blocksize);
+        if (table_bh)
+            simplefs_csum_bitmap(sb, table_bh, bh);
         mark_buffer_dirty(bh);
         if (wait)
             sync_dirty_buffer(bh);
         brelse(bh);
+
+        if (table_bh &&
+            (i + 1 == count ||
+             simplefs_csum_table(sb, first + i + 1) != table_bh->b_blocknr)) {
+            simplefs_journal_dirty_metadata(NULL, sb, table_bh);
+            if (wait)
+                sync_dirty_buffer(table_bh);
+            brelse(table_bh);
+            table_bh = NULL;
+        }
     }
+    return 0;
+}
 
-    /* Flush free blocks bitmask */
-    for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-        int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
+static int simplefs_sync_fs(struct super_block *sb, int wait)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct buffer_head *bh;
+    int i;
 
-        bh = sb_bread(sb, idx);
-        if (!bh)
-            return -EIO;
+    /* File data written back to the other devices of a striped partition */
+    if (wait) {
+        i = simplefs_stripe_flush(sb);
+        if (i)
+            return i;
+    }
 
-        memcpy(bh->b_data, (void *) sbi->bfree_bitmap + i * SIMPLEFS_BLOCK_SIZE,
-               SIMPLEFS_BLOCK_SIZE);
+    if (sbi->journal)
+        return simplefs_sync_fs_journal(sb, wait);
 
-        mark_buffer_dirty(bh);
-        if (wait)
-            sync_dirty_buffer(bh);
-        brelse(bh);
-    }
+    i = simplefs_sync_bitmap(sb, sbi->ifree_bitmap,
+                             sbi->nr_istore_blocks + 1, sbi->nr_ifree_blocks,
+                             wait);
+    if (!i)
+        i = simplefs_sync_bitmap(
+            sb, sbi->bfree_bitmap,
+            sbi->nr_istore_blocks + sbi->nr_ifree_blocks + 1,
+            sbi->nr_bfree_blocks, wait);
+    if (i)
+        return i;
+
+    /* Flush superblock */
+    bh = sb_bread(sb, SIMPLEFS_SB_BLOCK_NR);
+    if (!bh)
+        return -EIO;
+    simplefs_fill_disk_sb(sbi, (struct simplefs_sb_info *) bh->b_data);
+    simplefs_journal_dirty_metadata(NULL, sb, bh);
+    if (wait)
+        sync_dirty_buffer(bh);
+    brelse(bh);
 
     return 0;
 }
@@ -238,7 +405,7 @@ static int simplefs_statfs(struct dentry *dentry, struct kstatfs *stat)
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
 
     stat->f_type = SIMPLEFS_MAGIC;
-    stat->f_bsize = SIMPLEFS_BLOCK_SIZE;
+    stat->f_bsize = sb->s_blocksize;
     stat->f_blocks = sbi->nr_blocks;
     stat->f_bfree = sbi->nr_free_blocks;
     stat->f_bavail = sbi->nr_free_blocks;
@@ -258,8 +425,8 @@ static journal_t *simplefs_get_dev_journal(struct super_block *sb,
     struct buffer_head *bh;
     struct block_device *bdev;
     int hblock, blocksize;
-    unsigned long long sb_block, start, len;
-    unsigned long offset;
+    unsigned long long sb_block, start, len, dev_blocks;
+    journal_superblock_t *jsb;
     journal_t *journal;
     int errno = 0;
 #if SIMPLEFS_AT_LEAST(6, 9, 0)
@@ -324,8 +491,10 @@ static journal_t *simplefs_get_dev_journal(struct super_block *sb,
         goto out_bdev;
     }
 
-    sb_block = SIMPLEFS_BLOCK_SIZE / blocksize;
-    offset = SIMPLEFS_BLOCK_SIZE % blocksize;
+    /* mke2fs -O journal_dev writes an ext2 superblock at byte 1024, and the
+     * jbd2 superblock in the next block.
+     */
+    sb_block = 1024 / blocksize + 1;
 
 #if SIMPLEFS_AT_LEAST(6, 9, 0)
     set_blocksize(bdev_file, blocksize);
@@ -339,19 +508,35 @@ static journal_t *simplefs_get_dev_journal(struct super_block *sb,
         errno = -EINVAL;
         goto out_bdev;
     }
-    /*
-     * FIXME: Currently, the exact size of the external journal device is not
-     * available. Therefore, we use the device size divided by the block size to
-     * set `len`. Hint: External device size available now is 8MB.
-     *
-     * Future implementation might need to change to:
-     * len = CapacityOfJournalDevice / SIMPLEFS_BLOCK_SIZE
-     */
 
-    len = 2048;
+    /* The journal covers the device up to the end of the log recorded in its
+     * jbd2 superblock, which mke2fs -O journal_dev sizes to the device.
+     */
+    jsb = (journal_superblock_t *) bh->b_data;
+    if (jsb->s_header.h_magic != cpu_to_be32(JBD2_MAGIC_NUMBER) ||
+        (jsb->s_header.h_blocktype != cpu_to_be32(JBD2_SUPERBLOCK_V1) &&
+         jsb->s_header.h_blocktype != cpu_to_be32(JBD2_SUPERBLOCK_V2))) {
+        pr_err("external journal has a bad superblock\n");
+        brelse(bh);
+        errno = -EINVAL;
+        goto out_bdev;
+    }
+    len = be32_to_cpu(jsb->s_maxlen);
     start = sb_block;
     brelse(bh);
 
+#if SIMPLEFS_AT_LEAST(5, 16, 0)
+    dev_blocks = bdev_nr_bytes(bdev) >> sb->s_blocksize_bits;
+#else
+    dev_blocks = i_size_read(bdev->bd_inode) >> sb->s_blocksize_bits;
+#endif
+    if (len > dev_blocks) {
+        pr_err("external journal (%llu blocks) larger than its device (%llu)\n",
+               len, dev_blocks);
+        errno = -EINVAL;
+        goto out_bdev;
+    }
+
 #if SIMPLEFS_AT_LEAST(6, 9, 0)
     journal = jbd2_journal_init_dev(file_bdev(bdev_file), sb->s_bdev, start,
                                     len, sb->s_blocksize);
@@ -391,24 +576,152 @@ out_bdev:
 #elif SIMPLEFS_AT_LEAST(5, 10, 0)
     blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
 #endif
-    return NULL;
+    return ERR_PTR(errno);
+}
+
+/* Code related to the internal journal, stored in a regular inode reserved by
+ * mkfs.simplefs. jbd2 maps its blocks through simplefs_aops.bmap and writes
+ * them directly to the partition.
+ */
+static journal_t *simplefs_get_inode_journal(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    struct inode *journal_inode;
+    journal_t *journal;
+
+    journal_inode = simplefs_iget(sb, sbi->journal_ino);
+    if (IS_ERR(journal_inode)) {
+        pr_err("no journal found\n");
+        return ERR_CAST(journal_inode);
+    }
+    if (!journal_inode->i_nlink || !S_ISREG(journal_inode->i_mode)) {
+        pr_err("invalid journal inode %u\n", sbi->journal_ino);
+        iput(journal_inode);
+        return ERR_PTR(-EINVAL);
+    }
+
+    journal = jbd2_journal_init_inode(journal_inode);
+    if (IS_ERR_OR_NULL(journal)) {
+        pr_err("failed to initialize journal from inode %u\n",
+               sbi->journal_ino);
+        iput(journal_inode);
+        return journal ? journal : ERR_PTR(-EINVAL);
+    }
+
+    journal->j_private = sb;
+    return journal;
+}
+
+/* Apply the commit=, barrier, max_batch_time and min_batch_time options */
+static void simplefs_init_journal_params(struct super_block *sb,
+                                         journal_t *journal)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+
+    journal->j_commit_interval = sbi->s_commit_interval;
+    journal->j_min_batch_time = sbi->s_min_batch_time;
+    journal->j_max_batch_time = sbi->s_max_batch_time;
+
+    write_lock(&journal->j_state_lock);
+    if (sbi->s_mount_opt & SIMPLEFS_MOUNT_BARRIER)
+        journal->j_flags |= JBD2_BARRIER;
+    else
+        journal->j_flags &= ~JBD2_BARRIER;
+    write_unlock(&journal->j_state_lock);
+}
+
+/* journal_async_commit: write the commit block along with the transaction
+ * instead of after it, and rely on a checksum of the transaction to detect an
+ * incomplete commit at replay. Like every journal feature, this is recorded in
+ * the journal superblock, which jbd2 writes along with the feature.
+ */
+static int simplefs_set_journal_features(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    journal_t *journal = sbi->journal;
+
+    if (sbi->s_mount_opt & SIMPLEFS_MOUNT_JOURNAL_ASYNC_COMMIT) {
+        if (!jbd2_journal_set_features(journal, JBD2_FEATURE_COMPAT_CHECKSUM,
+                                       0, JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT))
+            return -EINVAL;
+    } else {
+        jbd2_journal_clear_features(journal, JBD2_FEATURE_COMPAT_CHECKSUM, 0,
+                                    JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT);
+    }
+    return 0;
 }
 
+#if SIMPLEFS_AT_LEAST(5, 10, 0)
+/* data=ordered on a striped partition: jbd2 only flushes the first device
+ * before the commit block, so the file data written to the others is
+ * flushed here. jbd2 waits for the data of each inode of the commit in turn:
+ * the devices are flushed once, after the last one. The inodes left to wait
+ * for cannot leave the list, pinned by JI_COMMIT_RUNNING.
+ */
+static int simplefs_finish_inode_data_buffers(struct jbd2_inode *jinode)
+{
+    transaction_t *transaction = jinode->i_transaction;
+    journal_t *journal = transaction->t_journal;
+    struct jbd2_inode *next = jinode;
+    int ret = jbd2_journal_finish_inode_data_buffers(jinode), err;
+    bool last = true;
+
+    spin_lock(&journal->j_list_lock);
+    list_for_each_entry_continue(next, &transaction->t_inode_list, i_list) {
+        if (next->i_flags & JI_WAIT_DATA) {
+            last = false;
+            break;
+        }
+    }
+    spin_unlock(&journal->j_list_lock);
+    if (!last)
+        return ret;
+    err = simplefs_stripe_flush_ordered(jinode->i_vfs_inode->i_sb,
+                                        transaction->t_tid);
+    return ret ? ret : err;
+}
+#endif
+
+/* Whether the journal holds transactions to replay, as jbd2_journal_load()
+ * would find them: a non-zero start in its superblock. Returns 1 if so, 0 if
+ * the journal is clean, or an error.
+ */
+static int simplefs_journal_needs_recovery(journal_t *journal)
+{
+    unsigned long long blocknr;
+    struct buffer_head *bh;
+    int ret;
+
+    ret = jbd2_journal_bmap(journal, 0, &blocknr);
+    if (ret)
+        return ret;
+    bh = __bread(journal->j_dev, blocknr, journal->j_blocksize);
+    if (!bh)
+        return -EIO;
+    ret = ((journal_superblock_t *) bh->b_data)->s_start != 0;
+    brelse(bh);
+    return ret;
+}
+
+/* Load and replay the journal. A zero journal_devnum selects the internal
+ * journal described in the superblock.
+ */
 static int simplefs_load_journal(struct super_block *sb,
                                  unsigned long journal_devnum)
 {
     journal_t *journal;
     struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
-    dev_t journal_dev;
     int err = 0;
     int really_read_only;
+    ktime_t start;
     int journal_dev_ro;
 
-    journal_dev = new_decode_dev(journal_devnum);
-    journal = simplefs_get_dev_journal(sb, journal_dev);
+    if (journal_devnum)
+        journal = simplefs_get_dev_journal(sb, new_decode_dev(journal_devnum));
+    else
+        journal = simplefs_get_inode_journal(sb);
     if (IS_ERR(journal)) {
-        pr_err("Failed to get journal from device, error %ld\n",
-               PTR_ERR(journal));
+        pr_err("Failed to get journal, error %ld\n", PTR_ERR(journal));
         return PTR_ERR(journal);
     }
 
@@ -421,36 +734,124 @@ static int simplefs_load_journal(struct super_block *sb,
         goto err_out;
     }
 
-    err = jbd2_journal_wipe(journal, !really_read_only);
-
-    if (!err) {
-        err = jbd2_journal_load(journal);
-        if (err) {
-            pr_err("error loading journal, error %d\n", err);
-            goto err_out;
+    /* Nothing can be replayed on a read-only device: refuse to mount stale
+     * metadata, go on without the journal only when it is clean.
+     */
+    if (really_read_only) {
+        err = simplefs_journal_needs_recovery(journal);
+        if (err > 0) {
+            pr_err("recovery required on read-only device\n");
+            err = -EROFS;
         }
+        if (err)
+            goto err_out;
+        jbd2_journal_destroy(journal);
+        return 0;
+    }
+
+#if SIMPLEFS_AT_LEAST(5, 10, 0)
+    /* data=ordered: write file data before committing the metadata */
+    if (!(sbi->s_mount_opt & SIMPLEFS_MOUNT_DATA_WRITEBACK)) {
+        journal->j_submit_inode_data_buffers =
+            jbd2_journal_submit_inode_data_buffers;
+        journal->j_finish_inode_data_buffers =
+            jbd2_journal_finish_inode_data_buffers;
+    }
+#endif
+    /* Freed inodes and blocks are reused once their transaction commits */
+    journal->j_commit_callback = simplefs_journal_commit_callback;
+
+    simplefs_init_journal_params(sb, journal);
+#if SIMPLEFS_AT_LEAST(5, 10, 0)
+    if (sbi->stripe && journal->j_flags & JBD2_BARRIER &&
+        !(sbi->s_mount_opt & SIMPLEFS_MOUNT_DATA_WRITEBACK))
+        journal->j_finish_inode_data_buffers =
+            simplefs_finish_inode_data_buffers;
+#endif
+
+    /* Fast commits following the last full commit are replayed by load */
+    err = simplefs_fc_init(sb, journal);
+    if (err)
+        goto err_out;
+
+    /* Replay time bounds the mount time after a crash: a debug message, that
+     * script/crash_test.sh enables with dynamic debug.
+     */
+    start = ktime_get();
+    err = jbd2_journal_load(journal);
+    if (err) {
+        pr_err("error loading journal, error %d\n", err);
+        goto err_out;
     }
+    pr_debug("journal: loaded in %lld us\n",
+             ktime_us_delta(ktime_get(), start));
 
     sbi->journal = journal;
+    err = simplefs_set_journal_features(sb);
+    if (err) {
+        pr_err("failed to set journal features, error %d\n", err);
+        sbi->journal = NULL;
+        goto err_out;
+    }
+    pr_info("journal: %u blocks (%u KiB)%s\n", journal->j_total_len,
+            journal->j_total_len << (sb->s_blocksize_bits - 10),
+            journal->j_inode ? "" : " on external device");
 
     return 0;
 
 err_out:
     jbd2_journal_destroy(journal);
+    simplefs_fc_release(sb);
     return err;
 }
 
-/* we use SIMPLEFS_OPT_JOURNAL_PATH case to load external journal device now */
+/* Mount options. The journal is loaded once all of them are parsed, so that
+ * the tuning options apply whatever their position.
+ */
 #define SIMPLEFS_OPT_JOURNAL_DEV 1
 #define SIMPLEFS_OPT_JOURNAL_PATH 2
+#define SIMPLEFS_OPT_FAST_COMMIT 3
+#define SIMPLEFS_OPT_COMMIT 4
+#define SIMPLEFS_OPT_BARRIER 5
+#define SIMPLEFS_OPT_NOBARRIER 6
+#define SIMPLEFS_OPT_JOURNAL_ASYNC_COMMIT 7
+#define SIMPLEFS_OPT_MAX_BATCH_TIME 8
+#define SIMPLEFS_OPT_MIN_BATCH_TIME 9
+#define SIMPLEFS_OPT_DISCARD 10
+#define SIMPLEFS_OPT_NODISCARD 11
+#define SIMPLEFS_OPT_COMPRESS 12
+#define SIMPLEFS_OPT_DEVICE 13
+#define SIMPLEFS_OPT_LOG 14
+#define SIMPLEFS_OPT_DATA_ORDERED 15
+#define SIMPLEFS_OPT_DATA_WRITEBACK 16
+#define SIMPLEFS_OPT_ERR 17
 static const match_table_t tokens = {
     {SIMPLEFS_OPT_JOURNAL_DEV, "journal_dev=%u"},
     {SIMPLEFS_OPT_JOURNAL_PATH, "journal_path=%s"},
+    {SIMPLEFS_OPT_FAST_COMMIT, "fast_commit"},
+    {SIMPLEFS_OPT_COMMIT, "commit=%u"},
+    {SIMPLEFS_OPT_BARRIER, "barrier"},
+    {SIMPLEFS_OPT_NOBARRIER, "nobarrier"},
+    {SIMPLEFS_OPT_JOURNAL_ASYNC_COMMIT, "journal_async_commit"},
+    {SIMPLEFS_OPT_MAX_BATCH_TIME, "max_batch_time=%u"},
+    {SIMPLEFS_OPT_MIN_BATCH_TIME, "min_batch_time=%u"},
+    {SIMPLEFS_OPT_DISCARD, "discard"},
+    {SIMPLEFS_OPT_NODISCARD, "nodiscard"},
+    {SIMPLEFS_OPT_COMPRESS, "compress"},
+    {SIMPLEFS_OPT_DEVICE, "device=%s"},
+    {SIMPLEFS_OPT_LOG, "log"},
+    {SIMPLEFS_OPT_DATA_ORDERED, "data=ordered"},
+    {SIMPLEFS_OPT_DATA_WRITEBACK, "data=writeback"},
+    {SIMPLEFS_OPT_ERR, NULL},
 };
-static int simplefs_parse_options(struct super_block *sb, char *options)
+static int simplefs_parse_options(struct super_block *sb,
+                                  char *options,
+                                  unsigned long *journal_devnum,
+                                  dev_t *devices)
 {
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
     substring_t args[MAX_OPT_ARGS];
-    int token, ret = 0, arg;
+    int token, ret = 0, arg, nr_devices = 0;
     char *p;
     char *journal_path;
     struct inode *journal_inode;
@@ -465,19 +866,17 @@ static int simplefs_parse_options(struct super_block *sb, char *options)
         args[0].to = args[0].from = NULL;
         token = match_token(p, tokens, args);
 
+        /* All numeric options are unsigned */
+        if (args->from && token != SIMPLEFS_OPT_JOURNAL_PATH &&
+            token != SIMPLEFS_OPT_DEVICE &&
+            (match_int(args, &arg) || arg < 0)) {
+            pr_err("simplefs_parse_options: invalid value in '%s'\n", p);
+            return -EINVAL;
+        }
+
         switch (token) {
         case SIMPLEFS_OPT_JOURNAL_DEV:
-            if (args->from && match_int(args, &arg)) {
-                pr_err("simplefs_parse_options: match_int failed\n");
-                return 1;
-            }
-            if ((ret = simplefs_load_journal(sb, arg))) {
-                pr_err(
-                    "simplefs_parse_options: simplefs_load_journal failed with "
-                    "%d\n",
-                    ret);
-                return ret;
-            }
+            *journal_devnum = arg;
             break;
 
         case SIMPLEFS_OPT_JOURNAL_PATH: {
@@ -500,22 +899,107 @@ static int simplefs_parse_options(struct super_block *sb, char *options)
             path_put(&path);
             kfree(journal_path);
 
-            if (S_ISBLK(journal_inode->i_mode)) {
-                unsigned long journal_devnum =
-                    new_encode_dev(journal_inode->i_rdev);
-                if ((ret = simplefs_load_journal(sb, journal_devnum))) {
-                    pr_err(
-                        "simplefs_parse_options: simplefs_load_journal failed "
-                        "with %d\n",
-                        ret);
-                    return ret;
-                }
+            if (S_ISBLK(journal_inode->i_mode))
+                *journal_devnum = new_encode_dev(journal_inode->i_rdev);
+            break;
+        }
+        case SIMPLEFS_OPT_FAST_COMMIT:
+            sbi->s_mount_opt |= SIMPLEFS_MOUNT_FAST_COMMIT;
+            break;
+        case SIMPLEFS_OPT_COMMIT:
+            if (arg > INT_MAX / HZ) {
+                pr_err("simplefs_parse_options: commit=%d too large\n", arg);
+                return -EINVAL;
             }
+            if (!arg)
+                arg = JBD2_DEFAULT_MAX_COMMIT_AGE;
+            sbi->s_commit_interval = HZ * arg;
+            break;
+        case SIMPLEFS_OPT_BARRIER:
+            sbi->s_mount_opt |= SIMPLEFS_MOUNT_BARRIER;
+            break;
+        case SIMPLEFS_OPT_NOBARRIER:
+            sbi->s_mount_opt &= ~SIMPLEFS_MOUNT_BARRIER;
+            break;
+        case SIMPLEFS_OPT_JOURNAL_ASYNC_COMMIT:
+            sbi->s_mount_opt |= SIMPLEFS_MOUNT_JOURNAL_ASYNC_COMMIT;
+            break;
+        case SIMPLEFS_OPT_MAX_BATCH_TIME:
+            sbi->s_max_batch_time = arg;
+            break;
+        case SIMPLEFS_OPT_MIN_BATCH_TIME:
+            sbi->s_min_batch_time = arg;
+            break;
+        case SIMPLEFS_OPT_DISCARD:
+            sbi->s_mount_opt |= SIMPLEFS_MOUNT_DISCARD;
+            break;
+        case SIMPLEFS_OPT_NODISCARD:
+            sbi->s_mount_opt &= ~SIMPLEFS_MOUNT_DISCARD;
+            break;
+        case SIMPLEFS_OPT_COMPRESS:
+            /* Pages are filled from one extent, see compress.c */
+            if (!SIMPLEFS_HAS_COMPRESSION || simplefs_has_stripe(sb) ||
+                SIMPLEFS_MAX_BLOCKS_PER_EXTENT * sb->s_blocksize < PAGE_SIZE) {
+                pr_err("simplefs_parse_options: compress not supported\n");
+                return -EINVAL;
+            }
+            sbi->s_mount_opt |= SIMPLEFS_MOUNT_COMPRESS;
+            break;
+        case SIMPLEFS_OPT_LOG:
+            sbi->s_mount_opt |= SIMPLEFS_MOUNT_LOG;
+            break;
+        case SIMPLEFS_OPT_DATA_ORDERED:
+            sbi->s_mount_opt &= ~SIMPLEFS_MOUNT_DATA_WRITEBACK;
+            break;
+        case SIMPLEFS_OPT_DATA_WRITEBACK:
+            sbi->s_mount_opt |= SIMPLEFS_MOUNT_DATA_WRITEBACK;
+            break;
+        case SIMPLEFS_OPT_DEVICE: {
+            /* Other devices of a striped partition, see stripe.c */
+            char *device = match_strdup(&args[0]);
+            struct inode *dev_inode;
+
+            if (!device)
+                return -ENOMEM;
+            if (nr_devices == SIMPLEFS_MAX_DEVICES - 1) {
+                pr_err("simplefs_parse_options: too many devices\n");
+                kfree(device);
+                return -EINVAL;
+            }
+            ret = kern_path(device, LOOKUP_FOLLOW, &path);
+            if (ret) {
+                pr_err("simplefs_parse_options: %s: error %d\n", device, ret);
+                kfree(device);
+                return ret;
+            }
+            dev_inode = path.dentry->d_inode;
+            if (!S_ISBLK(dev_inode->i_mode)) {
+                pr_err("simplefs_parse_options: %s: not a block device\n",
+                       device);
+                ret = -ENOTBLK;
+            } else {
+                devices[nr_devices++] = dev_inode->i_rdev;
+            }
+            path_put(&path);
+            kfree(device);
+            if (ret)
+                return ret;
             break;
         }
         }
     }
 
+    /* As ext4: data=ordered relies on the commit block being written after
+     * the file data, which an asynchronous commit does not wait for.
+     */
+    if (sbi->s_mount_opt & SIMPLEFS_MOUNT_JOURNAL_ASYNC_COMMIT &&
+        !(sbi->s_mount_opt & SIMPLEFS_MOUNT_DATA_WRITEBACK)) {
+        pr_err(
+            "simplefs_parse_options: journal_async_commit needs "
+            "data=writeback\n");
+        return -EINVAL;
+    }
+
     return 0;
 }
 
@@ -523,11 +1007,32 @@ static struct super_operations simplefs_super_ops = {
     .put_super = simplefs_put_super,
     .alloc_inode = simplefs_alloc_inode,
     .destroy_inode = simplefs_destroy_inode,
+    .evict_inode = simplefs_evict_inode,
+    .dirty_inode = simplefs_dirty_inode,
     .write_inode = simplefs_write_inode,
     .sync_fs = simplefs_sync_fs,
     .statfs = simplefs_statfs,
+    .show_stats = simplefs_log_show_stats,
 };
 
+/* Lazy itable: first inode store block past the highest inode in use. Blocks
+ * from there on are zeroed before their first inode is allocated.
+ */
+static uint32_t simplefs_itable_used(struct super_block *sb)
+{
+    struct simplefs_sb_info *sbi = SIMPLEFS_SB(sb);
+    unsigned long i = BITS_TO_LONGS(sbi->nr_inodes);
+    unsigned long last;
+
+    while (i && !~sbi->ifree_bitmap[i - 1])
+        i--;
+    if (!i)
+        return 1;
+    last = (i - 1) * BITS_PER_LONG + __fls(~sbi->ifree_bitmap[i - 1]);
+    return min_t(unsigned long, last / simplefs_inodes_per_block(sb) + 2,
+                 sbi->nr_istore_blocks + 1);
+}
+
 /* Fill the struct superblock from partition superblock */
 int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 {
@@ -535,12 +1040,20 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
     struct simplefs_sb_info *csb = NULL;
     struct simplefs_sb_info *sbi = NULL;
     struct inode *root_inode = NULL;
+    unsigned long journal_devnum = 0;
+    dev_t devices[SIMPLEFS_MAX_DEVICES] = {};
+    uint32_t blocksize;
     int ret = 0, i;
 
     /* Initialize the superblock */
     sb->s_magic = SIMPLEFS_MAGIC;
-    sb_set_blocksize(sb, SIMPLEFS_BLOCK_SIZE);
-    sb->s_maxbytes = SIMPLEFS_MAX_FILESIZE;
+    /* The superblock records the block size: read it with the smallest one
+     * the device supports first.
+     */
+    if (!sb_min_blocksize(sb, SIMPLEFS_MIN_BLOCK_SIZE)) {
+        pr_err("device block size too large\n");
+        return -EINVAL;
+    }
     sb->s_op = &simplefs_super_ops;
 
     /* Read the superblock from disk */
@@ -557,6 +1070,59 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
         goto release;
     }
 
+    blocksize = csb->block_size ? csb->block_size : SIMPLEFS_BLOCK_SIZE;
+    if (blocksize != sb->s_blocksize) {
+        if (blocksize < SIMPLEFS_MIN_BLOCK_SIZE ||
+            blocksize > SIMPLEFS_MAX_BLOCK_SIZE || !is_power_of_2(blocksize)) {
+            pr_err("Invalid block size %u\n", blocksize);
+            ret = -EINVAL;
+            goto release;
+        }
+        brelse(bh);
+        /* Larger than the page size needs large block size support */
+        if (!sb_set_blocksize(sb, blocksize)) {
+            pr_err("Unsupported block size %u\n", blocksize);
+            return -EINVAL;
+        }
+        bh = sb_bread(sb, SIMPLEFS_SB_BLOCK_NR);
+        if (!bh)
+            return -EIO;
+        csb = (struct simplefs_sb_info *) bh->b_data;
+    }
+    sb->s_maxbytes = SIMPLEFS_MAX_FILESIZE(sb->s_blocksize);
+
+    if (csb->features & ~SIMPLEFS_FEATURE_ALL) {
+        pr_err("Unsupported features %#x\n",
+               csb->features & ~SIMPLEFS_FEATURE_ALL);
+        ret = -EINVAL;
+        goto release;
+    }
+    if (csb->features & SIMPLEFS_FEATURE_COMPRESSION &&
+        (!SIMPLEFS_HAS_COMPRESSION ||
+         SIMPLEFS_MAX_BLOCKS_PER_EXTENT * sb->s_blocksize < PAGE_SIZE)) {
+        pr_err("compressed partition, LZ4 not supported\n");
+        ret = -EINVAL;
+        goto release;
+    }
+    ret = simplefs_csum_verify_sb(sb, bh);
+    if (ret)
+        goto release;
+    /* Bitmap checksums live in a table past the bitmaps, see csum.c */
+    if (csb->features & SIMPLEFS_FEATURE_METADATA_CSUM &&
+        ((uint64_t) csb->nr_csum_blocks !=
+             DIV_ROUND_UP((uint64_t) csb->nr_ifree_blocks +
+                              csb->nr_bfree_blocks,
+                          SIMPLEFS_CSUMS_PER_BLOCK(sb->s_blocksize)) ||
+         (uint64_t) csb->csum_start < 1ULL + csb->nr_istore_blocks +
+                                          csb->nr_ifree_blocks +
+                                          csb->nr_bfree_blocks ||
+         (uint64_t) csb->csum_start + csb->nr_csum_blocks > csb->nr_blocks)) {
+        pr_err("invalid bitmap checksum table at block %u\n",
+               csb->csum_start);
+        ret = -EUCLEAN;
+        goto release;
+    }
+
     /* Allocate sb_info */
     sbi = kzalloc(sizeof(struct simplefs_sb_info), GFP_KERNEL);
     if (!sbi) {
@@ -571,13 +1137,62 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
     sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
     sbi->nr_free_inodes = csb->nr_free_inodes;
     sbi->nr_free_blocks = csb->nr_free_blocks;
+    sbi->journal_ino = csb->journal_ino;
+    sbi->features = csb->features;
+    sbi->refcount_start = csb->refcount_start;
+    sbi->nr_refcount_blocks = csb->nr_refcount_blocks;
+    sbi->csum_start = csb->csum_start;
+    sbi->nr_csum_blocks = csb->nr_csum_blocks;
+    sbi->nr_devices = csb->nr_devices;
+    sbi->set_id = csb->set_id;
+    memcpy(sbi->dev_blocks, csb->dev_blocks, sizeof(sbi->dev_blocks));
+    /* A partition on a single device is mounted as a stripe of one */
+    if (!(sbi->features & SIMPLEFS_FEATURE_STRIPE)) {
+        sbi->nr_devices = 1;
+        sbi->dev_blocks[0] = sbi->nr_blocks;
+    }
+    spin_lock_init(&sbi->csum_lock);
+    spin_lock_init(&sbi->pending_lock);
+    mutex_init(&sbi->itable_lock);
     sb->s_fs_info = sbi;
 
     brelse(bh);
+    bh = NULL;
+
+    /* Load the journal first: replaying it may rewrite the bitmaps and inodes
+     * read below.
+     */
+    sbi->s_mount_opt = SIMPLEFS_MOUNT_BARRIER;
+    sbi->s_commit_interval = JBD2_DEFAULT_MAX_COMMIT_AGE * HZ;
+    sbi->s_max_batch_time = SIMPLEFS_DEF_MAX_BATCH_TIME;
+    sbi->s_min_batch_time = SIMPLEFS_DEF_MIN_BATCH_TIME;
+    ret = simplefs_parse_options(sb, data, &journal_devnum, devices);
+    if (ret) {
+        pr_err("simplefs_fill_super: Failed to parse options, error code: %d\n",
+               ret);
+        goto free_sbi;
+    }
+    ret = simplefs_discard_init(sb);
+    if (ret)
+        goto free_sbi;
+    ret = simplefs_stripe_init(sb, devices);
+    if (ret)
+        goto free_sbi;
+
+    /* An external journal takes precedence over the internal one */
+    if (journal_devnum || sbi->journal_ino) {
+        ret = simplefs_load_journal(sb, journal_devnum);
+        if (ret)
+            goto free_sbi;
+    }
+    if (sbi->journal)
+        simplefs_fc_enable(sb);
+    else if (sbi->s_mount_opt & SIMPLEFS_MOUNT_FAST_COMMIT)
+        pr_warn("fast_commit ignored without a journal\n");
 
     /* Allocate and copy ifree_bitmap */
     sbi->ifree_bitmap =
-        kzalloc(sbi->nr_ifree_blocks * SIMPLEFS_BLOCK_SIZE, GFP_KERNEL);
+        kzalloc(sbi->nr_ifree_blocks * sb->s_blocksize, GFP_KERNEL);
     if (!sbi->ifree_bitmap) {
         ret = -ENOMEM;
         goto free_sbi;
@@ -591,9 +1206,15 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
             ret = -EIO;
             goto free_ifree;
         }
+        ret = simplefs_csum_verify_bitmap(sb, bh);
+        if (ret) {
+            brelse(bh);
+            bh = NULL;
+            goto free_ifree;
+        }
 
-        memcpy((void *) sbi->ifree_bitmap + i * SIMPLEFS_BLOCK_SIZE, bh->b_data,
-               SIMPLEFS_BLOCK_SIZE);
+        memcpy((void *) sbi->ifree_bitmap + i * sb->s_blocksize, bh->b_data,
+               sb->s_blocksize);
 
         brelse(bh);
     }
@@ -601,7 +1222,7 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 
     /* Allocate and copy bfree_bitmap */
     sbi->bfree_bitmap =
-        kzalloc(sbi->nr_bfree_blocks * SIMPLEFS_BLOCK_SIZE, GFP_KERNEL);
+        kzalloc(sbi->nr_bfree_blocks * sb->s_blocksize, GFP_KERNEL);
     if (!sbi->bfree_bitmap) {
         ret = -ENOMEM;
         goto free_ifree;
@@ -615,14 +1236,50 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
             ret = -EIO;
             goto free_bfree;
         }
+        ret = simplefs_csum_verify_bitmap(sb, bh);
+        if (ret) {
+            brelse(bh);
+            bh = NULL;
+            goto free_bfree;
+        }
 
-        memcpy((void *) sbi->bfree_bitmap + i * SIMPLEFS_BLOCK_SIZE, bh->b_data,
-               SIMPLEFS_BLOCK_SIZE);
+        memcpy((void *) sbi->bfree_bitmap + i * sb->s_blocksize, bh->b_data,
+               sb->s_blocksize);
 
         brelse(bh);
     }
 
     bh = NULL;
+
+    if (sbi->journal) {
+        sbi->ifree_pending =
+            kzalloc(sbi->nr_ifree_blocks * sb->s_blocksize, GFP_KERNEL);
+        sbi->bfree_pending =
+            kzalloc(sbi->nr_bfree_blocks * sb->s_blocksize, GFP_KERNEL);
+        if (!sbi->ifree_pending || !sbi->bfree_pending) {
+            ret = -ENOMEM;
+            goto free_bfree;
+        }
+    }
+
+    /* The free counters are only logged by sync_fs, so after a replay the
+     * bitmaps are the reference.
+     */
+    if (sbi->journal) {
+        sbi->nr_free_inodes = bitmap_weight(sbi->ifree_bitmap, sbi->nr_inodes);
+        sbi->nr_free_blocks = bitmap_weight(sbi->bfree_bitmap, sbi->nr_blocks);
+    }
+
+    if (simplefs_has_lazy_itable(sb))
+        sbi->itable_init = simplefs_itable_used(sb);
+
+    ret = simplefs_refcount_load(sb);
+    if (ret)
+        goto free_bfree;
+    ret = simplefs_log_init(sb);
+    if (ret)
+        goto free_bfree;
+
     /* Create root inode */
     root_inode = simplefs_iget(sb, 1);
     if (IS_ERR(root_inode)) {
@@ -641,25 +1298,42 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
     sb->s_root = d_make_root(root_inode);
     if (!sb->s_root) {
         ret = -ENOMEM;
-        goto iput;
+        goto free_bfree;
     }
 
-    ret = simplefs_parse_options(sb, data);
-    if (ret) {
-        pr_err("simplefs_fill_super: Failed to parse options, error code: %d\n",
-               ret);
-        return ret;
+    /* Older drivers cannot read compressed extents: the first compress mount
+     * marks the partition.
+     */
+    if (sbi->s_mount_opt & SIMPLEFS_MOUNT_COMPRESS &&
+        !simplefs_has_compression(sb) && !sb_rdonly(sb)) {
+        sbi->features |= SIMPLEFS_FEATURE_COMPRESSION;
+        simplefs_sync_fs(sb, 1);
     }
 
     return 0;
 
-iput:
-    iput(root_inode);
 free_bfree:
+    simplefs_log_release(sb);
+    simplefs_refcount_release(sb);
+    kfree(sbi->bfree_pending);
+    kfree(sbi->ifree_pending);
     kfree(sbi->bfree_bitmap);
 free_ifree:
     kfree(sbi->ifree_bitmap);
 free_sbi:
+    simplefs_stripe_release(sb);
+    simplefs_discard_release(sb);
+    if (sbi->journal)
+        jbd2_journal_destroy(sbi->journal);
+    simplefs_fc_release(sb);
+#if SIMPLEFS_AT_LEAST(6, 9, 0)
+    if (sbi->s_journal_bdev_file)
+        fput(sbi->s_journal_bdev_file);
+#elif SIMPLEFS_AT_LEAST(6, 7, 0)
+    if (sbi->s_journal_bdev_handle)
+        bdev_release(sbi->s_journal_bdev_handle);
+#endif
+    sb->s_fs_info = NULL;
     kfree(sbi);
 release:
     brelse(bh);